@@ -0,0 +1,382 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "../histogram.h"
+
+/*
+* Load generator for the benchmarks. Each thread keeps its connections to the proxy busy with
+* back-to-back requests (one outstanding per connection) for the duration of the run, then the
+* throughput and latency percentiles of all of them are reported.
+*
+* Workloads:
+*   hit        GETs of num_objects cacheable objects, fetched once beforehand
+*   miss       GETs of objects the origin marks no-store, so every one goes to the origin
+*   blacklist  GETs of a host on the blacklist, answered by the proxy itself
+*   mixed      80% hit, 15% miss, 5% blacklist
+*/
+
+#define RESPONSE_BUFFER_SIZE 65536
+#define BLOCKED_HOST "blocked.bench" // must be on the proxy's blacklist
+#define CONNECT_RETRIES 3
+
+enum workload { WORKLOAD_HIT, WORKLOAD_MISS, WORKLOAD_BLACKLIST, WORKLOAD_MIXED };
+
+/*
+* One connection to the proxy, and the response being read on it.
+*/
+struct client_conn {
+	int fd;
+	char buffer[RESPONSE_BUFFER_SIZE];
+	int len;
+};
+
+/*
+* Counters and latencies of one thread.
+*/
+struct worker {
+	pthread_t tid;
+	int id;
+	unsigned int seed;
+	uint64_t requests;
+	uint64_t bytes;
+	uint64_t errors;
+	struct histogram latency_us;
+};
+
+static int proxy_port = 9090;
+static int origin_port = 9091;
+static enum workload workload = WORKLOAD_HIT;
+static int num_threads = 4;
+static int connections_per_thread = 16;
+static int duration_s = 10;
+static long long object_size = 4096;
+static int num_objects = 64;
+static volatile bool running = true;
+
+static void * run_worker(void * arg);
+static int connect_to_proxy();
+static int do_request(struct client_conn * conn, const char * request, int request_len, uint64_t * bytes);
+static int build_request(char * dest, int dest_size, enum workload kind, struct worker * worker);
+static enum workload pick_workload(struct worker * worker);
+static uint64_t now_us();
+static void warm_cache();
+static void print_usage_and_exit();
+
+int main(int argc, char ** argv) {
+	int opt;
+	while (-1 != (opt = getopt(argc, argv, "p:o:w:t:c:d:s:n:"))) {
+		switch (opt) {
+		case 'p':
+			proxy_port = atoi(optarg);
+			break;
+		case 'o':
+			origin_port = atoi(optarg);
+			break;
+		case 'w':
+			if (0 == strcmp(optarg, "hit")) {
+				workload = WORKLOAD_HIT;
+			} else if (0 == strcmp(optarg, "miss")) {
+				workload = WORKLOAD_MISS;
+			} else if (0 == strcmp(optarg, "blacklist")) {
+				workload = WORKLOAD_BLACKLIST;
+			} else if (0 == strcmp(optarg, "mixed")) {
+				workload = WORKLOAD_MIXED;
+			} else {
+				print_usage_and_exit();
+			}
+			break;
+		case 't':
+			num_threads = atoi(optarg);
+			break;
+		case 'c':
+			connections_per_thread = atoi(optarg);
+			break;
+		case 'd':
+			duration_s = atoi(optarg);
+			break;
+		case 's':
+			object_size = atoll(optarg);
+			break;
+		case 'n':
+			num_objects = atoi(optarg);
+			break;
+		default:
+			print_usage_and_exit();
+		}
+	}
+	if (num_threads < 1 || connections_per_thread < 1 || duration_s < 1 || num_objects < 1) {
+		print_usage_and_exit();
+	}
+
+	if (WORKLOAD_HIT == workload || WORKLOAD_MIXED == workload) {
+		warm_cache();
+	}
+
+	struct worker * workers = (struct worker *) calloc(num_threads, sizeof(struct worker));
+	uint64_t start = now_us();
+	int i;
+	for (i = 0; i < num_threads; i++) {
+		workers[i].id = i;
+		workers[i].seed = 12345 + i;
+		histogram_init(&workers[i].latency_us);
+		pthread_create(&workers[i].tid, NULL, &run_worker, &workers[i]);
+	}
+	sleep(duration_s);
+	running = false;
+
+	struct histogram latency_us;
+	histogram_init(&latency_us);
+	uint64_t requests = 0, bytes = 0, errors = 0;
+	for (i = 0; i < num_threads; i++) {
+		pthread_join(workers[i].tid, NULL);
+		histogram_merge(&latency_us, &workers[i].latency_us);
+		requests += workers[i].requests;
+		bytes += workers[i].bytes;
+		errors += workers[i].errors;
+	}
+	double elapsed = (now_us() - start) / 1e6;
+
+	static const char * names[] = { "hit", "miss", "blacklist", "mixed" };
+	printf("%-9s %6d conns %9.0f req/s %9.2f MB/s  p50 %7.3f ms  p99 %7.3f ms  p999 %7.3f ms  max %7.3f ms  errors %llu\n",
+		names[workload], num_threads * connections_per_thread, requests / elapsed, bytes / elapsed / (1024 * 1024),
+		histogram_percentile(&latency_us, 50) / 1000.0, histogram_percentile(&latency_us, 99) / 1000.0,
+		histogram_percentile(&latency_us, 99.9) / 1000.0, latency_us.max / 1000.0, (unsigned long long) errors);
+	free(workers);
+	return (0 == requests) ? 1 : 0;
+}
+
+/*
+* Body of a worker thread. Round-robins over its connections, one request at a time each.
+* Blocking sockets keep the client simple; with several threads the proxy still sees many
+* concurrent connections.
+*/
+static void * run_worker(void * arg) {
+	struct worker * worker = (struct worker *) arg;
+	struct client_conn * conns = (struct client_conn *) calloc(connections_per_thread, sizeof(struct client_conn));
+	int i;
+	for (i = 0; i < connections_per_thread; i++) {
+		conns[i].fd = -1;
+	}
+	char request[1024];
+	while (running) {
+		for (i = 0; i < connections_per_thread && running; i++) {
+			struct client_conn * conn = &conns[i];
+			if (-1 == conn->fd) {
+				conn->fd = connect_to_proxy();
+				conn->len = 0;
+				if (-1 == conn->fd) {
+					worker->errors++;
+					continue;
+				}
+			}
+			enum workload kind = pick_workload(worker);
+			int request_len = build_request(request, sizeof(request), kind, worker);
+			uint64_t start = now_us();
+			uint64_t bytes = 0;
+			int status = do_request(conn, request, request_len, &bytes);
+			uint64_t latency = now_us() - start;
+			bool expected = (WORKLOAD_BLACKLIST == kind) ? (403 == status) : (200 == status);
+			if (!expected) {
+				worker->errors++;
+				continue;
+			}
+			worker->requests++;
+			worker->bytes += bytes;
+			histogram_record(&worker->latency_us, latency);
+		}
+	}
+	for (i = 0; i < connections_per_thread; i++) {
+		if (-1 != conns[i].fd) {
+			close(conns[i].fd);
+		}
+	}
+	free(conns);
+	return NULL;
+}
+
+static enum workload pick_workload(struct worker * worker) {
+	if (WORKLOAD_MIXED != workload) {
+		return workload;
+	}
+	int r = rand_r(&worker->seed) % 100;
+	if (r < 80) {
+		return WORKLOAD_HIT;
+	}
+	return (r < 95) ? WORKLOAD_MISS : WORKLOAD_BLACKLIST;
+}
+
+static int build_request(char * dest, int dest_size, enum workload kind, struct worker * worker) {
+	switch (kind) {
+	case WORKLOAD_MISS:
+		return snprintf(dest, dest_size, "GET http://127.0.0.1:%d/nocache/%lld?id=%u HTTP/1.1\r\nHost: 127.0.0.1\r\n\r\n", origin_port, object_size, rand_r(&worker->seed));
+	case WORKLOAD_BLACKLIST:
+		return snprintf(dest, dest_size, "GET http://%s/obj/%lld HTTP/1.1\r\nHost: %s\r\n\r\n", BLOCKED_HOST, object_size, BLOCKED_HOST);
+	default:
+		return snprintf(dest, dest_size, "GET http://127.0.0.1:%d/obj/%lld?id=%d HTTP/1.1\r\nHost: 127.0.0.1\r\n\r\n", origin_port, object_size, rand_r(&worker->seed) % num_objects);
+	}
+}
+
+static int connect_to_proxy() {
+	int attempt;
+	for (attempt = 0; attempt < CONNECT_RETRIES; attempt++) {
+		int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		struct sockaddr_in addr;
+		memset(&addr, 0, sizeof(addr));
+		addr.sin_family = AF_INET;
+		addr.sin_port = htons(proxy_port);
+		addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		if (0 == connect(fd, (struct sockaddr *) &addr, sizeof(addr))) {
+			int on = 1;
+			setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+			struct timeval timeout = { 10, 0 };
+			setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+			return fd;
+		}
+		close(fd);
+	}
+	return -1;
+}
+
+/*
+* Sends request on conn and reads the whole response, adding its size to bytes. The proxy
+* answers blacklisted and bad requests with a bare status line and closes the connection; those
+* are read until the close. Returns the status code, or -1 (with conn closed) on error.
+*/
+static int do_request(struct client_conn * conn, const char * request, int request_len, uint64_t * bytes) {
+	int sent = 0;
+	while (sent < request_len) {
+		ssize_t n = send(conn->fd, request + sent, request_len - sent, MSG_NOSIGNAL);
+		if (n <= 0) {
+			goto fail;
+		}
+		sent += n;
+	}
+
+	// read the head of the response
+	char * end = NULL;
+	while (true) {
+		if (conn->len >= 5 && 0 != memcmp(conn->buffer, "HTTP/", 5)) {
+			break; // bare error line, not a response
+		}
+		if (NULL != (end = memmem(conn->buffer, conn->len, "\r\n\r\n", 4))) {
+			break;
+		}
+		if (conn->len == RESPONSE_BUFFER_SIZE) {
+			goto fail;
+		}
+		ssize_t n = recv(conn->fd, conn->buffer + conn->len, RESPONSE_BUFFER_SIZE - conn->len, 0);
+		if (n <= 0) {
+			if (conn->len > 0 && NULL == end && 0 != memcmp(conn->buffer, "HTTP/", conn->len < 5 ? conn->len : 5)) {
+				break;
+			}
+			goto fail;
+		}
+		conn->len += n;
+	}
+
+	if (NULL == end) {
+		// bare status line such as "403 Forbidden.", followed by the proxy closing
+		int status = atoi(conn->buffer);
+		while (recv(conn->fd, conn->buffer, RESPONSE_BUFFER_SIZE, 0) > 0) {
+		}
+		*bytes += conn->len;
+		close(conn->fd);
+		conn->fd = -1;
+		conn->len = 0;
+		return status;
+	}
+
+	int head_len = end + 4 - conn->buffer;
+	int status = atoi(conn->buffer + 9);
+	long long content_length = 0;
+	bool close_after = false;
+	char * line = conn->buffer;
+	while (line < end) {
+		char * next = memmem(line, end + 2 - line, "\r\n", 2);
+		if (0 == strncasecmp(line, "Content-Length:", 15)) {
+			content_length = atoll(line + 15);
+		} else if (0 == strncasecmp(line, "Connection:", 11) && NULL != strcasestr(line, "close")) {
+			close_after = true;
+		}
+		line = next + 2;
+	}
+
+	// skip the body, part of which may already be in buffer
+	long long remaining = content_length - (conn->len - head_len);
+	int extra = 0;
+	if (remaining < 0) {
+		extra = (int) -remaining; // start of the next response, which should not happen
+		remaining = 0;
+	}
+	while (remaining > 0) {
+		ssize_t n = recv(conn->fd, conn->buffer, (remaining < RESPONSE_BUFFER_SIZE) ? remaining : RESPONSE_BUFFER_SIZE, 0);
+		if (n <= 0) {
+			goto fail;
+		}
+		remaining -= n;
+	}
+	*bytes += head_len + content_length;
+	if (close_after || extra > 0) {
+		close(conn->fd);
+		conn->fd = -1;
+	}
+	conn->len = 0;
+	return status;
+
+fail:
+	close(conn->fd);
+	conn->fd = -1;
+	conn->len = 0;
+	return -1;
+}
+
+/*
+* Requests every cacheable object once so the hit workload finds them cached
+*/
+static void warm_cache() {
+	struct client_conn * conn = (struct client_conn *) calloc(1, sizeof(struct client_conn));
+	conn->fd = -1;
+	char request[1024];
+	int i;
+	for (i = 0; i < num_objects; i++) {
+		if (-1 == conn->fd) {
+			conn->fd = connect_to_proxy();
+			if (-1 == conn->fd) {
+				break;
+			}
+		}
+		int request_len = snprintf(request, sizeof(request), "GET http://127.0.0.1:%d/obj/%lld?id=%d HTTP/1.1\r\nHost: 127.0.0.1\r\n\r\n", origin_port, object_size, i);
+		uint64_t bytes = 0;
+		do_request(conn, request, request_len, &bytes);
+	}
+	if (-1 != conn->fd) {
+		close(conn->fd);
+	}
+	free(conn);
+	// the proxy stores the objects in the background
+	usleep(200000);
+}
+
+static uint64_t now_us() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void print_usage_and_exit() {
+	printf("Usage: ./bench/loadgen [-p proxy_port] [-o origin_port] [-w hit|miss|blacklist|mixed] [-t threads] [-c connections_per_thread] [-d seconds] [-s object_bytes] [-n objects]\n");
+	exit(-1);
+}
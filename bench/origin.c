@@ -0,0 +1,172 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+/*
+* Origin stub for the benchmarks. Serves GET /obj/<size> (cacheable for an hour) and
+* GET /nocache/<size> (Cache-Control: no-store) with a body of <size> bytes, after an optional
+* delay given by -l or a delay=<ms> query parameter. Any other query parameters (e.g. id=<n>)
+* only make the URI distinct. One thread per connection.
+*/
+
+#define REQUEST_BUFFER_SIZE 8192
+#define BODY_CHUNK_SIZE 65536
+
+static int latency_ms; // delay before each response
+static bool keep_alive = true;
+static char body_chunk[BODY_CHUNK_SIZE];
+
+static void * serve_connection(void * arg);
+static bool send_all(int fd, const char * data, size_t len);
+static void print_usage_and_exit();
+
+int main(int argc, char ** argv) {
+	int port = 9091;
+	int opt;
+	while (-1 != (opt = getopt(argc, argv, "p:l:k:"))) {
+		switch (opt) {
+		case 'p':
+			port = atoi(optarg);
+			break;
+		case 'l':
+			latency_ms = atoi(optarg);
+			break;
+		case 'k':
+			keep_alive = 0 != atoi(optarg);
+			break;
+		default:
+			print_usage_and_exit();
+		}
+	}
+	memset(body_chunk, 'x', sizeof(body_chunk));
+
+	int listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	int on = 1;
+	setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (-1 == bind(listen_fd, (struct sockaddr *) &addr, sizeof(addr)) || -1 == listen(listen_fd, 1024)) {
+		printf("Failed to listen on port %d: %s\n", port, strerror(errno));
+		return -1;
+	}
+
+	while (true) {
+		int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+		if (-1 == fd) {
+			continue;
+		}
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+		pthread_t tid;
+		if (0 != pthread_create(&tid, NULL, &serve_connection, (void *) (long) fd)) {
+			close(fd);
+			continue;
+		}
+		pthread_detach(tid);
+	}
+}
+
+/*
+* Answers the requests of one connection until it is closed
+*/
+static void * serve_connection(void * arg) {
+	int fd = (int) (long) arg;
+	char buffer[REQUEST_BUFFER_SIZE];
+	int len = 0;
+	while (true) {
+		char * end;
+		while (NULL == (end = memmem(buffer, len, "\r\n\r\n", 4))) {
+			if (len == sizeof(buffer)) {
+				close(fd);
+				return NULL;
+			}
+			ssize_t n = recv(fd, buffer + len, sizeof(buffer) - len, 0);
+			if (n <= 0) {
+				close(fd);
+				return NULL;
+			}
+			len += n;
+		}
+		int request_len = end + 4 - buffer;
+
+		char method[16], target[REQUEST_BUFFER_SIZE];
+		buffer[request_len - 1] = '\0';
+		long long size = -1;
+		bool no_store = false;
+		if (2 == sscanf(buffer, "%15s %8191s", method, target)) {
+			if (1 == sscanf(target, "/obj/%lld", &size)) {
+				no_store = false;
+			} else if (1 == sscanf(target, "/nocache/%lld", &size)) {
+				no_store = true;
+			}
+		}
+		int delay = latency_ms;
+		char * query = strstr(target, "delay=");
+		if (NULL != query) {
+			delay = atoi(query + 6);
+		}
+		memmove(buffer, buffer + request_len, len - request_len);
+		len -= request_len;
+
+		if (delay > 0) {
+			struct timespec ts = { delay / 1000, (long) (delay % 1000) * 1000000 };
+			nanosleep(&ts, NULL);
+		}
+
+		char head[256];
+		int head_len;
+		if (size < 0) {
+			head_len = snprintf(head, sizeof(head), "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n%s\r\n", keep_alive ? "" : "Connection: close\r\n");
+		} else {
+			head_len = snprintf(head, sizeof(head), "HTTP/1.1 200 OK\r\nContent-Length: %lld\r\nCache-Control: %s\r\n%s\r\n", size, no_store ? "no-store" : "max-age=3600", keep_alive ? "" : "Connection: close\r\n");
+		}
+		if (!send_all(fd, head, head_len)) {
+			break;
+		}
+		while (size > 0) {
+			size_t n = (size > BODY_CHUNK_SIZE) ? BODY_CHUNK_SIZE : (size_t) size;
+			if (!send_all(fd, body_chunk, n)) {
+				close(fd);
+				return NULL;
+			}
+			size -= n;
+		}
+		if (!keep_alive) {
+			break;
+		}
+	}
+	close(fd);
+	return NULL;
+}
+
+static bool send_all(int fd, const char * data, size_t len) {
+	while (len > 0) {
+		ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+		if (-1 == n) {
+			if (EINTR == errno) {
+				continue;
+			}
+			return false;
+		}
+		data += n;
+		len -= n;
+	}
+	return true;
+}
+
+static void print_usage_and_exit() {
+	printf("Usage: ./bench/origin [-p port] [-l latency_ms] [-k keep_alive(0|1)]\n");
+	exit(-1);
+}
@@ -0,0 +1,45 @@
+#!/bin/sh
+# Runs the benchmark workloads against a fresh proxy and origin stub on this machine and prints
+# one line of throughput and latency per workload. Settings come from the environment:
+#   PROXY_PORT (9090) ORIGIN_PORT (9091) BACKEND (epoll) DURATION seconds per workload (10)
+#   THREADS (4) CONNECTIONS per thread (16) SIZE object bytes (4096) LATENCY origin ms (0)
+#   WORKLOADS ("miss hit blacklist mixed")
+
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+PROXY_PORT=${PROXY_PORT:-9090}
+ORIGIN_PORT=${ORIGIN_PORT:-9091}
+BACKEND=${BACKEND:-epoll}
+DURATION=${DURATION:-10}
+THREADS=${THREADS:-4}
+CONNECTIONS=${CONNECTIONS:-16}
+SIZE=${SIZE:-4096}
+LATENCY=${LATENCY:-0}
+WORKLOADS=${WORKLOADS:-"miss hit blacklist mixed"}
+
+# the proxy keeps its cache in ./cache, so run it in a scratch directory
+WORKDIR=$(mktemp -d)
+echo "blocked" > "$WORKDIR/blacklist"
+
+ORIGIN_PID=
+PROXY_PID=
+cleanup() {
+	[ -n "$PROXY_PID" ] && kill "$PROXY_PID" 2>/dev/null
+	[ -n "$ORIGIN_PID" ] && kill "$ORIGIN_PID" 2>/dev/null
+	wait 2>/dev/null
+	rm -rf "$WORKDIR"
+}
+trap cleanup EXIT
+trap 'exit 1' INT TERM
+
+"$ROOT/bench/origin" -p "$ORIGIN_PORT" -l "$LATENCY" &
+ORIGIN_PID=$!
+(cd "$WORKDIR" && exec "$ROOT/proxyFilter" -b "$BACKEND" "$PROXY_PORT" blacklist > proxy.log 2>&1) &
+PROXY_PID=$!
+sleep 1
+
+echo "backend $BACKEND, $THREADS threads x $CONNECTIONS connections, $SIZE byte objects, origin latency $LATENCY ms, $DURATION s per workload"
+STATUS=0
+for WORKLOAD in $WORKLOADS; do
+	"$ROOT/bench/loadgen" -p "$PROXY_PORT" -o "$ORIGIN_PORT" -w "$WORKLOAD" -t "$THREADS" -c "$CONNECTIONS" -d "$DURATION" -s "$SIZE" || STATUS=1
+done
+exit $STATUS
@@ -2,6 +2,8 @@
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <dirent.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdbool.h>
 #include <string.h>
@@ -10,155 +12,380 @@
 #include <errno.h>
 #include <time.h>
 
-#define BUFFER_SIZE 8192 // for reading/sending data
+#include "cache.h"
+#include "memcache.h"
+#include "fill.h"
+#include "partial.h"
+#include "index.h"
+#include "journal.h"
+#include "log.h"
 
-void create_cache();
-int is_request_cached(char* uri);
+static long long cache_budget; // bytes of cache_files kept on disk
+static pthread_mutex_t janitor_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t janitor_cond = PTHREAD_COND_INITIALIZER;
+static unsigned long long temp_counter; // names generated so far by generate_temp_filename
 
-int create_cache_file_for_request(char* uri, char buffer[], char* temp_filename, bool is_req_end);
-int get_cache_file_for_request_and_send_to_client(char* uri, int client_socket_fd);
-int delete_cache_file_for_request(char* uri);
-
-char* get_filename_from_uri(char* uri);
-void generate_random_temp_filename(char* temp);
-char* hash(char* uri);
+static void * run_cache_janitor(void * arg);
+static void evict_over_budget();
+static void sweep_cache_directory();
+static void sweep_directory(const char * path, time_t now);
+static bool parse_cache_key(const char * name, struct cache_key * key);
 
 
 /*
-* Create the cache directory
+* Create the cache directory, its index and the memory cache in front of it, and start the
+* janitor thread that keeps the cache_files within budget bytes
 */
-void create_cache() {
+int create_cache(long long budget) {
 	mkdir("./cache/", 0700);
+	int i;
+	for (i = 0; i < 256; i++) {
+		char dirname[16];
+		snprintf(dirname, sizeof(dirname), "./cache/%02x", i);
+		mkdir(dirname, 0700);
+	}
+	create_index();
+	if (-1 == journal_open()) {
+		return -1;
+	}
+	create_memcache(MEMCACHE_BUDGET_BYTES);
+	create_fill_table();
+	create_partial_table(budget / PARTIAL_BUDGET_SHARE);
 
-	// seed srand for use in random temp_filename generation 
-	srand(time(NULL));
+	cache_budget = budget;
+	pthread_t tid;
+	int err = pthread_create(&tid, NULL, &run_cache_janitor, NULL);
+	if (0 != err) {
+		log_error("Error creating cache janitor thread with error number %d\n", err);
+		return -1;
+	}
+	pthread_detach(tid);
+	return 0;
 }
 
 /*
 * Checks if request to uri is cached as a cache_file in the cache directory
 */
 int is_request_cached(char* uri) {
-	char* filename = get_filename_from_uri(uri);
-	return access(filename, F_OK);
+	struct index_entry entry;
+	return index_lookup(uri, &entry) ? 0 : -1;
 }
 
 /*
-* Create a cache_file entry in the cache directory for the request to uri
+* Copies the metadata of the cache_file for request to uri into meta. Returns false if the
+* request is not cached.
 */
-int create_cache_file_for_request(char* uri, char buffer[], char* temp_filename, bool is_req_end) {
-	// get_filename_from_uri(uri)
-	// open filename... set cache_file_fd, create if not exist
-	// write in data from the buffer... write in append mode starting from the EOF
-	// close cache_file_fd
-	int cache_file_fd = open(temp_filename, O_WRONLY | O_CREAT | O_APPEND, S_IRWXU);
-	int write_succ = write(cache_file_fd, buffer, strlen(buffer));
-
-	// delete cache_file if error occurs on create|write
-	if ((-1 == cache_file_fd) || (-1 == write_succ)) {
-		printf("Error occured in caching request to - attempting to delete its cache file %s...\n", uri, temp_filename);
-		if (-1 == delete_cache_file_for_request(uri)) {
-			printf("Unable to delete %s: %s\n", temp_filename, strerror(errno));
-			return -1;
-		}
-		printf("Cache file %s deleted.\n", temp_filename);
-		return -1;
+bool get_cache_meta_for_request(char* uri, struct cache_meta* meta) {
+	struct index_entry entry;
+	if (!index_lookup(uri, &entry)) {
+		return false;
 	}
+	*meta = entry.meta;
+	return true;
+}
 
-	// cache_file size
-	struct stat sb;
-	stat(temp_filename, &sb);
-	// printf("File size:                %lld bytes\n", (long long) sb.st_size);
+/*
+* Replaces the metadata of the cache_file for request to uri once host has revalidated it
+*/
+int update_cache_meta_for_request(char* uri, const struct cache_meta* meta) {
+	return journal_update_meta(uri, meta) ? 0 : -1;
+}
 
-	close(cache_file_fd);
-	printf("Data cached in temp_file %s\n", temp_filename);
+/*
+* Rewrites the .meta file of the cache_file for request to uri with meta, the metadata
+* update_cache_meta_for_request put in the index. Skipped if the index has moved on to another
+* version or revalidation since. Called from a cache writer thread.
+*/
+int write_cache_meta_for_request(char* uri, const struct cache_meta* meta) {
+	struct cache_meta current;
+	if (!get_cache_meta_for_request(uri, &current) || current.stored != meta->stored || !freshness_same_validators(&current, meta)) {
+		return 0;
+	}
+	char filename[CACHE_FILENAME_SIZE];
+	get_filename_from_uri(uri, filename);
+	return write_cache_meta(filename, uri, meta);
+}
 
-	// rename temp_filename to hashed filename from the request uri
-	if (is_req_end) {
-		char* filename = get_filename_from_uri(uri);
-		rename(temp_filename, filename);
-		printf("Temp_cache file %s renamed to final cache file %s\n", temp_filename, filename);
+/*
+* Stores the complete response to uri, size bytes written to temp_filename (see writer.c), as
+* the cache_file for uri, with meta describing it. Called from a cache writer thread.
+* Returns 0 on success, -1 on error
+*/
+int store_cache_file(const char* uri, const char* temp_filename, off_t size, const struct cache_meta* meta) {
+	// rename temp_filename to hashed filename from the request uri and index it
+	char filename[CACHE_FILENAME_SIZE];
+	get_filename_from_uri(uri, filename);
+	if (-1 == write_cache_meta(filename, uri, meta) || -1 == rename(temp_filename, filename) || -1 == journal_insert(uri, size, meta)) {
+		log_error("Unable to store cache file %s: %s\n", filename, strerror(errno));
+		return -1;
+	}
+	log_debug("Temp_cache file %s renamed to final cache file %s\n", temp_filename, filename);
+	// a copy of the previous response in memory would be served in place of this one
+	memcache_remove(uri);
+	// byte ranges of the response are no longer needed
+	partial_remove(uri);
+	if (index_bytes() > cache_budget) {
+		pthread_cond_signal(&janitor_cond);
 	}
 	return 0;
 }
 
 /*
-* Get the cache_file contents for request to uri
+* Open the cache_file for request to uri for reading. The caller sends its contents to the
+* client as the client socket becomes writable and closes the returned fd.
+* Returns -1 (and deletes the cache_file) if it cannot be opened.
 */
-int get_cache_file_for_request_and_send_to_client(char* uri, int client_socket_fd) {
-	// get_filename_from_uri(uri)
-	// open filename... set cache_file_fd
-	// read in data from filename to buffer
-	// buffer of data will be sent to client via send in proxyFilter.c
-	// close cache_file_fd
-	char* filename = get_filename_from_uri(uri);
-	int cache_file_fd = open(filename, O_RDONLY);
+int open_cache_file_for_request(char* uri) {
+	struct index_entry entry;
+	if (!index_lookup(uri, &entry)) {
+		return -1;
+	}
+	char* filename = entry.filename;
+	int cache_file_fd = open(filename, O_RDONLY | O_CLOEXEC);
 
 	// do not attempt to fetch from cache_file and delete it if error on open
 	if (-1 == cache_file_fd) {
-		printf("Error occured in retrieving cached data for request to %s - attempting to delete its cache file %s...\n", uri, filename);
+		log_debug("Error occured in retrieving cached data for request to %s - attempting to delete its cache file %s...\n", uri, filename);
 		if (-1 == delete_cache_file_for_request(uri)) {
-			printf("Unable to delete %s: %s\n", filename, strerror(errno));
+			log_error("Unable to delete %s: %s\n", filename, strerror(errno));
 			return -1;
 		}
-		printf("Cache file %s deleted.\n", filename);
+		log_debug("Cache file %s deleted.\n", filename);
 		return -1;
 	}
+	return cache_file_fd;
+}
 
-	int num_bytes_read;
-	do {
-		char buffer[BUFFER_SIZE];
-		memset(buffer, 0, BUFFER_SIZE);
-		num_bytes_read = read(cache_file_fd, buffer, BUFFER_SIZE);
-		if (num_bytes_read > 0) {
-			send(client_socket_fd, buffer, BUFFER_SIZE, 0); // send data in buffer to client
-		}
-	} while (num_bytes_read > 0);
+/*
+* Returns true if fd is open on the cache_file stored for request to uri now, not on one a newer
+* response to uri has replaced since
+*/
+bool is_cache_file_current(const char* uri, int fd) {
+	char filename[CACHE_FILENAME_SIZE];
+	get_filename_from_uri(uri, filename);
+	struct stat fd_stat, file_stat;
+	return 0 == fstat(fd, &fd_stat) && 0 == stat(filename, &file_stat) && fd_stat.st_ino == file_stat.st_ino && fd_stat.st_dev == file_stat.st_dev;
+}
 
-	close(cache_file_fd);
-	printf("Request retrieved from cache.\n");
-	
-	close(client_socket_fd);
-	printf("Closing connection to client.\n");
-	return 0;
+/*
+* Reads the cache_file open as fd, size bytes, into a new memory cache object for uri and puts
+* it in the memory cache. Returns the object, referenced for the caller, or NULL if it is too
+* large for the memory cache, cannot be read or is no longer the cache_file of uri.
+*/
+struct mem_object * read_cache_file_into_memory(const char* uri, int fd, off_t size) {
+	if (size > MEMCACHE_MAX_OBJECT_SIZE) {
+		return NULL;
+	}
+	struct mem_object * object = memcache_alloc(uri, size);
+	if (NULL == object) {
+		return NULL;
+	}
+	off_t offset = 0;
+	while (offset < size) {
+		ssize_t num_bytes_read = pread(fd, object->data + offset, size - offset, offset);
+		if (num_bytes_read <= 0) {
+			memcache_release(object);
+			return NULL;
+		}
+		offset += num_bytes_read;
+	}
+	memcache_insert(object);
+	// a newer response stored while fd was read has already cleared the memory cache, so the
+	// object is dropped again unless fd is still the cache_file of uri
+	if (!is_cache_file_current(uri, fd)) {
+		memcache_remove_object(object);
+		memcache_release(object);
+		return NULL;
+	}
+	return object;
 }
 
 /*
 * Deletes the cache_file for request to uri from the cache directory
 */
 int delete_cache_file_for_request(char* uri) {
-	char * filename = get_filename_from_uri(uri);
+	journal_remove(uri);
+	memcache_remove(uri);
+	partial_remove(uri);
+	char filename[CACHE_FILENAME_SIZE];
+	get_filename_from_uri(uri, filename);
+	char meta_filename[CACHE_FILENAME_SIZE + 8];
+	snprintf(meta_filename, sizeof(meta_filename), "%s.meta", filename);
+	remove(meta_filename);
 	return remove(filename);
 }
 
 /*
-* Get the filename for request uri
+* Writes meta for the cache_file filename holding the response to uri into filename.meta,
+* one "name value" line per field
 */
-char* get_filename_from_uri(char* uri) {
-	return hash(uri);
+int write_cache_meta(const char* filename, const char* uri, const struct cache_meta* meta) {
+	char temp_filename[TEMP_FILENAME_SIZE];
+	generate_temp_filename(temp_filename);
+	FILE* meta_file = fopen(temp_filename, "wx");
+	if (NULL == meta_file) {
+		return -1;
+	}
+	fprintf(meta_file, "uri %s\n", uri);
+	fprintf(meta_file, "stored %lld\n", (long long) meta->stored);
+	fprintf(meta_file, "expires %lld\n", (long long) meta->expires);
+	fprintf(meta_file, "lifetime %lld\n", meta->lifetime);
+	fprintf(meta_file, "no-cache %d\n", meta->no_cache ? 1 : 0);
+	fprintf(meta_file, "etag %s\n", meta->etag);
+	fprintf(meta_file, "last-modified %s\n", meta->last_modified);
+	fprintf(meta_file, "vary %s\n", meta->vary);
+	fprintf(meta_file, "vary-key %s\n", meta->vary_key);
+	if (0 != fclose(meta_file)) {
+		remove(temp_filename);
+		return -1;
+	}
+
+	char meta_filename[CACHE_FILENAME_SIZE + 8];
+	snprintf(meta_filename, sizeof(meta_filename), "%s.meta", filename);
+	if (-1 == rename(temp_filename, meta_filename)) {
+		remove(temp_filename);
+		return -1;
+	}
+	return 0;
 }
 
 /*
-* Randomly generate a temporary filename
+* Get the filename for request uri into filename, which holds CACHE_FILENAME_SIZE bytes
 */
-void generate_random_temp_filename(char* temp) {
-	int r = rand();
-	sprintf(temp, "./cache/temp_%d", r);
+void get_filename_from_uri(const char* uri, char* filename) {
+	struct cache_key key;
+	cache_key_for_uri(uri, &key);
+	cache_filename_for_key(&key, filename);
 }
 
 /*
-* Hashes uri into a filename
+* Generates a temporary filename no other thread, nor another proxy sharing the cache directory,
+* generates. It is still created with O_EXCL, in case a file of an earlier run is left over.
 */
-char* hash(char* uri) {
-	// initialize hash with a prime number
-	int hash = 7;
-	int i;
+void generate_temp_filename(char* temp) {
+	unsigned long long n = __atomic_fetch_add(&temp_counter, 1, __ATOMIC_RELAXED);
+	snprintf(temp, TEMP_FILENAME_SIZE, "./cache/temp_%d_%llu", (int) getpid(), n);
+}
+
 
-	for (i = 0; i < strlen(uri); i++) {
-		hash = hash*31 + uri[i];
+/*
+* Body of the cache janitor thread. Evicts cache_files whenever they exceed the budget (checked
+* every CACHE_JANITOR_INTERVAL seconds, or when woken by a new cache_file), checkpoints the
+* index journal once it grows past JOURNAL_CHECKPOINT_BYTES and sweeps files
+* nothing refers to out of the cache directory every CACHE_SWEEP_INTERVAL seconds.
+*/
+static void * run_cache_janitor(void * arg) {
+	time_t last_sweep = 0;
+	pthread_mutex_lock(&janitor_lock);
+	while (true) {
+		pthread_mutex_unlock(&janitor_lock);
+		evict_over_budget();
+		if (journal_needs_checkpoint()) {
+			journal_checkpoint();
+		}
+		if (time(NULL) - last_sweep >= CACHE_SWEEP_INTERVAL) {
+			sweep_cache_directory();
+			last_sweep = time(NULL);
+		}
+		pthread_mutex_lock(&janitor_lock);
+
+		struct timespec deadline;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += CACHE_JANITOR_INTERVAL;
+		pthread_cond_timedwait(&janitor_cond, &janitor_lock, &deadline);
 	}
+	return NULL;
+}
 
-	char* filename = (char*) malloc(256);
-	sprintf(filename, "./cache/%u\0", hash);
-	return filename;
+/*
+* Deletes the cache_files least worth keeping until the rest fit in the budget
+*/
+static void evict_over_budget() {
+	char filename[CACHE_FILENAME_SIZE];
+	char meta_filename[CACHE_FILENAME_SIZE + 8];
+	while (index_bytes() > cache_budget) {
+		char* uri = journal_evict(filename);
+		if (NULL == uri) {
+			return;
+		}
+		memcache_remove(uri);
+		remove(filename);
+		snprintf(meta_filename, sizeof(meta_filename), "%s.meta", filename);
+		remove(meta_filename);
+		log_debug("Evicted cache file %s for %s\n", filename, uri);
+		free(uri);
+	}
 }
 
+/*
+* Removes temp_files left behind by fills that never finished, and cache_files that are not in
+* the index (or partial object files no longer in use), once they have not been written for
+* ORPHAN_FILE_MAX_AGE seconds
+*/
+static void sweep_cache_directory() {
+	time_t now = time(NULL);
+	sweep_directory("./cache", now);
+	int i;
+	for (i = 0; i < 256; i++) {
+		char dirname[16];
+		snprintf(dirname, sizeof(dirname), "./cache/%02x", i);
+		sweep_directory(dirname, now);
+	}
+}
+
+static void sweep_directory(const char * path, time_t now) {
+	DIR* dir = opendir(path);
+	if (NULL == dir) {
+		return;
+	}
+	struct dirent* dirent;
+	while (NULL != (dirent = readdir(dir))) {
+		char filename[CACHE_FILENAME_SIZE + 256];
+		struct stat sb;
+		struct cache_key key;
+		snprintf(filename, sizeof(filename), "%s/%s", path, dirent->d_name);
+		if (-1 == stat(filename, &sb) || !S_ISREG(sb.st_mode) || now - sb.st_mtime < ORPHAN_FILE_MAX_AGE) {
+			continue;
+		}
+		if (0 == strncmp(dirent->d_name, "index.", 6)) {
+			continue; // the index snapshot and journal
+		}
+		size_t name_len = strlen(dirent->d_name);
+		if (name_len > 5 && 0 == strcmp(dirent->d_name + name_len - 5, ".part") && partial_contains_file(filename)) {
+			continue; // byte ranges of a response not yet cached whole
+		}
+		if (parse_cache_key(dirent->d_name, &key) && index_contains_key(&key)) {
+			continue;
+		}
+		if (0 == remove(filename)) {
+			log_debug("Removed orphaned cache file %s\n", filename);
+		}
+	}
+	closedir(dir);
+}
+
+/*
+* Reads the cache_key a cache_file (or its .meta file) is named after
+*/
+static bool parse_cache_key(const char * name, struct cache_key * key) {
+	uint64_t halves[2] = { 0, 0 };
+	int i;
+	for (i = 0; i < 32; i++) {
+		char c = name[i];
+		int digit;
+		if (c >= '0' && c <= '9') {
+			digit = c - '0';
+		} else if (c >= 'a' && c <= 'f') {
+			digit = c - 'a' + 10;
+		} else {
+			return false;
+		}
+		halves[i / 16] = (halves[i / 16] << 4) | digit;
+	}
+	if ('\0' != name[32] && 0 != strcmp(name + 32, ".meta")) {
+		return false;
+	}
+	key->hi = halves[0];
+	key->lo = halves[1];
+	return true;
+}
@@ -0,0 +1,33 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+#include "freshness.h"
+
+struct mem_object;
+
+#define TEMP_FILENAME_SIZE 48 // "./cache/temp_" followed by the pid and a counter
+#define CACHE_DISK_BUDGET_BYTES (1024LL * 1024 * 1024) // default size of all cache_files
+#define CACHE_JANITOR_INTERVAL 1 // seconds between checks of the disk budget
+#define CACHE_SWEEP_INTERVAL 60 // seconds between sweeps of the cache directory
+#define ORPHAN_FILE_MAX_AGE 600 // seconds an unindexed file is left alone, in case it is still being written
+
+int create_cache(long long budget);
+int is_request_cached(char* uri);
+bool get_cache_meta_for_request(char* uri, struct cache_meta* meta);
+int update_cache_meta_for_request(char* uri, const struct cache_meta* meta);
+int write_cache_meta_for_request(char* uri, const struct cache_meta* meta);
+
+int store_cache_file(const char* uri, const char* temp_filename, off_t size, const struct cache_meta* meta);
+int open_cache_file_for_request(char* uri);
+bool is_cache_file_current(const char* uri, int fd);
+struct mem_object * read_cache_file_into_memory(const char* uri, int fd, off_t size);
+int delete_cache_file_for_request(char* uri);
+int write_cache_meta(const char* filename, const char* uri, const struct cache_meta* meta);
+
+void get_filename_from_uri(const char* uri, char* filename);
+void generate_temp_filename(char* temp);
+
+#endif
@@ -0,0 +1,254 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "encoding.h"
+#include "http.h"
+
+#define ACCEPT_ENCODING_SIZE 256 // bytes of Accept-Encoding looked at
+#define CONTENT_TYPE_SIZE 128
+
+static double accept_quality(const char * params);
+static bool is_compressible_type(const char * content_type);
+
+/*
+* Picks the encoding to compress the response to request with from its Accept-Encoding:
+* brotli or gzip, whichever the client prefers (brotli on a tie), or identity if it takes
+* neither.
+*/
+enum content_encoding encoding_negotiate(const struct http_message * request) {
+	char value[ACCEPT_ENCODING_SIZE];
+	if (!http_get_field(request, HTTP_FIELD_ACCEPT_ENCODING, value, sizeof(value))) {
+		return ENCODING_IDENTITY;
+	}
+	double brotli_q = -1;
+	double gzip_q = -1;
+	double any_q = -1;
+	const char * p = value;
+	while ('\0' != *p) {
+		while (' ' == *p || '\t' == *p || ',' == *p) {
+			p++;
+		}
+		int name_len = strcspn(p, ";, \t");
+		double q = accept_quality(p + name_len);
+		if (2 == name_len && 0 == strncasecmp(p, "br", 2)) {
+			brotli_q = q;
+		} else if ((4 == name_len && 0 == strncasecmp(p, "gzip", 4)) || (6 == name_len && 0 == strncasecmp(p, "x-gzip", 6))) {
+			gzip_q = q;
+		} else if (1 == name_len && '*' == *p) {
+			any_q = q;
+		}
+		while ('\0' != *p && ',' != *p) {
+			p++;
+		}
+	}
+	// "*" stands for the encodings not named
+	if (-1 == brotli_q) {
+		brotli_q = any_q;
+	}
+	if (-1 == gzip_q) {
+		gzip_q = any_q;
+	}
+	if (brotli_q > 0 && brotli_q >= gzip_q) {
+		return ENCODING_BROTLI;
+	}
+	return (gzip_q > 0) ? ENCODING_GZIP : ENCODING_IDENTITY;
+}
+
+/*
+* Returns the Content-Encoding name of encoding
+*/
+const char * encoding_name(enum content_encoding encoding) {
+	switch (encoding) {
+	case ENCODING_GZIP:
+		return "gzip";
+	case ENCODING_BROTLI:
+		return "br";
+	default:
+		return "identity";
+	}
+}
+
+/*
+* Returns true if response is worth compressing: text of some kind, not already encoded or a
+* byte range, not too small, and not marked no-transform.
+*/
+bool encoding_is_compressible(const struct http_message * response) {
+	char value[CONTENT_TYPE_SIZE];
+	if (http_get_field(response, HTTP_FIELD_CONTENT_ENCODING, value, sizeof(value)) && 0 != strcasecmp(value, "identity")) {
+		return false;
+	}
+	if (NULL != response->fields[HTTP_FIELD_CONTENT_RANGE].data) {
+		return false;
+	}
+	if (http_get_field(response, HTTP_FIELD_CACHE_CONTROL, value, sizeof(value)) && http_header_has_token(value, "no-transform")) {
+		return false;
+	}
+	if (-1 != response->content_length && response->content_length < ENCODING_MIN_SIZE) {
+		return false;
+	}
+	return http_get_field(response, HTTP_FIELD_CONTENT_TYPE, value, sizeof(value)) && is_compressible_type(value);
+}
+
+/*
+* Writes the head of the response with the given head compressed with encoding into dest: the
+* same status and fields, but chunked (the compressed length is not known up front), with
+* Content-Encoding, Accept-Encoding added to Vary and a strong ETag of its own. Returns the
+* length of the head, which is at least dest_size if it did not fit, or -1 if head cannot be
+* parsed.
+*/
+int encoding_write_head(char * dest, int dest_size, const char * head, int head_len, enum content_encoding encoding) {
+	struct http_parser parser;
+	struct http_message message;
+	http_parser_init(&parser);
+	if (HTTP_PARSE_DONE != http_parse_response(&parser, head, head_len, &message)) {
+		return -1;
+	}
+	const char * name = encoding_name(encoding);
+	bool has_vary = false;
+	int len = snprintf(dest, dest_size, "%.*s\r\n", message.first_line.len, message.first_line.data);
+	int i;
+	for (i = 0; i < message.num_headers && len < dest_size; i++) {
+		struct http_slice field = message.headers[i].name;
+		struct http_slice value = message.headers[i].value;
+		if (http_slice_case_equals(field, "Content-Length") || http_slice_case_equals(field, "Transfer-Encoding")
+			|| http_slice_case_equals(field, "Content-Encoding")) {
+			continue;
+		}
+		if (http_slice_case_equals(field, "ETag") && value.len >= 2 && '"' == value.data[0] && '"' == value.data[value.len - 1]) {
+			len += snprintf(dest + len, dest_size - len, "ETag: %.*s-%s\"\r\n", value.len - 1, value.data, name);
+			continue;
+		}
+		if (http_slice_case_equals(field, "Vary")) {
+			char vary[ACCEPT_ENCODING_SIZE];
+			snprintf(vary, sizeof(vary), "%.*s", value.len, value.data);
+			has_vary = true;
+			if (!http_header_has_token(vary, "Accept-Encoding") && !http_header_has_token(vary, "*")) {
+				len += snprintf(dest + len, dest_size - len, "Vary: %.*s, Accept-Encoding\r\n", value.len, value.data);
+				continue;
+			}
+		}
+		len += snprintf(dest + len, dest_size - len, "%.*s: %.*s\r\n", field.len, field.data, value.len, value.data);
+	}
+	if (len < dest_size && !has_vary) {
+		len += snprintf(dest + len, dest_size - len, "Vary: Accept-Encoding\r\n");
+	}
+	if (len < dest_size) {
+		len += snprintf(dest + len, dest_size - len, "Content-Encoding: %s\r\nTransfer-Encoding: chunked\r\n\r\n", name);
+	}
+	return len;
+}
+
+/*
+* Sets up encoder to compress a body with encoding. Returns 0 on success, -1 on failure.
+*/
+int encoder_init(struct encoder * encoder, enum content_encoding encoding) {
+	memset(encoder, 0, sizeof(*encoder));
+	encoder->encoding = encoding;
+	if (ENCODING_GZIP == encoding) {
+		// window bits + 16 writes a gzip header and trailer around the deflate stream
+		return (Z_OK == deflateInit2(&encoder->gzip, ENCODING_GZIP_LEVEL, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY)) ? 0 : -1;
+	}
+	encoder->brotli = BrotliEncoderCreateInstance(NULL, NULL, NULL);
+	if (NULL == encoder->brotli) {
+		return -1;
+	}
+	BrotliEncoderSetParameter(encoder->brotli, BROTLI_PARAM_QUALITY, ENCODING_BROTLI_QUALITY);
+	BrotliEncoderSetParameter(encoder->brotli, BROTLI_PARAM_LGWIN, ENCODING_BROTLI_WINDOW);
+	BrotliEncoderSetParameter(encoder->brotli, BROTLI_PARAM_MODE, BROTLI_MODE_TEXT);
+	return 0;
+}
+
+/*
+* Compresses the len bytes of data, passing the output to emit as it is produced, in pieces of
+* at most ENCODING_OUT_SIZE bytes. Returns 0 on success, -1 on failure.
+*/
+int encoder_write(struct encoder * encoder, const char * data, int len, enum encoder_flush flush, void (*emit)(void * arg, const char * data, int len), void * arg) {
+	char out[ENCODING_OUT_SIZE];
+	if (ENCODING_GZIP == encoder->encoding) {
+		int mode = (ENCODER_FINISH == flush) ? Z_FINISH : (ENCODER_FLUSH == flush) ? Z_SYNC_FLUSH : Z_NO_FLUSH;
+		z_stream * stream = &encoder->gzip;
+		stream->next_in = (Bytef *) data;
+		stream->avail_in = len;
+		int ret;
+		do {
+			stream->next_out = (Bytef *) out;
+			stream->avail_out = sizeof(out);
+			ret = deflate(stream, mode);
+			if (Z_STREAM_ERROR == ret) {
+				return -1;
+			}
+			if (stream->avail_out < sizeof(out)) {
+				emit(arg, out, sizeof(out) - stream->avail_out);
+			}
+			// deflate needs to be called again as long as it fills the output
+		} while (0 == stream->avail_out || (Z_FINISH == mode && Z_STREAM_END != ret && Z_BUF_ERROR != ret));
+		return 0;
+	}
+
+	BrotliEncoderOperation op = (ENCODER_FINISH == flush) ? BROTLI_OPERATION_FINISH : (ENCODER_FLUSH == flush) ? BROTLI_OPERATION_FLUSH : BROTLI_OPERATION_PROCESS;
+	size_t avail_in = len;
+	const uint8_t * next_in = (const uint8_t *) data;
+	while (true) {
+		size_t avail_out = sizeof(out);
+		uint8_t * next_out = (uint8_t *) out;
+		if (!BrotliEncoderCompressStream(encoder->brotli, op, &avail_in, &next_in, &avail_out, &next_out, NULL)) {
+			return -1;
+		}
+		if (avail_out < sizeof(out)) {
+			emit(arg, out, sizeof(out) - avail_out);
+		}
+		if (0 == avail_in && !BrotliEncoderHasMoreOutput(encoder->brotli) && (BROTLI_OPERATION_FINISH != op || BrotliEncoderIsFinished(encoder->brotli))) {
+			return 0;
+		}
+	}
+}
+
+void encoder_free(struct encoder * encoder) {
+	if (ENCODING_GZIP == encoder->encoding) {
+		deflateEnd(&encoder->gzip);
+	} else if (NULL != encoder->brotli) {
+		BrotliEncoderDestroyInstance(encoder->brotli);
+	}
+}
+
+/*
+* Returns the q value in the parameters following an Accept-Encoding entry, 1 if it has none
+*/
+static double accept_quality(const char * params) {
+	const char * p = params;
+	while ('\0' != *p && ',' != *p) {
+		while (';' == *p || ' ' == *p || '\t' == *p) {
+			p++;
+		}
+		if (('q' == *p || 'Q' == *p) && '=' == p[1]) {
+			return atof(p + 2);
+		}
+		while ('\0' != *p && ',' != *p && ';' != *p) {
+			p++;
+		}
+	}
+	return 1;
+}
+
+/*
+* Returns true for media types made of text: text/ types, JSON, XML (SVG too) and JavaScript
+*/
+static bool is_compressible_type(const char * content_type) {
+	int len = strcspn(content_type, "; \t");
+	if (0 == strncasecmp(content_type, "text/", 5)) {
+		return true;
+	}
+	static const char * suffixes[] = { "json", "xml", "javascript", "ecmascript" };
+	int i;
+	for (i = 0; i < sizeof(suffixes) / sizeof(suffixes[0]); i++) {
+		int suffix_len = strlen(suffixes[i]);
+		if (len >= suffix_len && 0 == strncasecmp(content_type + len - suffix_len, suffixes[i], suffix_len)) {
+			return true;
+		}
+	}
+	return false;
+}
@@ -0,0 +1,45 @@
+#ifndef ENCODING_H
+#define ENCODING_H
+
+#include <stdbool.h>
+#include <zlib.h>
+#include <brotli/encode.h>
+
+#include "http.h"
+
+#define ENCODING_MIN_SIZE 256 // responses known to be smaller are not worth compressing
+#define ENCODING_GZIP_LEVEL 6
+#define ENCODING_BROTLI_QUALITY 5 // fast enough to compress as responses stream through
+#define ENCODING_BROTLI_WINDOW 18 // log2 of the brotli window, bounds the memory of each encoder
+#define ENCODING_OUT_SIZE 16384 // bytes an encoder produces per call of its emit function at most
+
+enum content_encoding {
+	ENCODING_IDENTITY,
+	ENCODING_GZIP,
+	ENCODING_BROTLI
+};
+
+enum encoder_flush {
+	ENCODER_NO_FLUSH, // output data when the compressor has a block ready
+	ENCODER_FLUSH, // output everything given so far, so the client can use it
+	ENCODER_FINISH // output everything and end the compressed stream
+};
+
+/*
+* Streaming compressor for one response body
+*/
+struct encoder {
+	enum content_encoding encoding;
+	z_stream gzip;
+	BrotliEncoderState * brotli;
+};
+
+enum content_encoding encoding_negotiate(const struct http_message * request);
+const char * encoding_name(enum content_encoding encoding);
+bool encoding_is_compressible(const struct http_message * response);
+int encoding_write_head(char * dest, int dest_size, const char * head, int head_len, enum content_encoding encoding);
+int encoder_init(struct encoder * encoder, enum content_encoding encoding);
+int encoder_write(struct encoder * encoder, const char * data, int len, enum encoder_flush flush, void (*emit)(void * arg, const char * data, int len), void * arg);
+void encoder_free(struct encoder * encoder);
+
+#endif
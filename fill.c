@@ -0,0 +1,200 @@
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "fill.h"
+#include "memcache.h"
+
+/*
+* One part of the table of in-progress fills, keyed by uri.
+*/
+struct fill_shard {
+	pthread_mutex_t lock;
+	struct cache_fill * buckets[FILL_BUCKETS];
+};
+
+static struct fill_shard fill_shards[FILL_SHARDS];
+
+static void wake_waiters(struct cache_fill * fill);
+
+/*
+* Set up the table of in-progress fills
+*/
+void create_fill_table() {
+	int i;
+	for (i = 0; i < FILL_SHARDS; i++) {
+		pthread_mutex_init(&fill_shards[i].lock, NULL);
+		memset(fill_shards[i].buckets, 0, sizeof(fill_shards[i].buckets));
+	}
+}
+
+static struct fill_shard * fill_shard_for(uint64_t hash) {
+	return &fill_shards[(hash >> 56) % FILL_SHARDS];
+}
+
+/*
+* Looks up the in-progress fill for uri. If there is one, a reference to it is returned with
+* is_leader set to false and the caller should follow it. Otherwise a new fill is started with
+* the caller as its leader, its temp cache_file created, and a reference to it returned with
+* is_leader set to true. Returns NULL if a new fill cannot be set up.
+*/
+struct cache_fill * fill_begin(const char * uri, bool * is_leader) {
+	uint64_t hash = hash_key(uri);
+	struct fill_shard * shard = fill_shard_for(hash);
+	struct cache_fill * fill;
+
+	pthread_mutex_lock(&shard->lock);
+	for (fill = shard->buckets[hash % FILL_BUCKETS]; NULL != fill; fill = fill->hash_next) {
+		if (hash == fill->hash && 0 == strcmp(uri, fill->uri)) {
+			__atomic_add_fetch(&fill->refcount, 1, __ATOMIC_RELAXED);
+			pthread_mutex_unlock(&shard->lock);
+			*is_leader = false;
+			return fill;
+		}
+	}
+
+	fill = (struct cache_fill *) calloc(1, sizeof(struct cache_fill));
+	if (NULL == fill) {
+		pthread_mutex_unlock(&shard->lock);
+		return NULL;
+	}
+	fill->uri = strdup(uri);
+	generate_temp_filename(fill->temp_filename);
+	fill->fd = open(fill->temp_filename, O_RDONLY | O_CREAT | O_EXCL | O_CLOEXEC, S_IRWXU);
+	if (NULL == fill->uri || -1 == fill->fd) {
+		pthread_mutex_unlock(&shard->lock);
+		if (-1 != fill->fd) {
+			close(fill->fd);
+		}
+		free(fill->uri);
+		free(fill);
+		return NULL;
+	}
+	fill->hash = hash;
+	fill->refcount = 2; // one for the table, one for the leader
+	pthread_mutex_init(&fill->lock, NULL);
+	fill->waiters.prev = &fill->waiters;
+	fill->waiters.next = &fill->waiters;
+	fill->hash_next = shard->buckets[hash % FILL_BUCKETS];
+	shard->buckets[hash % FILL_BUCKETS] = fill;
+	pthread_mutex_unlock(&shard->lock);
+
+	*is_leader = true;
+	return fill;
+}
+
+/*
+* Registers waiter to be posted to its reactor whenever fill makes progress.
+*/
+void fill_attach(struct cache_fill * fill, struct fill_waiter * waiter) {
+	pthread_mutex_lock(&fill->lock);
+	waiter->prev = fill->waiters.prev;
+	waiter->next = &fill->waiters;
+	fill->waiters.prev->next = waiter;
+	fill->waiters.prev = waiter;
+	pthread_mutex_unlock(&fill->lock);
+}
+
+/*
+* Stops posting waiter about fill, including any post of it still queued.
+*/
+void fill_detach(struct cache_fill * fill, struct fill_waiter * waiter) {
+	pthread_mutex_lock(&fill->lock);
+	waiter->prev->next = waiter->next;
+	waiter->next->prev = waiter->prev;
+	pthread_mutex_unlock(&fill->lock);
+	reactor_unpost(waiter->reactor, &waiter->post);
+}
+
+/*
+* Called by the leader after appending to the temp cache_file; bytes_written is its new size.
+*/
+void fill_progress(struct cache_fill * fill, off_t bytes_written) {
+	pthread_mutex_lock(&fill->lock);
+	fill->bytes_written = bytes_written;
+	wake_waiters(fill);
+	pthread_mutex_unlock(&fill->lock);
+}
+
+/*
+* Returns true if any follower is waiting on fill
+*/
+bool fill_has_waiters(struct cache_fill * fill) {
+	pthread_mutex_lock(&fill->lock);
+	bool has_waiters = (&fill->waiters != fill->waiters.next);
+	pthread_mutex_unlock(&fill->lock);
+	return has_waiters;
+}
+
+/*
+* Called by the leader once it knows whether the response is self-delimiting.
+*/
+void fill_set_delimited(struct cache_fill * fill, bool delimited) {
+	pthread_mutex_lock(&fill->lock);
+	fill->delimited = delimited;
+	pthread_mutex_unlock(&fill->lock);
+}
+
+/*
+* Called by the leader when the fill is over, complete (the cache_file is in place) or not.
+* Later requests for the uri no longer find the fill.
+*/
+void fill_end(struct cache_fill * fill, bool complete) {
+	struct fill_shard * shard = fill_shard_for(fill->hash);
+	struct cache_fill ** link;
+	pthread_mutex_lock(&shard->lock);
+	for (link = &shard->buckets[fill->hash % FILL_BUCKETS]; NULL != *link; link = &(*link)->hash_next) {
+		if (fill == *link) {
+			*link = fill->hash_next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&shard->lock);
+
+	pthread_mutex_lock(&fill->lock);
+	fill->complete = complete;
+	fill->failed = !complete;
+	wake_waiters(fill);
+	pthread_mutex_unlock(&fill->lock);
+
+	fill_release(fill); // reference held by the table
+}
+
+/*
+* Reads the current state of fill.
+*/
+void fill_status(struct cache_fill * fill, off_t * bytes_written, bool * complete, bool * failed, bool * delimited) {
+	pthread_mutex_lock(&fill->lock);
+	*bytes_written = fill->bytes_written;
+	*complete = fill->complete;
+	*failed = fill->failed;
+	*delimited = fill->delimited;
+	pthread_mutex_unlock(&fill->lock);
+}
+
+/*
+* Drops a reference to fill, freeing it when the last one is gone.
+*/
+void fill_release(struct cache_fill * fill) {
+	if (0 == __atomic_sub_fetch(&fill->refcount, 1, __ATOMIC_ACQ_REL)) {
+		close(fill->fd);
+		pthread_mutex_destroy(&fill->lock);
+		free(fill->uri);
+		free(fill);
+	}
+}
+
+/*
+* Posts every waiter of fill to its reactor. Must be called with fill locked.
+*/
+static void wake_waiters(struct cache_fill * fill) {
+	struct fill_waiter * waiter;
+	for (waiter = fill->waiters.next; waiter != &fill->waiters; waiter = waiter->next) {
+		reactor_post(waiter->reactor, &waiter->post);
+	}
+}
@@ -0,0 +1,57 @@
+#ifndef FILL_H
+#define FILL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <pthread.h>
+
+#include "reactor.h"
+#include "cache.h"
+
+#define FILL_SHARDS 16 // independently locked parts of the in-progress fill table
+#define FILL_BUCKETS 1024 // hash buckets per shard
+
+/*
+* A request waiting on another connection's fill, embedded in its connection. post is queued on
+* the follower's reactor whenever the fill makes progress.
+*/
+struct fill_waiter {
+	struct reactor_post post;
+	struct reactor * reactor;
+	struct fill_waiter * prev;
+	struct fill_waiter * next;
+};
+
+/*
+* A response being fetched from host and written to a temp cache_file by one connection (the
+* leader). Concurrent requests for the same uri attach as followers and send the response from
+* the temp cache_file as it grows instead of fetching it themselves.
+*/
+struct cache_fill {
+	struct cache_fill * hash_next;
+	uint64_t hash;
+	char * uri;
+	char temp_filename[TEMP_FILENAME_SIZE];
+	int fd; // read-only descriptor on the temp cache_file, valid after rename
+	int refcount;
+	pthread_mutex_t lock;
+	off_t bytes_written; // bytes of the response in the temp cache_file so far
+	bool complete;
+	bool failed;
+	bool delimited; // response has Content-Length or chunked framing
+	struct fill_waiter waiters; // sentinel
+};
+
+void create_fill_table();
+struct cache_fill * fill_begin(const char * uri, bool * is_leader);
+void fill_attach(struct cache_fill * fill, struct fill_waiter * waiter);
+void fill_detach(struct cache_fill * fill, struct fill_waiter * waiter);
+void fill_progress(struct cache_fill * fill, off_t bytes_written);
+bool fill_has_waiters(struct cache_fill * fill);
+void fill_set_delimited(struct cache_fill * fill, bool delimited);
+void fill_end(struct cache_fill * fill, bool complete);
+void fill_status(struct cache_fill * fill, off_t * bytes_written, bool * complete, bool * failed, bool * delimited);
+void fill_release(struct cache_fill * fill);
+
+#endif
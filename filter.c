@@ -1,82 +1,368 @@
+#include <sys/inotify.h>
+#include <sys/signalfd.h>
+#include <poll.h>
+#include <signal.h>
+#include <pthread.h>
+#include <libgen.h>
+#include <unistd.h>
 #include <stdio.h>
 #include <stdbool.h>
 #include <string.h>
 #include <stdlib.h>
+#include <ctype.h>
+#include <errno.h>
 
-#define MAX_ENTRIES 100
+#include "filter.h"
+#include "reactor.h"
+#include "log.h"
 
-FILE * file;
-char * blacklist_entries[MAX_ENTRIES];
-int num_entries;
-int read_blacklist_file(char* filename);
-bool is_blacklisted(char * host);
-void to_lower_case(char * string);
+// the current automaton, replaced as a whole when the file changes and read without locking
+static struct blacklist * blacklist;
+
+static struct blacklist * load_blacklist(const char * filename);
+static struct blacklist * build_blacklist(char ** entries, int num_entries, size_t total_len);
+static void free_blacklist(struct blacklist * bl);
+static uint32_t find_edge(const struct blacklist * bl, uint32_t parent, unsigned char c);
+static uint32_t add_edge(struct blacklist * bl, uint32_t parent, unsigned char c);
+static int link_failures(struct blacklist * bl);
+static void * run_blacklist_reloader(void * arg);
+static bool wait_for_change(int signal_fd, int inotify_fd, const char * name);
 
 /*
-* Read each line (entry) of file into blacklist_entries and returns 0 on success, -1 on failure.
+* Read each line (entry) of file and compile them into the blacklist. Returns 0 on success, -1
+* on failure.
 */
 int read_blacklist_file(char* filename) {
-	
-	// open file 
-	file = fopen(filename, "r");
-	if (NULL == file) {
-		printf("Error opening file.\n");
+	struct blacklist * bl = load_blacklist(filename);
+	if (NULL == bl) {
 		return -1;
 	}
-	
-	// read each line (entry) into blacklist_entries
-	int line_index = 0;
-	char * line = (char *) malloc((MAX_ENTRIES + 3) * sizeof(char));
-	int line_len;
-	while (NULL != fgets(line, MAX_ENTRIES + 3, file) && line_index < MAX_ENTRIES) {
-		blacklist_entries[line_index] = (char *) malloc((MAX_ENTRIES + 3) * sizeof(char));
-		strcpy(blacklist_entries[line_index], line);
-		
-		// remove '\n' from entry
-		line_len = strlen(blacklist_entries[line_index]);
-		if ('\n' == *(blacklist_entries[line_index] + line_len - 1)) {
-			*(blacklist_entries[line_index] + line_len - 1) = '\0';
-		}
-		
-		// convert to lower case since we don't care about case 
-		to_lower_case(blacklist_entries[line_index]);
-				
-		line_index++;
+	__atomic_store_n(&blacklist, bl, __ATOMIC_SEQ_CST);
+	return 0;
+}
+
+/*
+* Starts a thread that reloads the blacklist from filename on SIGHUP or whenever the file is
+* rewritten or replaced. Must be called before any other thread is started, so that they all
+* leave SIGHUP to it. Returns 0 on success, -1 on failure.
+*/
+int watch_blacklist_file(char* filename) {
+	sigset_t mask;
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGHUP);
+	pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+	pthread_t tid;
+	int err = pthread_create(&tid, NULL, &run_blacklist_reloader, (void *) strdup(filename));
+	if (0 != err) {
+		log_error("Error creating blacklist reloader thread with error number %d\n", err);
+		return -1;
 	}
-	free(line);
-	num_entries = line_index;
-	
+	pthread_detach(tid);
 	return 0;
 }
 
 /*
-* Returns true if host is blacklisted, otherwise false
+* Returns true if host contains any blacklisted entry, ignoring case. Takes one step of the
+* automaton per character of host. Must be called from a reactor, whose batch of events keeps
+* the automaton it reads alive (see reactor_synchronize).
 */
 bool is_blacklisted(char * host) {
-	char * host_copy = (char *) malloc(sizeof(char) * strlen(host));
-	strcpy(host_copy, host);
-	
-	to_lower_case(host_copy);
-	
-	int i;
-	for (i = 0; i < num_entries; i++) {
-		if (NULL != strstr(host, blacklist_entries[i])) {
+	const struct blacklist * bl = __atomic_load_n(&blacklist, __ATOMIC_SEQ_CST);
+	if (NULL == bl) {
+		return false;
+	}
+	uint32_t node = BLACKLIST_ROOT;
+	const unsigned char * p;
+	for (p = (const unsigned char *) host; '\0' != *p; p++) {
+		unsigned char c = tolower(*p);
+		uint32_t next;
+		while (BLACKLIST_ROOT == (next = find_edge(bl, node, c)) && BLACKLIST_ROOT != node) {
+			node = bl->nodes[node].fail;
+		}
+		node = next;
+		if (bl->nodes[node].matches) {
 			return true;
 		}
 	}
 	return false;
-}	
+}
 
 /*
 * Converts string to lower case
 */
 void to_lower_case(char * string) {
+	for (; '\0' != *string; string++) {
+		*string = tolower((unsigned char) *string);
+	}
+}
+
+/*
+* Reads each line (entry) of filename and compiles them into a new automaton. Returns NULL if
+* the file cannot be read or memory runs out.
+*/
+static struct blacklist * load_blacklist(const char * filename) {
+
+	// open file
+	FILE * file = fopen(filename, "r");
+	if (NULL == file) {
+		log_error("Error opening file.\n");
+		return NULL;
+	}
+
+	// read each line (entry), whatever its length
+	char ** entries = NULL;
+	int num_entries = 0;
+	int entries_size = 0;
+	size_t total_len = 0;
+	char * line = NULL;
+	size_t line_size = 0;
+	ssize_t line_len;
+	bool failed = false;
+	while (-1 != (line_len = getline(&line, &line_size, file))) {
+		// remove "\r\n" from entry, and skip blank lines which would match every host
+		while (line_len > 0 && ('\n' == line[line_len - 1] || '\r' == line[line_len - 1])) {
+			line[--line_len] = '\0';
+		}
+		if (0 == line_len) {
+			continue;
+		}
+		if (num_entries == entries_size) {
+			int new_size = (0 == entries_size) ? 1024 : entries_size * 2;
+			char ** new_entries = (char **) realloc(entries, new_size * sizeof(char *));
+			if (NULL == new_entries) {
+				failed = true;
+				break;
+			}
+			entries = new_entries;
+			entries_size = new_size;
+		}
+
+		// convert to lower case since we don't care about case
+		to_lower_case(line);
+		char * entry = strdup(line);
+		if (NULL == entry) {
+			failed = true;
+			break;
+		}
+		entries[num_entries++] = entry;
+		total_len += line_len;
+	}
+	free(line);
+	fclose(file);
+
+	struct blacklist * bl = failed ? NULL : build_blacklist(entries, num_entries, total_len);
 	int i;
-	for (i = 0; i < strlen(string); i++) {
-		string[i] = tolower(string[i]);
+	for (i = 0; i < num_entries; i++) {
+		free(entries[i]);
+	}
+	free(entries);
+	if (NULL == bl) {
+		log_error("Out of memory compiling blacklist file.\n");
+		return NULL;
 	}
+	log_info("Compiled %d blacklist entries into %u states.\n", bl->num_entries, bl->num_nodes);
+	return bl;
 }
 
+/*
+* Builds the automaton of the num_entries lower case entries, total_len characters in all.
+* Returns NULL if memory runs out.
+*/
+static struct blacklist * build_blacklist(char ** entries, int num_entries, size_t total_len) {
+	struct blacklist * bl = (struct blacklist *) calloc(1, sizeof(struct blacklist));
+	if (NULL == bl) {
+		return NULL;
+	}
 
+	// every character of an entry adds at most one node, and the edge table is kept half empty
+	bl->nodes = (struct blacklist_node *) calloc(total_len + 1, sizeof(struct blacklist_node));
+	uint32_t num_slots = 16;
+	while (num_slots < 2 * (total_len + 1)) {
+		num_slots *= 2;
+	}
+	bl->edges = (struct blacklist_edge *) calloc(num_slots, sizeof(struct blacklist_edge));
+	if (NULL == bl->nodes || NULL == bl->edges) {
+		free_blacklist(bl);
+		return NULL;
+	}
+	bl->edge_mask = num_slots - 1;
+	bl->num_nodes = 1;
+	bl->num_entries = num_entries;
 
+	// the trie of the entries
+	int i;
+	for (i = 0; i < num_entries; i++) {
+		uint32_t node = BLACKLIST_ROOT;
+		const unsigned char * p;
+		for (p = (const unsigned char *) entries[i]; '\0' != *p; p++) {
+			uint32_t next = find_edge(bl, node, *p);
+			node = (BLACKLIST_ROOT != next) ? next : add_edge(bl, node, *p);
+		}
+		bl->nodes[node].matches = true;
+	}
+
+	if (-1 == link_failures(bl)) {
+		free_blacklist(bl);
+		return NULL;
+	}
+	return bl;
+}
 
+static void free_blacklist(struct blacklist * bl) {
+	free(bl->nodes);
+	free(bl->edges);
+	free(bl);
+}
+
+static uint32_t edge_slot(const struct blacklist * bl, uint32_t parent, unsigned char c) {
+	uint64_t h = (((uint64_t) parent << 8) | c) * 0x9e3779b97f4a7c15ULL;
+	return (uint32_t) (h >> 32) & bl->edge_mask;
+}
+
+/*
+* Returns the child of parent on c, or BLACKLIST_ROOT if there is none
+*/
+static uint32_t find_edge(const struct blacklist * bl, uint32_t parent, unsigned char c) {
+	uint32_t slot = edge_slot(bl, parent, c);
+	while (BLACKLIST_ROOT != bl->edges[slot].child) {
+		if (bl->edges[slot].parent == parent && bl->edges[slot].c == c) {
+			return bl->edges[slot].child;
+		}
+		slot = (slot + 1) & bl->edge_mask;
+	}
+	return BLACKLIST_ROOT;
+}
+
+/*
+* Creates a new child of parent on c and returns it
+*/
+static uint32_t add_edge(struct blacklist * bl, uint32_t parent, unsigned char c) {
+	uint32_t child = bl->num_nodes++;
+	bl->nodes[child].c = c;
+	bl->nodes[child].next_sibling = bl->nodes[parent].first_child;
+	bl->nodes[parent].first_child = child;
+
+	uint32_t slot = edge_slot(bl, parent, c);
+	while (BLACKLIST_ROOT != bl->edges[slot].child) {
+		slot = (slot + 1) & bl->edge_mask;
+	}
+	bl->edges[slot].parent = parent;
+	bl->edges[slot].child = child;
+	bl->edges[slot].c = c;
+	return child;
+}
+
+/*
+* Sets the failure link of every node, breadth first so the links of shorter prefixes are set
+* before they are followed, and marks the nodes that end in an entry. Returns 0 on success, -1
+* if memory runs out.
+*/
+static int link_failures(struct blacklist * bl) {
+	uint32_t * queue = (uint32_t *) malloc(bl->num_nodes * sizeof(uint32_t));
+	if (NULL == queue) {
+		return -1;
+	}
+	uint32_t head = 0;
+	uint32_t tail = 0;
+	uint32_t child;
+	for (child = bl->nodes[BLACKLIST_ROOT].first_child; BLACKLIST_ROOT != child; child = bl->nodes[child].next_sibling) {
+		bl->nodes[child].fail = BLACKLIST_ROOT;
+		queue[tail++] = child;
+	}
+	while (head < tail) {
+		uint32_t node = queue[head++];
+		for (child = bl->nodes[node].first_child; BLACKLIST_ROOT != child; child = bl->nodes[child].next_sibling) {
+			unsigned char c = bl->nodes[child].c;
+			uint32_t fail = bl->nodes[node].fail;
+			uint32_t next;
+			while (BLACKLIST_ROOT == (next = find_edge(bl, fail, c)) && BLACKLIST_ROOT != fail) {
+				fail = bl->nodes[fail].fail;
+			}
+			bl->nodes[child].fail = next;
+			bl->nodes[child].matches |= bl->nodes[next].matches;
+			queue[tail++] = child;
+		}
+	}
+	free(queue);
+	return 0;
+}
+
+/*
+* Body of the blacklist reloader thread. Compiles the file again whenever it changes and swaps
+* the new automaton in; the old one is freed once no reactor can still be reading it.
+*/
+static void * run_blacklist_reloader(void * arg) {
+	char * filename = (char *) arg;
+	char * dir_copy = strdup(filename);
+	char * name_copy = strdup(filename);
+	const char * dir = dirname(dir_copy);
+	const char * name = basename(name_copy);
+
+	sigset_t mask;
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGHUP);
+	int signal_fd = signalfd(-1, &mask, SFD_CLOEXEC);
+
+	// watch the directory rather than the file, which editors and deploy tools replace by rename
+	int inotify_fd = inotify_init1(IN_CLOEXEC);
+	if (-1 == inotify_fd || -1 == inotify_add_watch(inotify_fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO)) {
+		log_info("Unable to watch blacklist file, reloading on SIGHUP only: %s\n", strerror(errno));
+	}
+
+	while (wait_for_change(signal_fd, inotify_fd, name)) {
+		struct blacklist * bl = load_blacklist(filename);
+		if (NULL == bl) {
+			log_info("Keeping the current blacklist.\n");
+			continue;
+		}
+		struct blacklist * old = __atomic_exchange_n(&blacklist, bl, __ATOMIC_SEQ_CST);
+		reactor_synchronize();
+		free_blacklist(old);
+		log_info("Reloaded blacklist file %s.\n", filename);
+	}
+	return NULL;
+}
+
+/*
+* Blocks until SIGHUP arrives or the file called name is written or moved into the watched
+* directory, then waits for the burst of changes to settle. Returns false if it cannot wait.
+*/
+static bool wait_for_change(int signal_fd, int inotify_fd, const char * name) {
+	char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	struct pollfd fds[2] = { { signal_fd, POLLIN, 0 }, { inotify_fd, POLLIN, 0 } };
+	bool changed = false;
+	int timeout = -1;
+	while (true) {
+		int num_ready = poll(fds, 2, timeout);
+		if (-1 == num_ready) {
+			if (EINTR == errno) {
+				continue;
+			}
+			return false;
+		}
+		if (0 == num_ready) {
+			return true;
+		}
+		if (fds[0].revents & POLLIN) {
+			struct signalfd_siginfo info;
+			if (sizeof(info) == read(signal_fd, &info, sizeof(info))) {
+				changed = true;
+			}
+		}
+		if (fds[1].revents & POLLIN) {
+			ssize_t len = read(inotify_fd, events, sizeof(events));
+			ssize_t offset = 0;
+			while (offset < len) {
+				const struct inotify_event * event = (const struct inotify_event *) (events + offset);
+				if (event->len > 0 && 0 == strcmp(event->name, name)) {
+					changed = true;
+				}
+				offset += sizeof(struct inotify_event) + event->len;
+			}
+		}
+		if (changed) {
+			timeout = BLACKLIST_SETTLE_MS;
+		}
+	}
+}
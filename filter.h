@@ -0,0 +1,50 @@
+#ifndef FILTER_H
+#define FILTER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define BLACKLIST_ROOT 0 // node of the empty prefix
+#define BLACKLIST_SETTLE_MS 200 // quiet time after a change to the file before it is reloaded
+
+/*
+* A node of the blacklist automaton: a prefix of one or more entries. fail is the node of its
+* longest proper suffix that is also a prefix, and matches is set if it or any of its suffixes
+* is a whole entry.
+*/
+struct blacklist_node {
+	uint32_t fail;
+	uint32_t first_child; // BLACKLIST_ROOT if it has none
+	uint32_t next_sibling;
+	unsigned char c; // last character of the prefix
+	bool matches;
+};
+
+/*
+* A goto transition of the automaton, from node parent on character c. Kept in an open-addressing
+* table rather than in the nodes so a node costs the same however many children it has.
+*/
+struct blacklist_edge {
+	uint32_t parent;
+	uint32_t child; // BLACKLIST_ROOT if the slot is empty
+	unsigned char c;
+};
+
+/*
+* Aho-Corasick automaton of the blacklist entries (lower case), built once when the file is read
+* so a host is checked against all of them in one pass over its characters.
+*/
+struct blacklist {
+	struct blacklist_node * nodes;
+	uint32_t num_nodes;
+	struct blacklist_edge * edges;
+	uint32_t edge_mask; // number of edge slots - 1, a power of two - 1
+	int num_entries;
+};
+
+int read_blacklist_file(char* filename);
+int watch_blacklist_file(char* filename);
+bool is_blacklisted(char * host);
+void to_lower_case(char * string);
+
+#endif
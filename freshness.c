@@ -0,0 +1,292 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include "freshness.h"
+#include "http.h"
+
+static bool get_directive(const char * value, const char * name, long long * arg);
+static bool parse_http_date(const char * value, time_t * t);
+static void set_expiry(struct cache_meta * meta, const struct http_message * response, time_t now, bool explicit_only);
+static bool build_vary_key(const char * vary, const struct http_message * request, char * key, int key_size);
+
+/*
+* Fills in meta for a response to request received at now. Returns false if the response may
+* not be stored by a shared cache at all.
+*/
+bool freshness_init(struct cache_meta * meta, const struct http_message * request, const struct http_message * response, time_t now) {
+	char cache_control[VARY_SIZE];
+	int status_code = response->status_code;
+	memset(meta, 0, sizeof(*meta));
+
+	// only complete responses the cache knows how to reuse, and byte ranges of them (see partial.c)
+	if (200 != status_code && 203 != status_code && 204 != status_code && 206 != status_code) {
+		return false;
+	}
+	if (!http_get_field(response, HTTP_FIELD_CACHE_CONTROL, cache_control, sizeof(cache_control))) {
+		cache_control[0] = '\0';
+	}
+	if (get_directive(cache_control, "no-store", NULL) || get_directive(cache_control, "private", NULL)) {
+		return false;
+	}
+	// a response to an authenticated request is only shared when host says so
+	if (NULL != request->fields[HTTP_FIELD_AUTHORIZATION].data
+		&& !get_directive(cache_control, "public", NULL)
+		&& !get_directive(cache_control, "s-maxage", NULL)
+		&& !get_directive(cache_control, "must-revalidate", NULL)) {
+		return false;
+	}
+
+	if (http_get_field(response, HTTP_FIELD_VARY, meta->vary, sizeof(meta->vary))) {
+		if (http_header_has_token(meta->vary, "*")) {
+			return false;
+		}
+		if (!build_vary_key(meta->vary, request, meta->vary_key, sizeof(meta->vary_key))) {
+			return false;
+		}
+	}
+
+	http_get_field(response, HTTP_FIELD_ETAG, meta->etag, sizeof(meta->etag));
+	http_get_field(response, HTTP_FIELD_LAST_MODIFIED, meta->last_modified, sizeof(meta->last_modified));
+	set_expiry(meta, response, now, false);
+	return true;
+}
+
+/*
+* Updates meta from the headers of a 304 response that revalidated it at now.
+*/
+void freshness_update(struct cache_meta * meta, const struct http_message * response, time_t now) {
+	http_get_field(response, HTTP_FIELD_ETAG, meta->etag, sizeof(meta->etag));
+	http_get_field(response, HTTP_FIELD_LAST_MODIFIED, meta->last_modified, sizeof(meta->last_modified));
+	set_expiry(meta, response, now, true);
+}
+
+/*
+* Returns true if the stored response can be used at now without revalidating it.
+*/
+bool freshness_is_fresh(const struct cache_meta * meta, time_t now) {
+	return !meta->no_cache && now < meta->expires;
+}
+
+/*
+* Returns true if the stored response has a validator host can check it against.
+*/
+bool freshness_can_revalidate(const struct cache_meta * meta) {
+	return '\0' != meta->etag[0] || '\0' != meta->last_modified[0];
+}
+
+/*
+* Returns true if request selects the same variant as the request the response was stored for.
+*/
+bool freshness_matches_request(const struct cache_meta * meta, const struct http_message * request) {
+	char key[VARY_SIZE];
+	if ('\0' == meta->vary[0]) {
+		return true;
+	}
+	return build_vary_key(meta->vary, request, key, sizeof(key)) && 0 == strcmp(key, meta->vary_key);
+}
+
+/*
+* Returns true if request asks for a byte range of the stored response without an If-Range, or
+* with an If-Range naming its validator (compared strongly, so a weak ETag never matches).
+*/
+bool freshness_if_range_matches(const struct cache_meta * meta, const struct http_message * request) {
+	char value[VALIDATOR_SIZE];
+	if (!http_get_field(request, HTTP_FIELD_IF_RANGE, value, sizeof(value))) {
+		return true;
+	}
+	if ('"' == value[0] || 0 == strncmp(value, "W/", 2)) {
+		return freshness_has_strong_validator(meta) && 0 == strcmp(value, meta->etag);
+	}
+	return '\0' != meta->last_modified[0] && 0 == strcmp(value, meta->last_modified);
+}
+
+/*
+* Returns true if the stored response has a validator that changes with every change to its
+* body, so byte ranges received at different times can be put together (RFC 9110 15.3.7.3).
+*/
+bool freshness_has_strong_validator(const struct cache_meta * meta) {
+	if ('\0' != meta->etag[0]) {
+		return 0 != strncmp(meta->etag, "W/", 2);
+	}
+	return '\0' != meta->last_modified[0];
+}
+
+/*
+* Returns true if two stored responses carry the same validators, so they are the same
+* representation.
+*/
+bool freshness_same_validators(const struct cache_meta * a, const struct cache_meta * b) {
+	return 0 == strcmp(a->etag, b->etag) && 0 == strcmp(a->last_modified, b->last_modified);
+}
+
+/*
+* Appends the conditional header fields that revalidate the stored response to dest. Returns
+* the new length of dest, which is at least dest_size if they did not fit.
+*/
+int freshness_add_validators(const struct cache_meta * meta, char * dest, int dest_len, int dest_size) {
+	if ('\0' != meta->etag[0] && dest_len < dest_size) {
+		dest_len += snprintf(dest + dest_len, dest_size - dest_len, "If-None-Match: %s\r\n", meta->etag);
+	}
+	if ('\0' != meta->last_modified[0] && dest_len < dest_size) {
+		dest_len += snprintf(dest + dest_len, dest_size - dest_len, "If-Modified-Since: %s\r\n", meta->last_modified);
+	}
+	return dest_len;
+}
+
+/*
+* Reads the cache directives of a client request: no_cache if it must not be answered from
+* the cache without revalidating, no_store if the cache must be left out entirely.
+*/
+void freshness_request_directives(const struct http_message * request, bool * no_cache, bool * no_store) {
+	char value[VARY_SIZE];
+	long long max_age;
+	*no_cache = false;
+	*no_store = false;
+	if (http_get_field(request, HTTP_FIELD_CACHE_CONTROL, value, sizeof(value))) {
+		*no_store = get_directive(value, "no-store", NULL);
+		*no_cache = get_directive(value, "no-cache", NULL) || (get_directive(value, "max-age", &max_age) && 0 == max_age);
+	} else if (http_get_field(request, HTTP_FIELD_PRAGMA, value, sizeof(value))) {
+		*no_cache = http_header_has_token(value, "no-cache");
+	}
+}
+
+/*
+* Sets when the response in meta stops being fresh from the response headers. With explicit_only
+* the previous lifetime is kept unless the headers give one themselves.
+*/
+static void set_expiry(struct cache_meta * meta, const struct http_message * response, time_t now, bool explicit_only) {
+	char cache_control[VARY_SIZE];
+	char value[VALIDATOR_SIZE];
+	bool has_cache_control = http_get_field(response, HTTP_FIELD_CACHE_CONTROL, cache_control, sizeof(cache_control));
+	long long lifetime;
+	time_t date, expires, last_modified;
+
+	if (!has_cache_control) {
+		cache_control[0] = '\0';
+	}
+	if (!http_get_field(response, HTTP_FIELD_DATE, value, sizeof(value)) || !parse_http_date(value, &date)) {
+		date = now;
+	}
+
+	if (get_directive(cache_control, "s-maxage", &lifetime) || get_directive(cache_control, "max-age", &lifetime)) {
+		// lifetime set
+	} else if (http_get_field(response, HTTP_FIELD_EXPIRES, value, sizeof(value))) {
+		// an invalid Expires means already expired
+		lifetime = parse_http_date(value, &expires) ? (long long) (expires - date) : 0;
+	} else if (explicit_only) {
+		lifetime = meta->lifetime;
+	} else if ('\0' != meta->last_modified[0] && parse_http_date(meta->last_modified, &last_modified) && last_modified < date) {
+		lifetime = (date - last_modified) / 10;
+		if (lifetime > HEURISTIC_MAX_LIFETIME) {
+			lifetime = HEURISTIC_MAX_LIFETIME;
+		}
+	} else {
+		lifetime = HEURISTIC_LIFETIME;
+	}
+	if (lifetime < 0) {
+		lifetime = 0;
+	}
+	if (has_cache_control || !explicit_only) {
+		meta->no_cache = get_directive(cache_control, "no-cache", NULL);
+	}
+
+	// time the response already spent in other caches or in transit
+	long long age = (now > date) ? now - date : 0;
+	if (http_get_field(response, HTTP_FIELD_AGE, value, sizeof(value)) && atoll(value) > age) {
+		age = atoll(value);
+	}
+	meta->stored = now;
+	meta->lifetime = lifetime;
+	meta->expires = now + lifetime - age;
+}
+
+/*
+* Returns true if the comma separated Cache-Control value has directive name, with its numeric
+* argument (if any) in arg.
+*/
+static bool get_directive(const char * value, const char * name, long long * arg) {
+	int name_len = strlen(name);
+	const char * p = value;
+	while ('\0' != *p) {
+		while (' ' == *p || '\t' == *p || ',' == *p) {
+			p++;
+		}
+		if (0 == strncasecmp(p, name, name_len)) {
+			const char * next = p + name_len;
+			if ('\0' == *next || ',' == *next || ' ' == *next || '\t' == *next) {
+				if (NULL != arg) {
+					return false; // directive needs an argument here
+				}
+				return true;
+			}
+			if ('=' == *next) {
+				if (NULL != arg) {
+					next++;
+					if ('"' == *next) {
+						next++;
+					}
+					char * endptr;
+					*arg = strtoll(next, &endptr, 10);
+					return endptr != next;
+				}
+				return true;
+			}
+		}
+		while ('\0' != *p && ',' != *p) {
+			p++;
+		}
+	}
+	return false;
+}
+
+/*
+* Parses an HTTP-date in the preferred IMF-fixdate format ("Sun, 06 Nov 1994 08:49:37 GMT").
+*/
+static bool parse_http_date(const char * value, time_t * t) {
+	struct tm tm;
+	memset(&tm, 0, sizeof(tm));
+	const char * end = strptime(value, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+	if (NULL == end) {
+		return false;
+	}
+	*t = timegm(&tm);
+	return true;
+}
+
+/*
+* Writes the values of the request fields listed in vary into key as "name=value" entries
+* separated by tabs. Returns false if they do not fit.
+*/
+static bool build_vary_key(const char * vary, const struct http_message * request, char * key, int key_size) {
+	char name[VARY_SIZE];
+	char value[VARY_SIZE];
+	int key_len = 0;
+	const char * p = vary;
+	key[0] = '\0';
+	while ('\0' != *p) {
+		while (' ' == *p || '\t' == *p || ',' == *p) {
+			p++;
+		}
+		int name_len = strcspn(p, ", \t");
+		if (0 == name_len) {
+			break;
+		}
+		snprintf(name, sizeof(name), "%.*s", name_len, p);
+		p += name_len;
+		const struct http_slice * field = http_find_header(request, name);
+		if (NULL == field) {
+			value[0] = '\0';
+		} else {
+			http_copy_slice(*field, value, sizeof(value));
+		}
+		key_len += snprintf(key + key_len, key_size - key_len, "%s=%s\t", name, value);
+		if (key_len >= key_size) {
+			return false;
+		}
+	}
+	return true;
+}
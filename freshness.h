@@ -0,0 +1,40 @@
+#ifndef FRESHNESS_H
+#define FRESHNESS_H
+
+#include <stdbool.h>
+#include <time.h>
+
+#include "http.h"
+
+#define VALIDATOR_SIZE 128 // room for an ETag or Last-Modified value
+#define VARY_SIZE 256 // room for the Vary field list and for the request values it selects
+#define HEURISTIC_LIFETIME 300 // seconds a response without freshness information or Last-Modified stays fresh
+#define HEURISTIC_MAX_LIFETIME (24 * 60 * 60) // cap on the Last-Modified based heuristic
+
+/*
+* What the cache needs to know about a stored response to decide whether it can be used for a
+* request without asking host, and how to revalidate it when it cannot.
+*/
+struct cache_meta {
+	time_t stored; // when the response was received or last revalidated
+	time_t expires; // fresh until then
+	long long lifetime; // seconds of freshness from the last response, reused when a 304 gives none
+	bool no_cache; // must be revalidated before every use
+	char etag[VALIDATOR_SIZE];
+	char last_modified[VALIDATOR_SIZE];
+	char vary[VARY_SIZE]; // request fields named by Vary
+	char vary_key[VARY_SIZE]; // their values in the request the response was stored for
+};
+
+bool freshness_init(struct cache_meta * meta, const struct http_message * request, const struct http_message * response, time_t now);
+void freshness_update(struct cache_meta * meta, const struct http_message * response, time_t now);
+bool freshness_is_fresh(const struct cache_meta * meta, time_t now);
+bool freshness_can_revalidate(const struct cache_meta * meta);
+bool freshness_matches_request(const struct cache_meta * meta, const struct http_message * request);
+bool freshness_if_range_matches(const struct cache_meta * meta, const struct http_message * request);
+bool freshness_has_strong_validator(const struct cache_meta * meta);
+bool freshness_same_validators(const struct cache_meta * a, const struct cache_meta * b);
+int freshness_add_validators(const struct cache_meta * meta, char * dest, int dest_len, int dest_size);
+void freshness_request_directives(const struct http_message * request, bool * no_cache, bool * no_store);
+
+#endif
@@ -0,0 +1,90 @@
+#include <string.h>
+
+#include "histogram.h"
+
+void histogram_init(struct histogram * hist) {
+	memset(hist, 0, sizeof(*hist));
+}
+
+/*
+* Returns the bucket of value: its top 8 significant bits select one of HISTOGRAM_SUB_BUCKETS
+* buckets within its power of two.
+*/
+static int bucket_for(uint64_t value) {
+	if (value < HISTOGRAM_SUB_BUCKETS) {
+		return (int) value;
+	}
+	int shift = 63 - __builtin_clzll(value) - 7; // value >> shift is in [128, 256)
+	return HISTOGRAM_SUB_BUCKETS * shift + (int) (value >> shift);
+}
+
+/*
+* Returns the largest value counted in bucket
+*/
+static uint64_t bucket_max(int bucket) {
+	if (bucket < 2 * HISTOGRAM_SUB_BUCKETS) {
+		return (uint64_t) bucket;
+	}
+	int shift = bucket / HISTOGRAM_SUB_BUCKETS - 1;
+	uint64_t top = (uint64_t) (bucket - HISTOGRAM_SUB_BUCKETS * shift);
+	return ((top + 1) << shift) - 1;
+}
+
+/*
+* Counts value. Relaxed atomic stores (plain moves on x86) let another thread merge the
+* histogram at the same time without locking; only the recording thread writes it.
+*/
+void histogram_record(struct histogram * hist, uint64_t value) {
+	uint64_t * count = &hist->counts[bucket_for(value)];
+	__atomic_store_n(count, *count + 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&hist->total, hist->total + 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&hist->sum, hist->sum + value, __ATOMIC_RELAXED);
+	if (value > hist->max) {
+		__atomic_store_n(&hist->max, value, __ATOMIC_RELAXED);
+	}
+}
+
+/*
+* Adds the counts of src to dest. src may be recorded into by its own thread meanwhile, in which
+* case values recorded during the merge may be left out.
+*/
+void histogram_merge(struct histogram * dest, const struct histogram * src) {
+	uint64_t total = 0;
+	int i;
+	for (i = 0; i < HISTOGRAM_BUCKETS; i++) {
+		uint64_t count = __atomic_load_n(&src->counts[i], __ATOMIC_RELAXED);
+		dest->counts[i] += count;
+		total += count;
+	}
+	// total is summed from the buckets so that percentiles always find their rank
+	dest->total += total;
+	dest->sum += __atomic_load_n(&src->sum, __ATOMIC_RELAXED);
+	uint64_t max = __atomic_load_n(&src->max, __ATOMIC_RELAXED);
+	if (max > dest->max) {
+		dest->max = max;
+	}
+}
+
+/*
+* Returns the value below which percentile (0 to 100) of the recorded values fall, rounded up
+* to the end of its bucket. Returns 0 if nothing was recorded.
+*/
+uint64_t histogram_percentile(const struct histogram * hist, double percentile) {
+	if (0 == hist->total) {
+		return 0;
+	}
+	uint64_t rank = (uint64_t) (percentile / 100.0 * hist->total + 0.5);
+	if (rank < 1) {
+		rank = 1;
+	}
+	uint64_t seen = 0;
+	int i;
+	for (i = 0; i < HISTOGRAM_BUCKETS; i++) {
+		seen += hist->counts[i];
+		if (seen >= rank) {
+			uint64_t value = bucket_max(i);
+			return (value > hist->max) ? hist->max : value;
+		}
+	}
+	return hist->max;
+}
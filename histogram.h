@@ -0,0 +1,27 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stdint.h>
+
+#define HISTOGRAM_SUB_BUCKETS 128 // buckets per power of two, so values are kept to within 1/128
+#define HISTOGRAM_BUCKETS (HISTOGRAM_SUB_BUCKETS * 58) // enough for any uint64_t value
+
+/*
+* Log-linear histogram of non-negative values, HDR style: values below HISTOGRAM_SUB_BUCKETS are
+* counted exactly, larger ones in buckets whose width grows with the value so that the relative
+* error stays the same. Only one thread may record into a histogram, but others may merge it
+* while it does; use one per thread and merge them.
+*/
+struct histogram {
+	uint64_t counts[HISTOGRAM_BUCKETS];
+	uint64_t total;
+	uint64_t sum; // of all recorded values
+	uint64_t max;
+};
+
+void histogram_init(struct histogram * hist);
+void histogram_record(struct histogram * hist, uint64_t value);
+void histogram_merge(struct histogram * dest, const struct histogram * src);
+uint64_t histogram_percentile(const struct histogram * hist, double percentile);
+
+#endif
@@ -0,0 +1,696 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdlib.h>
+#include <strings.h>
+#include <ctype.h>
+#include <limits.h>
+
+#include "http.h"
+
+static int find_header_end(const char * buffer, int len, int start);
+static enum http_parse_result parse_head(struct http_parser * parser, const char * buffer, int len, struct http_message * message);
+static bool parse_header_fields(struct http_message * message, const char * fields, const char * end);
+static bool slice_has_token(struct http_slice value, const char * token);
+static struct http_slice trim(const char * start, const char * stop);
+static void rebase(struct http_slice * slice, const char * from, const char * to);
+static const char * parse_number(const char * p, long long * n);
+
+// names of the fields recorded in struct http_message, by enum http_field
+static const struct http_slice field_names[HTTP_NUM_FIELDS] = {
+	[HTTP_FIELD_ACCEPT_ENCODING] = { "Accept-Encoding", 15 },
+	[HTTP_FIELD_AGE] = { "Age", 3 },
+	[HTTP_FIELD_AUTHORIZATION] = { "Authorization", 13 },
+	[HTTP_FIELD_CACHE_CONTROL] = { "Cache-Control", 13 },
+	[HTTP_FIELD_CONTENT_ENCODING] = { "Content-Encoding", 16 },
+	[HTTP_FIELD_CONTENT_RANGE] = { "Content-Range", 13 },
+	[HTTP_FIELD_CONTENT_TYPE] = { "Content-Type", 12 },
+	[HTTP_FIELD_DATE] = { "Date", 4 },
+	[HTTP_FIELD_ETAG] = { "ETag", 4 },
+	[HTTP_FIELD_EXPIRES] = { "Expires", 7 },
+	[HTTP_FIELD_IF_RANGE] = { "If-Range", 8 },
+	[HTTP_FIELD_LAST_MODIFIED] = { "Last-Modified", 13 },
+	[HTTP_FIELD_PRAGMA] = { "Pragma", 6 },
+	[HTTP_FIELD_RANGE] = { "Range", 5 },
+	[HTTP_FIELD_VARY] = { "Vary", 4 }
+};
+
+/*
+* Returns the length of the header block at the start of buffer including the blank line that
+* ends it, or -1 if the blank line has not been received yet.
+*/
+int http_find_header_end(const char * buffer, int len) {
+	return find_header_end(buffer, len, 0);
+}
+
+/*
+* Prepare parser for a new request or response.
+*/
+void http_parser_init(struct http_parser * parser) {
+	parser->scanned = 0;
+}
+
+/*
+* Parses the request head at the start of the len bytes in buffer. Can be called again with
+* more data (and the same parser) as long as it returns HTTP_PARSE_INCOMPLETE; bytes already
+* searched for the end of the head are not searched again.
+*/
+enum http_parse_result http_parse_request(struct http_parser * parser, const char * buffer, int len, struct http_message * request) {
+	enum http_parse_result result = parse_head(parser, buffer, len, request);
+	if (HTTP_PARSE_DONE != result) {
+		return result;
+	}
+
+	// method SP request-target SP HTTP-version
+	const char * line = request->first_line.data;
+	const char * end = line + request->first_line.len;
+	const char * sp1 = memchr(line, ' ', end - line);
+	const char * sp2 = (NULL == sp1) ? NULL : memchr(sp1 + 1, ' ', end - sp1 - 1);
+	if (NULL == sp2 || sp1 == line || sp2 == sp1 + 1 || sp2 + 1 == end) {
+		return HTTP_PARSE_INVALID;
+	}
+	request->method = (struct http_slice) { line, sp1 - line };
+	request->target = (struct http_slice) { sp1 + 1, sp2 - sp1 - 1 };
+	request->version = (struct http_slice) { sp2 + 1, end - sp2 - 1 };
+	return HTTP_PARSE_DONE;
+}
+
+/*
+* Parses the response head at the start of the len bytes in buffer, like http_parse_request.
+*/
+enum http_parse_result http_parse_response(struct http_parser * parser, const char * buffer, int len, struct http_message * response) {
+	enum http_parse_result result = parse_head(parser, buffer, len, response);
+	if (HTTP_PARSE_DONE != result) {
+		return result;
+	}
+
+	// HTTP-version SP status-code [SP reason-phrase]
+	const char * line = response->first_line.data;
+	const char * end = line + response->first_line.len;
+	const char * sp = memchr(line, ' ', end - line);
+	if (NULL == sp || end - sp < 4 || !isdigit((unsigned char) sp[1]) || !isdigit((unsigned char) sp[2]) || !isdigit((unsigned char) sp[3])
+		|| (end - sp > 4 && ' ' != sp[4])) {
+		return HTTP_PARSE_INVALID;
+	}
+	response->version = (struct http_slice) { line, sp - line };
+	response->status_code = (sp[1] - '0') * 100 + (sp[2] - '0') * 10 + (sp[3] - '0');
+	return HTTP_PARSE_DONE;
+}
+
+/*
+* Splits an absolute-form request target into its parts. Returns false if it is not one.
+*/
+bool http_parse_uri(struct http_slice target, struct http_uri * uri) {
+	const char * p = target.data;
+	const char * end = p + target.len;
+	const char * colon = memchr(p, ':', end - p);
+	if (NULL == colon || end - colon < 3 || '/' != colon[1] || '/' != colon[2]) {
+		return false;
+	}
+	uri->authority_and_path = (struct http_slice) { colon + 1, end - colon - 1 };
+
+	const char * host = colon + 3;
+	const char * host_end = host;
+	while (host_end < end && ':' != *host_end && '/' != *host_end && '?' != *host_end) {
+		host_end++;
+	}
+	if (host_end == host) {
+		return false;
+	}
+	uri->host = (struct http_slice) { host, host_end - host };
+
+	uri->port = 0;
+	p = host_end;
+	if (p < end && ':' == *p) {
+		for (p++; p < end && isdigit((unsigned char) *p); p++) {
+			uri->port = uri->port * 10 + (*p - '0');
+			if (uri->port > 65535) {
+				return false;
+			}
+		}
+	}
+	if (p < end && '/' != *p && '?' != *p) {
+		return false;
+	}
+	uri->path = (struct http_slice) { p, end - p };
+	return true;
+}
+
+/*
+* Points the slices of message, parsed from a buffer at from, at the same bytes in a copy of that
+* buffer at to.
+*/
+void http_message_rebase(struct http_message * message, const char * from, const char * to) {
+	int i;
+	rebase(&message->first_line, from, to);
+	rebase(&message->method, from, to);
+	rebase(&message->target, from, to);
+	rebase(&message->version, from, to);
+	for (i = 0; i < message->num_headers; i++) {
+		rebase(&message->headers[i].name, from, to);
+		rebase(&message->headers[i].value, from, to);
+	}
+	for (i = 0; i < HTTP_NUM_FIELDS; i++) {
+		rebase(&message->fields[i], from, to);
+	}
+}
+
+/*
+* Returns the value of the first header field called name (case insensitive), or NULL.
+*/
+const struct http_slice * http_find_header(const struct http_message * message, const char * name) {
+	int i;
+	for (i = 0; i < message->num_headers; i++) {
+		if (http_slice_case_equals(message->headers[i].name, name)) {
+			return &message->headers[i].value;
+		}
+	}
+	return NULL;
+}
+
+bool http_slice_equals(struct http_slice slice, const char * string) {
+	return (int) strlen(string) == slice.len && 0 == memcmp(slice.data, string, slice.len);
+}
+
+bool http_slice_case_equals(struct http_slice slice, const char * string) {
+	return (int) strlen(string) == slice.len && 0 == strncasecmp(slice.data, string, slice.len);
+}
+
+/*
+* Copies the value of field into value (truncated to value_size bytes with its NUL) and returns
+* true if message has it.
+*/
+bool http_get_field(const struct http_message * message, enum http_field field, char * value, int value_size) {
+	if (NULL == message->fields[field].data) {
+		return false;
+	}
+	http_copy_slice(message->fields[field], value, value_size);
+	return true;
+}
+
+/*
+* Copies slice into dest as a NUL terminated string, truncated to dest_size bytes.
+*/
+void http_copy_slice(struct http_slice slice, char * dest, int dest_size) {
+	int copy_len = (slice.len < dest_size) ? slice.len : dest_size - 1;
+	memcpy(dest, slice.data, copy_len);
+	dest[copy_len] = '\0';
+}
+
+/*
+* Returns true if the comma separated header value contains token (case insensitive).
+*/
+bool http_header_has_token(const char * value, const char * token) {
+	int token_len = strlen(token);
+	const char * p = value;
+	while ('\0' != *p) {
+		while (' ' == *p || '\t' == *p || ',' == *p) {
+			p++;
+		}
+		if (0 == strncasecmp(p, token, token_len)) {
+			char next = p[token_len];
+			if ('\0' == next || ',' == next || ' ' == next || '\t' == next || ';' == next) {
+				return true;
+			}
+		}
+		while ('\0' != *p && ',' != *p) {
+			p++;
+		}
+	}
+	return false;
+}
+
+/*
+* Parses a Range field value asking for a single range of bytes. Returns false if it asks for
+* something else, such as several ranges, which the proxy answers with the whole response.
+*/
+bool http_parse_range(const char * value, struct http_range * range) {
+	const char * p = value;
+	if (0 != strncasecmp(p, "bytes=", 6)) {
+		return false;
+	}
+	p += 6;
+	while (' ' == *p || '\t' == *p) {
+		p++;
+	}
+	range->first = -1;
+	range->last = -1;
+	range->suffix_len = 0;
+	if ('-' == *p) {
+		p = parse_number(p + 1, &range->suffix_len);
+		if (NULL == p || 0 == range->suffix_len) {
+			return false;
+		}
+	} else {
+		p = parse_number(p, &range->first);
+		if (NULL == p || '-' != *p) {
+			return false;
+		}
+		p++;
+		if (isdigit((unsigned char) *p)) {
+			p = parse_number(p, &range->last);
+			if (NULL == p || range->last < range->first) {
+				return false;
+			}
+		}
+	}
+	while (' ' == *p || '\t' == *p) {
+		p++;
+	}
+	return '\0' == *p;
+}
+
+/*
+* Works out the bytes first to last that range selects from a body of length bytes. Returns
+* false if it selects none of them (416 Range Not Satisfiable).
+*/
+bool http_resolve_range(const struct http_range * range, long long length, long long * first, long long * last) {
+	if (-1 == range->first) {
+		if (0 == length) {
+			return false;
+		}
+		*first = (range->suffix_len < length) ? length - range->suffix_len : 0;
+		*last = length - 1;
+		return true;
+	}
+	if (range->first >= length) {
+		return false;
+	}
+	*first = range->first;
+	*last = (-1 == range->last || range->last >= length) ? length - 1 : range->last;
+	return true;
+}
+
+/*
+* Parses a Content-Range field value of a 206 response ("bytes first-last/length"). Returns
+* false if it is malformed or the length of the whole body is not given.
+*/
+bool http_parse_content_range(const char * value, long long * first, long long * last, long long * length) {
+	const char * p = value;
+	if (0 != strncasecmp(p, "bytes ", 6)) {
+		return false;
+	}
+	p = parse_number(p + 6, first);
+	if (NULL == p || '-' != *p) {
+		return false;
+	}
+	p = parse_number(p + 1, last);
+	if (NULL == p || '/' != *p) {
+		return false;
+	}
+	p = parse_number(p + 1, length);
+	return NULL != p && '\0' == *p && *first <= *last && *last < *length;
+}
+
+/*
+* Writes the head of a response carrying bytes first to last of a body of length bytes into
+* dest, with the header fields of the stored response head: a 206 with Content-Range, or a 200
+* for the whole body. Returns the length of the head, which is at least dest_size if it did not
+* fit, or -1 if head cannot be parsed.
+*/
+int http_write_range_head(char * dest, int dest_size, const char * head, int head_len, int status_code, long long first, long long last, long long length) {
+	struct http_parser parser;
+	struct http_message message;
+	http_parser_init(&parser);
+	if (HTTP_PARSE_DONE != http_parse_response(&parser, head, head_len, &message)) {
+		return -1;
+	}
+	int len = snprintf(dest, dest_size, "HTTP/1.1 %s\r\n", (206 == status_code) ? "206 Partial Content" : "200 OK");
+	int i;
+	for (i = 0; i < message.num_headers && len < dest_size; i++) {
+		struct http_slice name = message.headers[i].name;
+		struct http_slice value = message.headers[i].value;
+		// framing is written anew for the bytes being sent
+		if (http_slice_case_equals(name, "Content-Length") || http_slice_case_equals(name, "Content-Range")
+			|| http_slice_case_equals(name, "Transfer-Encoding")) {
+			continue;
+		}
+		len += snprintf(dest + len, dest_size - len, "%.*s: %.*s\r\n", name.len, name.data, value.len, value.data);
+	}
+	if (len < dest_size && 206 == status_code) {
+		len += snprintf(dest + len, dest_size - len, "Content-Range: bytes %lld-%lld/%lld\r\n", first, last, length);
+	}
+	if (len < dest_size) {
+		len += snprintf(dest + len, dest_size - len, "Content-Length: %lld\r\n\r\n", (206 == status_code) ? last - first + 1 : length);
+	}
+	return len;
+}
+
+/*
+* Sets up framer from the parsed head of a response to a GET request.
+*/
+void body_framer_init(struct body_framer * framer, const struct http_message * response) {
+	memset(framer, 0, sizeof(*framer));
+
+	// HTTP/1.1 connections are persistent unless the host says otherwise, HTTP/1.0 ones are not
+	framer->keep_alive = http_slice_equals(response->version, "HTTP/1.1");
+	if (response->connection_close) {
+		framer->keep_alive = false;
+	} else if (response->connection_keep_alive) {
+		framer->keep_alive = true;
+	}
+
+	// 1xx, 204 and 304 responses never have a body
+	int status_code = response->status_code;
+	if ((status_code >= 100 && status_code < 200) || 204 == status_code || 304 == status_code) {
+		framer->state = BODY_DONE;
+		return;
+	}
+
+	if (response->chunked) {
+		framer->chunked = true;
+		framer->state = BODY_CHUNK_SIZE;
+		return;
+	}
+
+	if (response->content_length >= 0) {
+		framer->remaining = response->content_length;
+		framer->state = (0 == response->content_length) ? BODY_DONE : BODY_LENGTH;
+		return;
+	}
+
+	// no framing, the body runs until the host closes the connection
+	framer->state = BODY_UNTIL_CLOSE;
+	framer->keep_alive = false;
+}
+
+/*
+* Feeds len bytes of body data to framer and returns how many of them belong to the body.
+* Anything past the returned count follows the end of the response.
+*/
+int body_framer_consume(struct body_framer * framer, const char * data, int len) {
+	return body_framer_decode(framer, data, len, NULL, NULL);
+}
+
+/*
+* Like body_framer_consume, also passing the payload of the body (what is left once chunked
+* framing is taken out) to payload, if not NULL, as it is found.
+*/
+int body_framer_decode(struct body_framer * framer, const char * data, int len, void (*payload)(void * arg, const char * data, int len), void * arg) {
+	int pos = 0;
+	while (pos < len) {
+		switch (framer->state) {
+		case BODY_DONE:
+			return pos;
+
+		case BODY_UNTIL_CLOSE:
+			if (NULL != payload) {
+				payload(arg, data + pos, len - pos);
+			}
+			return len;
+
+		case BODY_LENGTH:
+		case BODY_CHUNK_DATA: {
+			long long take = len - pos;
+			if (take > framer->remaining) {
+				take = framer->remaining;
+			}
+			if (NULL != payload) {
+				payload(arg, data + pos, take);
+			}
+			pos += take;
+			framer->remaining -= take;
+			if (0 == framer->remaining) {
+				framer->state = (BODY_LENGTH == framer->state) ? BODY_DONE : BODY_CHUNK_DATA_END;
+			}
+			break;
+		}
+
+		case BODY_CHUNK_SIZE: {
+			char c = data[pos++];
+			if (isxdigit((unsigned char) c)) {
+				int digit = isdigit((unsigned char) c) ? c - '0' : tolower((unsigned char) c) - 'a' + 10;
+				if (framer->remaining > (1LL << 56)) {
+					// absurd chunk size, stop trusting the framing
+					framer->state = BODY_UNTIL_CLOSE;
+					framer->keep_alive = false;
+					break;
+				}
+				framer->remaining = framer->remaining * 16 + digit;
+				framer->saw_chunk_digit = true;
+			} else if ('\n' == c || ';' == c || ' ' == c || '\t' == c || '\r' == c) {
+				if (!framer->saw_chunk_digit) {
+					if ('\r' == c || '\n' == c) {
+						break; // tolerate blank line before a chunk size
+					}
+					framer->state = BODY_UNTIL_CLOSE;
+					framer->keep_alive = false;
+					break;
+				}
+				if ('\n' == c) {
+					framer->saw_chunk_digit = false;
+					framer->state = (0 == framer->remaining) ? BODY_TRAILER : BODY_CHUNK_DATA;
+					framer->trailer_line_len = 0;
+				} else {
+					framer->state = BODY_CHUNK_EXT;
+				}
+			} else {
+				framer->state = BODY_UNTIL_CLOSE;
+				framer->keep_alive = false;
+			}
+			break;
+		}
+
+		case BODY_CHUNK_EXT: {
+			const char * newline = memchr(data + pos, '\n', len - pos);
+			if (NULL == newline) {
+				pos = len;
+				break;
+			}
+			pos = newline - data + 1;
+			framer->saw_chunk_digit = false;
+			framer->state = (0 == framer->remaining) ? BODY_TRAILER : BODY_CHUNK_DATA;
+			framer->trailer_line_len = 0;
+			break;
+		}
+
+		case BODY_CHUNK_DATA_END: {
+			char c = data[pos++];
+			if ('\n' == c) {
+				framer->state = BODY_CHUNK_SIZE;
+				framer->remaining = 0;
+			} else if ('\r' != c) {
+				framer->state = BODY_UNTIL_CLOSE;
+				framer->keep_alive = false;
+			}
+			break;
+		}
+
+		case BODY_TRAILER: {
+			char c = data[pos++];
+			if ('\n' == c) {
+				if (0 == framer->trailer_line_len) {
+					framer->state = BODY_DONE;
+				}
+				framer->trailer_line_len = 0;
+			} else if ('\r' != c) {
+				framer->trailer_line_len++;
+			}
+			break;
+		}
+		}
+	}
+	return pos;
+}
+
+/*
+* Counts len body bytes that were relayed without being looked at. Only valid while the body
+* is framed by Content-Length or by the connection closing.
+*/
+void body_framer_skip(struct body_framer * framer, long long len) {
+	if (BODY_LENGTH == framer->state) {
+		framer->remaining -= len;
+		if (framer->remaining <= 0) {
+			framer->state = BODY_DONE;
+		}
+	}
+}
+
+/*
+* Returns true once the whole body has been seen.
+*/
+bool body_framer_done(const struct body_framer * framer) {
+	return BODY_DONE == framer->state;
+}
+
+/*
+* Called when host closes the connection. Returns true if that ends the body, false if the
+* body was cut short.
+*/
+bool body_framer_close(struct body_framer * framer) {
+	if (BODY_UNTIL_CLOSE == framer->state) {
+		framer->state = BODY_DONE;
+	}
+	return BODY_DONE == framer->state;
+}
+
+/*
+* Returns the length of the head at the start of buffer, searching from start, or -1.
+*/
+static int find_header_end(const char * buffer, int len, int start) {
+	int i;
+	for (i = start; i < len; i++) {
+		if ('\n' != buffer[i]) {
+			continue;
+		}
+		if (i + 1 < len && '\n' == buffer[i + 1]) {
+			return i + 2;
+		}
+		if (i + 2 < len && '\r' == buffer[i + 1] && '\n' == buffer[i + 2]) {
+			return i + 3;
+		}
+	}
+	return -1;
+}
+
+/*
+* Finds the end of the head and splits it into its first line and header fields.
+*/
+static enum http_parse_result parse_head(struct http_parser * parser, const char * buffer, int len, struct http_message * message) {
+	int header_len = find_header_end(buffer, len, parser->scanned);
+	if (-1 == header_len) {
+		// a line ending at the very end may still turn out to be followed by a blank line
+		parser->scanned = (len > 2) ? len - 2 : 0;
+		return HTTP_PARSE_INCOMPLETE;
+	}
+
+	message->header_len = header_len;
+	message->num_headers = 0;
+	message->status_code = 0;
+	message->content_length = -1;
+	message->chunked = false;
+	message->connection_close = false;
+	message->connection_keep_alive = false;
+	memset(message->fields, 0, sizeof(message->fields));
+	message->method = (struct http_slice) { buffer, 0 };
+	message->target = (struct http_slice) { buffer, 0 };
+
+	const char * end = buffer + header_len;
+	const char * line_end = memchr(buffer, '\n', header_len);
+	message->first_line = trim(buffer, line_end);
+	if (0 == message->first_line.len) {
+		return HTTP_PARSE_INVALID;
+	}
+	return parse_header_fields(message, line_end + 1, end) ? HTTP_PARSE_DONE : HTTP_PARSE_INVALID;
+}
+
+/*
+* Adds each "name: value" line between fields and end to message, picking out the ones that
+* decide framing and persistence, and recording the ones in field_names, as it goes.
+*/
+static bool parse_header_fields(struct http_message * message, const char * fields, const char * end) {
+	const char * line = fields;
+	while (line < end) {
+		const char * line_end = memchr(line, '\n', end - line);
+		if (NULL == line_end) {
+			line_end = end;
+		}
+		const char * colon = memchr(line, ':', line_end - line);
+		if (NULL != colon && colon > line && ' ' != colon[-1] && '\t' != colon[-1]) {
+			if (HTTP_MAX_HEADERS == message->num_headers) {
+				return false;
+			}
+			struct http_header * header = &message->headers[message->num_headers++];
+			header->name = (struct http_slice) { line, colon - line };
+			header->value = trim(colon + 1, line_end);
+
+			if (http_slice_case_equals(header->name, "Content-Length")) {
+				long long content_length = 0;
+				int i;
+				for (i = 0; i < header->value.len && isdigit((unsigned char) header->value.data[i]); i++) {
+					int digit = header->value.data[i] - '0';
+					if (content_length > (LLONG_MAX - digit) / 10) {
+						return false;
+					}
+					content_length = content_length * 10 + digit;
+				}
+				if (0 == i || i != header->value.len || (-1 != message->content_length && content_length != message->content_length)) {
+					return false;
+				}
+				message->content_length = content_length;
+			} else if (http_slice_case_equals(header->name, "Transfer-Encoding")) {
+				message->chunked = slice_has_token(header->value, "chunked");
+			} else if (http_slice_case_equals(header->name, "Connection") || http_slice_case_equals(header->name, "Proxy-Connection")) {
+				message->connection_close |= slice_has_token(header->value, "close");
+				message->connection_keep_alive |= slice_has_token(header->value, "keep-alive");
+			} else {
+				int field;
+				for (field = 0; field < HTTP_NUM_FIELDS; field++) {
+					if (header->name.len == field_names[field].len && 0 == strncasecmp(header->name.data, field_names[field].data, header->name.len)) {
+						if (NULL == message->fields[field].data) {
+							message->fields[field] = header->value;
+						}
+						break;
+					}
+				}
+			}
+		}
+		line = line_end + 1;
+	}
+	return true;
+}
+
+/*
+* Returns true if the comma separated value contains token (case insensitive).
+*/
+static bool slice_has_token(struct http_slice value, const char * token) {
+	int token_len = strlen(token);
+	const char * p = value.data;
+	const char * end = p + value.len;
+	while (p < end) {
+		while (p < end && (' ' == *p || '\t' == *p || ',' == *p)) {
+			p++;
+		}
+		const char * token_end = p;
+		while (token_end < end && ',' != *token_end && ';' != *token_end && ' ' != *token_end && '\t' != *token_end) {
+			token_end++;
+		}
+		if (token_end - p == token_len && 0 == strncasecmp(p, token, token_len)) {
+			return true;
+		}
+		while (p < end && ',' != *p) {
+			p++;
+		}
+	}
+	return false;
+}
+
+/*
+* Reads the decimal number at p into n. Returns where it ends, or NULL if p does not start with
+* a digit or the number is too large.
+*/
+static const char * parse_number(const char * p, long long * n) {
+	if (!isdigit((unsigned char) *p)) {
+		return NULL;
+	}
+	*n = 0;
+	for (; isdigit((unsigned char) *p); p++) {
+		if (*n > (LLONG_MAX - 9) / 10) {
+			return NULL;
+		}
+		*n = *n * 10 + (*p - '0');
+	}
+	return p;
+}
+
+/*
+* Returns the bytes from start to stop without leading and trailing whitespace or '\r'.
+*/
+static struct http_slice trim(const char * start, const char * stop) {
+	while (start < stop && (' ' == *start || '\t' == *start)) {
+		start++;
+	}
+	while (stop > start && ('\r' == stop[-1] || ' ' == stop[-1] || '\t' == stop[-1])) {
+		stop--;
+	}
+	return (struct http_slice) { start, stop - start };
+}
+
+/*
+* Moves slice from the buffer at from to the same place in the buffer at to.
+*/
+static void rebase(struct http_slice * slice, const char * from, const char * to) {
+	if (NULL != slice->data) {
+		slice->data = to + (slice->data - from);
+	}
+}
@@ -0,0 +1,148 @@
+#ifndef HTTP_H
+#define HTTP_H
+
+#include <stdbool.h>
+
+#define HTTP_MAX_HEADERS 64 // header fields kept per request or response
+
+enum http_parse_result {
+	HTTP_PARSE_DONE, // the whole head is in and was parsed
+	HTTP_PARSE_INCOMPLETE, // the blank line ending the head has not been received yet
+	HTTP_PARSE_INVALID // malformed, or more than HTTP_MAX_HEADERS fields
+};
+
+/*
+* A run of bytes inside the buffer that was parsed, not NUL terminated. Only valid as long as
+* that buffer is not changed.
+*/
+struct http_slice {
+	const char * data;
+	int len;
+};
+
+struct http_header {
+	struct http_slice name;
+	struct http_slice value; // without surrounding whitespace
+};
+
+/*
+* The header fields the cache and the encoder look at, picked out while the head is parsed so
+* they are not searched for again.
+*/
+enum http_field {
+	HTTP_FIELD_ACCEPT_ENCODING,
+	HTTP_FIELD_AGE,
+	HTTP_FIELD_AUTHORIZATION,
+	HTTP_FIELD_CACHE_CONTROL,
+	HTTP_FIELD_CONTENT_ENCODING,
+	HTTP_FIELD_CONTENT_RANGE,
+	HTTP_FIELD_CONTENT_TYPE,
+	HTTP_FIELD_DATE,
+	HTTP_FIELD_ETAG,
+	HTTP_FIELD_EXPIRES,
+	HTTP_FIELD_IF_RANGE,
+	HTTP_FIELD_LAST_MODIFIED,
+	HTTP_FIELD_PRAGMA,
+	HTTP_FIELD_RANGE,
+	HTTP_FIELD_VARY,
+	HTTP_NUM_FIELDS
+};
+
+/*
+* The head of a request or response, as slices of the receive buffer it was parsed from.
+*/
+struct http_message {
+	struct http_slice first_line; // without its line ending
+	struct http_slice method; // requests only
+	struct http_slice target;
+	struct http_slice version;
+	int status_code; // responses only
+	struct http_header headers[HTTP_MAX_HEADERS];
+	int num_headers;
+	struct http_slice fields[HTTP_NUM_FIELDS]; // value of the first field of each kind, data NULL if absent
+	int header_len; // bytes of the head including the blank line ending it
+	long long content_length; // -1 if there is no Content-Length field
+	bool chunked; // Transfer-Encoding ends in chunked
+	bool connection_close; // Connection (or Proxy-Connection) has the close token
+	bool connection_keep_alive; // Connection has the keep-alive token
+};
+
+/*
+* The parts of an absolute-form request target ("http://host[:port]/path").
+*/
+struct http_uri {
+	struct http_slice host;
+	int port; // 0 if not given
+	struct http_slice path; // empty if not given
+	struct http_slice authority_and_path; // from the "//" before host to the end
+};
+
+/*
+* The single byte range asked for by a Range field: bytes first to last of the body, last -1
+* if it runs to the end, or the last suffix_len bytes of the body if first is -1.
+*/
+struct http_range {
+	long long first;
+	long long last;
+	long long suffix_len;
+};
+
+/*
+* Where the search for the end of a head left off, so data arriving over several recv calls
+* is only scanned once.
+*/
+struct http_parser {
+	int scanned;
+};
+
+/*
+* Where a response body framer is in the body it is tracking.
+*/
+enum body_state {
+	BODY_LENGTH, // Content-Length body, remaining bytes left
+	BODY_CHUNK_SIZE, // reading hex size of next chunk
+	BODY_CHUNK_EXT, // skipping chunk extension up to end of size line
+	BODY_CHUNK_DATA, // inside chunk data, remaining bytes left
+	BODY_CHUNK_DATA_END, // expecting CRLF after chunk data
+	BODY_TRAILER, // reading trailer lines after last chunk
+	BODY_UNTIL_CLOSE, // no framing, body ends when host closes connection
+	BODY_DONE // whole body seen
+};
+
+/*
+* Tracks how much of a response body has been seen so the end of the response is known
+* without waiting for the host to close the connection.
+*/
+struct body_framer {
+	enum body_state state;
+	long long remaining;
+	bool chunked;
+	bool saw_chunk_digit;
+	int trailer_line_len;
+	bool keep_alive; // connection to host can be reused once the body is done
+};
+
+void http_parser_init(struct http_parser * parser);
+enum http_parse_result http_parse_request(struct http_parser * parser, const char * buffer, int len, struct http_message * request);
+enum http_parse_result http_parse_response(struct http_parser * parser, const char * buffer, int len, struct http_message * response);
+bool http_parse_uri(struct http_slice target, struct http_uri * uri);
+void http_message_rebase(struct http_message * message, const char * from, const char * to);
+const struct http_slice * http_find_header(const struct http_message * message, const char * name);
+bool http_get_field(const struct http_message * message, enum http_field field, char * value, int value_size);
+void http_copy_slice(struct http_slice slice, char * dest, int dest_size);
+bool http_slice_equals(struct http_slice slice, const char * string);
+bool http_slice_case_equals(struct http_slice slice, const char * string);
+int http_find_header_end(const char * buffer, int len);
+bool http_header_has_token(const char * value, const char * token);
+bool http_parse_range(const char * value, struct http_range * range);
+bool http_resolve_range(const struct http_range * range, long long length, long long * first, long long * last);
+bool http_parse_content_range(const char * value, long long * first, long long * last, long long * length);
+int http_write_range_head(char * dest, int dest_size, const char * head, int head_len, int status_code, long long first, long long last, long long length);
+void body_framer_init(struct body_framer * framer, const struct http_message * response);
+int body_framer_consume(struct body_framer * framer, const char * data, int len);
+int body_framer_decode(struct body_framer * framer, const char * data, int len, void (*payload)(void * arg, const char * data, int len), void * arg);
+void body_framer_skip(struct body_framer * framer, long long len);
+bool body_framer_done(const struct body_framer * framer);
+bool body_framer_close(struct body_framer * framer);
+
+#endif
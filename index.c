@@ -0,0 +1,423 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "index.h"
+
+// fixed SipHash key, so a uri keeps its cache_file name across restarts
+#define SIPHASH_K0 0x0706050403020100ULL
+#define SIPHASH_K1 0x0f0e0d0c0b0a0908ULL
+
+#define ROTL(x, b) (((x) << (b)) | ((x) >> (64 - (b))))
+#define SIPROUND(v0, v1, v2, v3) do { \
+	v0 += v1; v1 = ROTL(v1, 13); v1 ^= v0; v0 = ROTL(v0, 32); \
+	v2 += v3; v3 = ROTL(v3, 16); v3 ^= v2; \
+	v0 += v3; v3 = ROTL(v3, 21); v3 ^= v0; \
+	v2 += v1; v1 = ROTL(v1, 17); v1 ^= v2; v2 = ROTL(v2, 32); \
+} while (0)
+
+static struct index_shard index_shards[INDEX_SHARDS];
+static long long index_total_bytes; // size of all indexed cache_files
+
+static struct index_slot * find_slot(struct index_shard * shard, const struct cache_key * key, const char * uri);
+static int grow_shard(struct index_shard * shard);
+static void remove_slot(struct index_shard * shard, struct index_slot * slot);
+static void unlink_entry(struct index_entry * entry);
+static uint64_t coarse_ms();
+static int insert_entry(const char * uri, off_t size, const struct cache_meta * meta, unsigned int hits, uint64_t last_used);
+
+/*
+* Set up the empty cache index
+*/
+void create_index() {
+	int i;
+	for (i = 0; i < INDEX_SHARDS; i++) {
+		struct index_shard * shard = &index_shards[i];
+		pthread_mutex_init(&shard->lock, NULL);
+		shard->slots = (struct index_slot *) calloc(INDEX_INITIAL_SLOTS, sizeof(struct index_slot));
+		shard->num_slots = (NULL == shard->slots) ? 0 : INDEX_INITIAL_SLOTS;
+		shard->num_entries = 0;
+		shard->lru.lru_prev = &shard->lru;
+		shard->lru.lru_next = &shard->lru;
+	}
+}
+
+/*
+* Hashes uri into key with SipHash-2-4 (128-bit output)
+*/
+void cache_key_for_uri(const char * uri, struct cache_key * key) {
+	const unsigned char * p = (const unsigned char *) uri;
+	size_t len = strlen(uri);
+	const unsigned char * end = p + (len & ~(size_t) 7);
+	uint64_t v0 = SIPHASH_K0 ^ 0x736f6d6570736575ULL;
+	uint64_t v1 = SIPHASH_K1 ^ 0x646f72616e646f6dULL ^ 0xee;
+	uint64_t v2 = SIPHASH_K0 ^ 0x6c7967656e657261ULL;
+	uint64_t v3 = SIPHASH_K1 ^ 0x7465646279746573ULL;
+	uint64_t m;
+	int i;
+
+	for (; p != end; p += 8) {
+		m = 0;
+		for (i = 7; i >= 0; i--) {
+			m = (m << 8) | p[i];
+		}
+		v3 ^= m;
+		SIPROUND(v0, v1, v2, v3);
+		SIPROUND(v0, v1, v2, v3);
+		v0 ^= m;
+	}
+
+	// last 0-7 bytes plus the length in the top byte
+	m = ((uint64_t) len) << 56;
+	for (i = (len & 7) - 1; i >= 0; i--) {
+		m |= ((uint64_t) p[i]) << (8 * i);
+	}
+	v3 ^= m;
+	SIPROUND(v0, v1, v2, v3);
+	SIPROUND(v0, v1, v2, v3);
+	v0 ^= m;
+
+	v2 ^= 0xee;
+	for (i = 0; i < 4; i++) {
+		SIPROUND(v0, v1, v2, v3);
+	}
+	key->lo = v0 ^ v1 ^ v2 ^ v3;
+	v1 ^= 0xdd;
+	for (i = 0; i < 4; i++) {
+		SIPROUND(v0, v1, v2, v3);
+	}
+	key->hi = v0 ^ v1 ^ v2 ^ v3;
+}
+
+/*
+* Writes the cache_file name for key into filename, which holds CACHE_FILENAME_SIZE bytes
+*/
+void cache_filename_for_key(const struct cache_key * key, char * filename) {
+	// the top byte picks one of 256 subdirectories so no directory gets too large
+	snprintf(filename, CACHE_FILENAME_SIZE, "./cache/%02x/%016llx%016llx", (unsigned int) (key->hi >> 56), (unsigned long long) key->hi, (unsigned long long) key->lo);
+}
+
+static struct index_shard * index_shard_for(const struct cache_key * key) {
+	return &index_shards[(key->hi >> 56) % INDEX_SHARDS];
+}
+
+static size_t home_slot(const struct index_shard * shard, const struct cache_key * key) {
+	return key->lo & (shard->num_slots - 1);
+}
+
+static void lru_push_front(struct index_shard * shard, struct index_entry * entry) {
+	entry->lru_next = shard->lru.lru_next;
+	entry->lru_prev = &shard->lru;
+	shard->lru.lru_next->lru_prev = entry;
+	shard->lru.lru_next = entry;
+}
+
+/*
+* Looks up the cache_file stored for uri and copies its entry into entry (without the uri).
+* Returns false if uri is not cached.
+*/
+bool index_lookup(const char * uri, struct index_entry * entry) {
+	struct cache_key key;
+	cache_key_for_uri(uri, &key);
+	struct index_shard * shard = index_shard_for(&key);
+
+	pthread_mutex_lock(&shard->lock);
+	struct index_slot * slot = find_slot(shard, &key, uri);
+	if (NULL != slot) {
+		unlink_entry(slot->entry);
+		lru_push_front(shard, slot->entry);
+		slot->entry->hits++;
+		slot->entry->last_used = coarse_ms();
+		*entry = *slot->entry;
+		entry->uri = NULL;
+		entry->lru_prev = NULL;
+		entry->lru_next = NULL;
+	}
+	pthread_mutex_unlock(&shard->lock);
+	return NULL != slot;
+}
+
+/*
+* Records that the cache_file for uri is complete, holds size bytes and is described by meta,
+* replacing whatever was indexed under its key before. Returns -1 if the entry cannot be allocated.
+*/
+int index_insert(const char * uri, off_t size, const struct cache_meta * meta) {
+	return insert_entry(uri, size, meta, 0, coarse_ms());
+}
+
+/*
+* Puts back an entry saved by index_for_each_in_shard when the index is loaded at startup.
+* Entries must be restored least recently used first.
+*/
+int index_restore(const char * uri, off_t size, const struct cache_meta * meta, unsigned int hits, uint64_t idle_ms) {
+	uint64_t now = coarse_ms();
+	return insert_entry(uri, size, meta, hits, (now > idle_ms) ? now - idle_ms : 0);
+}
+
+/*
+* Calls fn on every entry of shard (0 to INDEX_SHARDS - 1), least recently used first, with the
+* time since the entry was last used. The shard is locked while its entries are visited, so fn
+* should only copy them.
+*/
+void index_for_each_in_shard(int shard_index, void (*fn)(const struct index_entry * entry, uint64_t idle_ms, void * arg), void * arg) {
+	struct index_shard * shard = &index_shards[shard_index];
+	pthread_mutex_lock(&shard->lock);
+	uint64_t now = coarse_ms();
+	struct index_entry * entry;
+	for (entry = shard->lru.lru_prev; entry != &shard->lru; entry = entry->lru_prev) {
+		fn(entry, (now > entry->last_used) ? now - entry->last_used : 0, arg);
+	}
+	pthread_mutex_unlock(&shard->lock);
+}
+
+static int insert_entry(const char * uri, off_t size, const struct cache_meta * meta, unsigned int hits, uint64_t last_used) {
+	struct index_entry * entry = (struct index_entry *) malloc(sizeof(struct index_entry));
+	if (NULL == entry) {
+		return -1;
+	}
+	entry->uri = strdup(uri);
+	if (NULL == entry->uri) {
+		free(entry);
+		return -1;
+	}
+	cache_key_for_uri(uri, &entry->key);
+	cache_filename_for_key(&entry->key, entry->filename);
+	entry->size = size;
+	entry->hits = hits;
+	entry->last_used = last_used;
+	entry->meta = *meta;
+
+	struct index_shard * shard = index_shard_for(&entry->key);
+	pthread_mutex_lock(&shard->lock);
+	if ((shard->num_entries + 1) * 4 > shard->num_slots * 3 && -1 == grow_shard(shard)) {
+		pthread_mutex_unlock(&shard->lock);
+		free(entry->uri);
+		free(entry);
+		return -1;
+	}
+	size_t mask = shard->num_slots - 1;
+	size_t i;
+	for (i = home_slot(shard, &entry->key); NULL != shard->slots[i].entry; i = (i + 1) & mask) {
+		struct index_slot * slot = &shard->slots[i];
+		// a different uri with the same key shares its cache_file, so it is replaced as well
+		if (slot->key.hi == entry->key.hi && slot->key.lo == entry->key.lo) {
+			unlink_entry(slot->entry);
+			__atomic_sub_fetch(&index_total_bytes, slot->entry->size, __ATOMIC_RELAXED);
+			free(slot->entry->uri);
+			free(slot->entry);
+			slot->entry = entry;
+			break;
+		}
+	}
+	if (NULL == shard->slots[i].entry) {
+		shard->slots[i].key = entry->key;
+		shard->slots[i].entry = entry;
+		shard->num_entries++;
+	}
+	lru_push_front(shard, entry);
+	__atomic_add_fetch(&index_total_bytes, size, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&shard->lock);
+	return 0;
+}
+
+/*
+* Replaces the metadata of the cache_file for uri, after host revalidated it. Returns false if
+* uri is no longer cached.
+*/
+bool index_update_meta(const char * uri, const struct cache_meta * meta) {
+	struct cache_key key;
+	cache_key_for_uri(uri, &key);
+	struct index_shard * shard = index_shard_for(&key);
+
+	pthread_mutex_lock(&shard->lock);
+	struct index_slot * slot = find_slot(shard, &key, uri);
+	if (NULL != slot) {
+		slot->entry->meta = *meta;
+	}
+	pthread_mutex_unlock(&shard->lock);
+	return NULL != slot;
+}
+
+/*
+* Drops uri from the index if it is cached.
+*/
+void index_remove(const char * uri) {
+	struct cache_key key;
+	cache_key_for_uri(uri, &key);
+	struct index_shard * shard = index_shard_for(&key);
+
+	pthread_mutex_lock(&shard->lock);
+	struct index_slot * slot = find_slot(shard, &key, uri);
+	if (NULL != slot) {
+		remove_slot(shard, slot);
+	}
+	pthread_mutex_unlock(&shard->lock);
+}
+
+/*
+* Drops the entry least worth keeping and returns its uri, which the caller frees, with the name
+* of its cache_file in filename. The victim is the least recently used of the entries at the
+* LRU end of each shard; an entry looked up since it was last considered first gets another
+* pass with its hit count halved, so frequently used entries outlast ones that were only used
+* recently. Returns NULL if the index is empty.
+*/
+char * index_evict(char * filename) {
+	struct index_shard * victim_shard = NULL;
+	uint64_t oldest = UINT64_MAX;
+	int i;
+	for (i = 0; i < INDEX_SHARDS; i++) {
+		struct index_shard * shard = &index_shards[i];
+		pthread_mutex_lock(&shard->lock);
+		size_t passes;
+		for (passes = 0; passes < shard->num_entries && 0 != shard->lru.lru_prev->hits; passes++) {
+			struct index_entry * entry = shard->lru.lru_prev;
+			entry->hits /= 2;
+			unlink_entry(entry);
+			lru_push_front(shard, entry);
+		}
+		if (&shard->lru != shard->lru.lru_prev && shard->lru.lru_prev->last_used <= oldest) {
+			oldest = shard->lru.lru_prev->last_used;
+			victim_shard = shard;
+		}
+		pthread_mutex_unlock(&shard->lock);
+	}
+	if (NULL == victim_shard) {
+		return NULL;
+	}
+
+	char * uri = NULL;
+	pthread_mutex_lock(&victim_shard->lock);
+	if (&victim_shard->lru != victim_shard->lru.lru_prev) {
+		struct index_entry * entry = victim_shard->lru.lru_prev;
+		struct index_slot * slot = find_slot(victim_shard, &entry->key, entry->uri);
+		uri = entry->uri;
+		entry->uri = NULL; // keep it past remove_slot
+		memcpy(filename, entry->filename, CACHE_FILENAME_SIZE);
+		remove_slot(victim_shard, slot);
+	}
+	pthread_mutex_unlock(&victim_shard->lock);
+	return uri;
+}
+
+/*
+* Returns true if a cache_file is indexed under key, whatever its uri.
+*/
+bool index_contains_key(const struct cache_key * key) {
+	struct index_shard * shard = index_shard_for(key);
+	bool found = false;
+	pthread_mutex_lock(&shard->lock);
+	if (0 != shard->num_slots) {
+		size_t mask = shard->num_slots - 1;
+		size_t i;
+		for (i = home_slot(shard, key); NULL != shard->slots[i].entry; i = (i + 1) & mask) {
+			if (shard->slots[i].key.hi == key->hi && shard->slots[i].key.lo == key->lo) {
+				found = true;
+				break;
+			}
+		}
+	}
+	pthread_mutex_unlock(&shard->lock);
+	return found;
+}
+
+/*
+* Returns the size of all indexed cache_files.
+*/
+long long index_bytes() {
+	return __atomic_load_n(&index_total_bytes, __ATOMIC_RELAXED);
+}
+
+/*
+* Finds the slot holding uri in shard. Must be called with the shard locked.
+*/
+static struct index_slot * find_slot(struct index_shard * shard, const struct cache_key * key, const char * uri) {
+	if (0 == shard->num_slots) {
+		return NULL;
+	}
+	size_t mask = shard->num_slots - 1;
+	size_t i;
+	for (i = home_slot(shard, key); NULL != shard->slots[i].entry; i = (i + 1) & mask) {
+		struct index_slot * slot = &shard->slots[i];
+		if (slot->key.hi == key->hi && slot->key.lo == key->lo) {
+			// keys are unique within the table, so a different uri here is a collision: not cached
+			return (0 == strcmp(uri, slot->entry->uri)) ? slot : NULL;
+		}
+	}
+	return NULL;
+}
+
+/*
+* Doubles the slots of shard. Must be called with the shard locked.
+*/
+static int grow_shard(struct index_shard * shard) {
+	size_t num_slots = (0 == shard->num_slots) ? INDEX_INITIAL_SLOTS : shard->num_slots * 2;
+	struct index_slot * slots = (struct index_slot *) calloc(num_slots, sizeof(struct index_slot));
+	if (NULL == slots) {
+		return -1;
+	}
+	size_t i;
+	for (i = 0; i < shard->num_slots; i++) {
+		if (NULL != shard->slots[i].entry) {
+			size_t j = shard->slots[i].key.lo & (num_slots - 1);
+			while (NULL != slots[j].entry) {
+				j = (j + 1) & (num_slots - 1);
+			}
+			slots[j] = shard->slots[i];
+		}
+	}
+	free(shard->slots);
+	shard->slots = slots;
+	shard->num_slots = num_slots;
+	return 0;
+}
+
+/*
+* Frees the entry in slot and shifts back the slots after it that probed past it, so lookups
+* never need tombstones. Must be called with the shard locked.
+*/
+static void remove_slot(struct index_shard * shard, struct index_slot * slot) {
+	size_t mask = shard->num_slots - 1;
+	size_t hole = slot - shard->slots;
+	size_t i = hole;
+
+	unlink_entry(slot->entry);
+	__atomic_sub_fetch(&index_total_bytes, slot->entry->size, __ATOMIC_RELAXED);
+	free(slot->entry->uri);
+	free(slot->entry);
+	slot->entry = NULL;
+	shard->num_entries--;
+
+	while (true) {
+		i = (i + 1) & mask;
+		if (NULL == shard->slots[i].entry) {
+			return;
+		}
+		// an entry can fill the hole unless its home slot lies cyclically in (hole, i]
+		size_t home = home_slot(shard, &shard->slots[i].key);
+		if (((i - home) & mask) >= ((i - hole) & mask)) {
+			shard->slots[hole] = shard->slots[i];
+			shard->slots[i].entry = NULL;
+			hole = i;
+		}
+	}
+}
+
+/*
+* Takes entry off its shard's LRU list. Must be called with the shard locked.
+*/
+static void unlink_entry(struct index_entry * entry) {
+	entry->lru_prev->lru_next = entry->lru_next;
+	entry->lru_next->lru_prev = entry->lru_prev;
+}
+
+/*
+* Milliseconds from a coarse monotonic clock, cheap enough to read on every lookup.
+*/
+static uint64_t coarse_ms() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
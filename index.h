@@ -0,0 +1,73 @@
+#ifndef INDEX_H
+#define INDEX_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <pthread.h>
+
+#include "freshness.h"
+
+#define INDEX_SHARDS 16 // independently locked parts of the cache index
+#define INDEX_INITIAL_SLOTS 1024 // slots per shard before it first grows, a power of two
+#define CACHE_FILENAME_SIZE 48 // "./cache/xx/" followed by the 32 hex digits of a cache_key
+
+/*
+* 128-bit SipHash of a uri. Names its cache_file and places it in the index.
+*/
+struct cache_key {
+	uint64_t hi;
+	uint64_t lo;
+};
+
+/*
+* A response stored in the cache directory. uri is kept so a lookup only matches the request it
+* was stored for, even if another uri has the same key.
+*/
+struct index_entry {
+	struct index_entry * lru_prev;
+	struct index_entry * lru_next;
+	struct cache_key key;
+	char * uri;
+	char filename[CACHE_FILENAME_SIZE];
+	off_t size; // bytes in the cache_file
+	unsigned int hits; // lookups since it was last passed over for eviction
+	uint64_t last_used; // monotonic ms of the last lookup
+	struct cache_meta meta;
+};
+
+/*
+* A slot of a shard's open-addressing table. The key is kept next to the entry pointer so a
+* probe only follows the pointer when the key matches.
+*/
+struct index_slot {
+	struct cache_key key;
+	struct index_entry * entry; // NULL if the slot is empty
+};
+
+/*
+* One shard of the index: a linear probing table of slots plus an LRU list of its entries, most
+* recently used at the front, under a single lock.
+*/
+struct index_shard {
+	pthread_mutex_t lock;
+	struct index_slot * slots;
+	size_t num_slots; // a power of two
+	size_t num_entries;
+	struct index_entry lru; // sentinel
+};
+
+void create_index();
+void cache_key_for_uri(const char * uri, struct cache_key * key);
+void cache_filename_for_key(const struct cache_key * key, char * filename);
+bool index_lookup(const char * uri, struct index_entry * entry);
+int index_insert(const char * uri, off_t size, const struct cache_meta * meta);
+int index_restore(const char * uri, off_t size, const struct cache_meta * meta, unsigned int hits, uint64_t idle_ms);
+void index_for_each_in_shard(int shard, void (*fn)(const struct index_entry * entry, uint64_t idle_ms, void * arg), void * arg);
+bool index_update_meta(const char * uri, const struct cache_meta * meta);
+void index_remove(const char * uri);
+char * index_evict(char * filename);
+bool index_contains_key(const struct cache_key * key);
+long long index_bytes();
+
+#endif
@@ -0,0 +1,500 @@
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "journal.h"
+#include "index.h"
+#include "cache.h"
+#include "log.h"
+
+#define JOURNAL_RECORD_MAX (sizeof(struct journal_record) + 65536) // largest record, as its lengths are 16 bits
+#define SNAPSHOT_BUFFER_SIZE (1024 * 1024) // stdio buffer for writing a snapshot
+#define COPY_BUFFER_SIZE 65536
+
+/*
+* Records of the entries of one index shard, copied out while the shard is locked and written
+* to the snapshot once it is not.
+*/
+struct snapshot_copy {
+	char * data;
+	size_t len;
+	size_t cap;
+	bool failed; // out of memory
+};
+
+// held across an index change and its journal record, so the journal has them in index order
+static pthread_mutex_t journal_lock = PTHREAD_MUTEX_INITIALIZER;
+static int journal_fd = -1;
+static off_t journal_bytes;
+static off_t journal_loaded; // bytes of the journal read into the index
+static bool checkpoints_held; // another process may still be appending to the journal
+static pthread_mutex_t checkpoint_lock = PTHREAD_MUTEX_INITIALIZER; // one checkpoint at a time
+
+
+static int load_file(const char * path, off_t * position, int * num_records);
+static bool apply_record(const struct journal_record * record, const char * strings);
+static int encode_record(char * buffer, enum journal_record_type type, const char * uri, off_t size, const struct cache_meta * meta, unsigned int hits, uint64_t idle_ms);
+static void append_record(enum journal_record_type type, const char * uri, off_t size, const struct cache_meta * meta);
+static int rotate_journal();
+static int fold_rotated_journal(int rotated_fd);
+static void copy_snapshot_entry(const struct index_entry * entry, uint64_t idle_ms, void * arg);
+static uint32_t record_checksum(const char * record, uint32_t length);
+
+/*
+* Loads the index from the last snapshot and the journal of changes made after it, then opens
+* the journal to record further changes. Must be called after create_index.
+*/
+int journal_open() {
+	// a checkpoint was interrupted before its snapshot was in place
+	if (0 == access(JOURNAL_ROTATED_FILENAME, F_OK)) {
+		int rotated_fd = open(JOURNAL_ROTATED_FILENAME, O_WRONLY | O_APPEND | O_CLOEXEC);
+		if (-1 == rotated_fd || -1 == fold_rotated_journal(rotated_fd)) {
+			log_error("Unable to restore rotated cache journal: %s\n", strerror(errno));
+		}
+		if (-1 != rotated_fd) {
+			close(rotated_fd);
+		}
+	}
+	int num_snapshot_records = 0;
+	int num_journal_records = 0;
+	off_t snapshot_loaded = 0;
+	int snapshot_torn = load_file(SNAPSHOT_FILENAME, &snapshot_loaded, &num_snapshot_records);
+	int journal_torn = load_file(JOURNAL_FILENAME, &journal_loaded, &num_journal_records);
+	log_info("Loaded cache index: %d snapshot and %d journal records, %lld bytes cached\n", num_snapshot_records, num_journal_records, index_bytes());
+
+	journal_fd = open(JOURNAL_FILENAME, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, S_IRUSR | S_IWUSR);
+	if (-1 == journal_fd) {
+		log_error("Unable to open cache journal: %s\n", strerror(errno));
+		return -1;
+	}
+	struct stat sb;
+	fstat(journal_fd, &sb);
+	journal_bytes = sb.st_size;
+
+	// records appended after a torn one would never be read, so start from a fresh checkpoint
+	// (left to journal_catch_up while the previous process is still appending)
+	if (0 == journal_bytes || (!checkpoints_held && (0 != snapshot_torn || 0 != journal_torn))) {
+		return journal_checkpoint();
+	}
+	return 0;
+}
+
+/*
+* Stops checkpoints until journal_catch_up, because another process sharing the cache directory
+* is still appending to the journal and a checkpoint would throw its records away. Called by a
+* proxy taking over from a running one before journal_open, and by the one handing over.
+*/
+void journal_hold_checkpoints() {
+	pthread_mutex_lock(&journal_lock);
+	checkpoints_held = true;
+	pthread_mutex_unlock(&journal_lock);
+}
+
+/*
+* Called once the other process has stopped appending to the journal. Replays the records it
+* appended after journal_open read the journal, in journal order together with this process's
+* own (which are applied again to the same effect), and folds the result into a checkpoint.
+*/
+int journal_catch_up() {
+	int num_records = 0;
+	pthread_mutex_lock(&journal_lock);
+	load_file(JOURNAL_FILENAME, &journal_loaded, &num_records);
+	checkpoints_held = false;
+	pthread_mutex_unlock(&journal_lock);
+	log_info("Caught up with %d cache index records, %lld bytes cached\n", num_records, index_bytes());
+	return journal_checkpoint();
+}
+
+/*
+* Indexes the cache_file for uri and records it in the journal.
+*/
+int journal_insert(const char * uri, off_t size, const struct cache_meta * meta) {
+	pthread_mutex_lock(&journal_lock);
+	int result = index_insert(uri, size, meta);
+	if (0 == result) {
+		append_record(JOURNAL_INSERT, uri, size, meta);
+	}
+	pthread_mutex_unlock(&journal_lock);
+	return result;
+}
+
+/*
+* Replaces the metadata of the cache_file for uri and records it in the journal. Returns false
+* if uri is no longer cached.
+*/
+bool journal_update_meta(const char * uri, const struct cache_meta * meta) {
+	pthread_mutex_lock(&journal_lock);
+	bool updated = index_update_meta(uri, meta);
+	if (updated) {
+		append_record(JOURNAL_META, uri, 0, meta);
+	}
+	pthread_mutex_unlock(&journal_lock);
+	return updated;
+}
+
+/*
+* Drops uri from the index and records it in the journal.
+*/
+void journal_remove(const char * uri) {
+	pthread_mutex_lock(&journal_lock);
+	index_remove(uri);
+	append_record(JOURNAL_REMOVE, uri, 0, NULL);
+	pthread_mutex_unlock(&journal_lock);
+}
+
+/*
+* Evicts an entry from the index (see index_evict) and records it in the journal.
+*/
+char * journal_evict(char * filename) {
+	pthread_mutex_lock(&journal_lock);
+	char * uri = index_evict(filename);
+	if (NULL != uri) {
+		append_record(JOURNAL_REMOVE, uri, 0, NULL);
+	}
+	pthread_mutex_unlock(&journal_lock);
+	return uri;
+}
+
+/*
+* Returns true once the journal has grown enough to be folded into a new snapshot.
+*/
+bool journal_needs_checkpoint() {
+	pthread_mutex_lock(&journal_lock);
+	bool needs_checkpoint = !checkpoints_held && journal_bytes > JOURNAL_CHECKPOINT_BYTES;
+	pthread_mutex_unlock(&journal_lock);
+	return needs_checkpoint;
+}
+
+/*
+* Writes the whole index to a new snapshot, in LRU order, and drops the journal it replaces. The
+* journal is rotated first, so changes keep being recorded, in a fresh journal, while the
+* snapshot is written and synced without holding the journal lock; each shard of the index is
+* only locked while its entries are copied out. Replaying the fresh journal over the snapshot
+* is safe even for the changes the snapshot already has, as each record sets the whole state of
+* its entry.
+*/
+int journal_checkpoint() {
+	char temp_filename[TEMP_FILENAME_SIZE];
+	generate_temp_filename(temp_filename);
+	FILE * snapshot = fopen(temp_filename, "wx");
+	if (NULL == snapshot) {
+		log_error("Unable to write cache index snapshot: %s\n", strerror(errno));
+		return -1;
+	}
+	setvbuf(snapshot, NULL, _IOFBF, SNAPSHOT_BUFFER_SIZE);
+
+	pthread_mutex_lock(&checkpoint_lock);
+	pthread_mutex_lock(&journal_lock);
+	int rotated_fd = rotate_journal();
+	pthread_mutex_unlock(&journal_lock);
+	if (-1 == rotated_fd) {
+		pthread_mutex_unlock(&checkpoint_lock);
+		log_error("Unable to rotate cache journal: %s\n", strerror(errno));
+		fclose(snapshot);
+		remove(temp_filename);
+		return -1;
+	}
+
+	uint32_t magic = JOURNAL_MAGIC;
+	fwrite(&magic, sizeof(magic), 1, snapshot);
+	struct snapshot_copy copy = { NULL, 0, 0, false };
+	int i;
+	for (i = 0; i < INDEX_SHARDS && !copy.failed; i++) {
+		copy.len = 0;
+		index_for_each_in_shard(i, &copy_snapshot_entry, &copy);
+		if (copy.len > 0) {
+			fwrite(copy.data, copy.len, 1, snapshot);
+		}
+	}
+	free(copy.data);
+	bool failed = copy.failed || (0 != fflush(snapshot)) || (0 != fsync(fileno(snapshot)));
+	if (0 != fclose(snapshot) || failed || -1 == rename(temp_filename, SNAPSHOT_FILENAME)) {
+		log_error("Unable to write cache index snapshot: %s\n", strerror(errno));
+		remove(temp_filename);
+		// the rotated journal is still needed; changes since go after it
+		pthread_mutex_lock(&journal_lock);
+		close(journal_fd);
+		if (-1 == fold_rotated_journal(rotated_fd)) {
+			log_error("Unable to restore rotated cache journal: %s\n", strerror(errno));
+		}
+		journal_fd = open(JOURNAL_FILENAME, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, S_IRUSR | S_IWUSR);
+		struct stat sb;
+		journal_bytes = (-1 != journal_fd && 0 == fstat(journal_fd, &sb)) ? sb.st_size : 0;
+		journal_loaded = journal_bytes;
+		pthread_mutex_unlock(&journal_lock);
+		close(rotated_fd);
+		pthread_mutex_unlock(&checkpoint_lock);
+		return -1;
+	}
+
+	// everything in the rotated journal is in the snapshot now
+	close(rotated_fd);
+	remove(JOURNAL_ROTATED_FILENAME);
+	pthread_mutex_unlock(&checkpoint_lock);
+	log_info("Checkpointed cache index.\n");
+	return 0;
+}
+
+/*
+* Moves the journal aside as JOURNAL_ROTATED_FILENAME and starts a fresh one. Returns the
+* descriptor of the rotated journal, or -1 on failure, leaving the journal as it was. Must be
+* called with the journal locked.
+*/
+static int rotate_journal() {
+	if (-1 == journal_fd || -1 == rename(JOURNAL_FILENAME, JOURNAL_ROTATED_FILENAME)) {
+		return -1;
+	}
+	uint32_t magic = JOURNAL_MAGIC;
+	int fd = open(JOURNAL_FILENAME, O_WRONLY | O_CREAT | O_EXCL | O_APPEND | O_CLOEXEC, S_IRUSR | S_IWUSR);
+	if (-1 == fd || sizeof(magic) != write(fd, &magic, sizeof(magic))) {
+		if (-1 != fd) {
+			close(fd);
+		}
+		rename(JOURNAL_ROTATED_FILENAME, JOURNAL_FILENAME);
+		return -1;
+	}
+	int rotated_fd = journal_fd;
+	journal_fd = fd;
+	journal_bytes = sizeof(magic);
+	journal_loaded = sizeof(magic);
+	return rotated_fd;
+}
+
+/*
+* Undoes a rotation whose snapshot was not written: appends the records of the journal to the
+* rotated journal, open for appending as rotated_fd, and puts that back in place as the journal.
+* Returns 0 on success, -1 on failure, leaving the rotated journal to the next journal_open.
+*/
+static int fold_rotated_journal(int rotated_fd) {
+	int fd = open(JOURNAL_FILENAME, O_RDONLY | O_CLOEXEC);
+	if (-1 != fd) {
+		char buffer[COPY_BUFFER_SIZE];
+		off_t offset = sizeof(uint32_t); // past the magic
+		ssize_t num_bytes_read;
+		while ((num_bytes_read = pread(fd, buffer, sizeof(buffer), offset)) > 0) {
+			if (num_bytes_read != write(rotated_fd, buffer, num_bytes_read)) {
+				close(fd);
+				return -1;
+			}
+			offset += num_bytes_read;
+		}
+		close(fd);
+		if (-1 == num_bytes_read) {
+			return -1;
+		}
+	} else if (ENOENT != errno) {
+		return -1;
+	}
+	return rename(JOURNAL_ROTATED_FILENAME, JOURNAL_FILENAME);
+}
+
+/*
+* Replays the records of a snapshot or journal file into the index from *position (0 for the
+* whole file), counting them in num_records, and sets *position to where reading stopped. Returns
+* 0 if the file is missing or was read to its end, 1 if it ends in a torn or corrupt record.
+*/
+static int load_file(const char * path, off_t * position, int * num_records) {
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (-1 == fd) {
+		return 0;
+	}
+	struct stat sb;
+	if (-1 == fstat(fd, &sb)) {
+		close(fd);
+		return 1;
+	}
+	if (sb.st_size < (off_t) sizeof(uint32_t) || sb.st_size <= *position) {
+		close(fd);
+		return (0 == sb.st_size || sb.st_size == *position) ? 0 : 1;
+	}
+	char * data = (char *) mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (MAP_FAILED == data) {
+		return 1;
+	}
+	madvise(data, sb.st_size, MADV_SEQUENTIAL);
+
+	uint32_t magic;
+	memcpy(&magic, data, sizeof(magic));
+	off_t offset = *position;
+	if (0 == offset) {
+		offset = (JOURNAL_MAGIC == magic) ? sizeof(magic) : sb.st_size + 1;
+	}
+	while (offset + (off_t) sizeof(struct journal_record) <= sb.st_size) {
+		struct journal_record record;
+		memcpy(&record, data + offset, sizeof(record));
+		if (record.length < sizeof(record) || record.length > sb.st_size - offset
+			|| record.checksum != record_checksum(data + offset, record.length)
+			|| !apply_record(&record, data + offset + sizeof(record))) {
+			break;
+		}
+		offset += record.length;
+		(*num_records)++;
+	}
+	munmap(data, sb.st_size);
+	*position = offset;
+	if (offset != sb.st_size) {
+		log_info("Cache index file %s is torn, ignoring its end.\n", path);
+		return 1;
+	}
+	return 0;
+}
+
+/*
+* Copies the string of len bytes at *strings into dest (size bytes) and moves past it.
+*/
+static bool take_string(const char ** strings, uint16_t len, char * dest, size_t size) {
+	if (len >= size) {
+		return false;
+	}
+	memcpy(dest, *strings, len);
+	dest[len] = '\0';
+	*strings += len;
+	return true;
+}
+
+/*
+* Applies one record to the index. Returns false if it is malformed.
+*/
+static bool apply_record(const struct journal_record * record, const char * strings) {
+	char uri[65536];
+	struct cache_meta meta;
+	memset(&meta, 0, sizeof(meta));
+	if (record->length != sizeof(*record) + record->uri_len + record->etag_len + record->last_modified_len + record->vary_len + record->vary_key_len
+		|| !take_string(&strings, record->uri_len, uri, sizeof(uri))
+		|| !take_string(&strings, record->etag_len, meta.etag, sizeof(meta.etag))
+		|| !take_string(&strings, record->last_modified_len, meta.last_modified, sizeof(meta.last_modified))
+		|| !take_string(&strings, record->vary_len, meta.vary, sizeof(meta.vary))
+		|| !take_string(&strings, record->vary_key_len, meta.vary_key, sizeof(meta.vary_key))) {
+		return false;
+	}
+	meta.stored = record->stored;
+	meta.expires = record->expires;
+	meta.lifetime = record->lifetime;
+	meta.no_cache = record->no_cache;
+
+	switch (record->type) {
+	case JOURNAL_INSERT:
+		index_restore(uri, record->size, &meta, record->hits, record->idle_ms);
+		return true;
+	case JOURNAL_META:
+		index_update_meta(uri, &meta);
+		return true;
+	case JOURNAL_REMOVE:
+		index_remove(uri);
+		return true;
+	}
+	return false;
+}
+
+/*
+* Encodes a record into buffer (JOURNAL_RECORD_MAX bytes). meta may be NULL for JOURNAL_REMOVE.
+* Returns its length, or -1 if it is too large.
+*/
+static int encode_record(char * buffer, enum journal_record_type type, const char * uri, off_t size, const struct cache_meta * meta, unsigned int hits, uint64_t idle_ms) {
+	static const struct cache_meta no_meta;
+	struct journal_record record;
+	if (NULL == meta) {
+		meta = &no_meta;
+	}
+	memset(&record, 0, sizeof(record));
+	record.type = type;
+	record.hits = hits;
+	record.size = size;
+	record.idle_ms = idle_ms;
+	record.stored = meta->stored;
+	record.expires = meta->expires;
+	record.lifetime = meta->lifetime;
+	record.no_cache = meta->no_cache;
+	if (strlen(uri) > UINT16_MAX) {
+		return -1;
+	}
+	record.uri_len = strlen(uri);
+	record.etag_len = strlen(meta->etag);
+	record.last_modified_len = strlen(meta->last_modified);
+	record.vary_len = strlen(meta->vary);
+	record.vary_key_len = strlen(meta->vary_key);
+	record.length = sizeof(record) + record.uri_len + record.etag_len + record.last_modified_len + record.vary_len + record.vary_key_len;
+	if (record.length > JOURNAL_RECORD_MAX) {
+		return -1;
+	}
+
+	char * p = buffer + sizeof(record);
+	memcpy(p, uri, record.uri_len);
+	p += record.uri_len;
+	memcpy(p, meta->etag, record.etag_len);
+	p += record.etag_len;
+	memcpy(p, meta->last_modified, record.last_modified_len);
+	p += record.last_modified_len;
+	memcpy(p, meta->vary, record.vary_len);
+	p += record.vary_len;
+	memcpy(p, meta->vary_key, record.vary_key_len);
+	memcpy(buffer, &record, sizeof(record));
+	record.checksum = record_checksum(buffer, record.length);
+	memcpy(buffer, &record, sizeof(record));
+	return record.length;
+}
+
+/*
+* Appends a record to the journal. Must be called with the journal locked.
+*/
+static void append_record(enum journal_record_type type, const char * uri, off_t size, const struct cache_meta * meta) {
+	char buffer[JOURNAL_RECORD_MAX];
+	if (-1 == journal_fd) {
+		return;
+	}
+	int length = encode_record(buffer, type, uri, size, meta, 0, 0);
+	if (-1 == length) {
+		return;
+	}
+	// a single write, so a crash leaves at most the last record torn
+	ssize_t num_bytes_written = write(journal_fd, buffer, length);
+	if (num_bytes_written != length) {
+		log_error("Unable to append to cache journal: %s\n", strerror(errno));
+		return;
+	}
+	journal_bytes += length;
+}
+
+/*
+* index_for_each_in_shard callback copying the record of one entry into a snapshot_copy.
+*/
+static void copy_snapshot_entry(const struct index_entry * entry, uint64_t idle_ms, void * arg) {
+	struct snapshot_copy * copy = (struct snapshot_copy *) arg;
+	if (copy->failed) {
+		return;
+	}
+	if (copy->cap - copy->len < JOURNAL_RECORD_MAX) {
+		size_t cap = (0 == copy->cap) ? 4 * JOURNAL_RECORD_MAX : 2 * copy->cap;
+		char * data = (char *) realloc(copy->data, cap);
+		if (NULL == data) {
+			copy->failed = true;
+			return;
+		}
+		copy->data = data;
+		copy->cap = cap;
+	}
+	int length = encode_record(copy->data + copy->len, JOURNAL_INSERT, entry->uri, entry->size, &entry->meta, entry->hits, idle_ms);
+	if (-1 != length) {
+		copy->len += length;
+	}
+}
+
+/*
+* FNV-1a of a record after its checksum field.
+*/
+static uint32_t record_checksum(const char * record, uint32_t length) {
+	uint32_t hash = 2166136261U;
+	uint32_t i;
+	for (i = sizeof(uint32_t); i < length; i++) {
+		hash = (hash ^ (unsigned char) record[i]) * 16777619U;
+	}
+	return hash;
+}
@@ -0,0 +1,54 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "freshness.h"
+
+#define JOURNAL_FILENAME "./cache/index.journal" // changes to the index since the last checkpoint
+#define JOURNAL_ROTATED_FILENAME "./cache/index.journal.old" // journal being folded into a snapshot by a checkpoint
+#define SNAPSHOT_FILENAME "./cache/index.snapshot" // the whole index as of the last checkpoint
+#define JOURNAL_MAGIC 0x50584a31 // "PXJ1", first word of both files
+#define JOURNAL_CHECKPOINT_BYTES (16 * 1024 * 1024) // journal size that triggers a checkpoint
+
+enum journal_record_type {
+	JOURNAL_INSERT = 1, // cache_file stored, or an entry of the snapshot
+	JOURNAL_META, // cache_file revalidated
+	JOURNAL_REMOVE // cache_file deleted or evicted
+};
+
+/*
+* Fixed part of a record in the journal or snapshot, followed by the uri and the strings of its
+* cache_meta. checksum covers everything after it, so a record torn by a crash is detected.
+*/
+struct journal_record {
+	uint32_t checksum;
+	uint32_t length; // bytes of the whole record
+	uint32_t type;
+	uint32_t hits;
+	int64_t size;
+	int64_t idle_ms; // time since the entry was last used, for its LRU rank
+	int64_t stored;
+	int64_t expires;
+	int64_t lifetime;
+	uint8_t no_cache;
+	uint16_t uri_len;
+	uint16_t etag_len;
+	uint16_t last_modified_len;
+	uint16_t vary_len;
+	uint16_t vary_key_len;
+};
+
+int journal_open();
+int journal_insert(const char * uri, off_t size, const struct cache_meta * meta);
+bool journal_update_meta(const char * uri, const struct cache_meta * meta);
+void journal_remove(const char * uri);
+char * journal_evict(char * filename);
+bool journal_needs_checkpoint();
+int journal_checkpoint();
+void journal_hold_checkpoints();
+int journal_catch_up();
+
+#endif
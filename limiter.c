@@ -0,0 +1,227 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "limiter.h"
+#include "memcache.h"
+#include "reactor.h"
+
+#define TOKEN_BITS 24
+#define TOKEN_MASK ((1ULL << TOKEN_BITS) - 1)
+#define TOUCH_INTERVAL_MS 1000 // last_used_ms is only written once this much has passed, to keep shared entries cheap to read
+
+static const char * setting_names[LIMIT_NUM_SETTINGS] = {
+	"client-rate", "client-burst", "client-connections", "host-rate", "host-burst", "host-connections"
+};
+static long long settings[LIMIT_NUM_SETTINGS];
+static struct limiter_table clients;
+static struct limiter_table hosts;
+
+static struct limiter_entry * find_entry(struct limiter_table * table, uint64_t key);
+static bool entry_is_idle(struct limiter_entry * entry, uint64_t now);
+static uint64_t bucket_capacity(long long per_second, enum limit_setting burst);
+
+/*
+* Sets the limit called name (see setting_names) to value. Safe to call while the proxy runs.
+* Returns 0 on success, -1 if there is no such limit or value is negative.
+*/
+int limiter_set(const char * name, long long value) {
+	int i;
+	for (i = 0; i < LIMIT_NUM_SETTINGS; i++) {
+		if (0 == strcmp(name, setting_names[i])) {
+			if (value < 0) {
+				return -1;
+			}
+			__atomic_store_n(&settings[i], value, __ATOMIC_RELAXED);
+			return 0;
+		}
+	}
+	return -1;
+}
+
+/*
+* Writes every limit as a "name value" line into dest. Returns the length written.
+*/
+int limiter_format(char * dest, int dest_size) {
+	int len = 0;
+	int i;
+	for (i = 0; i < LIMIT_NUM_SETTINGS && len < dest_size; i++) {
+		len += snprintf(dest + len, dest_size - len, "%s %lld\n", setting_names[i], __atomic_load_n(&settings[i], __ATOMIC_RELAXED));
+	}
+	return (len < dest_size) ? len : dest_size - 1;
+}
+
+/*
+* Returns the entry of the IPv4 client address addr (in network byte order), or NULL if the
+* table has no room for it, in which case it is not limited.
+*/
+struct limiter_entry * limiter_client(uint32_t addr) {
+	// an odd multiplier spreads neighbouring addresses apart, and no address maps to 0
+	return find_entry(&clients, ((uint64_t) addr + 1) * 0x9E3779B97F4A7C15ULL);
+}
+
+/*
+* Returns the entry of host and port, or NULL if the table has no room for it.
+*/
+struct limiter_entry * limiter_host(const char * host, int port) {
+	char name[320];
+	snprintf(name, sizeof(name), "%s:%d", host, port);
+	uint64_t key = hash_key(name);
+	return find_entry(&hosts, (0 == key) ? 1 : key);
+}
+
+/*
+* Takes a token from the bucket of entry, which refills at the limit rate up to the limit
+* burst. Returns false if the bucket is empty. Always true when rate is not limited.
+*/
+bool limiter_take(struct limiter_entry * entry, enum limit_setting rate, enum limit_setting burst) {
+	long long per_second = __atomic_load_n(&settings[rate], __ATOMIC_RELAXED);
+	if (NULL == entry || per_second <= 0) {
+		return true;
+	}
+	uint64_t capacity = bucket_capacity(per_second, burst);
+	uint64_t now = monotonic_ms();
+	uint64_t old = __atomic_load_n(&entry->bucket, __ATOMIC_RELAXED);
+	while (true) {
+		// a new entry (bucket 0) starts out full
+		uint64_t tokens = capacity;
+		uint64_t refilled = now;
+		if (0 != old) {
+			uint64_t last = old >> TOKEN_BITS;
+			tokens = old & TOKEN_MASK;
+			if (now > last) {
+				// per_second tokens a second is per_second thousandths a millisecond
+				tokens += (now - last) * per_second;
+			} else {
+				refilled = last;
+			}
+			if (tokens > capacity) {
+				tokens = capacity;
+			}
+		}
+		if (tokens < LIMITER_TOKEN_SCALE) {
+			return false;
+		}
+		uint64_t bucket = (refilled << TOKEN_BITS) | (tokens - LIMITER_TOKEN_SCALE);
+		if (__atomic_compare_exchange_n(&entry->bucket, &old, bucket, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+			return true;
+		}
+	}
+}
+
+/*
+* Puts back the token limiter_take took from the bucket of entry for a request that was refused
+* by another limit after all.
+*/
+void limiter_refund(struct limiter_entry * entry, enum limit_setting rate, enum limit_setting burst) {
+	long long per_second = __atomic_load_n(&settings[rate], __ATOMIC_RELAXED);
+	if (NULL == entry || per_second <= 0) {
+		return;
+	}
+	uint64_t capacity = bucket_capacity(per_second, burst);
+	uint64_t old = __atomic_load_n(&entry->bucket, __ATOMIC_RELAXED);
+	while (0 != old) {
+		uint64_t tokens = (old & TOKEN_MASK) + LIMITER_TOKEN_SCALE;
+		if (tokens > capacity) {
+			tokens = capacity;
+		}
+		uint64_t bucket = (old & ~TOKEN_MASK) | tokens;
+		if (__atomic_compare_exchange_n(&entry->bucket, &old, bucket, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+			return;
+		}
+	}
+}
+
+/*
+* Counts a request of entry as being at a host, unless that would exceed the limit max. Returns
+* false if it would; otherwise limiter_leave must be called once the request is done.
+*/
+bool limiter_enter(struct limiter_entry * entry, enum limit_setting max) {
+	if (NULL == entry) {
+		return true;
+	}
+	// requests are counted even without a limit, so one set later starts out right
+	long long limit = __atomic_load_n(&settings[max], __ATOMIC_RELAXED);
+	int active = __atomic_add_fetch(&entry->active, 1, __ATOMIC_RELAXED);
+	if (limit > 0 && active > limit) {
+		__atomic_sub_fetch(&entry->active, 1, __ATOMIC_RELAXED);
+		return false;
+	}
+	return true;
+}
+
+void limiter_leave(struct limiter_entry * entry) {
+	if (NULL != entry) {
+		__atomic_sub_fetch(&entry->active, 1, __ATOMIC_RELAXED);
+	}
+}
+
+/*
+* Finds the entry of key in its shard of table, claiming a free slot for it if it has none, or
+* taking over the slot of a key that has been idle for LIMITER_IDLE_MS. Two threads seeing a new
+* key at once may give it two entries, or a key that comes back while its slot is being taken
+* over may share it with the new key for a moment; limits are only approximate for those keys.
+*/
+static struct limiter_entry * find_entry(struct limiter_table * table, uint64_t key) {
+	// high bits pick the shard, the middle ones the first slot to probe
+	struct limiter_shard * shard = &table->shards[(key >> 60) % LIMITER_SHARDS];
+	uint64_t now = monotonic_ms();
+	struct limiter_entry * idle = NULL;
+	int i;
+	for (i = 0; i < LIMITER_PROBES; i++) {
+		struct limiter_entry * entry = &shard->entries[((key >> 16) + i) % LIMITER_SLOTS];
+		uint64_t entry_key = __atomic_load_n(&entry->key, __ATOMIC_ACQUIRE);
+		if (0 == entry_key) {
+			// slots are never freed, so a key not found before the first free slot has none
+			if (__atomic_compare_exchange_n(&entry->key, &entry_key, key, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+				__atomic_store_n(&entry->last_used_ms, now, __ATOMIC_RELAXED);
+				return entry;
+			}
+		}
+		if (key == entry_key) {
+			uint64_t last = __atomic_load_n(&entry->last_used_ms, __ATOMIC_RELAXED);
+			if (now > last && now - last > TOUCH_INTERVAL_MS) {
+				__atomic_store_n(&entry->last_used_ms, now, __ATOMIC_RELAXED);
+			}
+			return entry;
+		}
+		if (NULL == idle && entry_is_idle(entry, now)) {
+			idle = entry;
+		}
+	}
+	if (NULL == idle) {
+		return NULL;
+	}
+	uint64_t idle_key = __atomic_load_n(&idle->key, __ATOMIC_ACQUIRE);
+	if (!__atomic_compare_exchange_n(&idle->key, &idle_key, key, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		return NULL;
+	}
+	__atomic_store_n(&idle->bucket, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&idle->last_used_ms, now, __ATOMIC_RELAXED);
+	return idle;
+}
+
+/*
+* Returns true if no request of entry is at a host and it has not been used for LIMITER_IDLE_MS.
+* Another thread may have stored a later time than now in last_used_ms meanwhile.
+*/
+static bool entry_is_idle(struct limiter_entry * entry, uint64_t now) {
+	uint64_t last = __atomic_load_n(&entry->last_used_ms, __ATOMIC_RELAXED);
+	return 0 == __atomic_load_n(&entry->active, __ATOMIC_RELAXED) && now > last && now - last > LIMITER_IDLE_MS;
+}
+
+/*
+* Returns the thousandths of tokens a bucket refilled at per_second holds at most
+*/
+static uint64_t bucket_capacity(long long per_second, enum limit_setting burst) {
+	long long max_tokens = __atomic_load_n(&settings[burst], __ATOMIC_RELAXED);
+	if (max_tokens <= 0) {
+		max_tokens = per_second;
+	}
+	if (max_tokens > LIMITER_MAX_BURST) {
+		max_tokens = LIMITER_MAX_BURST;
+	}
+	return (uint64_t) max_tokens * LIMITER_TOKEN_SCALE;
+}
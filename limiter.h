@@ -0,0 +1,60 @@
+#ifndef LIMITER_H
+#define LIMITER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define LIMITER_SHARDS 16 // parts of each limiter table, picked by the high bits of a key
+#define LIMITER_SLOTS 4096 // entries per shard
+#define LIMITER_PROBES 8 // slots a key may be put in; a key that finds none of them free is not limited
+#define LIMITER_IDLE_MS 60000 // time an entry has to be unused before its slot is given to another key
+#define LIMITER_TOKEN_SCALE 1000 // tokens are counted in thousandths
+#define LIMITER_MAX_BURST 16000 // tokens a bucket holds at most (24 bits of thousandths)
+
+/*
+* Limits, all changeable while the proxy runs. 0 means no limit.
+*/
+enum limit_setting {
+	LIMIT_CLIENT_RATE, // requests per second a client address may send to hosts
+	LIMIT_CLIENT_BURST, // requests a client address may send at once after being idle (default: its rate)
+	LIMIT_CLIENT_CONNECTIONS, // requests of a client address that may be at hosts at the same time
+	LIMIT_HOST_RATE, // requests per second sent to a host
+	LIMIT_HOST_BURST,
+	LIMIT_HOST_CONNECTIONS, // requests that may be at a host at the same time
+	LIMIT_NUM_SETTINGS
+};
+
+/*
+* Limiter state of one client address or host. key is claimed with a compare-and-swap, bucket
+* packs the time of its last refill (monotonic milliseconds, upper 40 bits) and
+* its tokens (lower 24 bits) into one word updated with a compare-and-swap, and active is
+* updated with atomic adds, so no entry is ever locked.
+*/
+struct limiter_entry {
+	uint64_t key; // 0 while the slot is free
+	uint64_t bucket;
+	uint64_t last_used_ms;
+	int active; // requests of the key at hosts
+};
+
+struct limiter_shard {
+	struct limiter_entry entries[LIMITER_SLOTS];
+};
+
+/*
+* Entries of all client addresses or all hosts seen lately, in open addressing shards.
+*/
+struct limiter_table {
+	struct limiter_shard shards[LIMITER_SHARDS];
+};
+
+int limiter_set(const char * name, long long value);
+int limiter_format(char * dest, int dest_size);
+struct limiter_entry * limiter_client(uint32_t addr);
+struct limiter_entry * limiter_host(const char * host, int port);
+bool limiter_take(struct limiter_entry * entry, enum limit_setting rate, enum limit_setting burst);
+void limiter_refund(struct limiter_entry * entry, enum limit_setting rate, enum limit_setting burst);
+bool limiter_enter(struct limiter_entry * entry, enum limit_setting max);
+void limiter_leave(struct limiter_entry * entry);
+
+#endif
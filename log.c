@@ -0,0 +1,21 @@
+#include <string.h>
+
+#include "log.h"
+
+enum log_level log_level = LOG_INFO;
+
+/*
+* Sets level to the level called name (error, info or debug). Returns 0 on success, -1 if there
+* is no such level.
+*/
+int parse_log_level(const char * name, enum log_level * level) {
+	static const char * names[] = { "error", "info", "debug" };
+	int i;
+	for (i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+		if (0 == strcmp(name, names[i])) {
+			*level = (enum log_level) i;
+			return 0;
+		}
+	}
+	return -1;
+}
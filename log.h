@@ -0,0 +1,24 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <stdio.h>
+
+/*
+* How much the proxy prints. Messages about each request and connection are at LOG_DEBUG, so
+* they cost one comparison unless asked for.
+*/
+enum log_level {
+	LOG_ERROR, // failures of the proxy itself
+	LOG_INFO, // startup and reconfiguration
+	LOG_DEBUG // every step of every request
+};
+
+extern enum log_level log_level;
+
+#define log_error(...) do { if (LOG_ERROR <= log_level) printf(__VA_ARGS__); } while (0)
+#define log_info(...) do { if (LOG_INFO <= log_level) printf(__VA_ARGS__); } while (0)
+#define log_debug(...) do { if (LOG_DEBUG <= log_level) printf(__VA_ARGS__); } while (0)
+
+int parse_log_level(const char * name, enum log_level * level);
+
+#endif
@@ -0,0 +1,233 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "memcache.h"
+
+static struct memcache_shard shards[MEMCACHE_SHARDS];
+
+static void unlink_object(struct memcache_shard * shard, struct mem_object * object);
+
+/*
+* Set up the memory cache with room for budget bytes of objects spread over the shards.
+*/
+void create_memcache(size_t budget) {
+	int i;
+	for (i = 0; i < MEMCACHE_SHARDS; i++) {
+		struct memcache_shard * shard = &shards[i];
+		pthread_mutex_init(&shard->lock, NULL);
+		memset(shard->buckets, 0, sizeof(shard->buckets));
+		shard->lru.lru_prev = &shard->lru;
+		shard->lru.lru_next = &shard->lru;
+		shard->bytes = 0;
+		shard->budget = budget / MEMCACHE_SHARDS;
+	}
+}
+
+/*
+* Hashes key with 64-bit FNV-1a
+*/
+uint64_t hash_key(const char * key) {
+	uint64_t hash = 14695981039346656037ULL;
+	const unsigned char * p;
+	for (p = (const unsigned char *) key; '\0' != *p; p++) {
+		hash = (hash ^ *p) * 1099511628211ULL;
+	}
+	return hash;
+}
+
+static struct memcache_shard * shard_for(uint64_t hash) {
+	// low bits pick the bucket, high bits pick the shard
+	return &shards[(hash >> 56) % MEMCACHE_SHARDS];
+}
+
+static size_t object_cost(const struct mem_object * object) {
+	return sizeof(struct mem_object) + strlen(object->key) + 1 + object->size;
+}
+
+static void lru_remove(struct mem_object * object) {
+	object->lru_prev->lru_next = object->lru_next;
+	object->lru_next->lru_prev = object->lru_prev;
+}
+
+static void lru_push_front(struct memcache_shard * shard, struct mem_object * object) {
+	object->lru_next = shard->lru.lru_next;
+	object->lru_prev = &shard->lru;
+	shard->lru.lru_next->lru_prev = object;
+	shard->lru.lru_next = object;
+}
+
+/*
+* Finds the object for key in shard. Must be called with the shard locked.
+*/
+static struct mem_object * find_object(struct memcache_shard * shard, uint64_t hash, const char * key) {
+	struct mem_object * object;
+	for (object = shard->buckets[hash % MEMCACHE_BUCKETS]; NULL != object; object = object->hash_next) {
+		if (hash == object->hash && 0 == strcmp(key, object->key)) {
+			return object;
+		}
+	}
+	return NULL;
+}
+
+/*
+* Returns the cached object for key with a reference held, or NULL if it is not in memory.
+* The caller must memcache_release the object when done with it.
+*/
+struct mem_object * memcache_get(const char * key) {
+	uint64_t hash = hash_key(key);
+	struct memcache_shard * shard = shard_for(hash);
+
+	pthread_mutex_lock(&shard->lock);
+	struct mem_object * object = find_object(shard, hash, key);
+	if (NULL != object) {
+		lru_remove(object);
+		lru_push_front(shard, object);
+		__atomic_add_fetch(&object->refcount, 1, __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&shard->lock);
+	return object;
+}
+
+/*
+* Allocates an object for key with room for size bytes of data, not yet in the cache. The
+* caller holds the only reference and fills in data before calling memcache_insert.
+* Returns NULL if the object cannot be allocated.
+*/
+struct mem_object * memcache_alloc(const char * key, size_t size) {
+	size_t key_len = strlen(key);
+	struct mem_object * object = (struct mem_object *) malloc(sizeof(struct mem_object) + key_len + 1 + size);
+	if (NULL == object) {
+		return NULL;
+	}
+	object->key = (char *) (object + 1);
+	object->data = object->key + key_len + 1;
+	memcpy(object->key, key, key_len + 1);
+	object->size = size;
+	object->hash = hash_key(key);
+	object->refcount = 1;
+	return object;
+}
+
+/*
+* Adds object to the memory cache, replacing any object already cached under its key and
+* evicting least recently used objects of its shard to stay within budget. The cache takes its
+* own reference; the caller keeps the one it holds.
+*/
+void memcache_insert(struct mem_object * object) {
+	if (object->size > MEMCACHE_MAX_OBJECT_SIZE) {
+		return;
+	}
+	struct memcache_shard * shard = shard_for(object->hash);
+	size_t cost = object_cost(object);
+	if (cost > shard->budget) {
+		return;
+	}
+	__atomic_add_fetch(&object->refcount, 1, __ATOMIC_RELAXED);
+
+	pthread_mutex_lock(&shard->lock);
+	struct mem_object * old = find_object(shard, object->hash, object->key);
+	if (NULL != old) {
+		unlink_object(shard, old);
+	}
+	while (shard->bytes + cost > shard->budget && shard->lru.lru_prev != &shard->lru) {
+		unlink_object(shard, shard->lru.lru_prev);
+	}
+
+	struct mem_object ** bucket = &shard->buckets[object->hash % MEMCACHE_BUCKETS];
+	object->hash_next = *bucket;
+	*bucket = object;
+	lru_push_front(shard, object);
+	shard->bytes += cost;
+	pthread_mutex_unlock(&shard->lock);
+}
+
+/*
+* Copies size bytes of data into the memory cache under key.
+*/
+void memcache_put(const char * key, const char * data, size_t size) {
+	if (size > MEMCACHE_MAX_OBJECT_SIZE) {
+		return;
+	}
+	struct mem_object * object = memcache_alloc(key, size);
+	if (NULL == object) {
+		return;
+	}
+	memcpy(object->data, data, size);
+	memcache_insert(object);
+	memcache_release(object);
+}
+
+/*
+* Drops the object for key from memory if it is cached.
+*/
+void memcache_remove(const char * key) {
+	uint64_t hash = hash_key(key);
+	struct memcache_shard * shard = shard_for(hash);
+
+	pthread_mutex_lock(&shard->lock);
+	struct mem_object * object = find_object(shard, hash, key);
+	if (NULL != object) {
+		unlink_object(shard, object);
+	}
+	pthread_mutex_unlock(&shard->lock);
+}
+
+/*
+* Drops object from memory if it is still the one cached under its key.
+*/
+void memcache_remove_object(struct mem_object * object) {
+	struct memcache_shard * shard = shard_for(object->hash);
+
+	pthread_mutex_lock(&shard->lock);
+	if (object == find_object(shard, object->hash, object->key)) {
+		unlink_object(shard, object);
+	}
+	pthread_mutex_unlock(&shard->lock);
+}
+
+/*
+* Calls fn with the key of every cached object, least recently used first within each shard, so
+* inserting them again in that order rebuilds the LRU lists. Each shard is locked while its
+* objects are visited.
+*/
+void memcache_for_each(void (*fn)(const char * key, size_t size, void * arg), void * arg) {
+	int i;
+	for (i = 0; i < MEMCACHE_SHARDS; i++) {
+		struct memcache_shard * shard = &shards[i];
+		pthread_mutex_lock(&shard->lock);
+		struct mem_object * object;
+		for (object = shard->lru.lru_prev; object != &shard->lru; object = object->lru_prev) {
+			fn(object->key, object->size, arg);
+		}
+		pthread_mutex_unlock(&shard->lock);
+	}
+}
+
+/*
+* Drops a reference to object, freeing it once it is out of the cache and no reader holds it.
+*/
+void memcache_release(struct mem_object * object) {
+	if (0 == __atomic_sub_fetch(&object->refcount, 1, __ATOMIC_ACQ_REL)) {
+		free(object);
+	}
+}
+
+/*
+* Removes object from its shard's table and LRU list and drops the cache's reference to it.
+* Must be called with the shard locked.
+*/
+static void unlink_object(struct memcache_shard * shard, struct mem_object * object) {
+	struct mem_object ** link;
+	for (link = &shard->buckets[object->hash % MEMCACHE_BUCKETS]; NULL != *link; link = &(*link)->hash_next) {
+		if (object == *link) {
+			*link = object->hash_next;
+			break;
+		}
+	}
+	lru_remove(object);
+	shard->bytes -= object_cost(object);
+	memcache_release(object);
+}
@@ -0,0 +1,51 @@
+#ifndef MEMCACHE_H
+#define MEMCACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#define MEMCACHE_SHARDS 16 // independently locked parts of the memory cache
+#define MEMCACHE_BUCKETS 4096 // hash buckets per shard
+#define MEMCACHE_BUDGET_BYTES (64 * 1024 * 1024) // memory used by all cached objects
+#define MEMCACHE_MAX_OBJECT_SIZE (1024 * 1024) // larger responses are only cached on disk
+
+/*
+* A cached response held in memory. Readers hold a reference while sending it so it can be
+* evicted from the cache at any time without being freed under them.
+*/
+struct mem_object {
+	struct mem_object * hash_next;
+	struct mem_object * lru_prev;
+	struct mem_object * lru_next;
+	uint64_t hash;
+	int refcount;
+	size_t size; // bytes of data
+	char * key;
+	char * data;
+};
+
+/*
+* One shard of the memory cache: a hash table of objects plus an LRU list, most recently used
+* at the front, under a single lock.
+*/
+struct memcache_shard {
+	pthread_mutex_t lock;
+	struct mem_object * buckets[MEMCACHE_BUCKETS];
+	struct mem_object lru; // sentinel
+	size_t bytes;
+	size_t budget;
+};
+
+void create_memcache(size_t budget);
+struct mem_object * memcache_get(const char * key);
+struct mem_object * memcache_alloc(const char * key, size_t size);
+void memcache_insert(struct mem_object * object);
+void memcache_put(const char * key, const char * data, size_t size);
+void memcache_remove(const char * key);
+void memcache_remove_object(struct mem_object * object);
+void memcache_release(struct mem_object * object);
+void memcache_for_each(void (*fn)(const char * key, size_t size, void * arg), void * arg);
+uint64_t hash_key(const char * key);
+
+#endif
@@ -0,0 +1,384 @@
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+
+#include "partial.h"
+#include "cache.h"
+#include "memcache.h"
+#include "log.h"
+
+static struct partial_table table;
+
+static struct partial_object * find_object(uint64_t hash, const char * uri);
+static struct partial_object * new_object(uint64_t hash, const char * uri, long long length);
+static void unlink_object(struct partial_object * object);
+static void free_object(struct partial_object * object);
+static bool add_segment(struct partial_object * object, long long first, long long last);
+static bool covers(const struct partial_object * object, long long first, long long last);
+static void promote(struct partial_object * object);
+static bool write_all(int fd, const char * data, int len);
+static bool copy_body(int from_fd, int to_fd, long long len);
+
+/*
+* Set up the table of partial objects, whose files may take up to budget bytes.
+*/
+void create_partial_table(long long budget) {
+	pthread_mutex_init(&table.lock, NULL);
+	memset(table.buckets, 0, sizeof(table.buckets));
+	table.lru.lru_prev = &table.lru;
+	table.lru.lru_next = &table.lru;
+	table.num_objects = 0;
+	table.bytes = 0;
+	table.budget = budget;
+	table.next_id = 0;
+}
+
+static void lru_remove(struct partial_object * object) {
+	object->lru_prev->lru_next = object->lru_next;
+	object->lru_next->lru_prev = object->lru_prev;
+}
+
+static void lru_push_front(struct partial_object * object) {
+	object->lru_next = table.lru.lru_next;
+	object->lru_prev = &table.lru;
+	table.lru.lru_next->lru_prev = object;
+	table.lru.lru_next = object;
+}
+
+/*
+* Gets the partial object of uri ready for a byte range of a body of length bytes, described by
+* the head and meta of the 206 response carrying it. Ranges stored for a different length or
+* validators are dropped first, since they belong to another version of the response. Returns a
+* descriptor of the object's file to write the range into, with id set to what partial_end
+* needs, or -1 if the object cannot be created.
+*/
+int partial_begin(const char * uri, const char * head, int head_len, long long length, const struct cache_meta * meta, uint64_t * id) {
+	uint64_t hash = hash_key(uri);
+	char * head_copy = (char *) malloc(head_len);
+	if (NULL == head_copy) {
+		return -1;
+	}
+	memcpy(head_copy, head, head_len);
+
+	pthread_mutex_lock(&table.lock);
+	struct partial_object * object = find_object(hash, uri);
+	if (NULL != object && (object->length != length || !freshness_same_validators(&object->meta, meta))) {
+		unlink_object(object);
+		free_object(object);
+		object = NULL;
+	}
+	if (NULL == object) {
+		object = new_object(hash, uri, length);
+		if (NULL == object) {
+			pthread_mutex_unlock(&table.lock);
+			free(head_copy);
+			return -1;
+		}
+	}
+	free(object->head);
+	object->head = head_copy;
+	object->head_len = head_len;
+	object->meta = *meta;
+	lru_remove(object);
+	lru_push_front(object);
+	*id = object->id;
+	int fd = fcntl(object->fd, F_DUPFD_CLOEXEC, 0);
+	pthread_mutex_unlock(&table.lock);
+	return fd;
+}
+
+/*
+* Records that len bytes of the body starting at first were written to the file of the partial
+* object id of uri. Called from a cache writer thread. If that completes the body, the response
+* is stored as a cache_file and the partial object is removed.
+*/
+void partial_end(const char * uri, uint64_t id, long long first, long long len) {
+	if (0 == len) {
+		return;
+	}
+	uint64_t hash = hash_key(uri);
+	pthread_mutex_lock(&table.lock);
+	struct partial_object * object = find_object(hash, uri);
+	// the object may have been dropped or replaced while the range was being written
+	if (NULL == object || id != object->id || first + len > object->length || !add_segment(object, first, first + len - 1)) {
+		pthread_mutex_unlock(&table.lock);
+		return;
+	}
+	struct partial_object * complete = NULL;
+	if (object->bytes == object->length) {
+		unlink_object(object);
+		complete = object;
+	}
+	while (table.bytes > table.budget && table.lru.lru_prev != &table.lru) {
+		struct partial_object * victim = table.lru.lru_prev;
+		log_debug("Dropped byte ranges of %s\n", victim->uri);
+		unlink_object(victim);
+		free_object(victim);
+	}
+	pthread_mutex_unlock(&table.lock);
+
+	if (NULL != complete) {
+		promote(complete);
+		free_object(complete);
+	}
+}
+
+/*
+* Opens the byte range of the partial object of uri that range selects, if the object holds
+* all of it and may be used for request. The head of a 206 response carrying the range is
+* written into head (head_size bytes), and first and last are set to the bytes of the returned
+* descriptor to send after it. Returns -1 if the range cannot be sent from the object.
+*/
+int partial_open(const char * uri, const struct http_message * request, const struct http_range * range, char * head, int head_size, int * head_len, off_t * first, off_t * last) {
+	uint64_t hash = hash_key(uri);
+	long long range_first, range_last;
+	int fd = -1;
+	pthread_mutex_lock(&table.lock);
+	struct partial_object * object = find_object(hash, uri);
+	if (NULL != object && freshness_is_fresh(&object->meta, time(NULL)) && freshness_matches_request(&object->meta, request)
+		&& freshness_if_range_matches(&object->meta, request) && http_resolve_range(range, object->length, &range_first, &range_last)
+		&& covers(object, range_first, range_last)) {
+		*head_len = http_write_range_head(head, head_size, object->head, object->head_len, 206, range_first, range_last, object->length);
+		if (-1 != *head_len && *head_len < head_size) {
+			fd = fcntl(object->fd, F_DUPFD_CLOEXEC, 0);
+			lru_remove(object);
+			lru_push_front(object);
+		}
+	}
+	pthread_mutex_unlock(&table.lock);
+	if (-1 != fd) {
+		*first = range_first;
+		*last = range_last;
+	}
+	return fd;
+}
+
+/*
+* Drops the partial object of uri, if there is one, because the whole response is cached or
+* may no longer be.
+*/
+void partial_remove(const char * uri) {
+	uint64_t hash = hash_key(uri);
+	pthread_mutex_lock(&table.lock);
+	struct partial_object * object = find_object(hash, uri);
+	if (NULL != object) {
+		unlink_object(object);
+		free_object(object);
+	}
+	pthread_mutex_unlock(&table.lock);
+}
+
+/*
+* Returns true if filename is the file of a partial object, so the cache directory sweep
+* leaves it alone.
+*/
+bool partial_contains_file(const char * filename) {
+	bool found = false;
+	pthread_mutex_lock(&table.lock);
+	struct partial_object * object;
+	for (object = table.lru.lru_next; object != &table.lru && !found; object = object->lru_next) {
+		found = (0 == strcmp(filename, object->filename));
+	}
+	pthread_mutex_unlock(&table.lock);
+	return found;
+}
+
+/*
+* Finds the partial object for uri. Must be called with the table locked.
+*/
+static struct partial_object * find_object(uint64_t hash, const char * uri) {
+	struct partial_object * object;
+	for (object = table.buckets[hash % PARTIAL_BUCKETS]; NULL != object; object = object->hash_next) {
+		if (hash == object->hash && 0 == strcmp(uri, object->uri)) {
+			return object;
+		}
+	}
+	return NULL;
+}
+
+/*
+* Creates an empty partial object for uri and its file, dropping the least recently used object
+* if there are too many. Must be called with the table locked. Returns NULL on failure.
+*/
+static struct partial_object * new_object(uint64_t hash, const char * uri, long long length) {
+	if (table.num_objects >= PARTIAL_MAX_OBJECTS && table.lru.lru_prev != &table.lru) {
+		struct partial_object * victim = table.lru.lru_prev;
+		unlink_object(victim);
+		free_object(victim);
+	}
+	struct partial_object * object = (struct partial_object *) calloc(1, sizeof(struct partial_object));
+	if (NULL == object) {
+		return NULL;
+	}
+	object->uri = strdup(uri);
+	get_filename_from_uri(uri, object->filename);
+	strcat(object->filename, ".part");
+	object->fd = open(object->filename, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRWXU);
+	if (NULL == object->uri || -1 == object->fd) {
+		log_error("Unable to open partial cache file %s: %s\n", object->filename, strerror(errno));
+		if (-1 != object->fd) {
+			close(object->fd);
+		}
+		free(object->uri);
+		free(object);
+		return NULL;
+	}
+	object->hash = hash;
+	object->id = ++table.next_id;
+	object->length = length;
+	object->hash_next = table.buckets[hash % PARTIAL_BUCKETS];
+	table.buckets[hash % PARTIAL_BUCKETS] = object;
+	lru_push_front(object);
+	table.num_objects++;
+	return object;
+}
+
+/*
+* Takes object out of the table and removes its file, which stays readable through descriptors
+* still open on it. Must be called with the table locked.
+*/
+static void unlink_object(struct partial_object * object) {
+	struct partial_object ** p = &table.buckets[object->hash % PARTIAL_BUCKETS];
+	while (*p != object) {
+		p = &(*p)->hash_next;
+	}
+	*p = object->hash_next;
+	lru_remove(object);
+	table.num_objects--;
+	table.bytes -= object->bytes;
+	remove(object->filename);
+}
+
+static void free_object(struct partial_object * object) {
+	close(object->fd);
+	free(object->head);
+	free(object->uri);
+	free(object);
+}
+
+/*
+* Adds bytes first to last to the segments of object, merging it with the ones it overlaps or
+* touches. Returns false if that would leave too many segments. Must be called with the table
+* locked.
+*/
+static bool add_segment(struct partial_object * object, long long first, long long last) {
+	struct partial_segment merged[PARTIAL_MAX_SEGMENTS + 1];
+	int num_merged = 0;
+	bool placed = false;
+	int i;
+	for (i = 0; i < object->num_segments; i++) {
+		struct partial_segment segment = object->segments[i];
+		if (segment.last + 1 < first) {
+			merged[num_merged++] = segment;
+		} else if (last + 1 < segment.first) {
+			if (!placed) {
+				merged[num_merged++] = (struct partial_segment) { first, last };
+				placed = true;
+			}
+			merged[num_merged++] = segment;
+		} else {
+			first = (segment.first < first) ? segment.first : first;
+			last = (segment.last > last) ? segment.last : last;
+		}
+	}
+	if (!placed) {
+		merged[num_merged++] = (struct partial_segment) { first, last };
+	}
+	if (num_merged > PARTIAL_MAX_SEGMENTS) {
+		return false;
+	}
+
+	long long bytes = 0;
+	for (i = 0; i < num_merged; i++) {
+		object->segments[i] = merged[i];
+		bytes += merged[i].last - merged[i].first + 1;
+	}
+	object->num_segments = num_merged;
+	table.bytes += bytes - object->bytes;
+	object->bytes = bytes;
+	return true;
+}
+
+/*
+* Returns true if a single segment of object holds bytes first to last
+*/
+static bool covers(const struct partial_object * object, long long first, long long last) {
+	int i;
+	for (i = 0; i < object->num_segments; i++) {
+		if (object->segments[i].first <= first && last <= object->segments[i].last) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+* Stores a partial object whose segments cover its whole body as a cache_file: a 200 response
+* with the fields of its head, followed by the body copied out of its file.
+*/
+static void promote(struct partial_object * object) {
+	int head_size = object->head_len + 128;
+	char * head = (char *) malloc(head_size);
+	int head_len = (NULL == head) ? -1 : http_write_range_head(head, head_size, object->head, object->head_len, 200, 0, object->length - 1, object->length);
+	if (-1 == head_len || head_len >= head_size) {
+		free(head);
+		return;
+	}
+
+	char temp_filename[TEMP_FILENAME_SIZE];
+	generate_temp_filename(temp_filename);
+	int fd = open(temp_filename, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, S_IRWXU);
+	if (-1 == fd) {
+		free(head);
+		return;
+	}
+	bool written = write_all(fd, head, head_len) && copy_body(object->fd, fd, object->length);
+	written = (0 == close(fd)) && written;
+	free(head);
+	if (!written) {
+		log_error("Unable to write %s completed from byte ranges: %s\n", temp_filename, strerror(errno));
+	}
+	if (!written || -1 == store_cache_file(object->uri, temp_filename, head_len + object->length, &object->meta)) {
+		remove(temp_filename);
+		return;
+	}
+	log_debug("Completed %s from byte ranges.\n", object->uri);
+}
+
+static bool write_all(int fd, const char * data, int len) {
+	while (len > 0) {
+		ssize_t num_bytes_written = write(fd, data, len);
+		if (-1 == num_bytes_written) {
+			if (EINTR == errno) {
+				continue;
+			}
+			return false;
+		}
+		data += num_bytes_written;
+		len -= num_bytes_written;
+	}
+	return true;
+}
+
+/*
+* Appends the first len bytes of from_fd to to_fd, inside the kernel
+*/
+static bool copy_body(int from_fd, int to_fd, long long len) {
+	loff_t offset = 0;
+	while (offset < len) {
+		ssize_t num_bytes_copied = copy_file_range(from_fd, &offset, to_fd, NULL, len - offset, 0);
+		if (num_bytes_copied <= 0) {
+			if (-1 == num_bytes_copied && EINTR == errno) {
+				continue;
+			}
+			return false;
+		}
+	}
+	return true;
+}
@@ -0,0 +1,71 @@
+#ifndef PARTIAL_H
+#define PARTIAL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <pthread.h>
+
+#include "freshness.h"
+#include "http.h"
+#include "index.h"
+
+#define PARTIAL_BUCKETS 1024 // hash buckets of the partial object table
+#define PARTIAL_MAX_OBJECTS 4096 // partial objects kept before the least recently used is dropped
+#define PARTIAL_MAX_SEGMENTS 32 // separate byte ranges kept per object, further ones are not stored
+#define PARTIAL_BUDGET_SHARE 4 // partial objects use up to 1/PARTIAL_BUDGET_SHARE of the disk budget
+
+/*
+* Bytes first to last of a body
+*/
+struct partial_segment {
+	long long first;
+	long long last;
+};
+
+/*
+* A response the cache only holds byte ranges of, from 206 responses to Range requests. The
+* bytes are kept at their place in the body in a sparse file named after the cache_file of uri,
+* and segments lists which of them are there. Once they cover the whole body the response is
+* stored as a cache_file like any other.
+*/
+struct partial_object {
+	struct partial_object * hash_next;
+	struct partial_object * lru_prev;
+	struct partial_object * lru_next;
+	uint64_t hash;
+	uint64_t id; // tells writes begun for this object from writes begun for one it replaced
+	char * uri;
+	char filename[CACHE_FILENAME_SIZE + 8]; // cache_file name followed by ".part"
+	int fd;
+	long long length; // of the whole body
+	long long bytes; // in segments
+	struct cache_meta meta;
+	char * head; // of the latest 206 response, whose fields are sent with ranges of the object
+	int head_len;
+	int num_segments;
+	struct partial_segment segments[PARTIAL_MAX_SEGMENTS]; // in order, neither overlapping nor touching
+};
+
+/*
+* All partial objects, with an LRU list of them, most recently used at the front. Only Range
+* requests for responses not cached whole get here, so one lock serves them all.
+*/
+struct partial_table {
+	pthread_mutex_t lock;
+	struct partial_object * buckets[PARTIAL_BUCKETS];
+	struct partial_object lru; // sentinel
+	int num_objects;
+	long long bytes;
+	long long budget;
+	uint64_t next_id;
+};
+
+void create_partial_table(long long budget);
+int partial_begin(const char * uri, const char * head, int head_len, long long length, const struct cache_meta * meta, uint64_t * id);
+void partial_end(const char * uri, uint64_t id, long long first, long long len);
+int partial_open(const char * uri, const struct http_message * request, const struct http_range * range, char * head, int head_size, int * head_len, off_t * first, off_t * last);
+void partial_remove(const char * uri);
+bool partial_contains_file(const char * filename);
+
+#endif
@@ -0,0 +1,94 @@
+#include <stdlib.h>
+
+#include "pool.h"
+
+// blocks of an arena start with their link, allocations follow it
+#define ARENA_HEADER_SIZE ((sizeof(struct pool_block) + POOL_ALIGN - 1) & ~(size_t) (POOL_ALIGN - 1))
+
+/*
+* Create an empty pool of blocks of block_size bytes, keeping at most max_idle free ones.
+*/
+struct buffer_pool * create_buffer_pool(size_t block_size, int max_idle) {
+	struct buffer_pool * pool = (struct buffer_pool *) calloc(1, sizeof(struct buffer_pool));
+	if (NULL == pool) {
+		return NULL;
+	}
+	pool->block_size = (block_size + POOL_ALIGN - 1) & ~(size_t) (POOL_ALIGN - 1);
+	pool->max_idle = max_idle;
+	return pool;
+}
+
+/*
+* Takes a block from the pool, allocating one if none is free. Returns NULL if out of memory.
+*/
+void * pool_get(struct buffer_pool * pool) {
+	struct pool_block * block = pool->idle;
+	if (NULL != block) {
+		pool->idle = block->next;
+		pool->num_idle--;
+	} else if (0 != posix_memalign((void **) &block, POOL_ALIGN, pool->block_size)) {
+		return NULL;
+	}
+	pool->num_in_use++;
+	return block;
+}
+
+/*
+* Returns a block taken from the pool. NULL is ignored.
+*/
+void pool_put(struct buffer_pool * pool, void * ptr) {
+	if (NULL == ptr) {
+		return;
+	}
+	pool->num_in_use--;
+	if (pool->num_idle >= pool->max_idle) {
+		free(ptr);
+		return;
+	}
+	struct pool_block * block = (struct pool_block *) ptr;
+	block->next = pool->idle;
+	pool->idle = block;
+	pool->num_idle++;
+}
+
+void arena_init(struct arena * arena, struct buffer_pool * pool) {
+	arena->pool = pool;
+	arena->blocks = NULL;
+	arena->used = 0;
+}
+
+/*
+* Allocates len bytes that stay valid until the next arena_reset, taking another block from the
+* pool when the current one is full. Returns NULL if len does not fit in a block or the pool is
+* out of memory.
+*/
+void * arena_alloc(struct arena * arena, size_t len) {
+	len = (len + POOL_ALIGN - 1) & ~(size_t) (POOL_ALIGN - 1);
+	if (len > arena->pool->block_size - ARENA_HEADER_SIZE) {
+		return NULL;
+	}
+	if (NULL == arena->blocks || arena->used + len > arena->pool->block_size) {
+		struct pool_block * block = (struct pool_block *) pool_get(arena->pool);
+		if (NULL == block) {
+			return NULL;
+		}
+		block->next = arena->blocks;
+		arena->blocks = block;
+		arena->used = ARENA_HEADER_SIZE;
+	}
+	void * ptr = (char *) arena->blocks + arena->used;
+	arena->used += len;
+	return ptr;
+}
+
+/*
+* Frees everything allocated from arena, returning its blocks to the pool.
+*/
+void arena_reset(struct arena * arena) {
+	while (NULL != arena->blocks) {
+		struct pool_block * block = arena->blocks;
+		arena->blocks = block->next;
+		pool_put(arena->pool, block);
+	}
+	arena->used = 0;
+}
@@ -0,0 +1,47 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <stddef.h>
+
+#define POOL_MAX_IDLE_BUFFERS 1024 // free I/O buffers a reactor keeps for reuse
+#define POOL_MAX_IDLE_CONNECTIONS 256 // free connection objects a reactor keeps for reuse
+#define POOL_ALIGN 16 // alignment of blocks and arena allocations
+
+/*
+* A free block, linked through its first bytes.
+*/
+struct pool_block {
+	struct pool_block * next;
+};
+
+/*
+* Fixed-size blocks recycled through a free list. Blocks only go back to the heap when more than
+* max_idle are free, so a steady load is served without heap calls. Only the owning reactor's
+* thread uses a pool, so no locking is needed.
+*/
+struct buffer_pool {
+	size_t block_size;
+	int max_idle;
+	struct pool_block * idle;
+	int num_idle;
+	int num_in_use; // blocks handed out and not yet put back
+};
+
+/*
+* Bump allocator for the data of one request, carved from blocks of a buffer_pool. Everything
+* allocated from it is released at once by arena_reset when the request completes.
+*/
+struct arena {
+	struct buffer_pool * pool;
+	struct pool_block * blocks; // newest first, allocations come from the newest
+	size_t used; // bytes of the newest block in use
+};
+
+struct buffer_pool * create_buffer_pool(size_t block_size, int max_idle);
+void * pool_get(struct buffer_pool * pool);
+void pool_put(struct buffer_pool * pool, void * block);
+void arena_init(struct arena * arena, struct buffer_pool * pool);
+void * arena_alloc(struct arena * arena, size_t len);
+void arena_reset(struct arena * arena);
+
+#endif
@@ -1,505 +1,2532 @@
-// beej.us guide and provided multithread_server.c file were used as references in the following code for setting up socket 
+// beej.us guide and provided multithread_server.c file were used as references in the following code for setting up socket
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <sys/signalfd.h>
+#include <poll.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <netdb.h>
 #include <stdbool.h>
 #include <pthread.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+
+#include "reactor.h"
+#include "upstream.h"
+#include "http.h"
+#include "encoding.h"
+#include "cache.h"
+#include "journal.h"
+#include "memcache.h"
+#include "fill.h"
+#include "partial.h"
+#include "filter.h"
+#include "resolver.h"
+#include "pool.h"
+#include "writer.h"
+#include "worker.h"
+#include "limiter.h"
+#include "stats.h"
+#include "upgrade.h"
+#include "log.h"
 
 
 #define BUFFER_SIZE 8192 // for reading/sending data
-#define DEFAULT_PORT 80 // default port number for connecting to host 
-#define NUM_THREADS 4
-#define NUM_BYTES_PARSE_STATUS_CODE 256 // number of bytes to read in response that should be sufficient to parse status code
+#define DEFAULT_PORT 80 // default port number for connecting to host
+#define CLIENT_IDLE_TIMEOUT_MS 30000 // time a client has to send its next request
+#define SPLICE_SIZE 65536 // bytes moved per splice/sendfile call
+#define HAPPY_EYEBALLS_DELAY_MS 250 // time a connect attempt gets before the next address is tried alongside it
+#define DRAIN_POLL_MS 100 // interval at which a draining proxy checks for connections still open
+
+/*
+* Steps a connection goes through. Each step runs until it completes or its socket would block,
+* in which case the connection waits for the next epoll event on one of its sockets.
+*/
+enum connection_state {
+	STATE_CLIENT_RECV, // receiving next request from client
+	STATE_MEMORY_SEND, // sending cached response from mem_object
+	STATE_CACHE_SEND, // sending cached response from cache_file_fd with sendfile
+	STATE_RESOLVE, // waiting for the resolver to look up host
+	STATE_ORIGIN_CONNECT, // waiting for a non-blocking connect to one of host's addresses to complete
+	STATE_ORIGIN_SEND, // sending request to host
+	STATE_ORIGIN_RECV, // receiving response from host
+	STATE_CLIENT_SEND, // sending buffer to client, then moving on to next_state
+	STATE_SPLICE_RELAY, // moving an uncached response body from host to client through pipe_fds
+	STATE_FILL_FOLLOW, // sending a response another connection is fetching as it reaches its temp cache_file
+	STATE_ENCODE_SEND, // having the next part of the cached response in mem_object or cache_file_fd compressed into encoded
+	STATE_WORK_WAIT, // waiting for work handed to the worker pool, then sending encoded to client and moving on to next_state
+	STATE_DONE // connection closed, waiting to be freed
+};
+
+enum step_result {
+	STEP_CONTINUE, // run the next step right away
+	STEP_WAIT, // socket would block, wait for the next event
+	STEP_DONE // close the connection
+};
+
+/*
+* Per-connection state for a client connection and the request currently being proxied on it.
+*/
+struct connection {
+	struct connection * prev; // in the client_list of its reactor
+	struct connection * next;
+	struct event_handler client_handler;
+	struct event_handler host_handler;
+	struct reactor * reactor;
+	enum connection_state state;
+	enum connection_state next_state; // state to move to once buffer is sent to client
+	int client_socket_fd;
+	uint32_t client_addr; // IPv4 address of client, in network byte order
+	int host_socket_fd;
+	int race_socket_fd; // second connect attempt racing host_socket_fd, to another address
+	struct event_handler race_handler;
+	struct timer connect_timer; // starts the next connect attempt if the current one is slow
+	struct resolver_waiter resolver_waiter;
+	bool resolving; // resolver_waiter is registered and not yet posted
+	struct resolver_result host_addrs;
+	int next_addr; // index of the next address of host_addrs to try
+	int cache_file_fd;
+	off_t cache_file_offset; // bytes of cache_file_fd already sent
+	off_t cache_file_size;
+	int pipe_fds[2]; // pipe for splicing host data to client, created on first use
+	int pipe_bytes; // bytes spliced into the pipe not yet spliced out to client
+	struct timer idle_timer; // closes the connection if client sends no request in time
+	char * client_buffer; // data received from client not yet processed, BUFFER_SIZE bytes from the reactor's buffer_pool
+	int client_buffer_len;
+	struct http_parser client_parser; // finds the end of the request at the start of client_buffer
+	bool client_keep_alive; // keep the client connection open after this response
+	bool has_range; // request asks for the single byte range in range
+	struct http_range range;
+	char host[256];
+	char * uri; // cache key of the request, in arena
+	int port;
+	struct arena arena; // per-request allocations, released when the request completes
+	char * request; // request to send to host, in arena
+	int request_len;
+	int conditionals_at; // offset in request of the client's conditional fields, which revalidation replaces
+	struct http_message * client_request; // the request as parsed from client, moved to a copy of its head in arena
+	int request_sent;
+	char * buffer; // buffer for sending/receiving data, BUFFER_SIZE bytes from the buffer_pool while a request is served
+	int buffer_len; // bytes of data in buffer
+	int buffer_sent; // bytes of buffer already sent
+	bool host_reused; // host_socket_fd came from the upstream pool
+	bool is_first_read;
+	struct http_parser response_parser; // finds the end of the response headers in buffer
+	struct body_framer framer; // tracks where the response body from host ends
+	bool abort_caching;
+	char temp_cache_filename[TEMP_FILENAME_SIZE]; // until the response is handed to cache_write
+	struct cache_write * cache_write; // writes the response to the temp cache_file, NULL if it is not cached
+	int cache_write_skip; // bytes at the start of buffer not to cache, the head of a response cached as a byte range
+	enum content_encoding encoding; // the response is compressed with, if it can be
+	char * variant_uri; // cache key of the response compressed with encoding, in arena
+	struct encoder * encoder; // compresses the response body, NULL if the response is sent as it is
+	char * encoded; // compressed response to send to client in place of buffer
+	int encoded_len;
+	int encoded_cap;
+	bool encode_failed; // encoded could not grow, the encoder failed or the cached response could not be read
+	int body_start; // where in buffer the response body received from host starts
+	struct work work; // compresses the next part of the response on a worker thread
+	struct cache_write * variant_write; // writes the compressed response to a temp cache_file, NULL if it is not cached
+	struct mem_object * mem_object; // response being sent from the memory cache
+	size_t mem_object_sent;
+	size_t mem_object_end; // bytes of mem_object to send up to
+	char * memory_fill; // copy of the response being cached, put in the memory cache when complete
+	size_t memory_fill_len;
+	size_t memory_fill_cap;
+	bool memory_fill_abort; // response is too large for the memory cache
+	struct cache_fill * fill; // fetch of uri this connection leads or follows
+	bool is_fill_leader;
+	struct fill_waiter fill_waiter;
+	struct cache_meta cache_meta; // freshness of the response being cached or revalidated
+	bool revalidating; // request carries the validators of a stale cached response
+	struct limiter_entry * client_limit; // limiter entries the request is counted in while it is at host
+	struct limiter_entry * host_limit;
+	bool admitted; // the request passed the limits and is counted in client_limit and host_limit
+	uint64_t connect_start_us; // when connecting to host started
+	uint64_t request_sent_us; // when the request was sent to host
+	uint64_t first_byte_us; // when the response from host started
+};
+
+/*
+* Reads a cache_file into the memory cache on a worker thread, off the reactor serving it.
+*/
+struct promotion {
+	struct work work;
+	char * key;
+	int fd; // own descriptor on the cache_file
+	off_t size;
+};
+
+/*
+* The client connections of one reactor, so a drain can find the idle ones.
+*/
+struct client_list {
+	struct connection * first;
+	int count; // also read by the main thread while draining
+	struct reactor_post drain_post;
+};
 
 void print_usage_and_exit();
-int start_server(int port);
-void handle_new_client(int client_socket_fd);
-void process_request(char buffer[], int client_socket_fd);
-int count_colons(char* string);
-void use_proxy(char* host, char* uri, char buffer[], int port, int client_socket_fd);
-void print_buffer(char buffer[]);
-void * connection_handler(void * server_socket_fd);
-void send_error_msg_and_close(char buffer[], int client_socket_fd);
-void parse_status_code(char * dest, const char * response);
-bool valid_status_code(const char * status_code);
-void get_first_line(char * dest, const char * response);
-bool using_chunked_encoding(char response[]);
+int parse_limit(char * arg);
+int start_server(int port, enum reactor_backend backend);
+int wait_for_shutdown(struct reactor * reactors, int num_reactors);
+void drain(struct reactor * reactors, int num_reactors, int successor_fd);
+void on_drain(struct reactor * reactor, struct reactor_post * post);
+int count_clients(int num_reactors);
+void handle_new_client(struct reactor * reactor, int client_socket_fd, uint32_t client_addr);
+void on_client_event(struct reactor * reactor, struct event_handler * handler, uint32_t events);
+void on_host_event(struct reactor * reactor, struct event_handler * handler, uint32_t events);
+void on_race_event(struct reactor * reactor, struct event_handler * handler, uint32_t events);
+void drive_connection(struct connection * conn);
+void close_connection(struct connection * conn);
+void free_connection(void * ptr);
+void release_request(struct connection * conn);
+void on_idle_timeout(struct reactor * reactor, struct timer * timer);
+void on_fill_progress(struct reactor * reactor, struct reactor_post * post);
+void on_resolved(struct reactor * reactor, struct reactor_post * post);
+void on_connect_timeout(struct reactor * reactor, struct timer * timer);
+void on_work_done(struct reactor * reactor, struct reactor_post * post);
+void release_fill(struct connection * conn, bool complete);
+enum step_result client_recv(struct connection * conn);
+enum step_result process_request(struct connection * conn, const struct http_message * request);
+enum step_result lookup_cache(struct connection * conn, bool no_cache);
+bool open_cached_response(struct connection * conn);
+bool open_cached_file(struct connection * conn, char * key);
+bool variant_is_usable(struct connection * conn);
+void open_encoded_response(struct connection * conn);
+void open_cached_range(struct connection * conn);
+bool open_partial_response(struct connection * conn);
+int add_validators(struct connection * conn, const struct cache_meta * meta);
+enum step_result fetch_or_follow(struct connection * conn);
+enum step_result use_proxy(struct connection * conn);
+const char * admit_request(struct connection * conn);
+enum step_result connect_to_host(struct connection * conn);
+enum step_result resolve_host(struct connection * conn);
+bool start_connect_attempt(struct connection * conn);
+int check_connect_attempt(int socket_fd);
+enum step_result retry_with_new_connection(struct connection * conn);
+enum step_result finish_response(struct connection * conn);
+enum step_result finish_revalidation(struct connection * conn, const struct http_message * response);
+enum step_result finish_request(struct connection * conn);
+enum step_result origin_connect(struct connection * conn);
+enum step_result origin_send(struct connection * conn);
+enum step_result origin_recv(struct connection * conn);
+struct cache_write * begin_range_write(struct connection * conn, const struct http_message * response);
+enum step_result client_send(struct connection * conn);
+enum step_result cache_send(struct connection * conn);
+enum step_result memory_send(struct connection * conn);
+enum step_result splice_relay(struct connection * conn);
+enum step_result fill_follow(struct connection * conn);
+enum step_result encode_send(struct connection * conn);
+enum step_result submit_work(struct connection * conn, void (*run)(struct work *), enum connection_state next_state);
+void compress_received(struct work * work);
+void compress_cached(struct work * work);
+bool start_encoding(struct connection * conn, const char * head, int head_len, bool cache);
+void encode_payload(void * arg, const char * data, int len);
+void emit_encoded_chunk(void * arg, const char * data, int len);
+void flush_encoder(struct connection * conn, bool finish);
+void append_encoded(struct connection * conn, const char * data, int len);
+void cache_encoded(struct connection * conn);
+bool can_splice_response(struct connection * conn);
+void promote_cache_file(struct connection * conn, const char * key);
+void run_promotion(struct work * work);
+void append_memory_fill(struct connection * conn, const char * data, int len);
+bool response_is_delimited(const char * response, int len);
+enum step_result send_error_msg_and_close(struct connection * conn, const char * msg);
+int append_header_fields(char * dest, int dest_len, int dest_size, const struct http_message * message, bool conditionals);
+bool is_hop_by_hop_field(struct http_slice name);
+bool is_conditional_field(struct http_slice name);
+bool valid_status_code(int status_code);
 
 bool blacklist_enabled = false;
+bool compression_enabled = false; // compress responses for clients that accept gzip or brotli
+char * upgrade_path = NULL; // unix socket a new proxy takes over from this one through
+int predecessor_fd = -1; // connection to the proxy this one takes over from
+int drain_seconds = UPGRADE_DRAIN_SECONDS;
+bool draining = false; // connections are closed once their response is sent
+struct client_list * client_lists; // indexed by reactor id
 
 /**
-* Processes command line args (port, blacklist file) and starts proxy server.
+* Processes command line args (cache size, event backend, log level, stats port, upgrade socket, drain time, compression, limits, port, blacklist file) and starts proxy server.
 */
 int main(int argc, char **argv) {
-	if (argc < 2 || argc > 3) {
+	long long cache_budget = CACHE_DISK_BUDGET_BYTES;
+	int opt;
+	enum reactor_backend backend = REACTOR_EPOLL;
+	int stats_port = 0;
+	while (-1 != (opt = getopt(argc, argv, "c:b:l:s:u:d:zr:"))) {
+		switch (opt) {
+		case 'c':
+			cache_budget = atoll(optarg) * 1024 * 1024;
+			break;
+		case 'b':
+			if (0 == strcmp(optarg, "io_uring")) {
+				backend = REACTOR_IO_URING;
+			} else if (0 != strcmp(optarg, "epoll")) {
+				print_usage_and_exit();
+			}
+			break;
+		case 'l':
+			if (-1 == parse_log_level(optarg, &log_level)) {
+				print_usage_and_exit();
+			}
+			break;
+		case 's':
+			stats_port = atoi(optarg);
+			break;
+		case 'u':
+			upgrade_path = optarg;
+			break;
+		case 'd':
+			drain_seconds = atoi(optarg);
+			break;
+		case 'z':
+			compression_enabled = true;
+			break;
+		case 'r':
+			if (-1 == parse_limit(optarg)) {
+				print_usage_and_exit();
+			}
+			break;
+		default:
+			print_usage_and_exit();
+		}
+	}
+	if (argc - optind < 1 || argc - optind > 2) {
 		print_usage_and_exit();
 	}
-	
-	if (argc == 3) {
+
+	// SIGTERM and SIGINT stop the proxy gracefully; only the main thread takes them
+	sigset_t mask;
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGTERM);
+	sigaddset(&mask, SIGINT);
+	pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+	// a proxy already running here shares the cache directory until it has drained
+	if (NULL != upgrade_path) {
+		predecessor_fd = upgrade_connect(upgrade_path);
+		if (-1 != predecessor_fd) {
+			journal_hold_checkpoints();
+		}
+	}
+
+	if (argc - optind == 2) {
 		// Process blacklist file
-		if (-1 == read_blacklist_file(argv[2])) {
-			printf("Error opening/reading blacklist file %s.\n", argv[2]);
+		if (-1 == read_blacklist_file(argv[optind + 1])) {
+			log_error("Error opening/reading blacklist file %s.\n", argv[optind + 1]);
 			return -1;
 		}
 		blacklist_enabled = true;
-		printf("Finished reading blacklist file.\n");
+		log_info("Finished reading blacklist file.\n");
+		if (-1 == watch_blacklist_file(argv[optind + 1])) {
+			return -1;
+		}
 	}
 
 	// Create cache directory
-	create_cache();
-	printf("Cache created\n");
+	if (-1 == create_cache(cache_budget)) {
+		return -1;
+	}
+	log_info("Cache created\n");
+
+	if (-1 == create_resolver()) {
+		return -1;
+	}
+
+	if (-1 == create_cache_writer()) {
+		return -1;
+	}
+
+	if (0 != stats_port && -1 == start_stats_server(stats_port)) {
+		return -1;
+	}
 
 	// get port the proxy server will listen on
-	int port_to_listen_on = atoi(argv[1]);
+	int port_to_listen_on = atoi(argv[optind]);
 
-	// start the proxy server 
-	return start_server(port_to_listen_on);
+	// start the proxy server
+	return start_server(port_to_listen_on, backend);
 }
 
 
 /**
-* Start the proxy server by creating a socket and listening for connections on given port.
-* If connection is accepted, will forward requests from client to host and forward data
-* from host to client.
-*/
-int start_server(int port) {
-	printf("Proxy server is using port %d\n", port); 
-
-	// Create the TCP socket
-	int socket_fd; 	// socket file descriptor
-	socket_fd = socket(AF_INET, SOCK_STREAM, 0);
-	if (-1 == socket_fd) {
-		printf("Failed to create socket\n");
-		return -1;
+* Start the proxy server with one reactor thread per core. Each reactor listens on port with its
+* own SO_REUSEPORT socket and drives all of its connections from a single epoll loop, forwarding
+* requests from clients to hosts and data from hosts to clients. Compression and reading cache
+* files into memory run on a pool of worker threads alongside them. When taking over from a
+* running proxy, its listening sockets are used instead. Returns once the proxy has stopped.
+*/
+int start_server(int port, enum reactor_backend backend) {
+	log_info("Proxy server is using port %d\n", port);
+
+	long num_reactors = sysconf(_SC_NPROCESSORS_ONLN);
+	if (num_reactors < 1) {
+		num_reactors = 1;
+	}
+
+	// the listeners of the proxy being replaced, with whatever connections are waiting on them
+	int listen_fds[UPGRADE_MAX_LISTENERS];
+	int num_inherited = 0;
+	if (-1 != predecessor_fd) {
+		num_inherited = upgrade_receive_listeners(predecessor_fd, listen_fds, UPGRADE_MAX_LISTENERS);
+		if (-1 == num_inherited) {
+			return -1;
+		}
+		if (num_inherited > num_reactors) {
+			num_reactors = num_inherited;
+		}
 	}
-	
-	// Bind the socket to the port
-	struct sockaddr_in server;
-	server.sin_family = AF_INET;
-	server.sin_port = htons(port);
-	server.sin_addr.s_addr = INADDR_ANY; // use my IPv4 address
-	
-	if (bind(socket_fd, (struct sockaddr *) &server, sizeof(server)) < 0) {
-		printf("Failed to bind socket\n");
+
+	// CPU and disk bound work is taken off the reactors by as many workers
+	if (-1 == create_worker_pool(num_reactors)) {
 		return -1;
 	}
-	
-	// Listen for incoming connection
-	if (-1 == listen(socket_fd, 10)) {
-		printf("Failed to listen for incoming connections\n");
+
+	struct reactor * reactors = (struct reactor *) calloc(num_reactors, sizeof(struct reactor));
+	client_lists = (struct client_list *) calloc(num_reactors, sizeof(struct client_list));
+	if (NULL == reactors || NULL == client_lists) {
+		log_error("Failed to allocate reactors\n");
 		return -1;
 	}
-	
-	// Create worker threads 
-	pthread_t tid[NUM_THREADS];
+
+	// Create a listener and event loop per core
+	int i;
+	for (i = 0; i < num_reactors; i++) {
+		int socket_fd = (i < num_inherited) ? listen_fds[i] : create_listener(port);
+		if (-1 == socket_fd || -1 == set_nonblocking(socket_fd)) {
+			return -1;
+		}
+		post_init(&client_lists[i].drain_post, &on_drain);
+		if (-1 == reactor_init(&reactors[i], i, socket_fd, backend, &handle_new_client)) {
+			return -1;
+		}
+		reactors[i].upstream_pool = create_upstream_pool(&reactors[i]);
+		if (NULL == reactors[i].upstream_pool) {
+			log_error("Failed to create upstream connection pool\n");
+			return -1;
+		}
+		reactors[i].buffer_pool = create_buffer_pool(BUFFER_SIZE, POOL_MAX_IDLE_BUFFERS);
+		reactors[i].connection_pool = create_buffer_pool(sizeof(struct connection), POOL_MAX_IDLE_CONNECTIONS);
+		if (NULL == reactors[i].buffer_pool || NULL == reactors[i].connection_pool) {
+			log_error("Failed to create buffer pools\n");
+			return -1;
+		}
+		reactors[i].stats = create_stats();
+		if (NULL == reactors[i].stats) {
+			log_error("Failed to create stats\n");
+			return -1;
+		}
+	}
+
+	// Create reactor threads
 	int err;
-	int i = 0;
-	while (i < NUM_THREADS) {
-		err = pthread_create(&tid[i], NULL, &connection_handler, (void *) &socket_fd);
+	for (i = 0; i < num_reactors; i++) {
+		err = pthread_create(&reactors[i].tid, NULL, &reactor_run, (void *) &reactors[i]);
 		if (0 != err) {
-			printf("Error creating thread %d with error number %d\n", i, err);
+			log_error("Error creating thread %d with error number %d\n", i, err);
 		}
-		i++;
 	}
-	for (i = 0; i < NUM_THREADS; i++) {
-		pthread_join(tid[i], NULL);
-	}
-		
-	printf("Waiting for incoming connection...\n");
-	
+	log_info("Waiting for incoming connection...\n");
 
-	
+	int successor_fd = wait_for_shutdown(reactors, num_reactors);
+	drain(reactors, num_reactors, successor_fd);
 	return 0;
 }
 
-/**
-* Handles accepting a connection from a client.
+/*
+* Runs on the main thread while the reactors serve. Finishes taking over from the previous proxy
+* once it is done, and waits for SIGTERM or SIGINT, or for a new proxy to take over. Returns the
+* connection to the new proxy, which has been handed the listeners, or -1 when stopping.
 */
-void * connection_handler(void * server_socket_fd) {
-	// Accept connection
+int wait_for_shutdown(struct reactor * reactors, int num_reactors) {
+	sigset_t mask;
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGTERM);
+	sigaddset(&mask, SIGINT);
+	int signal_fd = signalfd(-1, &mask, SFD_CLOEXEC);
+	int upgrade_fd = (NULL == upgrade_path) ? -1 : upgrade_listen(upgrade_path);
+
 	while (true) {
-		struct sockaddr_in client_addr;
-		int client_addr_size = sizeof(client_addr);
-		int client_socket_fd;
-		client_socket_fd = accept(*(int *) server_socket_fd, (struct sockaddr *) &client_addr, &client_addr_size);
-		if (-1 == client_socket_fd) {
-			printf("Failed to accept incoming connection\n");
-		} else {
-			printf("Established a new connection.\n");
-			handle_new_client(client_socket_fd);
+		// fds of -1 are ignored by poll
+		struct pollfd fds[3] = { { signal_fd, POLLIN, 0 }, { upgrade_fd, POLLIN, 0 }, { predecessor_fd, POLLIN, 0 } };
+		if (-1 == poll(fds, 3, -1)) {
+			if (EINTR == errno) {
+				continue;
+			}
+			log_error("Waiting for shutdown failed: %s\n", strerror(errno));
+			return -1;
+		}
+		if (fds[2].revents) {
+			// the previous proxy closes the connection once it has drained
+			upgrade_finish(predecessor_fd);
+			predecessor_fd = -1;
+		}
+		if (fds[0].revents & POLLIN) {
+			struct signalfd_siginfo info;
+			if (sizeof(info) == read(signal_fd, &info, sizeof(info))) {
+				log_info("Received signal %d, shutting down.\n", (int) info.ssi_signo);
+				if (-1 != upgrade_fd) {
+					close(upgrade_fd);
+					unlink(upgrade_path);
+				}
+				return -1;
+			}
+		}
+		if (fds[1].revents & POLLIN) {
+			int successor_fd = accept4(upgrade_fd, NULL, NULL, SOCK_CLOEXEC);
+			if (-1 == successor_fd) {
+				continue;
+			}
+			int listen_fds[UPGRADE_MAX_LISTENERS];
+			int num_listeners = 0;
+			int i;
+			for (i = 0; i < num_reactors && num_listeners < UPGRADE_MAX_LISTENERS; i++) {
+				listen_fds[num_listeners++] = reactors[i].listen_fd;
+			}
+			// the new proxy owns the index from now on, this one only adds to the journal
+			journal_hold_checkpoints();
+			if (-1 == upgrade_send_listeners(successor_fd, listen_fds, num_listeners)) {
+				close(successor_fd);
+				continue;
+			}
+			close(upgrade_fd);
+			return successor_fd;
 		}
-		printf("Waiting for incoming connection...\n");
 	}
 }
 
-/**
-* Send error message to client and close connection.
+/*
+* Stops accepting connections and waits up to drain_seconds for the open ones to finish, then
+* makes sure the responses cached so far are stored. The cache is then handed to successor_fd,
+* or checkpointed if there is no successor.
 */
-void send_error_msg_and_close(char buffer[], int client_socket_fd) {
-	send(client_socket_fd, buffer, strlen(buffer), 0);
-	close(client_socket_fd);
-}	
+void drain(struct reactor * reactors, int num_reactors, int successor_fd) {
+	__atomic_store_n(&draining, true, __ATOMIC_SEQ_CST);
+	int i;
+	for (i = 0; i < num_reactors; i++) {
+		reactor_post(&reactors[i], &client_lists[i].drain_post);
+	}
+
+	uint64_t deadline = monotonic_ms() + (uint64_t) drain_seconds * 1000;
+	int num_clients;
+	while (0 != (num_clients = count_clients(num_reactors)) && monotonic_ms() < deadline) {
+		usleep(DRAIN_POLL_MS * 1000);
+	}
+	if (0 != num_clients) {
+		log_info("Drain time is up, dropping %d client connections.\n", num_clients);
+	}
 
+	// responses completed while draining are still being written
+	cache_writer_flush();
+	if (-1 != successor_fd) {
+		upgrade_send_memcache(successor_fd);
+	} else if (-1 == predecessor_fd) {
+		journal_checkpoint();
+	}
+	log_info("Proxy server stopped.\n");
+}
 
 /*
-* Receives request from new client and processes it.
+* Called on each reactor when draining starts. Stops accepting connections and closes the ones
+* waiting for their next request; the others are closed once their response is sent.
 */
-void handle_new_client(int client_socket_fd) {
-	char buffer[BUFFER_SIZE]; // buffer for sending/receiving data
-	memset(buffer, 0, BUFFER_SIZE);
-	
-	int recv_data = recv(client_socket_fd, buffer, BUFFER_SIZE, 0);
-	if (-1 == recv_data) {
-		printf("Error receiving data from client.\n");
-		close(client_socket_fd);
-		return;
+void on_drain(struct reactor * reactor, struct reactor_post * post) {
+	reactor_stop_listening(reactor);
+	struct connection * conn = client_lists[reactor->id].first;
+	while (NULL != conn) {
+		struct connection * next = conn->next;
+		if (STATE_CLIENT_RECV == conn->state && 0 == conn->client_buffer_len) {
+			close_connection(conn);
+		}
+		conn = next;
 	}
-	if (0 == recv_data) {
-		printf("Client closed connection.\n");
-		return;
+}
+
+/*
+* Returns the number of client connections still open on all reactors
+*/
+int count_clients(int num_reactors) {
+	int num_clients = 0;
+	int i;
+	for (i = 0; i < num_reactors; i++) {
+		num_clients += __atomic_load_n(&client_lists[i].count, __ATOMIC_RELAXED);
 	}
-	//printf("%s%s%s", "Received request:\n", buffer, "\n");
-	process_request(buffer, client_socket_fd);
+	return num_clients;
 }
 
 /*
-* Process request if request is valid HTTP request.
+* Sets up the state for a new client connection and registers it with reactor.
 */
-void process_request(char buffer[], int client_socket_fd) {	
-	char buffer_copy[BUFFER_SIZE];
-	strcpy(buffer_copy, buffer);
-	
-	// parse buffer for header, URI, protocol 
-	char header[10], URI[BUFFER_SIZE], protocol[10];
-	if (3 != sscanf(buffer_copy, "%s %s %s", &header, &URI, &protocol)) {
-		memset(buffer, 0, BUFFER_SIZE);
-		sprintf(buffer, "405 Method Not Allowed. Request not in correct format 'GET absoluteURI[:port] HTTP/1.1'. Note: only GET is allowed.\n");
-		send_error_msg_and_close(buffer, client_socket_fd);
+void handle_new_client(struct reactor * reactor, int client_socket_fd, uint32_t client_addr) {
+	log_debug("Established a new connection.\n");
+	struct connection * conn = (struct connection *) pool_get(reactor->connection_pool);
+	char * client_buffer = (char *) pool_get(reactor->buffer_pool);
+	if (NULL == conn || NULL == client_buffer) {
+		log_error("Failed to allocate connection.\n");
+		close(client_socket_fd);
+		pool_put(reactor->connection_pool, conn);
+		pool_put(reactor->buffer_pool, client_buffer);
 		return;
 	}
-	
-	// Check for GET, HTTP/1.1 in request
-	if (0 != strcmp("GET", header) || 0 != strcmp("HTTP/1.1", protocol)) {
-		memset(buffer, 0, BUFFER_SIZE);
-		sprintf(buffer, "405 Method Not Allowed. Request not in correct format 'GET absoluteURI[:port] HTTP/1.1'. Note: only GET is allowed.\n");
-		send_error_msg_and_close(buffer, client_socket_fd);
+	conn->client_handler.on_event = &on_client_event;
+	conn->host_handler.on_event = &on_host_event;
+	conn->race_handler.on_event = &on_race_event;
+	conn->reactor = reactor;
+	conn->state = STATE_CLIENT_RECV;
+	conn->next_state = STATE_DONE;
+	conn->client_socket_fd = client_socket_fd;
+	conn->client_addr = client_addr;
+	conn->host_socket_fd = -1;
+	conn->race_socket_fd = -1;
+	timer_init(&conn->connect_timer, &on_connect_timeout);
+	post_init(&conn->resolver_waiter.post, &on_resolved);
+	conn->resolver_waiter.reactor = reactor;
+	conn->resolving = false;
+	conn->cache_file_fd = -1;
+	conn->cache_file_offset = 0;
+	conn->cache_file_size = 0;
+	conn->pipe_fds[0] = -1;
+	conn->pipe_fds[1] = -1;
+	conn->pipe_bytes = 0;
+	timer_init(&conn->idle_timer, &on_idle_timeout);
+	conn->client_buffer = client_buffer;
+	conn->client_buffer_len = 0;
+	http_parser_init(&conn->client_parser);
+	conn->client_keep_alive = false;
+	conn->has_range = false;
+	conn->host[0] = '\0';
+	conn->uri = NULL;
+	conn->port = DEFAULT_PORT;
+	arena_init(&conn->arena, reactor->buffer_pool);
+	conn->request = NULL;
+	conn->client_request = NULL;
+	conn->request_len = 0;
+	conn->conditionals_at = 0;
+	conn->request_sent = 0;
+	conn->buffer = NULL;
+	conn->buffer_len = 0;
+	conn->buffer_sent = 0;
+	conn->host_reused = false;
+	conn->is_first_read = true;
+	http_parser_init(&conn->response_parser);
+	conn->abort_caching = false;
+	conn->temp_cache_filename[0] = '\0';
+	conn->cache_write = NULL;
+	conn->cache_write_skip = 0;
+	conn->encoding = ENCODING_IDENTITY;
+	conn->variant_uri = NULL;
+	conn->encoder = NULL;
+	conn->encoded = NULL;
+	conn->encoded_len = 0;
+	conn->encoded_cap = 0;
+	conn->encode_failed = false;
+	conn->body_start = 0;
+	conn->variant_write = NULL;
+	conn->mem_object = NULL;
+	conn->mem_object_sent = 0;
+	conn->mem_object_end = 0;
+	conn->memory_fill = NULL;
+	conn->memory_fill_len = 0;
+	conn->memory_fill_cap = 0;
+	conn->memory_fill_abort = false;
+	conn->fill = NULL;
+	conn->is_fill_leader = false;
+	post_init(&conn->fill_waiter.post, &on_fill_progress);
+	conn->fill_waiter.reactor = reactor;
+	conn->revalidating = false;
+	conn->client_limit = NULL;
+	conn->host_limit = NULL;
+	conn->admitted = false;
+	conn->connect_start_us = 0;
+	conn->request_sent_us = 0;
+	conn->first_byte_us = 0;
+
+	// sockets are registered once for both directions; the current state decides what to do
+	if (-1 == reactor_add(reactor, client_socket_fd, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET | REACTOR_RECV, &conn->client_handler)) {
+		log_error("Failed to register client connection.\n");
+		close(client_socket_fd);
+		pool_put(reactor->buffer_pool, client_buffer);
+		pool_put(reactor->connection_pool, conn);
 		return;
 	}
-	
-	// ASSUME: URI begins with http:// and does not have more than two colons
-	
-	// parse out port, host if any 
-	char URI_copy[BUFFER_SIZE];
-	strcpy(URI_copy, URI);
-	
-	char host[256];
-	char host_and_request[BUFFER_SIZE];
-	char request[BUFFER_SIZE];
-	char port_as_string[6];
-	int port = DEFAULT_PORT;
-	int num_colons = count_colons(URI);
-	char * strptr;
-	
-	// get host plus request
-	strptr = strtok(URI_copy, ":");
-	strptr = strtok(NULL, ":");
-	strcpy(host, strptr);
-	strcpy(host_and_request, strptr);
-	
-	// get port if given port number
-	if (2 == num_colons) {
-		strptr = strtok(NULL, ":");
-		strcpy(port_as_string, strptr);
-		port = atoi(port_as_string);
-	}		
-	
-	// get host
-	strptr = strtok(host, "//");
-	strcpy(host,strptr);	
-	
-	// if blacklist enabled, check if host is blacklisted
-	if (blacklist_enabled) {
-		printf("checking blacklist...\n");
-		// if host blacklisted, send 403 and close connection
-		if (is_blacklisted(host)) {
-			printf("Host is blacklisted.\nClosing connection to client.\n");
-			memset(buffer, 0, BUFFER_SIZE);
-			sprintf(buffer, "403 Forbidden.\n");
-			send_error_msg_and_close(buffer, client_socket_fd);
-			return;
-		}
+	reactor_timer_add(reactor, &conn->idle_timer, CLIENT_IDLE_TIMEOUT_MS);
+	stats_add(reactor->stats, STAT_CONNECTIONS_OPENED, 1);
+
+	struct client_list * list = &client_lists[reactor->id];
+	conn->prev = NULL;
+	conn->next = list->first;
+	if (NULL != list->first) {
+		list->first->prev = conn;
 	}
-	
-	// get request (2 is for getting rid of leading "//")
-	strcpy(request, host_and_request + 2 + strlen(host));	
-	
-	// Get new buffer copy 
-	memset(buffer_copy, 0, BUFFER_SIZE);
-	strcpy(buffer_copy, buffer);
-	memset(buffer, 0, BUFFER_SIZE);	
-	
-	// Write proper HTTP request into buffer to send to host 
-	sprintf(buffer, "GET %s HTTP/1.1\r\nHost: %s\r\n", request, host);
-	char * request_without_first_line = strchr(buffer_copy, '\n');
-	// Append fields after the GET line, if any 
-	if (NULL != request_without_first_line) {
-		strcat(buffer, ++request_without_first_line);
-	}
-	// Append necessary CLRF
-	strcat(buffer, "\r\n\r\n");
-	
-	// Print out information about request 
-	printf("Host: %s\n", host);
-	printf("Port: %d\n", port);
-	printf("Request: %s\n", request);
-	
-	// Before sending request, check the cache
-	char uri[BUFFER_SIZE];
-	memset(uri, 0, BUFFER_SIZE);
-	strcpy(uri, host_and_request); 
+	list->first = conn;
+	__atomic_store_n(&list->count, list->count + 1, __ATOMIC_RELAXED);
+}
 
-	printf("Check if %s is cached...\n", uri);
-	if (0 == is_request_cached(uri)) {
-		printf("Request is cached, get it from cache!\n");
-		// Fetch from host if error when retrieving from cache
-		if (-1 == get_cache_file_for_request_and_send_to_client(uri, client_socket_fd)) {
-			printf("Fetch from host...\n");
-			use_proxy(host, uri, buffer, port, client_socket_fd);
-		}
-	} else {
-		// send request to host, get response and send to client 
-		printf("Request is NOT cached, ping host!\n");
-		use_proxy(host, uri, buffer, port, client_socket_fd);
+/*
+* Called when a client has not sent a complete request within CLIENT_IDLE_TIMEOUT_MS.
+*/
+void on_idle_timeout(struct reactor * reactor, struct timer * timer) {
+	struct connection * conn = (struct connection *) ((char *) timer - offsetof(struct connection, idle_timer));
+	log_debug("Client connection idle, closing it.\n");
+	close_connection(conn);
+}
+
+/*
+* Called on the connection's reactor when the fill it follows has made progress.
+*/
+void on_fill_progress(struct reactor * reactor, struct reactor_post * post) {
+	struct connection * conn = (struct connection *) ((char *) post - offsetof(struct connection, fill_waiter.post));
+	if (STATE_FILL_FOLLOW == conn->state) {
+		drive_connection(conn);
 	}
 }
 
 /*
-* Creates socket to host server, sends request which is contained in buffer, receives response, sends response back to client.
+* Called on the connection's reactor when the lookup of its host has completed.
 */
-void use_proxy(char* host, char* uri, char buffer[], int port, int client_socket_fd) {
-	
-	// Set up socket to host server 
-	int host_socket_fd;
-	host_socket_fd = socket(AF_INET, SOCK_STREAM, 0);
-	if (-1 == host_socket_fd) {
-		printf("Failed to create socket to host\n");
-		memset(buffer, 0, BUFFER_SIZE);
-		sprintf(buffer, "Internal Error 500.\n");
-		send_error_msg_and_close(buffer, client_socket_fd);
-		return;
-	}	
-	 
-	struct sockaddr_in host_addr;
-	host_addr.sin_family = AF_INET;
-	host_addr.sin_port = htons(port);
-	
-	// resolve ip address of host
-	struct hostent *host_entry;
-	host_entry = gethostbyname(host);
-	if (NULL == host_entry) {
-		printf("Failed to resolve host.\n"); 
-		memset(buffer, 0, BUFFER_SIZE);
-		sprintf(buffer, "404 Not Found. Failed to resolve host.\n");
-		send_error_msg_and_close(buffer, client_socket_fd);
-		return;
+void on_resolved(struct reactor * reactor, struct reactor_post * post) {
+	struct connection * conn = (struct connection *) ((char *) post - offsetof(struct connection, resolver_waiter.post));
+	conn->resolving = false;
+	if (STATE_RESOLVE == conn->state) {
+		drive_connection(conn);
 	}
-	bcopy(host_entry->h_addr, &host_addr.sin_addr.s_addr, host_entry->h_length);
-	
-	// connect to host server 
-	if (-1 == connect(host_socket_fd, (const struct sockaddr *) &host_addr, sizeof(struct sockaddr))) {
-		printf("Failed to connect to host server.\n");
-		memset(buffer, 0, BUFFER_SIZE);
-		sprintf(buffer, "502 Bad Gateway.\n");
-		send_error_msg_and_close(buffer, client_socket_fd);		
+}
+
+/*
+* Called when a connect attempt has not completed within HAPPY_EYEBALLS_DELAY_MS. The next
+* address of host is tried alongside it.
+*/
+void on_connect_timeout(struct reactor * reactor, struct timer * timer) {
+	struct connection * conn = (struct connection *) ((char *) timer - offsetof(struct connection, connect_timer));
+	if (STATE_ORIGIN_CONNECT != conn->state || -1 != conn->race_socket_fd) {
 		return;
 	}
-	printf("Connected to host server.\n");
-	
-	// send request 
-	if (-1 == send(host_socket_fd, buffer, strlen(buffer), 0)) {
-		printf("Failed to send request to host server.\n");
-		memset(buffer, 0, BUFFER_SIZE);
-		sprintf(buffer, "500 Internal Server Error.\n");
-		send_error_msg_and_close(buffer, client_socket_fd);				
+	if (start_connect_attempt(conn)) {
+		log_debug("Connect to host is slow, trying its next address as well.\n");
+		reactor_timer_add(reactor, &conn->connect_timer, HAPPY_EYEBALLS_DELAY_MS);
+	}
+}
+
+/*
+* Called on the connection's reactor when the work it handed to the worker pool is done.
+*/
+void on_work_done(struct reactor * reactor, struct reactor_post * post) {
+	struct connection * conn = (struct connection *) ((char *) post - offsetof(struct connection, work.done));
+	if (conn->encode_failed) {
+		log_debug("Failed to compress response.\n");
+		close_connection(conn);
 		return;
 	}
-	printf("Sent request to host.\n");
-	
-	// receive response and send to client
-	int num_bytes_read;
-	bool is_first_read;
-	is_first_read = true;
-	int sum = 0;
-	int abort_caching = false;
+	conn->buffer_sent = 0;
+	conn->state = STATE_CLIENT_SEND;
+	drive_connection(conn);
+}
 
-	// generate temp cache_file filename: temp_xxx, where xxx is a random int
-	char temp_cache_filename[sizeof(char) * (14 + sizeof(RAND_MAX))];
-	generate_random_temp_filename(temp_cache_filename);
+/*
+* Called by the reactor when the client socket of a connection is ready.
+*/
+void on_client_event(struct reactor * reactor, struct event_handler * handler, uint32_t events) {
+	struct connection * conn = (struct connection *) ((char *) handler - offsetof(struct connection, client_handler));
+	drive_connection(conn);
+}
 
-	do {
-		memset(buffer, 0, BUFFER_SIZE);
-		// receive response
-		num_bytes_read = recv(host_socket_fd, buffer, BUFFER_SIZE, 0);
-		if (-1 == num_bytes_read && is_first_read) {
-			printf("Failed to receive response from host server.\n");
-			memset(buffer, 0, BUFFER_SIZE);
-			sprintf(buffer, "500 Internal Server Error.\n");
-			send_error_msg_and_close(buffer, client_socket_fd);	
-			return;
-		}
-		
-		// On first read, parse status code from first line 
-		if (is_first_read) {	
-		
-			char first_line[NUM_BYTES_PARSE_STATUS_CODE];
-			get_first_line(first_line, buffer);
-		
-			char status_code[NUM_BYTES_PARSE_STATUS_CODE];
-			parse_status_code(status_code, first_line);
-			
-			is_first_read = false;
-
-			// print status code to server
-			printf("%s\n", first_line);
-
-			if (!valid_status_code(status_code)) {
-				memset(buffer, 0, BUFFER_SIZE);
-				sprintf(buffer, "%s\n", first_line);
-				send_error_msg_and_close(buffer, client_socket_fd);
-				return;
-			}
+/*
+* Called by the reactor when the host socket of a connection is ready.
+*/
+void on_host_event(struct reactor * reactor, struct event_handler * handler, uint32_t events) {
+	struct connection * conn = (struct connection *) ((char *) handler - offsetof(struct connection, host_handler));
+	drive_connection(conn);
+}
 
-			// print whether using chunked encoding
-			if (using_chunked_encoding(buffer)) {
-				printf("Using chunked encoding.\n");
-			} else {
-				printf("Not using chunked encoding.\n");
-			}
-		}
-		
-		printf("Response received from host.\n");
-		// send to client 
-		if (-1 == send(client_socket_fd, buffer, strlen(buffer), 0)) {
-			printf("Failed to send response to client.\n");
-			sprintf(buffer, "503 Service Unavailable.");
-			send_error_msg_and_close(buffer, client_socket_fd);
-			return;
-		}
-		printf("Sent data to client.\n");
-		// cache response
-		// Abort caching this request if error occurs in cache file create|write
-		if (!abort_caching) {
-			if (-1 == create_cache_file_for_request(uri, buffer, temp_cache_filename, (0 == num_bytes_read || -1 == num_bytes_read))) {
-				abort_caching = true;
-			}
-		}
+/*
+* Called by the reactor when the second connect attempt of a connection is ready.
+*/
+void on_race_event(struct reactor * reactor, struct event_handler * handler, uint32_t events) {
+	struct connection * conn = (struct connection *) ((char *) handler - offsetof(struct connection, race_handler));
+	drive_connection(conn);
+}
 
-		if (0 == num_bytes_read) {
-			printf("Host has closed the connection.\n");
-			memset(buffer, 0, BUFFER_SIZE);
+/*
+* Runs steps of the connection's state machine until one would block or the connection is done.
+*/
+void drive_connection(struct connection * conn) {
+	enum step_result result;
+	do {
+		switch (conn->state) {
+		case STATE_CLIENT_RECV:
+			result = client_recv(conn);
+			break;
+		case STATE_MEMORY_SEND:
+			result = memory_send(conn);
+			break;
+		case STATE_CACHE_SEND:
+			result = cache_send(conn);
+			break;
+		case STATE_RESOLVE:
+			result = resolve_host(conn);
+			break;
+		case STATE_ORIGIN_CONNECT:
+			result = origin_connect(conn);
+			break;
+		case STATE_ORIGIN_SEND:
+			result = origin_send(conn);
+			break;
+		case STATE_ORIGIN_RECV:
+			result = origin_recv(conn);
+			break;
+		case STATE_CLIENT_SEND:
+			result = client_send(conn);
+			break;
+		case STATE_SPLICE_RELAY:
+			result = splice_relay(conn);
+			break;
+		case STATE_FILL_FOLLOW:
+			result = fill_follow(conn);
 			break;
+		case STATE_ENCODE_SEND:
+			result = encode_send(conn);
+			break;
+		case STATE_WORK_WAIT:
+			result = STEP_WAIT; // on_work_done drives the connection again
+			break;
+		default:
+			return; // already closed; stale event from the current batch
 		}
+	} while (STEP_CONTINUE == result);
 
-		// keep track of bytes received
-		sum = sum + num_bytes_read;
-		//printf("Bytes received so far:	%d bytes\n", sum);
-	} while (num_bytes_read > 0);	
-
-	//printf("Total bytes received: %d\n", sum);
-	
-	// Close connection to host 
-	close(host_socket_fd);
-	printf("Closing connection to host.\n");
-	
-	// Close connection to client 
-	close(client_socket_fd);
-	printf("Closing connection to client.\n");
+	if (STEP_DONE == result) {
+		close_connection(conn);
+	}
 }
 
-/**
-* Returns true if using chunked encoding, otherwise false.
+/*
+* Closes every descriptor held by the connection and frees it after the current event batch.
 */
-bool using_chunked_encoding(char response[]) {
-	return (NULL != strstr(response, "Transfer-Encoding: chunked"));
-}
+void close_connection(struct connection * conn) {
+	release_request(conn);
+	reactor_timer_cancel(conn->reactor, &conn->idle_timer);
+	if (-1 != conn->pipe_fds[0]) {
+		close(conn->pipe_fds[0]);
+		close(conn->pipe_fds[1]);
+	}
+	reactor_close(conn->reactor, conn->client_socket_fd);
+	log_debug("Closing connection to client.\n");
+	stats_add(conn->reactor->stats, STAT_CONNECTIONS_CLOSED, 1);
 
+	struct client_list * list = &client_lists[conn->reactor->id];
+	if (NULL != conn->prev) {
+		conn->prev->next = conn->next;
+	} else {
+		list->first = conn->next;
+	}
+	if (NULL != conn->next) {
+		conn->next->prev = conn->prev;
+	}
+	__atomic_store_n(&list->count, list->count - 1, __ATOMIC_RELAXED);
 
+	conn->state = STATE_DONE;
+	reactor_defer_free(conn->reactor, conn, &free_connection);
+}
 
-/**
-* Gets first line of a char buffer.
+/*
+* Returns a closed connection and its client_buffer to the pools of its reactor
 */
-void get_first_line(char * dest, const char * response) {
-	// copy response
-	char * response_copy = (char *) malloc(sizeof(char) * strlen(response));
-	strcpy(response_copy, response);
-	
-	// get first line
-	char * strptr;
-	strptr = strtok(response_copy, "\n");
-	strcpy(dest, strptr);	
+void free_connection(void * ptr) {
+	struct connection * conn = (struct connection *) ptr;
+	pool_put(conn->reactor->buffer_pool, conn->client_buffer);
+	pool_put(conn->reactor->connection_pool, conn);
 }
 
-/**
-* Sets status code from the response headers in the first response from the server.
+/*
+* Releases everything held for the current request and resets the per-request state so the
+* connection can serve the next request from client.
 */
-void parse_status_code(char * dest, const char * response) {
-	// copy response 
-	char * response_copy = (char *) malloc(sizeof(char) * strlen(response));
-	strcpy(response_copy, response);
-	
-	// get second space-delimited word (the status code)
-	char * strptr;
-	strptr = strtok(response_copy, " ");
-	strptr = strtok(NULL, " ");
-	strcpy(dest, strptr);
+void release_request(struct connection * conn) {
+	if ((NULL != conn->fill && conn->is_fill_leader) || NULL != conn->cache_write) {
+		stats_add(conn->reactor->stats, STAT_FILL_ABORTS, 1);
+	}
+	// a fill this connection still leads did not complete
+	release_fill(conn, false);
+	if (conn->resolving) {
+		resolver_cancel(&conn->resolver_waiter);
+		conn->resolving = false;
+	}
+	reactor_timer_cancel(conn->reactor, &conn->connect_timer);
+	if (-1 != conn->race_socket_fd) {
+		reactor_close(conn->reactor, conn->race_socket_fd);
+		conn->race_socket_fd = -1;
+	}
+	if (-1 != conn->host_socket_fd) {
+		reactor_close(conn->reactor, conn->host_socket_fd);
+		conn->host_socket_fd = -1;
+		log_debug("Closing connection to host.\n");
+	}
+	if (-1 != conn->cache_file_fd) {
+		close(conn->cache_file_fd);
+		conn->cache_file_fd = -1;
+	}
+	conn->cache_file_offset = 0;
+	conn->cache_file_size = 0;
+	if (NULL != conn->cache_write) {
+		// response was not completely received, do not leave a partial cache_file behind
+		cache_write_abort(conn->cache_write);
+		conn->cache_write = NULL;
+	}
+	if ('\0' != conn->temp_cache_filename[0]) {
+		remove(conn->temp_cache_filename);
+		conn->temp_cache_filename[0] = '\0';
+	}
+	if (NULL != conn->variant_write) {
+		cache_write_abort(conn->variant_write);
+		conn->variant_write = NULL;
+	}
+	if (NULL != conn->encoder) {
+		encoder_free(conn->encoder);
+		free(conn->encoder);
+		conn->encoder = NULL;
+	}
+	free(conn->encoded);
+	conn->encoded = NULL;
+	conn->encoded_len = 0;
+	conn->encoded_cap = 0;
+	conn->encode_failed = false;
+	conn->encoding = ENCODING_IDENTITY;
+	if (NULL != conn->mem_object) {
+		memcache_release(conn->mem_object);
+		conn->mem_object = NULL;
+	}
+	conn->mem_object_sent = 0;
+	conn->mem_object_end = 0;
+	conn->cache_write_skip = 0;
+	free(conn->memory_fill);
+	conn->memory_fill = NULL;
+	conn->memory_fill_len = 0;
+	conn->memory_fill_cap = 0;
+	conn->memory_fill_abort = false;
+	arena_reset(&conn->arena);
+	conn->uri = NULL;
+	conn->variant_uri = NULL;
+	conn->request = NULL;
+	conn->client_request = NULL;
+	conn->request_len = 0;
+	conn->conditionals_at = 0;
+	conn->request_sent = 0;
+	pool_put(conn->reactor->buffer_pool, conn->buffer);
+	conn->buffer = NULL;
+	conn->buffer_len = 0;
+	conn->buffer_sent = 0;
+	conn->host_reused = false;
+	conn->is_first_read = true;
+	http_parser_init(&conn->response_parser);
+	conn->abort_caching = false;
+	conn->revalidating = false;
+	conn->has_range = false;
+	conn->next_state = STATE_DONE;
+	if (conn->admitted) {
+		limiter_leave(conn->client_limit);
+		limiter_leave(conn->host_limit);
+		conn->admitted = false;
+	}
+	conn->client_limit = NULL;
+	conn->host_limit = NULL;
 }
 
-/**
-* Returns true if status code is 2XX, otherwise false
+/*
+* Ends the fill this connection leads, or stops following it, and drops the reference to it.
 */
-bool valid_status_code(const char * status_code) {
-	if ('2' == *status_code) {
-		return true;
+void release_fill(struct connection * conn, bool complete) {
+	if (NULL == conn->fill) {
+		return;
 	}
-	return false;
+	if (conn->is_fill_leader) {
+		fill_end(conn->fill, complete);
+	} else {
+		fill_detach(conn->fill, &conn->fill_waiter);
+	}
+	fill_release(conn->fill);
+	conn->fill = NULL;
+	conn->is_fill_leader = false;
 }
 
 /**
-* Print contents of given buffer ignoring the '\r' carriage return
+* Send error message to client and close connection.
 */
-void print_buffer(char buffer[]) {
-	int i;
-	for (i = 0; i < strlen(buffer); i++) {
-		if ('\r' != buffer[i]) {
-			putchar(buffer[i]);
+enum step_result send_error_msg_and_close(struct connection * conn, const char * msg) {
+	ssize_t num_bytes_sent = send(conn->client_socket_fd, msg, strlen(msg), MSG_NOSIGNAL);
+	if (num_bytes_sent > 0) {
+		stats_add(conn->reactor->stats, STAT_CLIENT_BYTES_OUT, num_bytes_sent);
+	}
+	return STEP_DONE;
+}
+
+
+/*
+* Receives data from client until client_buffer holds a complete request (ended by a blank
+* line) and processes it. Pipelined requests already in client_buffer are processed without
+* another recv.
+*/
+enum step_result client_recv(struct connection * conn) {
+	struct http_message request;
+	enum http_parse_result result;
+	while (HTTP_PARSE_INCOMPLETE == (result = http_parse_request(&conn->client_parser, conn->client_buffer, conn->client_buffer_len, &request))) {
+		if (conn->client_buffer_len >= BUFFER_SIZE - 1) {
+			return send_error_msg_and_close(conn, "413 Request Entity Too Large.\n");
+		}
+		int recv_data = reactor_recv(conn->reactor, conn->client_socket_fd, conn->client_buffer + conn->client_buffer_len, BUFFER_SIZE - 1 - conn->client_buffer_len);
+		if (-1 == recv_data) {
+			if (EAGAIN == errno || EWOULDBLOCK == errno) {
+				return STEP_WAIT;
+			}
+			log_debug("Error receiving data from client.\n");
+			return STEP_DONE;
+		}
+		if (0 == recv_data) {
+			log_debug("Client closed connection.\n");
+			return STEP_DONE;
 		}
+		conn->client_buffer_len += recv_data;
+		stats_add(conn->reactor->stats, STAT_CLIENT_BYTES_IN, recv_data);
 	}
+	reactor_timer_cancel(conn->reactor, &conn->idle_timer);
+	if (HTTP_PARSE_INVALID == result) {
+		return send_error_msg_and_close(conn, "400 Bad Request.\n");
+	}
+
+	// request is parsed in place, anything after it is the start of the next pipelined one
+	enum step_result step = process_request(conn, &request);
+	conn->client_buffer_len -= request.header_len;
+	memmove(conn->client_buffer, conn->client_buffer + request.header_len, conn->client_buffer_len);
+	http_parser_init(&conn->client_parser);
+	return step;
 }
 
-/**
-* Returns number of colons (':') in given string 
+/*
+* Process the parsed request at the start of client_buffer if it is a valid proxy request.
 */
-int count_colons(char *string) {
-	int chptr = 0;
-	int count = 0;
-	while ('\0' != *(string + chptr)) {
-		if (':' == *(string + chptr)) {
-			count++;
+enum step_result process_request(struct connection * conn, const struct http_message * request) {
+	stats_add(conn->reactor->stats, STAT_REQUESTS, 1);
+
+	// Check for GET, HTTP/1.1 in request
+	if (!http_slice_equals(request->method, "GET") || !http_slice_equals(request->version, "HTTP/1.1")) {
+		return send_error_msg_and_close(conn, "405 Method Not Allowed. Request not in correct format 'GET absoluteURI[:port] HTTP/1.1'. Note: only GET is allowed.\n");
+	}
+
+	// the body of a GET is never relayed, and left in client_buffer it would be parsed as the next request
+	if (request->content_length > 0 || NULL != http_find_header(request, "Transfer-Encoding")) {
+		return send_error_msg_and_close(conn, "400 Bad Request. A GET request cannot have a body.\n");
+	}
+
+	// HTTP/1.1 connections are persistent unless the client asks to close
+	conn->client_keep_alive = !request->connection_close;
+
+	// parse out host, port and path of the absolute URI
+	struct http_uri uri;
+	if (!http_parse_uri(request->target, &uri) || uri.host.len >= sizeof(conn->host)) {
+		return send_error_msg_and_close(conn, "405 Method Not Allowed. Request not in correct format 'GET absoluteURI[:port] HTTP/1.1'. Note: only GET is allowed.\n");
+	}
+	memcpy(conn->host, uri.host.data, uri.host.len);
+	conn->host[uri.host.len] = '\0';
+	conn->port = (0 == uri.port) ? DEFAULT_PORT : uri.port;
+
+	// if blacklist enabled, check if host is blacklisted
+	if (blacklist_enabled) {
+		log_debug("checking blacklist...\n");
+		// if host blacklisted, send 403 and close connection
+		if (is_blacklisted(conn->host)) {
+			log_debug("Host is blacklisted.\nClosing connection to client.\n");
+			stats_add(conn->reactor->stats, STAT_BLACKLIST_BLOCKS, 1);
+			return send_error_msg_and_close(conn, "403 Forbidden.\n");
+		}
+	}
+
+	// the request is served through buffer, and its uri and host request live in arena
+	conn->buffer = (char *) pool_get(conn->reactor->buffer_pool);
+	conn->uri = (char *) arena_alloc(&conn->arena, uri.authority_and_path.len + 1);
+	if (NULL == conn->buffer || NULL == conn->uri) {
+		return send_error_msg_and_close(conn, "500 Internal Server Error.\n");
+	}
+	memcpy(conn->uri, uri.authority_and_path.data, uri.authority_and_path.len);
+	conn->uri[uri.authority_and_path.len] = '\0';
+
+	// Write proper HTTP request to send to host, using buffer as scratch space
+	char * host_request = conn->buffer;
+	const char * path = (0 == uri.path.len || '/' != uri.path.data[0]) ? "/" : "";
+	int request_len = snprintf(host_request, BUFFER_SIZE, "GET %s%.*s HTTP/1.1\r\nHost: %s\r\n", path, uri.path.len, uri.path.data, conn->host);
+	// Append fields after the GET line, if any, the client's conditionals last
+	request_len = append_header_fields(host_request, request_len, BUFFER_SIZE, request, false);
+	conn->conditionals_at = request_len;
+	request_len = append_header_fields(host_request, request_len, BUFFER_SIZE, request, true);
+	// Ask host to keep the connection open so it can go back to the upstream pool
+	if (request_len < BUFFER_SIZE) {
+		request_len += snprintf(host_request + request_len, BUFFER_SIZE - request_len, "Connection: keep-alive\r\n\r\n");
+	}
+	if (request_len >= BUFFER_SIZE) {
+		return send_error_msg_and_close(conn, "413 Request Entity Too Large.\n");
+	}
+	conn->request = (char *) arena_alloc(&conn->arena, request_len + 1);
+	if (NULL == conn->request) {
+		return send_error_msg_and_close(conn, "413 Request Entity Too Large.\n");
+	}
+	memcpy(conn->request, host_request, request_len + 1);
+	conn->request_len = request_len;
+	conn->request_sent = 0;
+
+	// the fields of the request are looked at again once client_buffer has moved on to the next one
+	conn->client_request = (struct http_message *) arena_alloc(&conn->arena, sizeof(struct http_message));
+	char * client_head = (char *) arena_alloc(&conn->arena, request->header_len);
+	if (NULL == conn->client_request || NULL == client_head) {
+		return send_error_msg_and_close(conn, "413 Request Entity Too Large.\n");
+	}
+	memcpy(client_head, conn->client_buffer, request->header_len);
+	*conn->client_request = *request;
+	http_message_rebase(conn->client_request, conn->client_buffer, client_head);
+
+	// a single byte range can be sent from the cache, other Range requests get the whole response
+	struct http_slice range = request->fields[HTTP_FIELD_RANGE];
+	if (NULL != range.data && range.len < VALIDATOR_SIZE) {
+		char value[VALIDATOR_SIZE];
+		http_copy_slice(range, value, sizeof(value));
+		conn->has_range = http_parse_range(value, &conn->range);
+	}
+
+	// responses are compressed for clients that accept it, and cached compressed under variant_uri
+	conn->encoding = compression_enabled ? encoding_negotiate(request) : ENCODING_IDENTITY;
+	if (ENCODING_IDENTITY != conn->encoding) {
+		const char * name = encoding_name(conn->encoding);
+		int variant_len = strlen(conn->uri) + 1 + strlen(name);
+		conn->variant_uri = (char *) arena_alloc(&conn->arena, variant_len + 1);
+		if (NULL == conn->variant_uri) {
+			conn->encoding = ENCODING_IDENTITY;
+		} else {
+			snprintf(conn->variant_uri, variant_len + 1, "%s %s", conn->uri, name);
 		}
-		chptr++;
-	}		
-	return count;
+	}
+
+	// Print out information about request
+	log_debug("Host: %s\n", conn->host);
+	log_debug("Port: %d\n", conn->port);
+	log_debug("Request: %s%.*s\n", path, uri.path.len, uri.path.data);
+
+	// Before sending request, check the cache
+	bool no_cache, no_store;
+	freshness_request_directives(request, &no_cache, &no_store);
+	if (no_store) {
+		log_debug("Client asked not to store the response, ping host!\n");
+		conn->abort_caching = true;
+		stats_add(conn->reactor->stats, STAT_CACHE_MISSES, 1);
+		return use_proxy(conn);
+	}
+	return lookup_cache(conn, no_cache);
+}
+
+/*
+* Sends the response from the cache if it holds a fresh one for the request (and the client did
+* not ask for no_cache). A stale response with validators is revalidated with host, anything
+* else is fetched.
+*/
+enum step_result lookup_cache(struct connection * conn, bool no_cache) {
+	struct cache_meta meta;
+	log_debug("Check if %s is cached...\n", conn->uri);
+	if (!get_cache_meta_for_request(conn->uri, &meta) || !freshness_matches_request(&meta, conn->client_request)) {
+		if (conn->has_range && !no_cache && open_partial_response(conn)) {
+			stats_add(conn->reactor->stats, STAT_PARTIAL_HITS, 1);
+			return STEP_CONTINUE;
+		}
+		// send request to host, get response and send to client
+		log_debug("Request is NOT cached, ping host!\n");
+		return fetch_or_follow(conn);
+	}
+	if (!no_cache && freshness_is_fresh(&meta, time(NULL))) {
+		if (open_cached_response(conn)) {
+			stats_add(conn->reactor->stats, (NULL != conn->mem_object) ? STAT_MEMORY_HITS : STAT_DISK_HITS, 1);
+			return STEP_CONTINUE;
+		}
+		// Fetch from host if error when retrieving from cache
+		log_debug("Fetch from host...\n");
+		return fetch_or_follow(conn);
+	}
+	if (!freshness_can_revalidate(&meta) || -1 == add_validators(conn, &meta)) {
+		log_debug("Cached response is stale, ping host!\n");
+		return fetch_or_follow(conn);
+	}
+	log_debug("Cached response is stale, revalidate it with host!\n");
+	return fetch_or_follow(conn);
+}
+
+/*
+* Sets up sending the cached response for uri: the compressed variant of it if one is cached for
+* the encoding the client accepts, otherwise the response itself, narrowed down to the byte range
+* the request asks for or compressed as it is sent. Returns false if it cannot be read.
+*/
+bool open_cached_response(struct connection * conn) {
+	if (variant_is_usable(conn) && open_cached_file(conn, conn->variant_uri)) {
+		log_debug("Compressed response is cached, send it!\n");
+		stats_add(conn->reactor->stats, STAT_VARIANT_HITS, 1);
+		return true;
+	}
+	if (!open_cached_file(conn, conn->uri)) {
+		return false;
+	}
+	if (conn->has_range) {
+		open_cached_range(conn);
+	}
+	if (STATE_CLIENT_SEND != conn->state && ENCODING_IDENTITY != conn->encoding) {
+		open_encoded_response(conn);
+	}
+	return true;
+}
+
+/*
+* Sets up sending the response cached under key from the memory cache, or from its cache_file.
+* Returns false if it cannot be read.
+*/
+bool open_cached_file(struct connection * conn, char * key) {
+	conn->is_first_read = true;
+	conn->mem_object = memcache_get(key);
+	if (NULL != conn->mem_object) {
+		log_debug("Request is cached in memory, send it from there!\n");
+		conn->mem_object_sent = 0;
+		conn->mem_object_end = conn->mem_object->size;
+		conn->state = STATE_MEMORY_SEND;
+		return true;
+	}
+	conn->cache_file_fd = open_cache_file_for_request(key);
+	if (-1 == conn->cache_file_fd) {
+		return false;
+	}
+	log_debug("Request is cached, get it from cache!\n");
+	struct stat sb;
+	fstat(conn->cache_file_fd, &sb);
+	conn->cache_file_offset = 0;
+	conn->cache_file_size = sb.st_size;
+	// the file goes out with sendfile, and if it is small it is read into the memory cache for later hits
+	promote_cache_file(conn, key);
+	conn->state = STATE_CACHE_SEND;
+	return true;
+}
+
+/*
+* Returns true if the response cached under variant_uri can be sent: it is fresh, matches the
+* request, and is no older than the response it was compressed from (which is revalidated on its
+* own). Byte ranges are only served from the uncompressed response.
+*/
+bool variant_is_usable(struct connection * conn) {
+	struct cache_meta meta, variant_meta;
+	return ENCODING_IDENTITY != conn->encoding && !conn->has_range && get_cache_meta_for_request(conn->uri, &meta)
+		&& get_cache_meta_for_request(conn->variant_uri, &variant_meta) && variant_meta.stored >= meta.stored
+		&& freshness_matches_request(&variant_meta, conn->client_request) && freshness_is_fresh(&variant_meta, time(NULL));
+}
+
+/*
+* Narrows the cached response just opened down to the byte range the request asks for, sent
+* after a 206 head written into buffer (or to a 416 head alone if the range is past its end).
+* The whole response is sent instead if it is not a 200 with Content-Length, or If-Range names
+* another version of it.
+*/
+void open_cached_range(struct connection * conn) {
+	struct cache_meta meta;
+	if (!get_cache_meta_for_request(conn->uri, &meta) || !freshness_if_range_matches(&meta, conn->client_request)) {
+		return;
+	}
+	char file_head[BUFFER_SIZE];
+	const char * head;
+	long long size;
+	int len;
+	if (NULL != conn->mem_object) {
+		head = conn->mem_object->data;
+		size = conn->mem_object->size;
+		len = (size < BUFFER_SIZE) ? size : BUFFER_SIZE;
+	} else {
+		head = file_head;
+		size = conn->cache_file_size;
+		len = pread(conn->cache_file_fd, file_head, BUFFER_SIZE, 0);
+	}
+	struct http_parser parser;
+	struct http_message response;
+	http_parser_init(&parser);
+	if (len <= 0 || HTTP_PARSE_DONE != http_parse_response(&parser, head, len, &response) || 200 != response.status_code
+		|| response.chunked || response.header_len + response.content_length != size) {
+		return;
+	}
+
+	long long length = response.content_length;
+	long long first, last;
+	if (http_resolve_range(&conn->range, length, &first, &last)) {
+		conn->buffer_len = http_write_range_head(conn->buffer, BUFFER_SIZE, head, response.header_len, 206, first, last, length);
+		if (-1 == conn->buffer_len || conn->buffer_len >= BUFFER_SIZE) {
+			conn->buffer_len = 0;
+			return;
+		}
+		first += response.header_len;
+		last += response.header_len;
+	} else {
+		conn->buffer_len = snprintf(conn->buffer, BUFFER_SIZE, "HTTP/1.1 416 Range Not Satisfiable\r\nContent-Range: bytes */%lld\r\nContent-Length: 0\r\n\r\n", length);
+		first = size;
+		last = size - 1;
+	}
+	if (NULL != conn->mem_object) {
+		conn->mem_object_sent = first;
+		conn->mem_object_end = last + 1;
+	} else {
+		conn->cache_file_offset = first;
+		conn->cache_file_size = last + 1;
+	}
+	// the head written here carries Content-Length, so the response is delimited
+	conn->is_first_read = false;
+	conn->buffer_sent = 0;
+	conn->next_state = conn->state;
+	conn->state = STATE_CLIENT_SEND;
+}
+
+/*
+* Sets up sending the cached response just opened compressed with encoding, if it is a
+* compressible 200. Its head is rewritten into encoded, its body is compressed as it is read,
+* and the compressed response is cached under variant_uri for the next request.
+*/
+void open_encoded_response(struct connection * conn) {
+	char file_head[BUFFER_SIZE];
+	const char * head;
+	int len;
+	if (NULL != conn->mem_object) {
+		head = conn->mem_object->data;
+		len = (conn->mem_object->size < BUFFER_SIZE) ? conn->mem_object->size : BUFFER_SIZE;
+	} else {
+		head = file_head;
+		len = pread(conn->cache_file_fd, file_head, BUFFER_SIZE, 0);
+	}
+	struct http_parser parser;
+	struct http_message response;
+	http_parser_init(&parser);
+	if (len <= 0 || HTTP_PARSE_DONE != http_parse_response(&parser, head, len, &response) || 200 != response.status_code
+		|| !encoding_is_compressible(&response)) {
+		return;
+	}
+	body_framer_init(&conn->framer, &response);
+	if (body_framer_done(&conn->framer)) {
+		return;
+	}
+	bool cache = get_cache_meta_for_request(conn->uri, &conn->cache_meta);
+	if (!start_encoding(conn, head, response.header_len, cache)) {
+		return;
+	}
+	if (NULL != conn->mem_object) {
+		conn->mem_object_sent = response.header_len;
+	} else {
+		conn->cache_file_offset = response.header_len;
+	}
+	// the compressed response is chunked, so it is delimited
+	conn->is_first_read = false;
+	conn->buffer_sent = 0;
+	conn->next_state = STATE_ENCODE_SEND;
+	conn->state = STATE_CLIENT_SEND;
+}
+
+/*
+* Sets up sending the byte range the request asks for from the partial object of uri, after a
+* 206 head written into buffer. Returns false if the partial object does not hold it.
+*/
+bool open_partial_response(struct connection * conn) {
+	off_t first, last;
+	int fd = partial_open(conn->uri, conn->client_request, &conn->range, conn->buffer, BUFFER_SIZE, &conn->buffer_len, &first, &last);
+	if (-1 == fd) {
+		return false;
+	}
+	log_debug("Byte range is cached, get it from cache!\n");
+	conn->cache_file_fd = fd;
+	conn->cache_file_offset = first;
+	conn->cache_file_size = last + 1;
+	conn->is_first_read = false;
+	conn->buffer_sent = 0;
+	conn->next_state = STATE_CACHE_SEND;
+	conn->state = STATE_CLIENT_SEND;
+	return true;
+}
+
+/*
+* Adds the validators of the stale cached response described by meta to the request for host,
+* so host can answer 304 Not Modified instead of sending the response again.
+*/
+int add_validators(struct connection * conn, const struct cache_meta * meta) {
+	char * host_request = conn->buffer;
+	// the cache's validators take the place of the client's own conditionals
+	int request_len = conn->conditionals_at;
+	memcpy(host_request, conn->request, request_len);
+	request_len = freshness_add_validators(meta, host_request, request_len, BUFFER_SIZE);
+	if (request_len < BUFFER_SIZE) {
+		request_len += snprintf(host_request + request_len, BUFFER_SIZE - request_len, "Connection: keep-alive\r\n\r\n");
+	}
+	if (request_len >= BUFFER_SIZE) {
+		return -1;
+	}
+
+	char * request = (char *) arena_alloc(&conn->arena, request_len + 1);
+	if (NULL == request) {
+		return -1;
+	}
+	memcpy(request, host_request, request_len + 1);
+	conn->request = request;
+	conn->request_len = request_len;
+	conn->cache_meta = *meta;
+	conn->revalidating = true;
+	return 0;
+}
+
+/*
+* Fetches uri from host unless another connection is already fetching it, in which case the
+* response is sent from that connection's temp cache_file as it arrives.
+*/
+enum step_result fetch_or_follow(struct connection * conn) {
+	// a byte range is fetched on its own, fills are for whole responses
+	if (conn->has_range) {
+		stats_add(conn->reactor->stats, conn->revalidating ? STAT_REVALIDATIONS : STAT_CACHE_MISSES, 1);
+		return use_proxy(conn);
+	}
+	bool is_leader;
+	conn->fill = fill_begin(conn->uri, &is_leader);
+	if (NULL == conn->fill) {
+		stats_add(conn->reactor->stats, STAT_CACHE_MISSES, 1);
+		return use_proxy(conn);
+	}
+	conn->is_fill_leader = is_leader;
+	if (is_leader) {
+		stats_add(conn->reactor->stats, conn->revalidating ? STAT_REVALIDATIONS : STAT_CACHE_MISSES, 1);
+		snprintf(conn->temp_cache_filename, TEMP_FILENAME_SIZE, "%s", conn->fill->temp_filename);
+		return use_proxy(conn);
+	}
+	log_debug("Request is being fetched by another connection, follow it!\n");
+	stats_add(conn->reactor->stats, STAT_FILL_FOLLOWS, 1);
+	fill_attach(conn->fill, &conn->fill_waiter);
+	conn->cache_file_offset = 0;
+	conn->state = STATE_FILL_FOLLOW;
+	return STEP_CONTINUE;
+}
+
+/*
+* Gets a connection to host, reusing an idle one from the reactor's upstream pool if there is
+* one, and sends the request once connected. The response is then relayed back to the client.
+*/
+enum step_result use_proxy(struct connection * conn) {
+	const char * refusal = admit_request(conn);
+	if (NULL != refusal) {
+		return send_error_msg_and_close(conn, refusal);
+	}
+	int host_socket_fd = upstream_acquire(conn->reactor->upstream_pool, conn->host, conn->port);
+	if (-1 == host_socket_fd) {
+		return connect_to_host(conn);
+	}
+	if (-1 == reactor_mod(conn->reactor, host_socket_fd, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET | REACTOR_RECV, &conn->host_handler)) {
+		reactor_close(conn->reactor, host_socket_fd);
+		return connect_to_host(conn);
+	}
+	log_debug("Reusing pooled connection to host server.\n");
+	stats_add(conn->reactor->stats, STAT_UPSTREAM_REUSES, 1);
+	conn->host_socket_fd = host_socket_fd;
+	conn->host_reused = true;
+	conn->state = STATE_ORIGIN_SEND;
+	return STEP_CONTINUE;
+}
+
+/*
+* Applies the rate and concurrency limits of client and host to a request about to be sent to
+* host, and counts it as being at host until it is released. Returns the error to answer it with
+* if a limit refuses it, NULL if it may go ahead. Requests served from the cache are never limited.
+*/
+const char * admit_request(struct connection * conn) {
+	if (conn->admitted) {
+		return NULL;
+	}
+	// rate tokens are taken last, so a request refused by any limit does not spend them
+	conn->client_limit = limiter_client(conn->client_addr);
+	if (!limiter_enter(conn->client_limit, LIMIT_CLIENT_CONNECTIONS)) {
+		log_debug("Client is over its limits.\n");
+		stats_add(conn->reactor->stats, STAT_CLIENT_LIMITED, 1);
+		return "429 Too Many Requests.\n";
+	}
+	conn->host_limit = limiter_host(conn->host, conn->port);
+	if (!limiter_enter(conn->host_limit, LIMIT_HOST_CONNECTIONS)) {
+		limiter_leave(conn->client_limit);
+		log_debug("Host is over its limits.\n");
+		stats_add(conn->reactor->stats, STAT_HOST_LIMITED, 1);
+		return "503 Service Unavailable.\n";
+	}
+	if (!limiter_take(conn->client_limit, LIMIT_CLIENT_RATE, LIMIT_CLIENT_BURST)) {
+		limiter_leave(conn->client_limit);
+		limiter_leave(conn->host_limit);
+		log_debug("Client is over its limits.\n");
+		stats_add(conn->reactor->stats, STAT_CLIENT_LIMITED, 1);
+		return "429 Too Many Requests.\n";
+	}
+	if (!limiter_take(conn->host_limit, LIMIT_HOST_RATE, LIMIT_HOST_BURST)) {
+		limiter_refund(conn->client_limit, LIMIT_CLIENT_RATE, LIMIT_CLIENT_BURST);
+		limiter_leave(conn->client_limit);
+		limiter_leave(conn->host_limit);
+		log_debug("Host is over its limits.\n");
+		stats_add(conn->reactor->stats, STAT_HOST_LIMITED, 1);
+		return "503 Service Unavailable.\n";
+	}
+	conn->admitted = true;
+	return NULL;
+}
+
+/*
+* Looks up the addresses of host and starts connecting to them.
+*/
+enum step_result connect_to_host(struct connection * conn) {
+	conn->state = STATE_RESOLVE;
+	return STEP_CONTINUE;
+}
+
+/*
+* Gets the addresses of host from the resolver, waiting for it if they are not cached, and
+* starts connecting to the first of them.
+*/
+enum step_result resolve_host(struct connection * conn) {
+	if (conn->resolving) {
+		return STEP_WAIT;
+	}
+	switch (resolver_lookup(conn->host, &conn->host_addrs, &conn->resolver_waiter)) {
+	case RESOLVE_PENDING:
+		conn->resolving = true;
+		return STEP_WAIT;
+	case RESOLVE_FAILED:
+		log_debug("Failed to resolve host.\n");
+		stats_add(conn->reactor->stats, STAT_UPSTREAM_ERRORS, 1);
+		return send_error_msg_and_close(conn, "404 Not Found. Failed to resolve host.\n");
+	case RESOLVE_DONE:
+		break;
+	}
+
+	conn->next_addr = 0;
+	conn->connect_start_us = monotonic_us();
+	if (!start_connect_attempt(conn)) {
+		log_debug("Failed to connect to host server.\n");
+		stats_add(conn->reactor->stats, STAT_UPSTREAM_ERRORS, 1);
+		return send_error_msg_and_close(conn, "502 Bad Gateway.\n");
+	}
+	reactor_timer_add(conn->reactor, &conn->connect_timer, HAPPY_EYEBALLS_DELAY_MS);
+	conn->state = STATE_ORIGIN_CONNECT;
+	return STEP_CONTINUE;
+}
+
+/*
+* Starts a non-blocking connect to the next address of host, as host_socket_fd or, if that is
+* taken, as race_socket_fd. Returns false if no address is left to try.
+*/
+bool start_connect_attempt(struct connection * conn) {
+	while (conn->next_addr < conn->host_addrs.num_addrs) {
+		union resolver_addr * addr = &conn->host_addrs.addrs[conn->next_addr++];
+		socklen_t addr_len;
+		if (AF_INET6 == addr->sa.sa_family) {
+			addr->in6.sin6_port = htons(conn->port);
+			addr_len = sizeof(addr->in6);
+		} else {
+			addr->in.sin_port = htons(conn->port);
+			addr_len = sizeof(addr->in);
+		}
+
+		int socket_fd = socket(addr->sa.sa_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		if (-1 == socket_fd) {
+			log_error("Failed to create socket to host\n");
+			continue;
+		}
+		if (-1 == connect(socket_fd, &addr->sa, addr_len) && EINPROGRESS != errno) {
+			close(socket_fd);
+			continue;
+		}
+		bool is_race = (-1 != conn->host_socket_fd);
+		if (-1 == reactor_add(conn->reactor, socket_fd, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET | REACTOR_RECV, is_race ? &conn->race_handler : &conn->host_handler)) {
+			log_error("Failed to register host connection.\n");
+			close(socket_fd);
+			continue;
+		}
+		if (is_race) {
+			conn->race_socket_fd = socket_fd;
+		} else {
+			conn->host_socket_fd = socket_fd;
+		}
+		return true;
+	}
+	return false;
+}
+
+/*
+* Returns 1 if the non-blocking connect on socket_fd has completed, 0 if it is still in
+* progress and -1 if it failed.
+*/
+int check_connect_attempt(int socket_fd) {
+	int err = 0;
+	socklen_t err_len = sizeof(err);
+	if (-1 == getsockopt(socket_fd, SOL_SOCKET, SO_ERROR, &err, &err_len) || 0 != err) {
+		return -1;
+	}
+
+	// getpeername only succeeds once the connection is established
+	struct sockaddr_storage peer;
+	socklen_t peer_len = sizeof(peer);
+	if (-1 == getpeername(socket_fd, (struct sockaddr *) &peer, &peer_len)) {
+		return 0;
+	}
+	return 1;
+}
+
+/*
+* Called when a pooled connection turns out to have been closed by host before it answered.
+* Drops it and sends the request again on a new connection.
+*/
+enum step_result retry_with_new_connection(struct connection * conn) {
+	log_debug("Pooled connection to host was closed, reconnecting.\n");
+	reactor_close(conn->reactor, conn->host_socket_fd);
+	conn->host_socket_fd = -1;
+	conn->host_reused = false;
+	conn->request_sent = 0;
+	conn->buffer_len = 0;
+	return connect_to_host(conn);
+}
+
+/*
+* Checks whether a connect attempt to host has completed. The first one to complete becomes
+* host_socket_fd and the other is dropped; a failed attempt is replaced by one to the next
+* address right away.
+*/
+enum step_result origin_connect(struct connection * conn) {
+	int host_result = (-1 == conn->host_socket_fd) ? -1 : check_connect_attempt(conn->host_socket_fd);
+	int race_result = (-1 == conn->race_socket_fd) ? -1 : check_connect_attempt(conn->race_socket_fd);
+	bool failed = false;
+	if (-1 == host_result && -1 != conn->host_socket_fd) {
+		reactor_close(conn->reactor, conn->host_socket_fd);
+		conn->host_socket_fd = -1;
+		failed = true;
+	}
+	if (-1 == race_result && -1 != conn->race_socket_fd) {
+		reactor_close(conn->reactor, conn->race_socket_fd);
+		conn->race_socket_fd = -1;
+		failed = true;
+	}
+	if (1 == race_result && 1 != host_result) {
+		// the race attempt won, drop the host attempt in its favour
+		if (-1 != conn->host_socket_fd) {
+			reactor_close(conn->reactor, conn->host_socket_fd);
+			conn->host_socket_fd = -1;
+		}
+		host_result = 1;
+	}
+	if (-1 == conn->host_socket_fd && -1 != conn->race_socket_fd) {
+		// the remaining attempt takes over the host socket's place
+		conn->host_socket_fd = conn->race_socket_fd;
+		conn->race_socket_fd = -1;
+		if (-1 == reactor_mod(conn->reactor, conn->host_socket_fd, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET | REACTOR_RECV, &conn->host_handler)) {
+			log_error("Failed to register host connection.\n");
+			return send_error_msg_and_close(conn, "500 Internal Server Error.\n");
+		}
+	}
+
+	if (1 != host_result) {
+		if (failed && start_connect_attempt(conn)) {
+			reactor_timer_add(conn->reactor, &conn->connect_timer, HAPPY_EYEBALLS_DELAY_MS);
+		}
+		if (-1 == conn->host_socket_fd) {
+			log_debug("Failed to connect to host server.\n");
+			stats_add(conn->reactor->stats, STAT_UPSTREAM_ERRORS, 1);
+			return send_error_msg_and_close(conn, "502 Bad Gateway.\n");
+		}
+		return STEP_WAIT;
+	}
+
+	if (-1 != conn->race_socket_fd) {
+		reactor_close(conn->reactor, conn->race_socket_fd);
+		conn->race_socket_fd = -1;
+	}
+	reactor_timer_cancel(conn->reactor, &conn->connect_timer);
+	log_debug("Connected to host server.\n");
+	stats_add(conn->reactor->stats, STAT_UPSTREAM_CONNECTS, 1);
+	stats_record(conn->reactor->stats, STAT_UPSTREAM_CONNECT, monotonic_us() - conn->connect_start_us);
+	conn->state = STATE_ORIGIN_SEND;
+	return STEP_CONTINUE;
+}
+
+/*
+* Sends the request to host.
+*/
+enum step_result origin_send(struct connection * conn) {
+	while (conn->request_sent < conn->request_len) {
+		int num_bytes_sent = send(conn->host_socket_fd, conn->request + conn->request_sent, conn->request_len - conn->request_sent, MSG_NOSIGNAL);
+		if (-1 == num_bytes_sent) {
+			if (EAGAIN == errno || EWOULDBLOCK == errno) {
+				return STEP_WAIT;
+			}
+			if (conn->host_reused) {
+				return retry_with_new_connection(conn);
+			}
+			log_debug("Failed to send request to host server.\n");
+			stats_add(conn->reactor->stats, STAT_UPSTREAM_ERRORS, 1);
+			return send_error_msg_and_close(conn, "500 Internal Server Error.\n");
+		}
+		conn->request_sent += num_bytes_sent;
+		stats_add(conn->reactor->stats, STAT_UPSTREAM_BYTES_OUT, num_bytes_sent);
+	}
+	log_debug("Sent request to host.\n");
+	conn->request_sent_us = monotonic_us();
+
+	// generate temp cache_file filename: temp_<pid>_<n>
+	if ('\0' == conn->temp_cache_filename[0]) {
+		generate_temp_filename(conn->temp_cache_filename);
+	}
+	conn->buffer_len = 0;
+	conn->state = STATE_ORIGIN_RECV;
+	return STEP_CONTINUE;
+}
+
+/*
+* Receives the next part of the response from host and queues it to be sent to client.
+*/
+enum step_result origin_recv(struct connection * conn) {
+	char * buffer = conn->buffer;
+	// response headers are collected in buffer until complete, after that each recv starts over
+	int offset = conn->is_first_read ? conn->buffer_len : 0;
+	int num_bytes_read = reactor_recv(conn->reactor, conn->host_socket_fd, buffer + offset, BUFFER_SIZE - offset);
+	if (-1 == num_bytes_read) {
+		if (EAGAIN == errno || EWOULDBLOCK == errno) {
+			return STEP_WAIT;
+		}
+		if (conn->is_first_read && 0 == offset && conn->host_reused) {
+			return retry_with_new_connection(conn);
+		}
+		log_debug("Failed to receive response from host server.\n");
+		stats_add(conn->reactor->stats, STAT_UPSTREAM_ERRORS, 1);
+		if (conn->is_first_read) {
+			return send_error_msg_and_close(conn, "500 Internal Server Error.\n");
+		}
+		// response was cut short, do not cache it
+		return STEP_DONE;
+	}
+
+	if (0 == num_bytes_read) {
+		log_debug("Host has closed the connection.\n");
+		if (conn->is_first_read) {
+			if (0 == offset && conn->host_reused) {
+				return retry_with_new_connection(conn);
+			}
+			stats_add(conn->reactor->stats, STAT_UPSTREAM_ERRORS, 1);
+			return send_error_msg_and_close(conn, "502 Bad Gateway.\n");
+		}
+		if (BODY_UNTIL_CLOSE == conn->framer.state && NULL == conn->encoder) {
+			// client can only tell where this response ends by its connection closing
+			conn->client_keep_alive = false;
+		}
+		if (!body_framer_close(&conn->framer)) {
+			// response was cut short, do not cache it
+			return STEP_DONE;
+		}
+		if (NULL == conn->encoder) {
+			return finish_response(conn);
+		}
+		// the compressed response still has to be ended
+		conn->buffer_len = 0;
+		conn->body_start = 0;
+		return submit_work(conn, &compress_received, STATE_ORIGIN_RECV);
+	}
+	stats_add(conn->reactor->stats, STAT_UPSTREAM_BYTES_IN, num_bytes_read);
+	if (conn->is_first_read && 0 == offset) {
+		conn->first_byte_us = monotonic_us();
+		stats_record(conn->reactor->stats, STAT_UPSTREAM_FIRST_BYTE, conn->first_byte_us - conn->request_sent_us);
+	}
+	int body_start = 0;
+	int body_len = num_bytes_read;
+
+	// On first read, parse status code from first line once all response headers are in
+	if (conn->is_first_read) {
+		conn->buffer_len = offset + num_bytes_read;
+		struct http_message response;
+		enum http_parse_result result = http_parse_response(&conn->response_parser, buffer, conn->buffer_len, &response);
+		if (HTTP_PARSE_INCOMPLETE == result) {
+			if (conn->buffer_len >= BUFFER_SIZE) {
+				log_debug("Response headers from host are too large.\n");
+				return send_error_msg_and_close(conn, "502 Bad Gateway.\n");
+			}
+			return STEP_CONTINUE;
+		}
+		if (HTTP_PARSE_INVALID == result) {
+			log_debug("Malformed response from host.\n");
+			return send_error_msg_and_close(conn, "502 Bad Gateway.\n");
+		}
+		int header_len = response.header_len;
+
+		conn->is_first_read = false;
+
+		// print status line to server
+		log_debug("%.*s\n", response.first_line.len, response.first_line.data);
+
+		if (conn->revalidating && 304 == response.status_code) {
+			return finish_revalidation(conn, &response);
+		}
+		if (!valid_status_code(response.status_code)) {
+			char msg[256];
+			snprintf(msg, sizeof(msg), "%.*s\n", response.first_line.len, response.first_line.data);
+			return send_error_msg_and_close(conn, msg);
+		}
+
+		body_framer_init(&conn->framer, &response);
+		if (conn->is_fill_leader) {
+			fill_set_delimited(conn->fill, BODY_UNTIL_CLOSE != conn->framer.state);
+		}
+		if (!conn->abort_caching && !freshness_init(&conn->cache_meta, conn->client_request, &response, time(NULL))) {
+			log_debug("Response may not be cached.\n");
+			conn->abort_caching = true;
+			// followers fetch the response themselves
+			release_fill(conn, false);
+			// a byte range does not replace the cached response
+			if (!conn->has_range && 206 != response.status_code && 0 == is_request_cached(conn->uri)) {
+				cache_write_delete(conn->uri);
+			}
+		}
+		if (!conn->abort_caching && 206 == response.status_code) {
+			conn->cache_write = begin_range_write(conn, &response);
+			if (NULL == conn->cache_write) {
+				conn->abort_caching = true;
+				release_fill(conn, false);
+			}
+		} else if (!conn->abort_caching) {
+			conn->cache_write = cache_write_begin(conn->uri, conn->temp_cache_filename, conn->is_fill_leader ? conn->fill : NULL);
+			if (NULL == conn->cache_write) {
+				conn->abort_caching = true;
+				release_fill(conn, false);
+			} else {
+				// the writer now owns the temp cache_file, and ends the fill once it is written
+				conn->temp_cache_filename[0] = '\0';
+				if (conn->is_fill_leader) {
+					conn->fill = NULL;
+					conn->is_fill_leader = false;
+				}
+			}
+		}
+
+		if (ENCODING_IDENTITY != conn->encoding && 200 == response.status_code && !body_framer_done(&conn->framer)
+			&& encoding_is_compressible(&response)) {
+			start_encoding(conn, buffer, header_len, NULL != conn->cache_write);
+		}
+
+		// print whether using chunked encoding
+		if (conn->framer.chunked) {
+			log_debug("Using chunked encoding.\n");
+		} else {
+			log_debug("Not using chunked encoding.\n");
+		}
+		body_start = header_len;
+		body_len = conn->buffer_len - header_len;
+	}
+
+	log_debug("Response received from host.\n");
+	if (NULL != conn->encoder) {
+		conn->buffer_len = body_start + body_len;
+		conn->body_start = body_start;
+		return submit_work(conn, &compress_received, STATE_ORIGIN_RECV);
+	}
+	int body_used = body_framer_consume(&conn->framer, buffer + body_start, body_len);
+	if (body_used < body_len) {
+		// host sent more than the response, its connection cannot be reused
+		conn->framer.keep_alive = false;
+	}
+
+	conn->buffer_len = body_start + body_used;
+	conn->buffer_sent = 0;
+	conn->state = STATE_CLIENT_SEND;
+	conn->next_state = STATE_ORIGIN_RECV;
+	return STEP_CONTINUE;
+}
+
+/*
+* Starts writing the body of the 206 response in buffer into the partial object of uri, if it
+* is a single byte range of a body of known length with a strong validator. Returns NULL if the
+* range is not cached.
+*/
+struct cache_write * begin_range_write(struct connection * conn, const struct http_message * response) {
+	char value[VALIDATOR_SIZE];
+	long long first, last, length;
+	// only a Range request gets a 206, and it does not lead a fill
+	if (conn->is_fill_leader || !freshness_has_strong_validator(&conn->cache_meta)) {
+		return NULL;
+	}
+	struct http_slice content_range = response->fields[HTTP_FIELD_CONTENT_RANGE];
+	if (NULL == content_range.data || content_range.len >= VALIDATOR_SIZE) {
+		return NULL;
+	}
+	http_copy_slice(content_range, value, sizeof(value));
+	if (!http_parse_content_range(value, &first, &last, &length) || response->content_length != last - first + 1) {
+		return NULL;
+	}
+
+	uint64_t partial_id;
+	int fd = partial_begin(conn->uri, conn->buffer, response->header_len, length, &conn->cache_meta, &partial_id);
+	if (-1 == fd) {
+		return NULL;
+	}
+	struct cache_write * cache_write = cache_write_begin_range(conn->uri, fd, partial_id, first);
+	if (NULL == cache_write) {
+		close(fd);
+		return NULL;
+	}
+	log_debug("Caching bytes %lld-%lld of %lld.\n", first, last, length);
+	conn->cache_write_skip = response->header_len;
+	conn->memory_fill_abort = true;
+	return cache_write;
+}
+
+/*
+* Sends the data in buffer (or encoded, for a compressed response) to client, then moves on to
+* next_state.
+*/
+enum step_result client_send(struct connection * conn) {
+	const char * data = (NULL != conn->encoder) ? conn->encoded : conn->buffer;
+	int len = (NULL != conn->encoder) ? conn->encoded_len : conn->buffer_len;
+	while (conn->buffer_sent < len) {
+		int num_bytes_sent = send(conn->client_socket_fd, data + conn->buffer_sent, len - conn->buffer_sent, MSG_NOSIGNAL);
+		if (-1 == num_bytes_sent) {
+			if (EAGAIN == errno || EWOULDBLOCK == errno) {
+				return STEP_WAIT;
+			}
+			log_debug("Failed to send response to client.\n");
+			return STEP_DONE;
+		}
+		conn->buffer_sent += num_bytes_sent;
+		stats_add(conn->reactor->stats, STAT_CLIENT_BYTES_OUT, num_bytes_sent);
+	}
+
+	if (STATE_ORIGIN_RECV == conn->next_state) {
+		log_debug("Sent data to client.\n");
+		// cache response, the writer appends it to the temp cache_file off this thread
+		// Abort caching this request if it cannot be queued
+		if (NULL != conn->cache_write) {
+			if (-1 == cache_write_append(conn->cache_write, conn->buffer + conn->cache_write_skip, conn->buffer_len - conn->cache_write_skip)) {
+				conn->abort_caching = true;
+				stats_add(conn->reactor->stats, STAT_FILL_ABORTS, 1);
+				// followers fetch the response themselves once the fill fails
+				cache_write_abort(conn->cache_write);
+				conn->cache_write = NULL;
+			} else {
+				append_memory_fill(conn, conn->buffer, conn->buffer_len);
+			}
+		}
+		conn->cache_write_skip = 0;
+		cache_encoded(conn);
+		if (body_framer_done(&conn->framer)) {
+			return finish_response(conn);
+		}
+		// nothing left to cache or compress, so the rest of the body does not need to pass through buffer
+		if (conn->abort_caching && NULL == conn->encoder && can_splice_response(conn)) {
+			conn->state = STATE_SPLICE_RELAY;
+			return STEP_CONTINUE;
+		}
+	}
+	if (STATE_ENCODE_SEND == conn->next_state) {
+		cache_encoded(conn);
+		if (body_framer_done(&conn->framer)) {
+			if (NULL != conn->variant_write) {
+				cache_write_finish(conn->variant_write, &conn->cache_meta);
+				conn->variant_write = NULL;
+			}
+			log_debug("Request retrieved from cache.\n");
+			return finish_request(conn);
+		}
+	}
+	conn->state = conn->next_state;
+	return STEP_CONTINUE;
+}
+
+/*
+* Returns true if the rest of the response body can be moved with splice. That needs a pipe,
+* and a body whose end is known without looking at it (so not chunked).
+*/
+bool can_splice_response(struct connection * conn) {
+	if (BODY_LENGTH != conn->framer.state && BODY_UNTIL_CLOSE != conn->framer.state) {
+		return false;
+	}
+	// the body is already arriving in the buffers of the reactor's multishot recv
+	if (conn->reactor->multishot_recv) {
+		return false;
+	}
+	if (-1 == conn->pipe_fds[0] && -1 == pipe2(conn->pipe_fds, O_NONBLOCK | O_CLOEXEC)) {
+		conn->pipe_fds[0] = -1;
+		conn->pipe_fds[1] = -1;
+		return false;
+	}
+	return true;
+}
+
+/*
+* Relays the response body from host to client through pipe_fds without copying it to user space.
+*/
+enum step_result splice_relay(struct connection * conn) {
+	while (true) {
+		// empty the pipe into the client first
+		while (conn->pipe_bytes > 0) {
+			ssize_t num_bytes_sent = splice(conn->pipe_fds[0], NULL, conn->client_socket_fd, NULL, conn->pipe_bytes, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+			if (-1 == num_bytes_sent) {
+				if (EAGAIN == errno || EWOULDBLOCK == errno) {
+					return STEP_WAIT;
+				}
+				log_debug("Failed to send response to client.\n");
+				return STEP_DONE;
+			}
+			conn->pipe_bytes -= num_bytes_sent;
+			stats_add(conn->reactor->stats, STAT_CLIENT_BYTES_OUT, num_bytes_sent);
+		}
+		if (body_framer_done(&conn->framer)) {
+			return finish_response(conn);
+		}
+
+		size_t want = SPLICE_SIZE;
+		if (BODY_LENGTH == conn->framer.state && conn->framer.remaining < want) {
+			want = conn->framer.remaining;
+		}
+		ssize_t num_bytes_read = splice(conn->host_socket_fd, NULL, conn->pipe_fds[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if (-1 == num_bytes_read) {
+			if (EAGAIN == errno || EWOULDBLOCK == errno) {
+				return STEP_WAIT;
+			}
+			log_debug("Failed to receive response from host server.\n");
+			return STEP_DONE;
+		}
+		if (0 == num_bytes_read) {
+			log_debug("Host has closed the connection.\n");
+			if (BODY_UNTIL_CLOSE == conn->framer.state) {
+				conn->client_keep_alive = false;
+			}
+			if (body_framer_close(&conn->framer)) {
+				return finish_response(conn);
+			}
+			return STEP_DONE;
+		}
+		conn->pipe_bytes += num_bytes_read;
+		stats_add(conn->reactor->stats, STAT_UPSTREAM_BYTES_IN, num_bytes_read);
+		body_framer_skip(&conn->framer, num_bytes_read);
+	}
+}
+
+/*
+* Called once the whole response has been relayed to the client. Completes the cache_file and
+* hands the connection to host back to the upstream pool if it can be reused.
+*/
+enum step_result finish_response(struct connection * conn) {
+	stats_record(conn->reactor->stats, STAT_UPSTREAM_TRANSFER, monotonic_us() - conn->first_byte_us);
+
+	// the writer stores the temp cache_file once the rest of the response is written
+	if (NULL != conn->cache_write) {
+		cache_write_finish(conn->cache_write, &conn->cache_meta);
+		conn->cache_write = NULL;
+		if (!conn->memory_fill_abort) {
+			memcache_put(conn->uri, conn->memory_fill, conn->memory_fill_len);
+		}
+	}
+	if (NULL != conn->variant_write) {
+		cache_write_finish(conn->variant_write, &conn->cache_meta);
+		conn->variant_write = NULL;
+	}
+	// a fill still held here was not cached
+	release_fill(conn, false);
+
+	if (conn->framer.keep_alive) {
+		upstream_release(conn->reactor->upstream_pool, conn->host, conn->port, conn->host_socket_fd);
+		conn->host_socket_fd = -1;
+		log_debug("Returned connection to host to the pool.\n");
+	}
+	return finish_request(conn);
+}
+
+/*
+* Called when host answers the revalidation of a stale cached response with 304 Not Modified.
+* The cached response is fresh again and is sent to client from the cache.
+*/
+enum step_result finish_revalidation(struct connection * conn, const struct http_message * response) {
+	int header_len = response->header_len;
+	log_debug("Cached response is still valid.\n");
+	freshness_update(&conn->cache_meta, response, time(NULL));
+	// the index is updated before followers are woken, so they find the revalidated response
+	// in the cache instead of going to host each; only the .meta file is left to a writer thread
+	if (0 == update_cache_meta_for_request(conn->uri, &conn->cache_meta)) {
+		cache_write_update_meta(conn->uri, &conn->cache_meta);
+	}
+	release_fill(conn, false);
+
+	body_framer_init(&conn->framer, response);
+	if (conn->framer.keep_alive && header_len == conn->buffer_len) {
+		upstream_release(conn->reactor->upstream_pool, conn->host, conn->port, conn->host_socket_fd);
+		log_debug("Returned connection to host to the pool.\n");
+	} else {
+		reactor_close(conn->reactor, conn->host_socket_fd);
+	}
+	conn->host_socket_fd = -1;
+
+	if (!open_cached_response(conn)) {
+		return send_error_msg_and_close(conn, "502 Bad Gateway.\n");
+	}
+	return STEP_CONTINUE;
+}
+
+/*
+* Called once a response has been completely sent to client. Closes the connection unless the
+* client keeps it alive, in which case the next (possibly already pipelined) request is read.
+*/
+enum step_result finish_request(struct connection * conn) {
+	if (!conn->client_keep_alive || __atomic_load_n(&draining, __ATOMIC_RELAXED)) {
+		return STEP_DONE;
+	}
+	release_request(conn);
+	conn->state = STATE_CLIENT_RECV;
+	reactor_timer_add(conn->reactor, &conn->idle_timer, CLIENT_IDLE_TIMEOUT_MS);
+	log_debug("Waiting for next request from client.\n");
+	return STEP_CONTINUE;
+}
+
+/*
+* Sends the response another connection is fetching to client with sendfile, from its temp
+* cache_file as the leader writes it. If the fetch fails before anything was sent, the request
+* goes to host instead.
+*/
+enum step_result fill_follow(struct connection * conn) {
+	off_t bytes_written;
+	bool complete, failed, delimited;
+	while (true) {
+		fill_status(conn->fill, &bytes_written, &complete, &failed, &delimited);
+		if (failed) {
+			release_fill(conn, false);
+			if (0 == conn->cache_file_offset) {
+				// host may have revalidated the cached response instead of sending a new one
+				struct cache_meta meta;
+				if (get_cache_meta_for_request(conn->uri, &meta) && freshness_matches_request(&meta, conn->client_request)
+					&& freshness_is_fresh(&meta, time(NULL)) && open_cached_response(conn)) {
+					return STEP_CONTINUE;
+				}
+				log_debug("Fetch by other connection failed, ping host!\n");
+				return use_proxy(conn);
+			}
+			log_debug("Fetch by other connection failed.\n");
+			return STEP_DONE;
+		}
+		if (conn->cache_file_offset >= bytes_written) {
+			break;
+		}
+		ssize_t num_bytes_sent = sendfile(conn->client_socket_fd, conn->fill->fd, &conn->cache_file_offset, bytes_written - conn->cache_file_offset);
+		if (-1 == num_bytes_sent) {
+			if (EAGAIN == errno || EWOULDBLOCK == errno) {
+				return STEP_WAIT;
+			}
+			log_debug("Failed to send response to client.\n");
+			return STEP_DONE;
+		}
+		if (0 == num_bytes_sent) {
+			return STEP_DONE;
+		}
+		stats_add(conn->reactor->stats, STAT_CLIENT_BYTES_OUT, num_bytes_sent);
+	}
+	if (!complete) {
+		return STEP_WAIT; // on_fill_progress drives the connection again
+	}
+	if (!delimited) {
+		conn->client_keep_alive = false;
+	}
+	log_debug("Request retrieved from fetch by other connection.\n");
+	return finish_request(conn);
+}
+
+/*
+* Sends the cached response in cache_file_fd to client with sendfile.
+*/
+enum step_result cache_send(struct connection * conn) {
+	// a cached response without Content-Length or chunked framing ends when the connection does
+	if (conn->is_first_read) {
+		conn->is_first_read = false;
+		int num_bytes_read = pread(conn->cache_file_fd, conn->buffer, BUFFER_SIZE, 0);
+		if (num_bytes_read <= 0 || !response_is_delimited(conn->buffer, num_bytes_read)) {
+			conn->client_keep_alive = false;
+		}
+	}
+
+	while (conn->cache_file_offset < conn->cache_file_size) {
+		ssize_t num_bytes_sent = sendfile(conn->client_socket_fd, conn->cache_file_fd, &conn->cache_file_offset, conn->cache_file_size - conn->cache_file_offset);
+		if (-1 == num_bytes_sent) {
+			if (EAGAIN == errno || EWOULDBLOCK == errno) {
+				return STEP_WAIT;
+			}
+			log_debug("Failed to send response to client.\n");
+			return STEP_DONE;
+		}
+		if (0 == num_bytes_sent) {
+			break; // file was truncated under us
+		}
+		stats_add(conn->reactor->stats, STAT_CLIENT_BYTES_OUT, num_bytes_sent);
+	}
+	log_debug("Request retrieved from cache.\n");
+	return finish_request(conn);
+}
+
+/*
+* Has a cache_file small enough for the memory cache read into a new memory cache object on a
+* worker thread, so later hits are sent from memory.
+*/
+void promote_cache_file(struct connection * conn, const char * key) {
+	if (conn->cache_file_size > MEMCACHE_MAX_OBJECT_SIZE) {
+		return;
+	}
+	struct promotion * promotion = (struct promotion *) malloc(sizeof(struct promotion));
+	if (NULL == promotion) {
+		return;
+	}
+	promotion->key = strdup(key);
+	promotion->fd = dup(conn->cache_file_fd);
+	promotion->size = conn->cache_file_size;
+	if (NULL == promotion->key || -1 == promotion->fd) {
+		if (-1 != promotion->fd) {
+			close(promotion->fd);
+		}
+		free(promotion->key);
+		free(promotion);
+		return;
+	}
+	work_init(&promotion->work, &run_promotion, NULL);
+	work_submit(conn->reactor, &promotion->work);
+}
+
+/*
+* Runs on a worker thread. Reads the cache_file of a promotion into the memory cache and frees it.
+*/
+void run_promotion(struct work * work) {
+	struct promotion * promotion = (struct promotion *) ((char *) work - offsetof(struct promotion, work));
+	struct mem_object * object = read_cache_file_into_memory(promotion->key, promotion->fd, promotion->size);
+	if (NULL != object) {
+		memcache_release(object);
+	}
+	close(promotion->fd);
+	free(promotion->key);
+	free(promotion);
+}
+
+/*
+* Sends the cached response in mem_object to client.
+*/
+enum step_result memory_send(struct connection * conn) {
+	struct mem_object * object = conn->mem_object;
+	if (conn->is_first_read) {
+		conn->is_first_read = false;
+		if (!response_is_delimited(object->data, object->size)) {
+			conn->client_keep_alive = false;
+		}
+	}
+
+	while (conn->mem_object_sent < conn->mem_object_end) {
+		int num_bytes_sent = send(conn->client_socket_fd, object->data + conn->mem_object_sent, conn->mem_object_end - conn->mem_object_sent, MSG_NOSIGNAL);
+		if (-1 == num_bytes_sent) {
+			if (EAGAIN == errno || EWOULDBLOCK == errno) {
+				return STEP_WAIT;
+			}
+			log_debug("Failed to send response to client.\n");
+			return STEP_DONE;
+		}
+		conn->mem_object_sent += num_bytes_sent;
+		stats_add(conn->reactor->stats, STAT_CLIENT_BYTES_OUT, num_bytes_sent);
+	}
+	log_debug("Request retrieved from memory cache.\n");
+	return finish_request(conn);
+}
+
+/*
+* Has the next part of the cached response body compressed and sent to client.
+*/
+enum step_result encode_send(struct connection * conn) {
+	return submit_work(conn, &compress_cached, STATE_ENCODE_SEND);
+}
+
+/*
+* Hands run to the worker pool, and waits for it to be done to send encoded to client and move
+* on to next_state (see on_work_done).
+*/
+enum step_result submit_work(struct connection * conn, void (*run)(struct work *), enum connection_state next_state) {
+	conn->next_state = next_state;
+	conn->state = STATE_WORK_WAIT;
+	work_init(&conn->work, run, &on_work_done);
+	work_submit(conn->reactor, &conn->work);
+	return STEP_WAIT;
+}
+
+/*
+* Runs on a worker thread. Takes the response body received from host out of its framing and
+* compresses it into encoded, leaving in buffer what belongs to the response.
+*/
+void compress_received(struct work * work) {
+	struct connection * conn = (struct connection *) ((char *) work - offsetof(struct connection, work));
+	int body_len = conn->buffer_len - conn->body_start;
+	int body_used = body_framer_decode(&conn->framer, conn->buffer + conn->body_start, body_len, &encode_payload, conn);
+	if (body_used < body_len) {
+		// host sent more than the response, its connection cannot be reused
+		conn->framer.keep_alive = false;
+	}
+	conn->buffer_len = conn->body_start + body_used;
+	// what the client is sent of the body is usable right away
+	flush_encoder(conn, body_framer_done(&conn->framer));
+}
+
+/*
+* Runs on a worker thread. Compresses the cached response body in mem_object or cache_file_fd
+* into encoded until there is something to send or the body is done.
+*/
+void compress_cached(struct work * work) {
+	struct connection * conn = (struct connection *) ((char *) work - offsetof(struct connection, work));
+	while (0 == conn->encoded_len && !body_framer_done(&conn->framer) && !conn->encode_failed) {
+		const char * data;
+		int len;
+		if (NULL != conn->mem_object) {
+			data = conn->mem_object->data + conn->mem_object_sent;
+			len = (conn->mem_object_end - conn->mem_object_sent < BUFFER_SIZE) ? conn->mem_object_end - conn->mem_object_sent : BUFFER_SIZE;
+			conn->mem_object_sent += len;
+		} else {
+			data = conn->buffer;
+			len = pread(conn->cache_file_fd, conn->buffer, BUFFER_SIZE, conn->cache_file_offset);
+			if (-1 == len) {
+				log_debug("Failed to read cached response.\n");
+				conn->encode_failed = true;
+				return;
+			}
+			conn->cache_file_offset += len;
+		}
+		if (0 == len && !body_framer_close(&conn->framer)) {
+			log_debug("Cached response is cut short.\n");
+			conn->encode_failed = true;
+			return;
+		}
+		body_framer_decode(&conn->framer, data, len, &encode_payload, conn);
+		if (body_framer_done(&conn->framer)) {
+			flush_encoder(conn, true);
+		}
+	}
+}
+
+/*
+* Sets up compressing the response with the given head to client with encoding: the head of the
+* compressed response goes into encoded, and it is cached under variant_uri too if cache is set.
+* Returns false if the response has to be sent as it is.
+*/
+bool start_encoding(struct connection * conn, const char * head, int head_len, bool cache) {
+	char encoded_head[BUFFER_SIZE];
+	int len = encoding_write_head(encoded_head, BUFFER_SIZE, head, head_len, conn->encoding);
+	if (-1 == len || len >= BUFFER_SIZE) {
+		return false;
+	}
+	struct encoder * encoder = (struct encoder *) malloc(sizeof(struct encoder));
+	if (NULL == encoder) {
+		return false;
+	}
+	if (-1 == encoder_init(encoder, conn->encoding)) {
+		log_error("Failed to set up %s compression.\n", encoding_name(conn->encoding));
+		free(encoder);
+		return false;
+	}
+	log_debug("Compressing response with %s.\n", encoding_name(conn->encoding));
+	conn->encoder = encoder;
+	conn->encoded_len = 0;
+	append_encoded(conn, encoded_head, len);
+	if (cache) {
+		char temp_filename[TEMP_FILENAME_SIZE];
+		generate_temp_filename(temp_filename);
+		conn->variant_write = cache_write_begin(conn->variant_uri, temp_filename, NULL);
+	}
+	stats_add(conn->reactor->stats, STAT_RESPONSES_ENCODED, 1);
+	return true;
+}
+
+/*
+* Passes body payload found by the framer of the connection in arg to its encoder.
+*/
+void encode_payload(void * arg, const char * data, int len) {
+	struct connection * conn = (struct connection *) arg;
+	if (-1 == encoder_write(conn->encoder, data, len, ENCODER_NO_FLUSH, &emit_encoded_chunk, conn)) {
+		conn->encode_failed = true;
+	}
+}
+
+/*
+* Appends compressed data from the encoder of the connection in arg to encoded as one chunk.
+*/
+void emit_encoded_chunk(void * arg, const char * data, int len) {
+	struct connection * conn = (struct connection *) arg;
+	char chunk_size[16];
+	append_encoded(conn, chunk_size, snprintf(chunk_size, sizeof(chunk_size), "%x\r\n", len));
+	append_encoded(conn, data, len);
+	append_encoded(conn, "\r\n", 2);
+}
+
+/*
+* Gets everything compressed so far out of the encoder, or ends the compressed response if
+* finish is set.
+*/
+void flush_encoder(struct connection * conn, bool finish) {
+	if (-1 == encoder_write(conn->encoder, NULL, 0, finish ? ENCODER_FINISH : ENCODER_FLUSH, &emit_encoded_chunk, conn)) {
+		conn->encode_failed = true;
+	}
+	if (finish) {
+		append_encoded(conn, "0\r\n\r\n", 5);
+	}
+}
+
+/*
+* Appends len bytes of data to encoded, growing it as needed.
+*/
+void append_encoded(struct connection * conn, const char * data, int len) {
+	if (conn->encoded_len + len > conn->encoded_cap) {
+		int cap = (0 == conn->encoded_cap) ? BUFFER_SIZE : conn->encoded_cap;
+		while (cap < conn->encoded_len + len) {
+			cap *= 2;
+		}
+		char * encoded = (char *) realloc(conn->encoded, cap);
+		if (NULL == encoded) {
+			conn->encode_failed = true;
+			return;
+		}
+		conn->encoded = encoded;
+		conn->encoded_cap = cap;
+	}
+	memcpy(conn->encoded + conn->encoded_len, data, len);
+	conn->encoded_len += len;
+}
+
+/*
+* Hands the compressed data just sent to client to the writer caching it, and empties encoded.
+*/
+void cache_encoded(struct connection * conn) {
+	if (NULL == conn->encoder) {
+		return;
+	}
+	if (NULL != conn->variant_write && -1 == cache_write_append(conn->variant_write, conn->encoded, conn->encoded_len)) {
+		cache_write_abort(conn->variant_write);
+		conn->variant_write = NULL;
+	}
+	conn->encoded_len = 0;
+}
+
+/*
+* Appends part of a response being cached to the copy kept for the memory cache, giving up on
+* the copy once the response is larger than MEMCACHE_MAX_OBJECT_SIZE.
+*/
+void append_memory_fill(struct connection * conn, const char * data, int len) {
+	if (conn->memory_fill_abort) {
+		return;
+	}
+	if (conn->memory_fill_len + len > MEMCACHE_MAX_OBJECT_SIZE) {
+		conn->memory_fill_abort = true;
+		free(conn->memory_fill);
+		conn->memory_fill = NULL;
+		return;
+	}
+	if (conn->memory_fill_len + len > conn->memory_fill_cap) {
+		size_t cap = (0 == conn->memory_fill_cap) ? BUFFER_SIZE : conn->memory_fill_cap;
+		while (cap < conn->memory_fill_len + len) {
+			cap *= 2;
+		}
+		char * memory_fill = (char *) realloc(conn->memory_fill, cap);
+		if (NULL == memory_fill) {
+			conn->memory_fill_abort = true;
+			return;
+		}
+		conn->memory_fill = memory_fill;
+		conn->memory_fill_cap = cap;
+	}
+	memcpy(conn->memory_fill + conn->memory_fill_len, data, len);
+	conn->memory_fill_len += len;
+}
+
+/*
+* Returns true if a cached response carries Content-Length or chunked framing, so the client
+* can find its end without the connection closing.
+*/
+bool response_is_delimited(const char * response, int len) {
+	struct http_parser parser;
+	struct http_message message;
+	http_parser_init(&parser);
+	if (HTTP_PARSE_DONE != http_parse_response(&parser, response, len, &message)) {
+		return false;
+	}
+	struct body_framer framer;
+	body_framer_init(&framer, &message);
+	return BODY_UNTIL_CLOSE != framer.state;
+}
+
+/**
+* Returns true if status code is 2XX, otherwise false
+*/
+bool valid_status_code(int status_code) {
+	return 2 == status_code / 100;
+}
+
+/**
+* Appends the conditional header fields of message to dest if conditionals is true, its other
+* fields otherwise, leaving out Host and the ones that only apply to the client's connection to
+* the proxy. Returns the new length of dest, which is at least dest_size if the fields did not fit.
+*/
+int append_header_fields(char * dest, int dest_len, int dest_size, const struct http_message * message, bool conditionals) {
+	int i;
+	for (i = 0; i < message->num_headers && dest_len < dest_size; i++) {
+		const struct http_header * header = &message->headers[i];
+		if (!is_hop_by_hop_field(header->name) && !http_slice_case_equals(header->name, "Host") && conditionals == is_conditional_field(header->name)) {
+			dest_len += snprintf(dest + dest_len, dest_size - dest_len, "%.*s: %.*s\r\n", header->name.len, header->name.data, header->value.len, header->value.data);
+		}
+	}
+	return dest_len;
+}
+
+/**
+* Returns true if header field name only applies to a single connection (RFC 9110, section 7.6.1)
+*/
+bool is_hop_by_hop_field(struct http_slice name) {
+	static const char * names[] = { "Connection", "Proxy-Connection", "Keep-Alive", "TE", "Transfer-Encoding", "Upgrade" };
+	int i;
+	for (i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+		if (http_slice_case_equals(name, names[i])) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/**
+* Returns true if header field name is one of the conditionals the cache sends itself when
+* revalidating
+*/
+bool is_conditional_field(struct http_slice name) {
+	return http_slice_case_equals(name, "If-None-Match") || http_slice_case_equals(name, "If-Modified-Since");
+}
+
+/*
+* Sets the limit given on the command line as name=value. Returns 0 on success, -1 if it is malformed.
+*/
+int parse_limit(char * arg) {
+	char * value = strchr(arg, '=');
+	if (NULL == value) {
+		return -1;
+	}
+	*value++ = '\0';
+	char * end;
+	long long n = strtoll(value, &end, 10);
+	if (end == value || '\0' != *end) {
+		return -1;
+	}
+	return limiter_set(arg, n);
 }
 
 /**
 * Prints usage info for the program and exits.
 */
 void print_usage_and_exit() {
-	printf("Usage: ./proxyFilter port_no [blacklist_file]\n");
+	printf("Usage: ./proxyFilter [-c cache_megabytes] [-b epoll|io_uring] [-l error|info|debug] [-s stats_port] [-u upgrade_socket] [-d drain_seconds] [-z] [-r limit=n]... port_no [blacklist_file]\n");
 	exit(-1);
 }
 
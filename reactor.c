@@ -0,0 +1,1036 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+
+#include "reactor.h"
+#include "uring.h"
+#include "log.h"
+
+#define LISTEN_BACKLOG 1024
+#define SYNCHRONIZE_POLL_NS 1000000 // how often reactor_synchronize checks on a busy reactor
+#define URING_REMOVE_DATA UINT64_MAX // user_data of removals and cancels, whose completions are ignored
+#define URING_POLL 0 // kinds of io_uring request, in the top bits of their user_data
+#define URING_RECV 1
+#define URING_ACCEPT 2
+#define URING_KIND_SHIFT 62
+#define URING_GEN_MASK 0x3fffffff
+
+/*
+* The requests of an fd registered with an io_uring reactor: a multishot poll, and for fds read
+* with reactor_recv a multishot recv whose data is queued until it is read. Their completions
+* carry the kind of request, the fd and the generation it was armed with, so those of a request
+* that has since been removed or replaced are told apart and ignored.
+*/
+struct uring_watch {
+	struct event_handler * handler;
+	uint32_t events;
+	uint32_t gen;
+	bool active; // the poll is armed
+	bool accepting; // the listener's multishot accept is armed instead of a poll
+	bool receiving; // registered with REACTOR_RECV
+	bool recv_armed; // a multishot recv is running, fd is not polled for input meanwhile
+	bool recv_cancelling; // the recv was cancelled because too much is queued
+	bool recv_eof;
+	int recv_error; // errno that ended the recv
+	uint32_t recv_gen;
+	int num_received; // provided buffers queued, first_received to last_received
+	unsigned short first_received;
+	unsigned short last_received;
+};
+
+/*
+* A provided buffer holding data received for an fd that has not been read yet.
+*/
+struct uring_received {
+	int len;
+	int offset; // bytes already read
+	unsigned short next; // next buffer queued for the same fd
+};
+
+static pthread_mutex_t reactors_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct reactor ** reactors; // every initialized reactor, for reactor_synchronize
+static int num_reactors;
+
+static void on_post_event(struct reactor * reactor, struct event_handler * handler, uint32_t events);
+static void on_listen_event(struct reactor * reactor, struct event_handler * handler, uint32_t events);
+static void on_accept_retry(struct reactor * reactor, struct timer * timer);
+static int grow_watches(struct reactor * reactor, int fd);
+static uint64_t request_data(uint64_t kind, uint32_t gen, int fd);
+static bool is_current(const struct io_uring_cqe * cqe, uint32_t gen);
+static int uring_watch(struct reactor * reactor, int fd, uint32_t events, struct event_handler * handler);
+static int uring_arm(struct reactor * reactor, int fd);
+static bool uring_arm_recv(struct reactor * reactor, int fd);
+static int uring_accept(struct reactor * reactor);
+static void uring_cancel(struct reactor * reactor, uint64_t user_data);
+static void uring_remove_poll(struct reactor * reactor, int fd);
+static void uring_rearm_poll(struct reactor * reactor, int fd);
+static void uring_stop_receiving(struct reactor * reactor, int fd);
+static void uring_unwatch(struct reactor * reactor, int fd);
+static uint32_t complete_poll(struct reactor * reactor, const struct io_uring_cqe * cqe, struct event_handler ** handler);
+static uint32_t complete_recv(struct reactor * reactor, const struct io_uring_cqe * cqe, struct event_handler ** handler);
+static uint32_t complete_accept(struct reactor * reactor, const struct io_uring_cqe * cqe, struct event_handler ** handler);
+static int wait_for_events(struct reactor * reactor, struct epoll_event * events, int timeout);
+
+/*
+* Create a non-blocking TCP socket listening on port. SO_REUSEPORT lets every reactor bind its
+* own listener to the same port so the kernel spreads incoming connections across them.
+* Returns the socket on success, -1 on failure.
+*/
+int create_listener(int port) {
+	int socket_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (-1 == socket_fd) {
+		log_error("Failed to create socket\n");
+		return -1;
+	}
+
+	int on = 1;
+	setsockopt(socket_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	// accepted connections inherit it: responses go out in the pieces they arrive in from the
+	// host, and a small piece held back for the client's delayed ACK would stall it
+	setsockopt(socket_fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+	if (-1 == setsockopt(socket_fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on))) {
+		log_error("Failed to set SO_REUSEPORT: %s\n", strerror(errno));
+		close(socket_fd);
+		return -1;
+	}
+
+	// Bind the socket to the port
+	struct sockaddr_in server;
+	memset(&server, 0, sizeof(server));
+	server.sin_family = AF_INET;
+	server.sin_port = htons(port);
+	server.sin_addr.s_addr = INADDR_ANY; // use my IPv4 address
+
+	if (bind(socket_fd, (struct sockaddr *) &server, sizeof(server)) < 0) {
+		log_error("Failed to bind socket\n");
+		close(socket_fd);
+		return -1;
+	}
+
+	// Listen for incoming connection
+	if (-1 == listen(socket_fd, LISTEN_BACKLOG)) {
+		log_error("Failed to listen for incoming connections\n");
+		close(socket_fd);
+		return -1;
+	}
+	return socket_fd;
+}
+
+/*
+* Put fd into non-blocking mode. Returns 0 on success, -1 on failure.
+*/
+int set_nonblocking(int fd) {
+	int flags = fcntl(fd, F_GETFL, 0);
+	if (-1 == flags) {
+		return -1;
+	}
+	return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+/*
+* Create the epoll instance or io_uring of reactor, as backend asks, and register its listener.
+* A reactor falls back to epoll if io_uring cannot be set up, and an io_uring reactor reads
+* after readiness events if it cannot provide receive buffers. on_accept is called with every
+* connection accepted on the listener and its client's IPv4 address. Returns 0 on success, -1 on
+* failure.
+*/
+int reactor_init(struct reactor * reactor, int id, int listen_fd, enum reactor_backend backend, void (*on_accept)(struct reactor *, int, uint32_t)) {
+	memset(reactor, 0, sizeof(*reactor));
+	reactor->id = id;
+	reactor->listen_fd = listen_fd;
+	reactor->epoll_fd = -1;
+	if (REACTOR_IO_URING == backend) {
+		reactor->uring = (struct uring *) malloc(sizeof(struct uring));
+		if (NULL == reactor->uring || -1 == uring_init(reactor->uring, URING_ENTRIES)) {
+			log_info("Failed to set up io_uring, using epoll instead.\n");
+			free(reactor->uring);
+			reactor->uring = NULL;
+			backend = REACTOR_EPOLL;
+		} else if (-1 != uring_provide_buffers(reactor->uring, URING_BUFFERS, URING_BUFFER_SIZE)) {
+			reactor->received = (struct uring_received *) calloc(URING_BUFFERS, sizeof(struct uring_received));
+			reactor->multishot_recv = (NULL != reactor->received);
+		}
+	}
+	reactor->backend = backend;
+	if (REACTOR_EPOLL == backend) {
+		reactor->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+		if (-1 == reactor->epoll_fd) {
+			log_error("Failed to create epoll instance: %s\n", strerror(errno));
+			return -1;
+		}
+	}
+
+	reactor->listen_handler.on_event = &on_listen_event;
+	reactor->on_accept = on_accept;
+	timer_init(&reactor->accept_timer, &on_accept_retry);
+	int added = (REACTOR_IO_URING == backend) ? uring_accept(reactor) : reactor_add(reactor, listen_fd, EPOLLIN | EPOLLET, &reactor->listen_handler);
+	if (-1 == added) {
+		log_error("Failed to register listener: %s\n", strerror(errno));
+		close(reactor->epoll_fd);
+		return -1;
+	}
+
+	// eventfd other threads signal when they post work to this reactor
+	pthread_mutex_init(&reactor->post_lock, NULL);
+	reactor->posts.prev = &reactor->posts;
+	reactor->posts.next = &reactor->posts;
+	reactor->post_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	reactor->post_handler.on_event = &on_post_event;
+	if (-1 == reactor->post_fd || -1 == reactor_add(reactor, reactor->post_fd, EPOLLIN | EPOLLET, &reactor->post_handler)) {
+		log_error("Failed to set up reactor eventfd: %s\n", strerror(errno));
+		close(reactor->epoll_fd);
+		return -1;
+	}
+
+	// quiescent until its thread picks up a batch of events
+	reactor->quiescent_epoch = 1;
+	pthread_mutex_lock(&reactors_lock);
+	reactors = (struct reactor **) realloc(reactors, (num_reactors + 1) * sizeof(struct reactor *));
+	reactors[num_reactors++] = reactor;
+	pthread_mutex_unlock(&reactors_lock);
+	return 0;
+}
+
+/*
+* Prepare post for use; it starts out not queued.
+*/
+void post_init(struct reactor_post * post, void (*on_post)(struct reactor *, struct reactor_post *)) {
+	post->prev = NULL;
+	post->next = NULL;
+	post->queued = false;
+	post->on_post = on_post;
+}
+
+/*
+* Queue post to run on reactor's thread. Safe to call from any thread.
+*/
+void reactor_post(struct reactor * reactor, struct reactor_post * post) {
+	bool was_empty;
+	pthread_mutex_lock(&reactor->post_lock);
+	if (post->queued) {
+		pthread_mutex_unlock(&reactor->post_lock);
+		return;
+	}
+	was_empty = (reactor->posts.next == &reactor->posts);
+	post->prev = reactor->posts.prev;
+	post->next = &reactor->posts;
+	reactor->posts.prev->next = post;
+	reactor->posts.prev = post;
+	post->queued = true;
+	pthread_mutex_unlock(&reactor->post_lock);
+
+	// the reactor drains the whole queue per wakeup, so only the first post needs to signal
+	if (was_empty) {
+		uint64_t one = 1;
+		if (-1 == write(reactor->post_fd, &one, sizeof(one)) && EAGAIN != errno) {
+			log_error("Failed to signal reactor: %s\n", strerror(errno));
+		}
+	}
+}
+
+/*
+* Take post off reactor's queue if it is still queued. Called before freeing an object that
+* may have been posted.
+*/
+void reactor_unpost(struct reactor * reactor, struct reactor_post * post) {
+	pthread_mutex_lock(&reactor->post_lock);
+	if (post->queued) {
+		post->prev->next = post->next;
+		post->next->prev = post->prev;
+		post->queued = false;
+	}
+	pthread_mutex_unlock(&reactor->post_lock);
+}
+
+/*
+* Runs every post queued for reactor.
+*/
+static void on_post_event(struct reactor * reactor, struct event_handler * handler, uint32_t events) {
+	uint64_t count;
+	while (-1 != read(reactor->post_fd, &count, sizeof(count))) {
+	}
+
+	while (true) {
+		pthread_mutex_lock(&reactor->post_lock);
+		struct reactor_post * post = reactor->posts.next;
+		if (post == &reactor->posts) {
+			pthread_mutex_unlock(&reactor->post_lock);
+			return;
+		}
+		post->prev->next = post->next;
+		post->next->prev = post->prev;
+		post->queued = false;
+		pthread_mutex_unlock(&reactor->post_lock);
+
+		post->on_post(reactor, post);
+	}
+}
+
+/*
+* Hands the connections waiting on the listener to on_accept: the ones the multishot accept took
+* during this batch with io_uring, every pending one with epoll.
+*/
+static void on_listen_event(struct reactor * reactor, struct event_handler * handler, uint32_t events) {
+	struct sockaddr_in client_addr;
+	socklen_t client_addr_size;
+	if (REACTOR_IO_URING == reactor->backend) {
+		int i;
+		for (i = 0; i < reactor->num_accepted; i++) {
+			int fd = reactor->accepted[i];
+			client_addr_size = sizeof(client_addr);
+			if (-1 == getpeername(fd, (struct sockaddr *) &client_addr, &client_addr_size)) {
+				close(fd); // client already gone
+				continue;
+			}
+			reactor->on_accept(reactor, fd, client_addr.sin_addr.s_addr);
+		}
+		reactor->num_accepted = 0;
+		return;
+	}
+
+	// the listener is closed once draining starts
+	while (-1 != reactor->listen_fd) {
+		client_addr_size = sizeof(client_addr);
+		int fd = accept4(reactor->listen_fd, (struct sockaddr *) &client_addr, &client_addr_size, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (-1 == fd) {
+			if (EINTR == errno || ECONNABORTED == errno) {
+				continue;
+			}
+			if (EAGAIN != errno && EWOULDBLOCK != errno) {
+				log_error("Failed to accept incoming connection\n");
+			}
+			return;
+		}
+		reactor->on_accept(reactor, fd, client_addr.sin_addr.s_addr);
+	}
+}
+
+/*
+* Arms the multishot accept again once URING_ACCEPT_RETRY_MS have passed since it failed.
+*/
+static void on_accept_retry(struct reactor * reactor, struct timer * timer) {
+	if (-1 != reactor->listen_fd && !reactor->watches[reactor->listen_fd].accepting) {
+		uring_accept(reactor);
+	}
+}
+
+/*
+* Register fd with the reactor. handler->on_event is called when any of events is ready. With
+* REACTOR_RECV in events, fd must be read with reactor_recv.
+*/
+int reactor_add(struct reactor * reactor, int fd, uint32_t events, struct event_handler * handler) {
+	if (REACTOR_IO_URING == reactor->backend) {
+		return uring_watch(reactor, fd, events, handler);
+	}
+	struct epoll_event event;
+	memset(&event, 0, sizeof(event));
+	event.events = events & ~REACTOR_RECV;
+	event.data.ptr = handler;
+	return epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, fd, &event);
+}
+
+/*
+* Change the events or the handler fd is registered with. Fails if REACTOR_RECV is dropped while
+* data received for fd has not been read, as it would be lost.
+*/
+int reactor_mod(struct reactor * reactor, int fd, uint32_t events, struct event_handler * handler) {
+	if (REACTOR_IO_URING == reactor->backend) {
+		return uring_watch(reactor, fd, events, handler);
+	}
+	struct epoll_event event;
+	memset(&event, 0, sizeof(event));
+	event.events = events & ~REACTOR_RECV;
+	event.data.ptr = handler;
+	return epoll_ctl(reactor->epoll_fd, EPOLL_CTL_MOD, fd, &event);
+}
+
+/*
+* Stop watching fd.
+*/
+int reactor_del(struct reactor * reactor, int fd) {
+	if (REACTOR_IO_URING == reactor->backend) {
+		uring_unwatch(reactor, fd);
+		return 0;
+	}
+	return epoll_ctl(reactor->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+/*
+* Stops accepting connections on the reactor's listener and closes it. The listener may have
+* been handed to another process, which keeps the socket open, so it is taken out of the epoll
+* set explicitly rather than by the close.
+*/
+void reactor_stop_listening(struct reactor * reactor) {
+	if (-1 == reactor->listen_fd) {
+		return;
+	}
+	reactor_del(reactor, reactor->listen_fd);
+	reactor_timer_cancel(reactor, &reactor->accept_timer);
+	close(reactor->listen_fd);
+	reactor->listen_fd = -1;
+}
+
+/*
+* Stop watching fd and close it. A poll request in an io_uring holds on to the socket, which
+* would stay open after a plain close, so fds registered with a reactor are closed through here.
+*/
+int reactor_close(struct reactor * reactor, int fd) {
+	if (REACTOR_IO_URING == reactor->backend) {
+		uring_unwatch(reactor, fd);
+	}
+	return close(fd);
+}
+
+/*
+* Reads up to len bytes from fd into dest, like recv. An fd registered with REACTOR_RECV on an
+* io_uring reactor is read from the data its multishot recv has queued; the socket itself is
+* only read while that recv is not running, and the recv is armed again once it is drained.
+*/
+int reactor_recv(struct reactor * reactor, int fd, char * dest, int len) {
+	if (REACTOR_IO_URING != reactor->backend || fd >= reactor->max_watches || !reactor->watches[fd].receiving) {
+		return recv(fd, dest, len, 0);
+	}
+	struct uring_watch * watch = &reactor->watches[fd];
+	int copied = 0;
+	while (copied < len && watch->num_received > 0) {
+		unsigned short bid = watch->first_received;
+		struct uring_received * received = &reactor->received[bid];
+		int n = received->len - received->offset;
+		if (n > len - copied) {
+			n = len - copied;
+		}
+		memcpy(dest + copied, uring_buffer(reactor->uring, bid) + received->offset, n);
+		received->offset += n;
+		copied += n;
+		if (received->offset == received->len) {
+			watch->first_received = received->next;
+			watch->num_received--;
+			uring_recycle_buffer(reactor->uring, bid);
+			reactor->buffers_held--;
+		}
+	}
+	if (copied > 0) {
+		return copied;
+	}
+	if (watch->recv_eof) {
+		return 0;
+	}
+	if (0 != watch->recv_error) {
+		errno = watch->recv_error;
+		return -1;
+	}
+	if (watch->recv_armed) {
+		errno = EAGAIN;
+		return -1;
+	}
+	int n = recv(fd, dest, len, 0);
+	if (-1 == n && (EAGAIN == errno || EWOULDBLOCK == errno)) {
+		// drained, what arrives next comes with the completions of the recv again
+		if (uring_arm_recv(reactor, fd)) {
+			uring_rearm_poll(reactor, fd);
+		}
+		errno = EAGAIN;
+	}
+	return n;
+}
+
+/*
+* Makes room for the watch of fd. Returns 0 on success, -1 on failure.
+*/
+static int grow_watches(struct reactor * reactor, int fd) {
+	if (fd < reactor->max_watches) {
+		return 0;
+	}
+	int max_watches = (0 == reactor->max_watches) ? 1024 : reactor->max_watches;
+	while (max_watches <= fd) {
+		max_watches *= 2;
+	}
+	struct uring_watch * watches = (struct uring_watch *) realloc(reactor->watches, max_watches * sizeof(struct uring_watch));
+	if (NULL == watches) {
+		return -1;
+	}
+	memset(watches + reactor->max_watches, 0, (max_watches - reactor->max_watches) * sizeof(struct uring_watch));
+	reactor->watches = watches;
+	reactor->max_watches = max_watches;
+	return 0;
+}
+
+/*
+* Returns the user_data of the request of kind on fd armed in generation gen
+*/
+static uint64_t request_data(uint64_t kind, uint32_t gen, int fd) {
+	return (kind << URING_KIND_SHIFT) | ((uint64_t) (gen & URING_GEN_MASK) << 32) | (uint32_t) fd;
+}
+
+/*
+* Returns true if cqe belongs to the request armed in generation gen
+*/
+static bool is_current(const struct io_uring_cqe * cqe, uint32_t gen) {
+	return ((cqe->user_data >> 32) & URING_GEN_MASK) == (gen & URING_GEN_MASK);
+}
+
+/*
+* Arms a multishot poll request for events on fd that calls handler, replacing the one fd has,
+* if any, and a multishot recv if events has REACTOR_RECV. Returns 0 on success, -1 on failure.
+*/
+static int uring_watch(struct reactor * reactor, int fd, uint32_t events, struct event_handler * handler) {
+	if (-1 == grow_watches(reactor, fd)) {
+		return -1;
+	}
+	struct uring_watch * watch = &reactor->watches[fd];
+	bool receive = 0 != (events & REACTOR_RECV);
+	if (watch->receiving && !receive) {
+		bool unread = watch->num_received > 0 || watch->recv_eof || 0 != watch->recv_error;
+		uring_stop_receiving(reactor, fd);
+		// the cancel goes in now, before the caller sends anything the old recv could take
+		uring_submit_and_wait(reactor->uring, 0);
+		if (unread) {
+			uring_remove_poll(reactor, fd);
+			return -1;
+		}
+	}
+	uring_remove_poll(reactor, fd);
+	watch->handler = handler;
+	watch->events = events & ~REACTOR_RECV;
+	if (receive && !watch->receiving) {
+		watch->receiving = true;
+		uring_arm_recv(reactor, fd);
+	}
+	watch->active = true;
+	return uring_arm(reactor, fd);
+}
+
+/*
+* Queues the poll request of fd. Like EPOLLET, a multishot poll reports each new wakeup of the
+* fd (and whatever is ready when it is armed) rather than the ready state on every wait. Input
+* is left to the recv while one is running.
+*/
+static int uring_arm(struct reactor * reactor, int fd) {
+	struct uring_watch * watch = &reactor->watches[fd];
+	struct io_uring_sqe * sqe = uring_get_sqe(reactor->uring);
+	if (NULL == sqe) {
+		watch->active = false;
+		return -1;
+	}
+	uint32_t events = watch->events & ~EPOLLET;
+	if (watch->recv_armed) {
+		events &= ~(EPOLLIN | EPOLLRDHUP);
+	}
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = fd;
+	sqe->len = IORING_POLL_ADD_MULTI;
+	sqe->poll32_events = events;
+	sqe->user_data = request_data(URING_POLL, watch->gen, fd);
+	return 0;
+}
+
+/*
+* Queues a multishot recv of fd into the provided buffers, unless the reactor has none or they
+* are running low (fd is then read after readiness events). Returns true if it was queued.
+*/
+static bool uring_arm_recv(struct reactor * reactor, int fd) {
+	struct uring_watch * watch = &reactor->watches[fd];
+	if (!reactor->multishot_recv || watch->recv_armed || reactor->buffers_held > URING_BUFFERS / 2) {
+		return false;
+	}
+	struct io_uring_sqe * sqe = uring_get_sqe(reactor->uring);
+	if (NULL == sqe) {
+		return false;
+	}
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = fd;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = URING_BUFFER_GROUP;
+	sqe->user_data = request_data(URING_RECV, watch->recv_gen, fd);
+	watch->recv_armed = true;
+	return true;
+}
+
+/*
+* Queues the multishot accept of the listener. Every connection it accepts posts a completion
+* with the new socket. Returns 0 on success, -1 on failure.
+*/
+static int uring_accept(struct reactor * reactor) {
+	int fd = reactor->listen_fd;
+	if (-1 == grow_watches(reactor, fd)) {
+		return -1;
+	}
+	struct uring_watch * watch = &reactor->watches[fd];
+	struct io_uring_sqe * sqe = uring_get_sqe(reactor->uring);
+	if (NULL == sqe) {
+		return -1;
+	}
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = fd;
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+	sqe->user_data = request_data(URING_ACCEPT, watch->gen, fd);
+	watch->handler = &reactor->listen_handler;
+	watch->accepting = true;
+	return 0;
+}
+
+/*
+* Queues the cancellation of the request with user_data
+*/
+static void uring_cancel(struct reactor * reactor, uint64_t user_data) {
+	struct io_uring_sqe * sqe = uring_get_sqe(reactor->uring);
+	if (NULL == sqe) {
+		log_error("io_uring submission queue is full, fd %d keeps its request.\n", (int) (uint32_t) user_data);
+		return;
+	}
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = -1;
+	sqe->addr = user_data;
+	sqe->user_data = URING_REMOVE_DATA;
+}
+
+/*
+* Queues the removal of the poll request of fd, if it has one. Completions it already posted
+* are ignored from now on.
+*/
+static void uring_remove_poll(struct reactor * reactor, int fd) {
+	if (fd >= reactor->max_watches || !reactor->watches[fd].active) {
+		return;
+	}
+	struct uring_watch * watch = &reactor->watches[fd];
+	struct io_uring_sqe * sqe = uring_get_sqe(reactor->uring);
+	if (NULL == sqe) {
+		log_error("io_uring submission queue is full, fd %d stays polled.\n", fd);
+	} else {
+		sqe->opcode = IORING_OP_POLL_REMOVE;
+		sqe->fd = -1;
+		sqe->addr = request_data(URING_POLL, watch->gen, fd);
+		sqe->user_data = URING_REMOVE_DATA;
+	}
+	watch->active = false;
+	watch->gen++;
+}
+
+/*
+* Replaces the poll request of fd, if it has one, after its recv was armed or ended.
+*/
+static void uring_rearm_poll(struct reactor * reactor, int fd) {
+	if (reactor->watches[fd].active) {
+		uring_remove_poll(reactor, fd);
+		reactor->watches[fd].active = true;
+		uring_arm(reactor, fd);
+	}
+}
+
+/*
+* Cancels the recv of fd, if it has one, and drops the data it queued.
+*/
+static void uring_stop_receiving(struct reactor * reactor, int fd) {
+	struct uring_watch * watch = &reactor->watches[fd];
+	if (!watch->receiving) {
+		return;
+	}
+	if (watch->recv_armed) {
+		uring_cancel(reactor, request_data(URING_RECV, watch->recv_gen, fd));
+	}
+	while (watch->num_received > 0) {
+		unsigned short bid = watch->first_received;
+		watch->first_received = reactor->received[bid].next;
+		watch->num_received--;
+		uring_recycle_buffer(reactor->uring, bid);
+		reactor->buffers_held--;
+	}
+	watch->receiving = false;
+	watch->recv_armed = false;
+	watch->recv_cancelling = false;
+	watch->recv_eof = false;
+	watch->recv_error = 0;
+	watch->recv_gen++;
+}
+
+/*
+* Queues the removal of every request of fd. Completions they already posted are ignored from
+* now on, except for connections the listener's accept took, which are still served.
+*/
+static void uring_unwatch(struct reactor * reactor, int fd) {
+	if (fd >= reactor->max_watches) {
+		return;
+	}
+	struct uring_watch * watch = &reactor->watches[fd];
+	if (watch->accepting) {
+		uring_cancel(reactor, request_data(URING_ACCEPT, watch->gen, fd));
+		watch->accepting = false;
+		watch->gen++;
+	}
+	uring_stop_receiving(reactor, fd);
+	uring_remove_poll(reactor, fd);
+}
+
+/*
+* Handles a completion of the poll request of an fd. Returns the events it reports for handler,
+* 0 if there are none.
+*/
+static uint32_t complete_poll(struct reactor * reactor, const struct io_uring_cqe * cqe, struct event_handler ** handler) {
+	int fd = (int) (uint32_t) cqe->user_data;
+	struct uring_watch * watch = &reactor->watches[fd];
+	if (!watch->active || !is_current(cqe, watch->gen)) {
+		return 0; // request removed or replaced since
+	}
+	*handler = watch->handler;
+	if (!(cqe->flags & IORING_CQE_F_MORE)) {
+		// the kernel ended the request, put it back unless it failed
+		if (cqe->res < 0) {
+			watch->active = false;
+			watch->gen++;
+		} else {
+			uring_arm(reactor, fd);
+		}
+	}
+	return (cqe->res < 0) ? (EPOLLERR | EPOLLHUP) : (uint32_t) cqe->res;
+}
+
+/*
+* Handles a completion of the recv of an fd, queueing the data it carries for reactor_recv.
+* A recv holding URING_MAX_QUEUED buffers is cancelled until its fd has been read. Returns the
+* events it reports for handler, 0 if there are none.
+*/
+static uint32_t complete_recv(struct reactor * reactor, const struct io_uring_cqe * cqe, struct event_handler ** handler) {
+	int fd = (int) (uint32_t) cqe->user_data;
+	struct uring_watch * watch = &reactor->watches[fd];
+	bool has_buffer = 0 != (cqe->flags & IORING_CQE_F_BUFFER);
+	unsigned short bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+	if (!watch->receiving || !is_current(cqe, watch->recv_gen)) {
+		if (has_buffer) {
+			uring_recycle_buffer(reactor->uring, bid);
+		}
+		return 0;
+	}
+	*handler = watch->handler;
+	if (cqe->res > 0 && has_buffer) {
+		reactor->received[bid].len = cqe->res;
+		reactor->received[bid].offset = 0;
+		if (0 == watch->num_received) {
+			watch->first_received = bid;
+		} else {
+			reactor->received[watch->last_received].next = bid;
+		}
+		watch->last_received = bid;
+		watch->num_received++;
+		reactor->buffers_held++;
+	} else if (has_buffer) {
+		uring_recycle_buffer(reactor->uring, bid);
+	}
+	if (cqe->flags & IORING_CQE_F_MORE) {
+		if (watch->num_received >= URING_MAX_QUEUED && !watch->recv_cancelling) {
+			uring_cancel(reactor, request_data(URING_RECV, watch->recv_gen, fd));
+			watch->recv_cancelling = true;
+		}
+		return EPOLLIN;
+	}
+
+	// the recv has ended: at the end of the stream, on an error, or to be armed again later
+	watch->recv_armed = false;
+	watch->recv_cancelling = false;
+	if (0 == cqe->res) {
+		watch->recv_eof = true;
+		return EPOLLIN | EPOLLRDHUP;
+	}
+	if (-EINVAL == cqe->res) {
+		log_info("io_uring has no multishot recv, reading after readiness events instead.\n");
+		reactor->multishot_recv = false;
+	} else if (cqe->res < 0 && -ENOBUFS != cqe->res && -ECANCELED != cqe->res) {
+		watch->recv_error = -cqe->res;
+		return EPOLLIN | EPOLLERR;
+	}
+	// until it is, fd is read after readiness events
+	uring_rearm_poll(reactor, fd);
+	return EPOLLIN;
+}
+
+/*
+* Handles a completion of the listener's multishot accept, adding the connection it accepted to
+* those on_listen_event hands out. Returns the events it reports for the listener, 0 if there
+* are none.
+*/
+static uint32_t complete_accept(struct reactor * reactor, const struct io_uring_cqe * cqe, struct event_handler ** handler) {
+	int fd = (int) (uint32_t) cqe->user_data;
+	struct uring_watch * watch = &reactor->watches[fd];
+	*handler = &reactor->listen_handler;
+	if (cqe->res >= 0) {
+		// a connection accepted just before the listener was given up is still served
+		reactor->accepted[reactor->num_accepted++] = cqe->res;
+	}
+	if (watch->accepting && is_current(cqe, watch->gen) && !(cqe->flags & IORING_CQE_F_MORE)) {
+		watch->accepting = false;
+		watch->gen++;
+		if (cqe->res >= 0 || -ECONNABORTED == cqe->res || -EINTR == cqe->res) {
+			uring_accept(reactor);
+		} else {
+			log_error("Failed to accept incoming connection: %s\n", strerror(-cqe->res));
+			reactor_timer_add(reactor, &reactor->accept_timer, URING_ACCEPT_RETRY_MS);
+		}
+	}
+	return (cqe->res >= 0 && 1 == reactor->num_accepted) ? EPOLLIN : 0;
+}
+
+/*
+* Waits up to timeout ms (-1 for ever) for registered fds to become ready and fills in events
+* with their handlers, as epoll_wait does. Returns the number of events, -1 on failure.
+*/
+static int wait_for_events(struct reactor * reactor, struct epoll_event * events, int timeout) {
+	if (REACTOR_EPOLL == reactor->backend) {
+		return epoll_wait(reactor->epoll_fd, events, MAX_EVENTS, timeout);
+	}
+
+	// poll changes made while handling the last batch go in with the wait
+	struct uring * ring = reactor->uring;
+	if (-1 == uring_submit_and_wait(ring, timeout)) {
+		return -1;
+	}
+	int num_events = 0;
+	unsigned ready = uring_cq_ready(ring);
+	unsigned i;
+	for (i = 0; i < ready && num_events < MAX_EVENTS && reactor->num_accepted < MAX_EVENTS; i++) {
+		struct io_uring_cqe * cqe = uring_cqe_at(ring, i);
+		if (URING_REMOVE_DATA == cqe->user_data) {
+			continue;
+		}
+		struct event_handler * handler = NULL;
+		uint32_t ready_events;
+		switch (cqe->user_data >> URING_KIND_SHIFT) {
+		case URING_RECV:
+			ready_events = complete_recv(reactor, cqe, &handler);
+			break;
+		case URING_ACCEPT:
+			ready_events = complete_accept(reactor, cqe, &handler);
+			break;
+		default:
+			ready_events = complete_poll(reactor, cqe, &handler);
+		}
+		if (0 != ready_events) {
+			events[num_events].events = ready_events;
+			events[num_events].data.ptr = handler;
+			num_events++;
+		}
+	}
+	uring_cq_advance(ring, i);
+	return num_events;
+}
+
+/*
+* Free ptr once the current batch of events has been dispatched, since later events in the same
+* batch may still point at it.
+*/
+void reactor_defer_free(struct reactor * reactor, void * ptr, void (*free_fn)(void *)) {
+	if (reactor->num_deferred == reactor->max_deferred) {
+		int max_deferred = (0 == reactor->max_deferred) ? 64 : 2 * reactor->max_deferred;
+		struct deferred_free * deferred = (struct deferred_free *) realloc(reactor->deferred, max_deferred * sizeof(struct deferred_free));
+		if (NULL == deferred) {
+			log_error("Out of memory deferring free, leaking object.\n");
+			return;
+		}
+		reactor->deferred = deferred;
+		reactor->max_deferred = max_deferred;
+	}
+	reactor->deferred[reactor->num_deferred].ptr = ptr;
+	reactor->deferred[reactor->num_deferred].free_fn = free_fn;
+	reactor->num_deferred++;
+}
+
+/*
+* Returns the current CLOCK_MONOTONIC time in milliseconds.
+*/
+uint64_t monotonic_ms() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+* Returns the current CLOCK_MONOTONIC time in microseconds, for measuring latencies.
+*/
+uint64_t monotonic_us() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+* Prepare timer for use; it starts out not armed.
+*/
+void timer_init(struct timer * timer, void (*on_timeout)(struct reactor *, struct timer *)) {
+	timer->deadline_ms = 0;
+	timer->heap_index = -1;
+	timer->on_timeout = on_timeout;
+}
+
+static void timer_heap_swap(struct reactor * reactor, int i, int j) {
+	struct timer * tmp = reactor->timers[i];
+	reactor->timers[i] = reactor->timers[j];
+	reactor->timers[j] = tmp;
+	reactor->timers[i]->heap_index = i;
+	reactor->timers[j]->heap_index = j;
+}
+
+static void timer_heap_up(struct reactor * reactor, int i) {
+	while (i > 0) {
+		int parent = (i - 1) / 2;
+		if (reactor->timers[parent]->deadline_ms <= reactor->timers[i]->deadline_ms) {
+			break;
+		}
+		timer_heap_swap(reactor, i, parent);
+		i = parent;
+	}
+}
+
+static void timer_heap_down(struct reactor * reactor, int i) {
+	while (true) {
+		int smallest = i;
+		int left = 2 * i + 1;
+		int right = left + 1;
+		if (left < reactor->num_timers && reactor->timers[left]->deadline_ms < reactor->timers[smallest]->deadline_ms) {
+			smallest = left;
+		}
+		if (right < reactor->num_timers && reactor->timers[right]->deadline_ms < reactor->timers[smallest]->deadline_ms) {
+			smallest = right;
+		}
+		if (smallest == i) {
+			break;
+		}
+		timer_heap_swap(reactor, i, smallest);
+		i = smallest;
+	}
+}
+
+/*
+* Arm timer to fire delay_ms from now, re-arming it if it is already armed.
+* Returns 0 on success, -1 on failure.
+*/
+int reactor_timer_add(struct reactor * reactor, struct timer * timer, uint64_t delay_ms) {
+	reactor_timer_cancel(reactor, timer);
+	if (reactor->num_timers == reactor->max_timers) {
+		int max_timers = (0 == reactor->max_timers) ? 64 : 2 * reactor->max_timers;
+		struct timer ** timers = (struct timer **) realloc(reactor->timers, max_timers * sizeof(struct timer *));
+		if (NULL == timers) {
+			return -1;
+		}
+		reactor->timers = timers;
+		reactor->max_timers = max_timers;
+	}
+	timer->deadline_ms = monotonic_ms() + delay_ms;
+	timer->heap_index = reactor->num_timers;
+	reactor->timers[reactor->num_timers++] = timer;
+	timer_heap_up(reactor, timer->heap_index);
+	return 0;
+}
+
+/*
+* Disarm timer if it is armed.
+*/
+void reactor_timer_cancel(struct reactor * reactor, struct timer * timer) {
+	int i = timer->heap_index;
+	if (-1 == i) {
+		return;
+	}
+	int last = --reactor->num_timers;
+	if (i != last) {
+		timer_heap_swap(reactor, i, last);
+		timer_heap_down(reactor, i);
+		timer_heap_up(reactor, i);
+	}
+	timer->heap_index = -1;
+}
+
+/*
+* Returns the epoll_wait timeout until the next timer is due, -1 if no timer is armed.
+*/
+static int next_timeout(struct reactor * reactor) {
+	if (0 == reactor->num_timers) {
+		return -1;
+	}
+	uint64_t deadline_ms = reactor->timers[0]->deadline_ms;
+	if (deadline_ms <= reactor->now_ms) {
+		return 0;
+	}
+	return (int) (deadline_ms - reactor->now_ms);
+}
+
+/*
+* Fire every timer whose deadline has passed.
+*/
+static void run_timers(struct reactor * reactor) {
+	while (reactor->num_timers > 0 && reactor->timers[0]->deadline_ms <= reactor->now_ms) {
+		struct timer * timer = reactor->timers[0];
+		reactor_timer_cancel(reactor, timer);
+		timer->on_timeout(reactor, timer);
+	}
+}
+
+/*
+* Run the event loop of the given reactor forever.
+*/
+void * reactor_run(void * arg) {
+	struct reactor * reactor = (struct reactor *) arg;
+	struct epoll_event events[MAX_EVENTS];
+
+	while (true) {
+		reactor->now_ms = monotonic_ms();
+		int num_events = wait_for_events(reactor, events, next_timeout(reactor));
+		if (-1 == num_events) {
+			if (EINTR == errno) {
+				continue;
+			}
+			log_error("Waiting for events failed: %s\n", strerror(errno));
+			return NULL;
+		}
+		__atomic_add_fetch(&reactor->quiescent_epoch, 1, __ATOMIC_SEQ_CST);
+
+		int i;
+		for (i = 0; i < num_events; i++) {
+			struct event_handler * handler = (struct event_handler *) events[i].data.ptr;
+			handler->on_event(reactor, handler, events[i].events);
+		}
+
+		reactor->now_ms = monotonic_ms();
+		run_timers(reactor);
+
+		// release objects closed during this batch
+		for (i = 0; i < reactor->num_deferred; i++) {
+			reactor->deferred[i].free_fn(reactor->deferred[i].ptr);
+		}
+		reactor->num_deferred = 0;
+
+		// nothing from this batch is referenced past this point
+		__atomic_add_fetch(&reactor->quiescent_epoch, 1, __ATOMIC_SEQ_CST);
+	}
+	return NULL;
+}
+
+/*
+* Waits until every reactor has finished the batch of events it was handling, if any. A shared
+* object unpublished before the call is then no longer referenced by any reactor and can be
+* freed, without the reactors ever taking a lock to read it. Must not be called from a reactor.
+*/
+void reactor_synchronize() {
+	pthread_mutex_lock(&reactors_lock);
+	int i;
+	for (i = 0; i < num_reactors; i++) {
+		uint64_t epoch = __atomic_load_n(&reactors[i]->quiescent_epoch, __ATOMIC_SEQ_CST);
+		if (1 == epoch % 2) {
+			continue;
+		}
+		while (epoch == __atomic_load_n(&reactors[i]->quiescent_epoch, __ATOMIC_SEQ_CST)) {
+			struct timespec delay = { 0, SYNCHRONIZE_POLL_NS };
+			nanosleep(&delay, NULL);
+		}
+	}
+	pthread_mutex_unlock(&reactors_lock);
+}
@@ -0,0 +1,130 @@
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#define MAX_EVENTS 256 // number of epoll events handled per epoll_wait call
+#define URING_ENTRIES 1024 // submission queue entries of an io_uring reactor
+#define URING_BUFFERS 256 // provided receive buffers of an io_uring reactor, a power of two
+#define URING_BUFFER_SIZE 8192
+#define URING_MAX_QUEUED 8 // received buffers an fd holds before its multishot recv is paused
+#define URING_ACCEPT_RETRY_MS 100 // wait before accepting again after the multishot accept failed
+#define REACTOR_RECV (1U << 27) // reactor_add/reactor_mod flag: fd is read with reactor_recv
+
+struct reactor;
+struct upstream_pool;
+struct buffer_pool;
+struct uring;
+struct uring_watch;
+struct uring_received;
+struct stats;
+
+/*
+* How a reactor waits for readiness. With io_uring, every registered fd has a multishot poll
+* request in the ring, and the poll changes of a batch are submitted together with the wait for
+* the next one in a single system call. The listener has a multishot accept instead, and fds
+* registered with REACTOR_RECV a multishot recv into the reactor's provided buffers as well, so
+* connections and received data arrive with their completions rather than after a readiness
+* event and another system call.
+*/
+enum reactor_backend {
+	REACTOR_EPOLL,
+	REACTOR_IO_URING
+};
+
+/*
+* Embedded in every object registered with a reactor. The epoll data pointer points at the
+* handler, and on_event is called with the ready events.
+*/
+struct event_handler {
+	void (*on_event)(struct reactor * reactor, struct event_handler * handler, uint32_t events);
+};
+
+/*
+* A one-shot timeout, embedded in the object it belongs to. on_timeout is called from the
+* reactor's thread once deadline_ms (CLOCK_MONOTONIC milliseconds) has passed.
+*/
+struct timer {
+	uint64_t deadline_ms;
+	int heap_index; // position in the reactor's timer heap, -1 when not armed
+	void (*on_timeout)(struct reactor * reactor, struct timer * timer);
+};
+
+/*
+* Work handed to a reactor from another thread, embedded in the object it belongs to. on_post
+* is called from the reactor's thread. Posting an already queued post does nothing.
+*/
+struct reactor_post {
+	struct reactor_post * prev;
+	struct reactor_post * next;
+	bool queued;
+	void (*on_post)(struct reactor * reactor, struct reactor_post * post);
+};
+
+struct deferred_free {
+	void * ptr;
+	void (*free_fn)(void * ptr);
+};
+
+/*
+* One event loop, run by one thread, owning its own epoll instance and SO_REUSEPORT listener.
+*/
+struct reactor {
+	int id;
+	enum reactor_backend backend;
+	int epoll_fd; // -1 with io_uring
+	struct uring * uring; // NULL with epoll
+	struct uring_watch * watches; // io_uring requests of each fd, indexed by fd
+	int max_watches;
+	struct uring_received * received; // io_uring provided buffers holding received data, indexed by buffer id
+	int buffers_held; // provided buffers whose data has not been read yet
+	bool multishot_recv; // fds registered with REACTOR_RECV are read by multishot recvs
+	int listen_fd;
+	pthread_t tid;
+	struct event_handler listen_handler;
+	void (*on_accept)(struct reactor * reactor, int fd, uint32_t addr); // called with every accepted connection
+	int accepted[MAX_EVENTS]; // connections taken by the io_uring multishot accept during this batch
+	int num_accepted;
+	struct timer accept_timer; // arms the io_uring multishot accept again after it failed
+	int post_fd; // eventfd signalled when posts are queued
+	struct event_handler post_handler;
+	pthread_mutex_t post_lock;
+	struct reactor_post posts; // sentinel of queued posts
+	struct upstream_pool * upstream_pool; // idle connections to hosts owned by this loop
+	struct buffer_pool * buffer_pool; // I/O buffers and request arena blocks of this loop
+	struct buffer_pool * connection_pool; // client connection objects of this loop
+	struct stats * stats; // counters and latencies of this loop, written only by its thread
+	struct deferred_free * deferred; // frees pending until the end of the current event batch
+	int num_deferred;
+	int max_deferred;
+	struct timer ** timers; // binary min-heap ordered by deadline
+	int num_timers;
+	int max_timers;
+	uint64_t now_ms; // time at the start of the current event batch
+	uint64_t quiescent_epoch; // odd while waiting for events, even while handling a batch
+};
+
+int create_listener(int port);
+int set_nonblocking(int fd);
+int reactor_init(struct reactor * reactor, int id, int listen_fd, enum reactor_backend backend, void (*on_accept)(struct reactor *, int, uint32_t));
+int reactor_add(struct reactor * reactor, int fd, uint32_t events, struct event_handler * handler);
+int reactor_mod(struct reactor * reactor, int fd, uint32_t events, struct event_handler * handler);
+int reactor_del(struct reactor * reactor, int fd);
+int reactor_close(struct reactor * reactor, int fd);
+int reactor_recv(struct reactor * reactor, int fd, char * dest, int len);
+void reactor_stop_listening(struct reactor * reactor);
+void reactor_defer_free(struct reactor * reactor, void * ptr, void (*free_fn)(void *));
+void timer_init(struct timer * timer, void (*on_timeout)(struct reactor *, struct timer *));
+int reactor_timer_add(struct reactor * reactor, struct timer * timer, uint64_t delay_ms);
+void reactor_timer_cancel(struct reactor * reactor, struct timer * timer);
+uint64_t monotonic_ms();
+uint64_t monotonic_us();
+void post_init(struct reactor_post * post, void (*on_post)(struct reactor *, struct reactor_post *));
+void reactor_post(struct reactor * reactor, struct reactor_post * post);
+void reactor_unpost(struct reactor * reactor, struct reactor_post * post);
+void reactor_synchronize();
+void * reactor_run(void * reactor);
+
+#endif
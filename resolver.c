@@ -0,0 +1,326 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <arpa/nameser.h>
+#include <resolv.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "resolver.h"
+#include "memcache.h"
+#include "log.h"
+
+/*
+* One part of the resolver cache, keyed by host.
+*/
+struct resolver_shard {
+	pthread_mutex_t lock;
+	struct resolver_entry * buckets[RESOLVER_BUCKETS];
+};
+
+static struct resolver_shard resolver_shards[RESOLVER_SHARDS];
+
+// lookups waiting for a resolver thread, oldest first
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+static struct resolver_entry * queue_head;
+static struct resolver_entry * queue_tail;
+
+static struct resolver_shard * resolver_shard_for(uint64_t hash);
+static bool parse_address(const char * host, struct resolver_result * result);
+static void * run_resolver(void * arg);
+static time_t resolve(res_state res, const char * host, struct resolver_result * result);
+static void query_addresses(res_state res, const char * host, int type, union resolver_addr * addrs, int * num_addrs, uint32_t * ttl);
+static void lookup_addresses(const char * host, union resolver_addr * addrs6, int * num_addrs6, union resolver_addr * addrs4, int * num_addrs4);
+
+/*
+* Set up the resolver cache and start the resolver threads. Returns 0 on success, -1 on failure.
+*/
+int create_resolver() {
+	int i;
+	for (i = 0; i < RESOLVER_SHARDS; i++) {
+		pthread_mutex_init(&resolver_shards[i].lock, NULL);
+		memset(resolver_shards[i].buckets, 0, sizeof(resolver_shards[i].buckets));
+	}
+	for (i = 0; i < RESOLVER_THREADS; i++) {
+		pthread_t tid;
+		int err = pthread_create(&tid, NULL, &run_resolver, NULL);
+		if (0 != err) {
+			log_error("Error creating resolver thread with error number %d\n", err);
+			return -1;
+		}
+		pthread_detach(tid);
+	}
+	return 0;
+}
+
+/*
+* Looks up the addresses of host. A literal address or a cached answer is returned at once.
+* Otherwise waiter (with its post and reactor set) is registered to be posted when the lookup
+* completes, after which the caller should call resolver_lookup again.
+*/
+enum resolve_status resolver_lookup(const char * host, struct resolver_result * result, struct resolver_waiter * waiter) {
+	if (parse_address(host, result)) {
+		return RESOLVE_DONE;
+	}
+	if (strlen(host) >= RESOLVER_HOST_SIZE) {
+		return RESOLVE_FAILED;
+	}
+
+	uint64_t hash = hash_key(host);
+	struct resolver_shard * shard = resolver_shard_for(hash);
+	struct resolver_entry ** link = &shard->buckets[hash % RESOLVER_BUCKETS];
+	struct resolver_entry * entry = NULL;
+	time_t now = time(NULL);
+
+	pthread_mutex_lock(&shard->lock);
+	while (NULL != *link) {
+		struct resolver_entry * candidate = *link;
+		if (hash == candidate->hash && 0 == strcmp(host, candidate->host)) {
+			entry = candidate;
+			link = &candidate->hash_next;
+		} else if (!candidate->resolving && now >= candidate->expires) {
+			// drop expired answers for other hosts as they are passed over
+			*link = candidate->hash_next;
+			free(candidate);
+		} else {
+			link = &candidate->hash_next;
+		}
+	}
+
+	if (NULL != entry && !entry->resolving && now < entry->expires) {
+		*result = entry->result;
+		pthread_mutex_unlock(&shard->lock);
+		return (0 == result->num_addrs) ? RESOLVE_FAILED : RESOLVE_DONE;
+	}
+
+	bool start_lookup = false;
+	if (NULL == entry) {
+		entry = (struct resolver_entry *) calloc(1, sizeof(struct resolver_entry));
+		if (NULL == entry) {
+			pthread_mutex_unlock(&shard->lock);
+			return RESOLVE_FAILED;
+		}
+		entry->hash = hash;
+		snprintf(entry->host, RESOLVER_HOST_SIZE, "%s", host);
+		entry->waiters.prev = &entry->waiters;
+		entry->waiters.next = &entry->waiters;
+		entry->hash_next = shard->buckets[hash % RESOLVER_BUCKETS];
+		shard->buckets[hash % RESOLVER_BUCKETS] = entry;
+	}
+	if (!entry->resolving) {
+		entry->resolving = true;
+		start_lookup = true;
+	}
+	waiter->hash = hash;
+	waiter->prev = entry->waiters.prev;
+	waiter->next = &entry->waiters;
+	entry->waiters.prev->next = waiter;
+	entry->waiters.prev = waiter;
+	pthread_mutex_unlock(&shard->lock);
+
+	if (start_lookup) {
+		pthread_mutex_lock(&queue_lock);
+		entry->queue_next = NULL;
+		if (NULL == queue_tail) {
+			queue_head = entry;
+		} else {
+			queue_tail->queue_next = entry;
+		}
+		queue_tail = entry;
+		pthread_cond_signal(&queue_cond);
+		pthread_mutex_unlock(&queue_lock);
+	}
+	return RESOLVE_PENDING;
+}
+
+/*
+* Stops waiting for a lookup, including any post of waiter still queued.
+*/
+void resolver_cancel(struct resolver_waiter * waiter) {
+	struct resolver_shard * shard = resolver_shard_for(waiter->hash);
+	pthread_mutex_lock(&shard->lock);
+	if (NULL != waiter->prev) {
+		waiter->prev->next = waiter->next;
+		waiter->next->prev = waiter->prev;
+		waiter->prev = NULL;
+		waiter->next = NULL;
+	}
+	pthread_mutex_unlock(&shard->lock);
+	reactor_unpost(waiter->reactor, &waiter->post);
+}
+
+static struct resolver_shard * resolver_shard_for(uint64_t hash) {
+	return &resolver_shards[(hash >> 56) % RESOLVER_SHARDS];
+}
+
+/*
+* Fills in result if host is a literal IPv4 or IPv6 address.
+*/
+static bool parse_address(const char * host, struct resolver_result * result) {
+	memset(&result->addrs[0], 0, sizeof(result->addrs[0]));
+	if (1 == inet_pton(AF_INET, host, &result->addrs[0].in.sin_addr)) {
+		result->addrs[0].in.sin_family = AF_INET;
+	} else if (1 == inet_pton(AF_INET6, host, &result->addrs[0].in6.sin6_addr)) {
+		result->addrs[0].in6.sin6_family = AF_INET6;
+	} else {
+		return false;
+	}
+	result->num_addrs = 1;
+	return true;
+}
+
+/*
+* Body of a resolver thread. Takes lookups off the queue, runs them, caches the answer and
+* posts everything waiting on it.
+*/
+static void * run_resolver(void * arg) {
+	struct __res_state res;
+	memset(&res, 0, sizeof(res));
+	res_ninit(&res);
+
+	while (true) {
+		pthread_mutex_lock(&queue_lock);
+		while (NULL == queue_head) {
+			pthread_cond_wait(&queue_cond, &queue_lock);
+		}
+		struct resolver_entry * entry = queue_head;
+		queue_head = entry->queue_next;
+		if (NULL == queue_head) {
+			queue_tail = NULL;
+		}
+		pthread_mutex_unlock(&queue_lock);
+
+		// entry->host never changes while it is resolving, and the entry is not freed
+		struct resolver_result result;
+		time_t ttl = resolve(&res, entry->host, &result);
+		if (0 == result.num_addrs) {
+			log_debug("Failed to resolve host %s.\n", entry->host);
+		}
+
+		struct resolver_shard * shard = resolver_shard_for(entry->hash);
+		pthread_mutex_lock(&shard->lock);
+		entry->result = result;
+		entry->expires = time(NULL) + ttl;
+		entry->resolving = false;
+		struct resolver_waiter * waiter = entry->waiters.next;
+		while (waiter != &entry->waiters) {
+			struct resolver_waiter * next = waiter->next;
+			waiter->prev = NULL;
+			waiter->next = NULL;
+			reactor_post(waiter->reactor, &waiter->post);
+			waiter = next;
+		}
+		entry->waiters.prev = &entry->waiters;
+		entry->waiters.next = &entry->waiters;
+		pthread_mutex_unlock(&shard->lock);
+	}
+	return NULL;
+}
+
+/*
+* Resolves host into result and returns how many seconds the answer may be cached. DNS is
+* queried directly so the TTLs of the records are known; if it has no answer the system
+* resolver (which also reads /etc/hosts) is asked instead.
+*/
+static time_t resolve(res_state res, const char * host, struct resolver_result * result) {
+	union resolver_addr addrs6[RESOLVER_MAX_ADDRS];
+	union resolver_addr addrs4[RESOLVER_MAX_ADDRS];
+	int num_addrs6 = 0;
+	int num_addrs4 = 0;
+	uint32_t ttl = RESOLVER_MAX_TTL;
+
+	query_addresses(res, host, ns_t_aaaa, addrs6, &num_addrs6, &ttl);
+	query_addresses(res, host, ns_t_a, addrs4, &num_addrs4, &ttl);
+	if (0 == num_addrs6 + num_addrs4) {
+		lookup_addresses(host, addrs6, &num_addrs6, addrs4, &num_addrs4);
+		ttl = RESOLVER_DEFAULT_TTL;
+	}
+
+	// alternate the families, IPv6 first
+	int i6 = 0;
+	int i4 = 0;
+	result->num_addrs = 0;
+	while (result->num_addrs < RESOLVER_MAX_ADDRS && (i6 < num_addrs6 || i4 < num_addrs4)) {
+		if (i6 < num_addrs6) {
+			result->addrs[result->num_addrs++] = addrs6[i6++];
+		}
+		if (i4 < num_addrs4 && result->num_addrs < RESOLVER_MAX_ADDRS) {
+			result->addrs[result->num_addrs++] = addrs4[i4++];
+		}
+	}
+
+	if (0 == result->num_addrs) {
+		return RESOLVER_NEGATIVE_TTL;
+	}
+	if (ttl < RESOLVER_MIN_TTL) {
+		ttl = RESOLVER_MIN_TTL;
+	}
+	return ttl;
+}
+
+/*
+* Queries DNS for the A or AAAA records (type) of host, appending their addresses to addrs and
+* lowering ttl to the smallest TTL in the answer.
+*/
+static void query_addresses(res_state res, const char * host, int type, union resolver_addr * addrs, int * num_addrs, uint32_t * ttl) {
+	unsigned char answer[NS_MAXMSG / 16];
+	int answer_len = res_nquery(res, host, ns_c_in, type, answer, sizeof(answer));
+	ns_msg msg;
+	if (answer_len < 0 || -1 == ns_initparse(answer, answer_len < (int) sizeof(answer) ? answer_len : (int) sizeof(answer), &msg)) {
+		return;
+	}
+	int i;
+	for (i = 0; i < ns_msg_count(msg, ns_s_an) && *num_addrs < RESOLVER_MAX_ADDRS; i++) {
+		ns_rr rr;
+		if (-1 == ns_parserr(&msg, ns_s_an, i, &rr) || ns_c_in != ns_rr_class(rr)) {
+			continue;
+		}
+		// the records of a CNAME chain expire as soon as any of them does
+		if (ns_rr_ttl(rr) < *ttl) {
+			*ttl = ns_rr_ttl(rr);
+		}
+		union resolver_addr * addr = &addrs[*num_addrs];
+		memset(addr, 0, sizeof(*addr));
+		if (ns_t_a == type && ns_t_a == ns_rr_type(rr) && sizeof(struct in_addr) == ns_rr_rdlen(rr)) {
+			addr->in.sin_family = AF_INET;
+			memcpy(&addr->in.sin_addr, ns_rr_rdata(rr), sizeof(struct in_addr));
+			(*num_addrs)++;
+		} else if (ns_t_aaaa == type && ns_t_aaaa == ns_rr_type(rr) && sizeof(struct in6_addr) == ns_rr_rdlen(rr)) {
+			addr->in6.sin6_family = AF_INET6;
+			memcpy(&addr->in6.sin6_addr, ns_rr_rdata(rr), sizeof(struct in6_addr));
+			(*num_addrs)++;
+		}
+	}
+}
+
+/*
+* Asks the system resolver for the addresses of host, split by family in the order it gives.
+*/
+static void lookup_addresses(const char * host, union resolver_addr * addrs6, int * num_addrs6, union resolver_addr * addrs4, int * num_addrs4) {
+	struct addrinfo hints;
+	struct addrinfo * info = NULL;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_ADDRCONFIG;
+	if (0 != getaddrinfo(host, NULL, &hints, &info)) {
+		return;
+	}
+	struct addrinfo * ai;
+	for (ai = info; NULL != ai; ai = ai->ai_next) {
+		if (AF_INET6 == ai->ai_family && *num_addrs6 < RESOLVER_MAX_ADDRS) {
+			memset(&addrs6[*num_addrs6], 0, sizeof(union resolver_addr));
+			memcpy(&addrs6[(*num_addrs6)++], ai->ai_addr, sizeof(struct sockaddr_in6));
+		} else if (AF_INET == ai->ai_family && *num_addrs4 < RESOLVER_MAX_ADDRS) {
+			memset(&addrs4[*num_addrs4], 0, sizeof(union resolver_addr));
+			memcpy(&addrs4[(*num_addrs4)++], ai->ai_addr, sizeof(struct sockaddr_in));
+		}
+	}
+	freeaddrinfo(info);
+}
@@ -0,0 +1,74 @@
+#ifndef RESOLVER_H
+#define RESOLVER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <pthread.h>
+
+#include "reactor.h"
+
+#define RESOLVER_THREADS 4 // threads running blocking lookups
+#define RESOLVER_SHARDS 16 // independently locked parts of the resolver cache
+#define RESOLVER_BUCKETS 256 // hash buckets per shard
+#define RESOLVER_MAX_ADDRS 8 // addresses kept per host
+#define RESOLVER_HOST_SIZE 256
+#define RESOLVER_MIN_TTL 1 // seconds an answer is cached at least, so waiters can pick it up
+#define RESOLVER_MAX_TTL 3600 // seconds an answer is cached at most
+#define RESOLVER_DEFAULT_TTL 60 // seconds an answer without a TTL (e.g. from /etc/hosts) is cached
+#define RESOLVER_NEGATIVE_TTL 30 // seconds a failed lookup is cached
+
+enum resolve_status {
+	RESOLVE_DONE, // result filled in
+	RESOLVE_FAILED, // host does not resolve
+	RESOLVE_PENDING // waiter will be posted once the lookup completes
+};
+
+union resolver_addr {
+	struct sockaddr sa;
+	struct sockaddr_in in;
+	struct sockaddr_in6 in6;
+};
+
+/*
+* Addresses of a host, port 0, in the order they should be tried: IPv6 and IPv4 alternate,
+* starting with IPv6, so that a broken family only delays a connect (RFC 8305).
+*/
+struct resolver_result {
+	int num_addrs;
+	union resolver_addr addrs[RESOLVER_MAX_ADDRS];
+};
+
+/*
+* A request waiting for a lookup, embedded in its connection. post is queued on its reactor
+* when the lookup completes.
+*/
+struct resolver_waiter {
+	struct reactor_post post;
+	struct reactor * reactor;
+	uint64_t hash; // of the host it waits for
+	struct resolver_waiter * prev; // NULL when not waiting
+	struct resolver_waiter * next;
+};
+
+/*
+* A cached answer for a host, or a lookup of it in progress. Concurrent lookups of the same host
+* wait on the one entry, so a host is only ever being resolved once.
+*/
+struct resolver_entry {
+	struct resolver_entry * hash_next;
+	struct resolver_entry * queue_next; // next lookup for the resolver threads
+	uint64_t hash;
+	char host[RESOLVER_HOST_SIZE];
+	struct resolver_result result;
+	time_t expires; // result is used until then
+	bool resolving;
+	struct resolver_waiter waiters; // sentinel
+};
+
+int create_resolver();
+enum resolve_status resolver_lookup(const char * host, struct resolver_result * result, struct resolver_waiter * waiter);
+void resolver_cancel(struct resolver_waiter * waiter);
+
+#endif
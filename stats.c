@@ -0,0 +1,323 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+
+#include "stats.h"
+#include "limiter.h"
+#include "log.h"
+
+/*
+* How a counter is exported: its metric name, labels (may be empty) and help text. Counters
+* sharing a name must be adjacent, so the name gets one HELP and TYPE line.
+*/
+struct counter_metric {
+	enum stats_counter counter;
+	const char * name;
+	const char * labels;
+	const char * help;
+};
+
+struct histogram_metric {
+	enum stats_histogram histogram;
+	const char * name;
+	const char * help;
+};
+
+static const struct counter_metric counter_metrics[] = {
+	{ STAT_CONNECTIONS_OPENED, "proxy_client_connections_total", "", "Client connections accepted." },
+	{ STAT_REQUESTS, "proxy_requests_total", "", "Requests received from clients." },
+	{ STAT_MEMORY_HITS, "proxy_cache_lookups_total", "result=\"memory_hit\"", "Requests by how the cache served them." },
+	{ STAT_DISK_HITS, "proxy_cache_lookups_total", "result=\"disk_hit\"", NULL },
+	{ STAT_PARTIAL_HITS, "proxy_cache_lookups_total", "result=\"partial_hit\"", NULL },
+	{ STAT_FILL_FOLLOWS, "proxy_cache_lookups_total", "result=\"follow\"", NULL },
+	{ STAT_CACHE_MISSES, "proxy_cache_lookups_total", "result=\"miss\"", NULL },
+	{ STAT_REVALIDATIONS, "proxy_cache_lookups_total", "result=\"revalidate\"", NULL },
+	{ STAT_FILL_ABORTS, "proxy_cache_fill_aborts_total", "", "Responses being cached that were given up on." },
+	{ STAT_RESPONSES_ENCODED, "proxy_compressed_responses_total", "source=\"encoder\"", "Responses sent compressed, by whether they were compressed for the request or cached compressed." },
+	{ STAT_VARIANT_HITS, "proxy_compressed_responses_total", "source=\"cache\"", NULL },
+	{ STAT_BLACKLIST_BLOCKS, "proxy_blacklist_blocks_total", "", "Requests refused because their host is blacklisted." },
+	{ STAT_CLIENT_LIMITED, "proxy_limited_requests_total", "limit=\"client\"", "Requests refused by a rate or concurrency limit, by whether their client or their host hit it." },
+	{ STAT_HOST_LIMITED, "proxy_limited_requests_total", "limit=\"host\"", NULL },
+	{ STAT_UPSTREAM_CONNECTS, "proxy_upstream_connects_total", "", "New connections made to hosts." },
+	{ STAT_UPSTREAM_REUSES, "proxy_upstream_reuses_total", "", "Requests sent on pooled connections to hosts." },
+	{ STAT_UPSTREAM_ERRORS, "proxy_upstream_errors_total", "", "Hosts that could not be resolved, connected to or read from." },
+	{ STAT_CLIENT_BYTES_IN, "proxy_client_bytes_total", "direction=\"in\"", "Bytes received from and sent to clients." },
+	{ STAT_CLIENT_BYTES_OUT, "proxy_client_bytes_total", "direction=\"out\"", NULL },
+	{ STAT_UPSTREAM_BYTES_IN, "proxy_upstream_bytes_total", "direction=\"in\"", "Bytes received from and sent to hosts." },
+	{ STAT_UPSTREAM_BYTES_OUT, "proxy_upstream_bytes_total", "direction=\"out\"", NULL }
+};
+
+static const struct histogram_metric histogram_metrics[] = {
+	{ STAT_UPSTREAM_CONNECT, "proxy_upstream_connect_seconds", "Time taken to connect to hosts." },
+	{ STAT_UPSTREAM_FIRST_BYTE, "proxy_upstream_first_byte_seconds", "Time from sending a request to a host until its response starts." },
+	{ STAT_UPSTREAM_TRANSFER, "proxy_upstream_transfer_seconds", "Time from a response starting until it has been relayed to the client." }
+};
+
+static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+
+// every thread's stats, for the stats server to add up
+static struct stats * all_stats;
+static pthread_mutex_t all_stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void * run_stats_server(void * arg);
+static void serve_admin_request(int client_fd);
+static void serve_limits_request(int client_fd, char * args);
+static char * format_metrics(size_t * len);
+static void send_response(int client_fd, const char * status, const char * content_type, const char * body, size_t body_len);
+
+/*
+* Creates the stats of a thread. Returns NULL on failure.
+*/
+struct stats * create_stats() {
+	struct stats * stats = (struct stats *) calloc(1, sizeof(struct stats));
+	if (NULL == stats) {
+		return NULL;
+	}
+	pthread_mutex_lock(&all_stats_lock);
+	stats->next = all_stats;
+	all_stats = stats;
+	pthread_mutex_unlock(&all_stats_lock);
+	return stats;
+}
+
+/*
+* Adds n to counter. Must be called from the thread stats belongs to.
+*/
+void stats_add(struct stats * stats, enum stats_counter counter, uint64_t n) {
+	__atomic_store_n(&stats->counters[counter], stats->counters[counter] + n, __ATOMIC_RELAXED);
+}
+
+/*
+* Records a latency of value_us microseconds. Must be called from the thread stats belongs to.
+*/
+void stats_record(struct stats * stats, enum stats_histogram histogram, uint64_t value_us) {
+	histogram_record(&stats->histograms[histogram], value_us);
+}
+
+/*
+* Starts a thread serving the admin endpoint on port of the loopback interface:
+*   GET /stats (or /metrics)  the counters and latencies in Prometheus text format
+*   GET /log/<level>          sets the log level to error, info or debug
+*   GET /limits               the rate and concurrency limits of clients and hosts
+*   GET /limits/<name>/<n>    sets the limit called name to n (0 for none)
+* Returns 0 on success, -1 on failure.
+*/
+int start_stats_server(int port) {
+	int listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (-1 == listen_fd) {
+		log_error("Failed to create stats socket: %s\n", strerror(errno));
+		return -1;
+	}
+	int on = 1;
+	setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (-1 == bind(listen_fd, (struct sockaddr *) &addr, sizeof(addr)) || -1 == listen(listen_fd, 16)) {
+		log_error("Failed to listen for stats requests on port %d: %s\n", port, strerror(errno));
+		close(listen_fd);
+		return -1;
+	}
+
+	pthread_t tid;
+	int err = pthread_create(&tid, NULL, &run_stats_server, (void *) (intptr_t) listen_fd);
+	if (0 != err) {
+		log_error("Error creating stats thread with error number %d\n", err);
+		close(listen_fd);
+		return -1;
+	}
+	pthread_detach(tid);
+	log_info("Serving stats on 127.0.0.1:%d/stats\n", port);
+	return 0;
+}
+
+/*
+* Body of the stats thread. Admin requests are rare, so they are served one at a time with
+* blocking calls, away from the reactors.
+*/
+static void * run_stats_server(void * arg) {
+	int listen_fd = (int) (intptr_t) arg;
+	while (true) {
+		int client_fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+		if (-1 == client_fd) {
+			if (EINTR != errno && ECONNABORTED != errno) {
+				log_error("Failed to accept stats request: %s\n", strerror(errno));
+				sleep(1);
+			}
+			continue;
+		}
+		struct timeval timeout = { 5, 0 };
+		setsockopt(client_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+		serve_admin_request(client_fd);
+		close(client_fd);
+	}
+	return NULL;
+}
+
+/*
+* Reads one request from client_fd and answers it.
+*/
+static void serve_admin_request(int client_fd) {
+	char request[STATS_REQUEST_SIZE];
+	int len = 0;
+	while (len < STATS_REQUEST_SIZE - 1 && NULL == memmem(request, len, "\r\n\r\n", 4)) {
+		ssize_t n = recv(client_fd, request + len, STATS_REQUEST_SIZE - 1 - len, 0);
+		if (n <= 0) {
+			return;
+		}
+		len += n;
+	}
+	request[len] = '\0';
+
+	// GET only reads; settings are changed with PUT, which a web page cannot send cross-site
+	// without a preflight this endpoint never answers
+	char method[8];
+	char path[256];
+	if (2 != sscanf(request, "%7s %255s ", method, path) || (0 != strcmp(method, "GET") && 0 != strcmp(method, "PUT"))) {
+		send_response(client_fd, "405 Method Not Allowed", "text/plain", "Only GET and PUT are allowed.\n", 30);
+		return;
+	}
+	bool put = 0 == strcmp(method, "PUT");
+	bool setter = 0 == strncmp(path, "/log/", 5) || 0 == strncmp(path, "/limits/", 8);
+	if (put != setter) {
+		const char * body = put ? "Use GET to read.\n" : "Use PUT to change a setting.\n";
+		send_response(client_fd, "405 Method Not Allowed", "text/plain", body, strlen(body));
+		return;
+	}
+	if (0 == strcmp(path, "/stats") || 0 == strcmp(path, "/metrics")) {
+		size_t body_len;
+		char * body = format_metrics(&body_len);
+		if (NULL == body) {
+			send_response(client_fd, "500 Internal Server Error", "text/plain", "", 0);
+			return;
+		}
+		send_response(client_fd, "200 OK", "text/plain; version=0.0.4", body, body_len);
+		free(body);
+		return;
+	}
+	enum log_level level;
+	if (0 == strncmp(path, "/log/", 5) && 0 == parse_log_level(path + 5, &level)) {
+		__atomic_store_n(&log_level, level, __ATOMIC_RELAXED);
+		char body[64];
+		int body_len = snprintf(body, sizeof(body), "Log level set to %s.\n", path + 5);
+		send_response(client_fd, "200 OK", "text/plain", body, body_len);
+		return;
+	}
+	if (0 == strcmp(path, "/limits") || 0 == strncmp(path, "/limits/", 8)) {
+		serve_limits_request(client_fd, path + 7);
+		return;
+	}
+	send_response(client_fd, "404 Not Found", "text/plain", "Not found.\n", 11);
+}
+
+/*
+* Answers GET /limits with the current limits, or PUT /limits/<name>/<value> (args) with them
+* after setting one.
+*/
+static void serve_limits_request(int client_fd, char * args) {
+	if ('\0' != *args) {
+		char * name = args + 1;
+		char * value = strchr(name, '/');
+		char * end = NULL;
+		long long n = -1;
+		if (NULL != value) {
+			*value++ = '\0';
+			n = strtoll(value, &end, 10);
+		}
+		if (NULL == value || end == value || '\0' != *end || -1 == limiter_set(name, n)) {
+			send_response(client_fd, "400 Bad Request", "text/plain", "Unknown limit or bad value.\n", 28);
+			return;
+		}
+		log_info("Limit %s set to %lld\n", name, n);
+	}
+	char body[512];
+	int body_len = limiter_format(body, sizeof(body));
+	send_response(client_fd, "200 OK", "text/plain", body, body_len);
+}
+
+/*
+* Adds up the stats of all threads and writes them in Prometheus text format. Returns the
+* malloc'd text, or NULL on failure.
+*/
+static char * format_metrics(size_t * len) {
+	uint64_t counters[STAT_NUM_COUNTERS];
+	memset(counters, 0, sizeof(counters));
+	struct histogram * histograms = (struct histogram *) calloc(STAT_NUM_HISTOGRAMS, sizeof(struct histogram));
+	if (NULL == histograms) {
+		return NULL;
+	}
+	pthread_mutex_lock(&all_stats_lock);
+	struct stats * stats;
+	for (stats = all_stats; NULL != stats; stats = stats->next) {
+		int i;
+		for (i = 0; i < STAT_NUM_COUNTERS; i++) {
+			counters[i] += __atomic_load_n(&stats->counters[i], __ATOMIC_RELAXED);
+		}
+		for (i = 0; i < STAT_NUM_HISTOGRAMS; i++) {
+			histogram_merge(&histograms[i], &stats->histograms[i]);
+		}
+	}
+	pthread_mutex_unlock(&all_stats_lock);
+
+	char * text = NULL;
+	FILE * out = open_memstream(&text, len);
+	if (NULL == out) {
+		free(histograms);
+		return NULL;
+	}
+	int i;
+	for (i = 0; i < sizeof(counter_metrics) / sizeof(counter_metrics[0]); i++) {
+		const struct counter_metric * metric = &counter_metrics[i];
+		if (NULL != metric->help) {
+			fprintf(out, "# HELP %s %s\n# TYPE %s counter\n", metric->name, metric->help, metric->name);
+		}
+		if ('\0' == metric->labels[0]) {
+			fprintf(out, "%s %llu\n", metric->name, (unsigned long long) counters[metric->counter]);
+		} else {
+			fprintf(out, "%s{%s} %llu\n", metric->name, metric->labels, (unsigned long long) counters[metric->counter]);
+		}
+	}
+	// a connection is closed by the same reactor that opened it, so this never goes negative
+	fprintf(out, "# HELP proxy_client_connections_active Client connections open now.\n# TYPE proxy_client_connections_active gauge\n");
+	fprintf(out, "proxy_client_connections_active %llu\n", (unsigned long long) (counters[STAT_CONNECTIONS_OPENED] - counters[STAT_CONNECTIONS_CLOSED]));
+
+	for (i = 0; i < sizeof(histogram_metrics) / sizeof(histogram_metrics[0]); i++) {
+		const struct histogram_metric * metric = &histogram_metrics[i];
+		const struct histogram * hist = &histograms[metric->histogram];
+		fprintf(out, "# HELP %s %s\n# TYPE %s summary\n", metric->name, metric->help, metric->name);
+		int q;
+		for (q = 0; q < sizeof(quantiles) / sizeof(quantiles[0]); q++) {
+			fprintf(out, "%s{quantile=\"%g\"} %.6f\n", metric->name, quantiles[q], histogram_percentile(hist, quantiles[q] * 100) / 1e6);
+		}
+		fprintf(out, "%s_sum %.6f\n", metric->name, hist->sum / 1e6);
+		fprintf(out, "%s_count %llu\n", metric->name, (unsigned long long) hist->total);
+	}
+	fclose(out);
+	free(histograms);
+	return text;
+}
+
+static void send_response(int client_fd, const char * status, const char * content_type, const char * body, size_t body_len) {
+	char head[256];
+	int head_len = snprintf(head, sizeof(head), "HTTP/1.1 %s\r\nContent-Type: %s\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n", status, content_type, body_len);
+	send(client_fd, head, head_len, MSG_NOSIGNAL);
+	size_t sent = 0;
+	while (sent < body_len) {
+		ssize_t n = send(client_fd, body + sent, body_len - sent, MSG_NOSIGNAL);
+		if (n <= 0) {
+			return;
+		}
+		sent += n;
+	}
+}
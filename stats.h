@@ -0,0 +1,64 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+
+#include "histogram.h"
+
+#define STATS_REQUEST_SIZE 1024 // bytes of an admin request that are read
+
+/*
+* Things counted by every reactor
+*/
+enum stats_counter {
+	STAT_CONNECTIONS_OPENED,
+	STAT_CONNECTIONS_CLOSED,
+	STAT_REQUESTS,
+	STAT_MEMORY_HITS, // served from the memory cache
+	STAT_DISK_HITS, // served from a cache_file
+	STAT_PARTIAL_HITS, // byte ranges served from a partial object
+	STAT_FILL_FOLLOWS, // served from another connection's fetch
+	STAT_CACHE_MISSES, // fetched from host
+	STAT_REVALIDATIONS, // stale responses revalidated with host
+	STAT_FILL_ABORTS, // responses being cached that were given up on
+	STAT_RESPONSES_ENCODED, // responses compressed on their way to the client
+	STAT_VARIANT_HITS, // compressed responses sent from the cache
+	STAT_BLACKLIST_BLOCKS,
+	STAT_CLIENT_LIMITED, // requests refused by the limits of their client address
+	STAT_HOST_LIMITED, // requests refused by the limits of their host
+	STAT_UPSTREAM_CONNECTS, // new connections to hosts
+	STAT_UPSTREAM_REUSES, // requests sent on pooled connections
+	STAT_UPSTREAM_ERRORS, // hosts that could not be resolved, connected to or read from
+	STAT_CLIENT_BYTES_IN,
+	STAT_CLIENT_BYTES_OUT,
+	STAT_UPSTREAM_BYTES_IN,
+	STAT_UPSTREAM_BYTES_OUT,
+	STAT_NUM_COUNTERS
+};
+
+/*
+* Latencies measured by every reactor, in microseconds
+*/
+enum stats_histogram {
+	STAT_UPSTREAM_CONNECT, // from starting to connect to host until connected
+	STAT_UPSTREAM_FIRST_BYTE, // from the request being sent until the response starts
+	STAT_UPSTREAM_TRANSFER, // from the response starting until it has been relayed
+	STAT_NUM_HISTOGRAMS
+};
+
+/*
+* Counters and latencies of one thread. Only that thread writes them, with relaxed atomic
+* stores, so recording takes no lock and the stats server can read them at any time.
+*/
+struct stats {
+	uint64_t counters[STAT_NUM_COUNTERS];
+	struct histogram histograms[STAT_NUM_HISTOGRAMS];
+	struct stats * next; // in the list of all of them
+};
+
+struct stats * create_stats();
+void stats_add(struct stats * stats, enum stats_counter counter, uint64_t n);
+void stats_record(struct stats * stats, enum stats_histogram histogram, uint64_t value_us);
+int start_stats_server(int port);
+
+#endif
@@ -0,0 +1,262 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "upgrade.h"
+#include "cache.h"
+#include "memcache.h"
+#include "journal.h"
+#include "log.h"
+
+/*
+* Handing a running proxy over to a new one without refusing a connection. The running proxy
+* listens on a unix socket; a new proxy started with the same socket connects to it, loads the
+* cache, and sends UPGRADE_READY. The running proxy then passes it its listening sockets
+* (SCM_RIGHTS), so connections waiting to be accepted are accepted by the new one, stops
+* accepting, and drains. Once its last cache_files are stored it sends the keys of its memory
+* cache, one per line, and closes the unix socket; the new proxy then replays the journal records
+* appended meanwhile and reads those keys into its own memory cache.
+*/
+
+static bool fill_address(struct sockaddr_un * addr, const char * path);
+static void send_memcache_key(const char * key, size_t size, void * arg);
+static void warm_memcache(char * uri);
+
+/*
+* Connects to the proxy listening on the unix socket at path. Returns the connection, or -1 if
+* no proxy is listening there.
+*/
+int upgrade_connect(const char * path) {
+	struct sockaddr_un addr;
+	if (!fill_address(&addr, path)) {
+		return -1;
+	}
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (-1 == fd) {
+		return -1;
+	}
+	if (-1 == connect(fd, (struct sockaddr *) &addr, sizeof(addr))) {
+		close(fd);
+		return -1;
+	}
+	log_info("Taking over from the proxy running at %s\n", path);
+	return fd;
+}
+
+/*
+* Listens for a new proxy on the unix socket at path, replacing any socket there. Returns the
+* listening socket, or -1 on failure.
+*/
+int upgrade_listen(const char * path) {
+	struct sockaddr_un addr;
+	if (!fill_address(&addr, path)) {
+		log_error("Upgrade socket path %s is too long\n", path);
+		return -1;
+	}
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (-1 == fd) {
+		log_error("Failed to create upgrade socket: %s\n", strerror(errno));
+		return -1;
+	}
+	unlink(path);
+	if (-1 == bind(fd, (struct sockaddr *) &addr, sizeof(addr)) || -1 == listen(fd, 1)) {
+		log_error("Failed to listen on upgrade socket %s: %s\n", path, strerror(errno));
+		close(fd);
+		return -1;
+	}
+	chmod(path, S_IRUSR | S_IWUSR);
+	return fd;
+}
+
+/*
+* Tells the running proxy on fd that this one is ready and receives its listening sockets into
+* listen_fds. Returns how many were received, or -1 on failure.
+*/
+int upgrade_receive_listeners(int fd, int * listen_fds, int max_listeners) {
+	char ready = UPGRADE_READY;
+	if (1 != send(fd, &ready, 1, MSG_NOSIGNAL)) {
+		return -1;
+	}
+
+	int num_listeners;
+	struct iovec iov = { &num_listeners, sizeof(num_listeners) };
+	char control[CMSG_SPACE(UPGRADE_MAX_LISTENERS * sizeof(int))];
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	if (sizeof(num_listeners) != recvmsg(fd, &msg, MSG_CMSG_CLOEXEC)) {
+		log_error("Failed to receive listening sockets: %s\n", strerror(errno));
+		return -1;
+	}
+	struct cmsghdr * cmsg = CMSG_FIRSTHDR(&msg);
+	if (NULL == cmsg || SOL_SOCKET != cmsg->cmsg_level || SCM_RIGHTS != cmsg->cmsg_type) {
+		log_error("Received no listening sockets.\n");
+		return -1;
+	}
+	int num_received = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+	int * received = (int *) CMSG_DATA(cmsg);
+	int i;
+	for (i = 0; i < num_received; i++) {
+		if (i < max_listeners) {
+			listen_fds[i] = received[i];
+		} else {
+			close(received[i]);
+		}
+	}
+	log_info("Received %d listening sockets.\n", num_received);
+	return (num_received < max_listeners) ? num_received : max_listeners;
+}
+
+/*
+* Waits for the new proxy on fd to be ready, then passes it listen_fds. Returns 0 on success,
+* -1 if the new proxy went away first.
+*/
+int upgrade_send_listeners(int fd, const int * listen_fds, int num_listeners) {
+	char ready;
+	if (1 != recv(fd, &ready, 1, 0) || UPGRADE_READY != ready) {
+		log_error("New proxy did not become ready.\n");
+		return -1;
+	}
+	if (num_listeners > UPGRADE_MAX_LISTENERS) {
+		num_listeners = UPGRADE_MAX_LISTENERS;
+	}
+
+	struct iovec iov = { &num_listeners, sizeof(num_listeners) };
+	char control[CMSG_SPACE(UPGRADE_MAX_LISTENERS * sizeof(int))];
+	memset(control, 0, sizeof(control));
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = CMSG_SPACE(num_listeners * sizeof(int));
+	struct cmsghdr * cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(num_listeners * sizeof(int));
+	memcpy(CMSG_DATA(cmsg), listen_fds, num_listeners * sizeof(int));
+	if (-1 == sendmsg(fd, &msg, MSG_NOSIGNAL)) {
+		log_error("Failed to hand over listening sockets: %s\n", strerror(errno));
+		return -1;
+	}
+	log_info("Handed %d listening sockets over to the new proxy.\n", num_listeners);
+	return 0;
+}
+
+/*
+* Sends the keys of the memory cache to the new proxy on fd and closes it, which tells the new
+* proxy that this one has stopped changing the cache.
+*/
+void upgrade_send_memcache(int fd) {
+	char * keys = NULL;
+	size_t len = 0;
+	FILE * out = open_memstream(&keys, &len);
+	if (NULL != out) {
+		memcache_for_each(&send_memcache_key, out);
+		fclose(out);
+		size_t sent = 0;
+		while (sent < len) {
+			ssize_t n = send(fd, keys + sent, len - sent, MSG_NOSIGNAL);
+			if (n <= 0) {
+				break;
+			}
+			sent += n;
+		}
+		free(keys);
+	}
+	close(fd);
+}
+
+/*
+* Called in the new proxy once the old one on fd is done: picks up the changes it made to the
+* cache index and reads the responses it had in memory into this proxy's memory cache.
+*/
+void upgrade_finish(int fd) {
+	FILE * in = fdopen(fd, "r");
+	if (NULL == in) {
+		close(fd);
+		journal_catch_up();
+		return;
+	}
+	// the keys come in full before the close, and the journal is complete by then
+	char ** uris = NULL;
+	int num_uris = 0;
+	int uris_size = 0;
+	char * line = NULL;
+	size_t line_size = 0;
+	ssize_t line_len;
+	while (-1 != (line_len = getline(&line, &line_size, in))) {
+		if (line_len > 0 && '\n' == line[line_len - 1]) {
+			line[--line_len] = '\0';
+		}
+		if (0 == line_len) {
+			continue;
+		}
+		if (num_uris == uris_size) {
+			uris_size = (0 == uris_size) ? 256 : uris_size * 2;
+			uris = (char **) realloc(uris, uris_size * sizeof(char *));
+		}
+		uris[num_uris++] = strdup(line);
+	}
+	free(line);
+	fclose(in);
+
+	journal_catch_up();
+	int i;
+	for (i = 0; i < num_uris; i++) {
+		warm_memcache(uris[i]);
+		free(uris[i]);
+	}
+	free(uris);
+	log_info("Took over %d responses of the memory cache.\n", num_uris);
+}
+
+static bool fill_address(struct sockaddr_un * addr, const char * path) {
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr->sun_path)) {
+		return false;
+	}
+	strcpy(addr->sun_path, path);
+	return true;
+}
+
+/*
+* memcache_for_each callback writing one key to the FILE in arg
+*/
+static void send_memcache_key(const char * key, size_t size, void * arg) {
+	fprintf((FILE *) arg, "%s\n", key);
+}
+
+/*
+* Reads the cache_file for uri into the memory cache, unless it is there already
+*/
+static void warm_memcache(char * uri) {
+	struct mem_object * object = memcache_get(uri);
+	if (NULL != object) {
+		memcache_release(object);
+		return;
+	}
+	int fd = open_cache_file_for_request(uri);
+	if (-1 == fd) {
+		return;
+	}
+	struct stat sb;
+	if (0 == fstat(fd, &sb)) {
+		object = read_cache_file_into_memory(uri, fd, sb.st_size);
+		if (NULL != object) {
+			memcache_release(object);
+		}
+	}
+	close(fd);
+}
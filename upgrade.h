@@ -0,0 +1,15 @@
+#ifndef UPGRADE_H
+#define UPGRADE_H
+
+#define UPGRADE_DRAIN_SECONDS 30 // default time active connections get to finish when stopping
+#define UPGRADE_MAX_LISTENERS 256 // listening sockets handed over at most
+#define UPGRADE_READY 'R' // sent by the new proxy once it can serve, asking for the listeners
+
+int upgrade_connect(const char * path);
+int upgrade_listen(const char * path);
+int upgrade_receive_listeners(int fd, int * listen_fds, int max_listeners);
+int upgrade_send_listeners(int fd, const int * listen_fds, int num_listeners);
+void upgrade_send_memcache(int fd);
+void upgrade_finish(int fd);
+
+#endif
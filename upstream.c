@@ -0,0 +1,167 @@
+#include <sys/epoll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <unistd.h>
+
+#include "upstream.h"
+
+static void on_idle_event(struct reactor * reactor, struct event_handler * handler, uint32_t events);
+static void free_idle(void * ptr);
+
+/*
+* Create an empty connection pool for reactor.
+*/
+struct upstream_pool * create_upstream_pool(struct reactor * reactor) {
+	struct upstream_pool * pool = (struct upstream_pool *) calloc(1, sizeof(struct upstream_pool));
+	if (NULL == pool) {
+		return NULL;
+	}
+	pool->reactor = reactor;
+	pool->idle_conns = create_buffer_pool(sizeof(struct upstream_conn), UPSTREAM_BUCKETS * MAX_IDLE_PER_HOST);
+	if (NULL == pool->idle_conns) {
+		free(pool);
+		return NULL;
+	}
+	return pool;
+}
+
+/*
+* Hashes (host, port) into a bucket index
+*/
+static unsigned int host_bucket(const char * host, int port) {
+	unsigned int hash = 2166136261u; // FNV-1a
+	const char * p;
+	for (p = host; '\0' != *p; p++) {
+		hash = (hash ^ (unsigned char) *p) * 16777619u;
+	}
+	hash = (hash ^ (unsigned int) port) * 16777619u;
+	return hash % UPSTREAM_BUCKETS;
+}
+
+/*
+* Finds the entry for (host, port), creating it if create is set.
+*/
+static struct upstream_host * find_host(struct upstream_pool * pool, const char * host, int port, bool create) {
+	unsigned int bucket = host_bucket(host, port);
+	struct upstream_host * entry;
+	for (entry = pool->buckets[bucket]; NULL != entry; entry = entry->next) {
+		if (port == entry->port && 0 == strcmp(host, entry->host)) {
+			return entry;
+		}
+	}
+	if (!create || strlen(host) >= sizeof(entry->host)) {
+		return NULL;
+	}
+
+	entry = (struct upstream_host *) calloc(1, sizeof(struct upstream_host));
+	if (NULL == entry) {
+		return NULL;
+	}
+	strcpy(entry->host, host);
+	entry->port = port;
+	entry->pool = pool;
+	entry->next = pool->buckets[bucket];
+	pool->buckets[bucket] = entry;
+	return entry;
+}
+
+/*
+* Unlinks idle connection from its host entry, closes it and frees it after the current batch.
+*/
+static void discard_idle(struct upstream_conn * idle) {
+	struct upstream_host * entry = idle->host;
+	struct upstream_conn ** link;
+	for (link = &entry->idle; NULL != *link; link = &(*link)->next) {
+		if (idle == *link) {
+			*link = idle->next;
+			entry->num_idle--;
+			break;
+		}
+	}
+	reactor_close(entry->pool->reactor, idle->fd);
+	idle->fd = -1;
+	reactor_defer_free(entry->pool->reactor, idle, &free_idle);
+}
+
+/*
+* Returns an idle connection object to the pool it came from
+*/
+static void free_idle(void * ptr) {
+	struct upstream_conn * idle = (struct upstream_conn *) ptr;
+	pool_put(idle->host->pool->idle_conns, idle);
+}
+
+/*
+* Takes an idle connection to (host, port) out of the pool. The caller owns the returned
+* socket and must re-register it with its own handler. Returns -1 if none is available.
+*/
+int upstream_acquire(struct upstream_pool * pool, const char * host, int port) {
+	struct upstream_host * entry = find_host(pool, host, port, false);
+	if (NULL == entry) {
+		return -1;
+	}
+
+	time_t now = time(NULL);
+	while (NULL != entry->idle) {
+		struct upstream_conn * idle = entry->idle;
+		if (now - idle->idle_since > UPSTREAM_IDLE_TIMEOUT) {
+			discard_idle(idle);
+			continue;
+		}
+		entry->idle = idle->next;
+		entry->num_idle--;
+		int fd = idle->fd;
+		idle->fd = -1;
+		reactor_defer_free(pool->reactor, idle, &free_idle);
+		return fd;
+	}
+	return -1;
+}
+
+/*
+* Returns a connection to (host, port) whose last response was fully read to the pool. The
+* connection is closed instead if the pool for that host is full.
+*/
+void upstream_release(struct upstream_pool * pool, const char * host, int port, int fd) {
+	struct upstream_host * entry = find_host(pool, host, port, true);
+	if (NULL == entry || entry->num_idle >= MAX_IDLE_PER_HOST) {
+		reactor_close(pool->reactor, fd);
+		return;
+	}
+
+	struct upstream_conn * idle = (struct upstream_conn *) pool_get(pool->idle_conns);
+	if (NULL == idle) {
+		reactor_close(pool->reactor, fd);
+		return;
+	}
+	idle->handler.on_event = &on_idle_event;
+	idle->host = entry;
+	idle->fd = fd;
+	idle->idle_since = time(NULL);
+
+	// any readiness on an idle connection means the host closed it or sent something unexpected.
+	// The io_uring recv carries on while it is idle, so the response to its next request does
+	// not race a recv being cancelled
+	if (-1 == reactor_mod(pool->reactor, fd, EPOLLIN | EPOLLRDHUP | EPOLLET | REACTOR_RECV, &idle->handler)) {
+		reactor_close(pool->reactor, fd);
+		pool_put(pool->idle_conns, idle);
+		return;
+	}
+	idle->next = entry->idle;
+	entry->idle = idle;
+	entry->num_idle++;
+}
+
+/*
+* Called by the reactor when an idle connection becomes readable or is closed by the host.
+*/
+static void on_idle_event(struct reactor * reactor, struct event_handler * handler, uint32_t events) {
+	struct upstream_conn * idle = (struct upstream_conn *) ((char *) handler - offsetof(struct upstream_conn, handler));
+	if (-1 == idle->fd) {
+		return; // already handed out or discarded during this batch
+	}
+	discard_idle(idle);
+}
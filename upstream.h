@@ -0,0 +1,53 @@
+#ifndef UPSTREAM_H
+#define UPSTREAM_H
+
+#include <time.h>
+
+#include "reactor.h"
+#include "pool.h"
+
+#define UPSTREAM_BUCKETS 256 // hash buckets for (host, port) pairs in a pool
+#define MAX_IDLE_PER_HOST 8 // idle connections kept per (host, port)
+#define UPSTREAM_IDLE_TIMEOUT 30 // seconds an idle connection is kept before it is discarded
+
+struct upstream_host;
+
+/*
+* An idle persistent connection to a host, watched by the reactor so it can be dropped as soon
+* as the host closes it.
+*/
+struct upstream_conn {
+	struct event_handler handler;
+	struct upstream_host * host;
+	int fd;
+	time_t idle_since;
+	struct upstream_conn * next;
+};
+
+/*
+* Idle connections to one (host, port).
+*/
+struct upstream_host {
+	char host[256];
+	int port;
+	struct upstream_conn * idle; // most recently used first
+	int num_idle;
+	struct upstream_pool * pool;
+	struct upstream_host * next;
+};
+
+/*
+* Pool of idle connections to hosts owned by one reactor. Only that reactor's thread uses it,
+* so no locking is needed.
+*/
+struct upstream_pool {
+	struct reactor * reactor;
+	struct buffer_pool * idle_conns; // recycled upstream_conn objects
+	struct upstream_host * buckets[UPSTREAM_BUCKETS];
+};
+
+struct upstream_pool * create_upstream_pool(struct reactor * reactor);
+int upstream_acquire(struct upstream_pool * pool, const char * host, int port);
+void upstream_release(struct upstream_pool * pool, const char * host, int port, int fd);
+
+#endif
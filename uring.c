@@ -0,0 +1,224 @@
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+
+#include "uring.h"
+#include "log.h"
+
+static int io_uring_setup(unsigned entries, struct io_uring_params * params) {
+	return (int) syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags, void * arg, size_t argsz) {
+	return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+static int io_uring_register(int fd, unsigned opcode, void * arg, unsigned nr_args) {
+	return (int) syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/*
+* Sets up ring with room for entries submissions and four times as many completions. Needs a
+* kernel that maps both rings at once and takes a timeout when waiting (5.11 and later).
+* Returns 0 on success, -1 on failure.
+*/
+int uring_init(struct uring * ring, unsigned entries) {
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	memset(ring, 0, sizeof(*ring));
+	params.flags = IORING_SETUP_CQSIZE;
+	params.cq_entries = 4 * entries;
+	ring->fd = io_uring_setup(entries, &params);
+	if (-1 == ring->fd) {
+		log_info("io_uring_setup failed: %s\n", strerror(errno));
+		return -1;
+	}
+	if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_EXT_ARG)) {
+		log_info("io_uring is too old on this kernel.\n");
+		close(ring->fd);
+		return -1;
+	}
+
+	ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if (ring->cq_ring_size > ring->sq_ring_size) {
+		ring->sq_ring_size = ring->cq_ring_size;
+	}
+	ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if (MAP_FAILED == ring->sq_ring) {
+		close(ring->fd);
+		return -1;
+	}
+	// both rings share the one mapping
+	ring->cq_ring = ring->sq_ring;
+	ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = (struct io_uring_sqe *) mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (MAP_FAILED == ring->sqes) {
+		munmap(ring->sq_ring, ring->sq_ring_size);
+		close(ring->fd);
+		return -1;
+	}
+
+	char * sq = (char *) ring->sq_ring;
+	ring->sq_head = (unsigned *) (sq + params.sq_off.head);
+	ring->sq_tail = (unsigned *) (sq + params.sq_off.tail);
+	ring->sq_mask = *(unsigned *) (sq + params.sq_off.ring_mask);
+	ring->sq_array = (unsigned *) (sq + params.sq_off.array);
+	ring->sq_entries = params.sq_entries;
+	char * cq = (char *) ring->cq_ring;
+	ring->cq_head = (unsigned *) (cq + params.cq_off.head);
+	ring->cq_tail = (unsigned *) (cq + params.cq_off.tail);
+	ring->cq_mask = *(unsigned *) (cq + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+	return 0;
+}
+
+void uring_free(struct uring * ring) {
+	if (NULL != ring->buf_ring) {
+		munmap(ring->buf_ring, ring->buf_ring_size);
+		free(ring->bufs);
+	}
+	munmap(ring->sqes, ring->sqes_size);
+	munmap(ring->sq_ring, ring->sq_ring_size);
+	close(ring->fd);
+}
+
+/*
+* Returns a cleared submission queue entry to fill in. It is submitted by the next
+* uring_submit_and_wait, or right away if the queue is full.
+*/
+struct io_uring_sqe * uring_get_sqe(struct uring * ring) {
+	unsigned tail = *ring->sq_tail;
+	if (tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries) {
+		uring_submit_and_wait(ring, 0);
+		if (tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries) {
+			return NULL;
+		}
+	}
+	unsigned index = tail & ring->sq_mask;
+	struct io_uring_sqe * sqe = &ring->sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	ring->sq_array[index] = index;
+	__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	ring->sq_pending++;
+	return sqe;
+}
+
+/*
+* Submits the prepared entries and, unless timeout_ms is 0, waits until a completion is ready
+* or timeout_ms (-1 for none) passes, in one system call. Returns 0 on success, -1 on failure.
+*/
+int uring_submit_and_wait(struct uring * ring, int timeout_ms) {
+	struct __kernel_timespec ts;
+	struct io_uring_getevents_arg arg;
+	memset(&arg, 0, sizeof(arg));
+	unsigned min_complete = 0;
+	unsigned flags = IORING_ENTER_EXT_ARG;
+	if (0 != timeout_ms && 0 == uring_cq_ready(ring)) {
+		min_complete = 1;
+		flags |= IORING_ENTER_GETEVENTS;
+		if (timeout_ms > 0) {
+			ts.tv_sec = timeout_ms / 1000;
+			ts.tv_nsec = (long long) (timeout_ms % 1000) * 1000000;
+			arg.ts = (uint64_t) (uintptr_t) &ts;
+		}
+	}
+	if (0 == ring->sq_pending && 0 == min_complete) {
+		return 0;
+	}
+	int submitted = io_uring_enter(ring->fd, ring->sq_pending, min_complete, flags, &arg, sizeof(arg));
+	if (-1 == submitted) {
+		if (ETIME == errno || EINTR == errno || EBUSY == errno) {
+			return 0;
+		}
+		return -1;
+	}
+	ring->sq_pending -= submitted;
+	return 0;
+}
+
+/*
+* Returns the number of completions ready to be read
+*/
+unsigned uring_cq_ready(struct uring * ring) {
+	return __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE) - *ring->cq_head;
+}
+
+/*
+* Returns the i-th ready completion
+*/
+struct io_uring_cqe * uring_cqe_at(struct uring * ring, unsigned i) {
+	return &ring->cqes[(*ring->cq_head + i) & ring->cq_mask];
+}
+
+/*
+* Hands the first n ready completions back to the kernel
+*/
+void uring_cq_advance(struct uring * ring, unsigned n) {
+	__atomic_store_n(ring->cq_head, *ring->cq_head + n, __ATOMIC_RELEASE);
+}
+
+/*
+* Hands the kernel num_bufs (a power of two) receive buffers of buf_size bytes, in a ring
+* shared with it (5.19 and later). A receive with IOSQE_BUFFER_SELECT from URING_BUFFER_GROUP
+* takes one of them, and its completion names it by buffer id. Returns 0 on success, -1 on
+* failure.
+*/
+int uring_provide_buffers(struct uring * ring, unsigned num_bufs, unsigned buf_size) {
+	size_t buf_ring_size = num_bufs * sizeof(struct io_uring_buf);
+	void * buf_ring = mmap(NULL, buf_ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (MAP_FAILED == buf_ring) {
+		return -1;
+	}
+	char * bufs = (char *) malloc((size_t) num_bufs * buf_size);
+	if (NULL == bufs) {
+		munmap(buf_ring, buf_ring_size);
+		return -1;
+	}
+	struct io_uring_buf_reg reg;
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (uint64_t) (uintptr_t) buf_ring;
+	reg.ring_entries = num_bufs;
+	reg.bgid = URING_BUFFER_GROUP;
+	if (-1 == io_uring_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1)) {
+		log_info("io_uring cannot take provided buffers: %s\n", strerror(errno));
+		free(bufs);
+		munmap(buf_ring, buf_ring_size);
+		return -1;
+	}
+	ring->buf_ring = (struct io_uring_buf_ring *) buf_ring;
+	ring->buf_ring_size = buf_ring_size;
+	ring->bufs = bufs;
+	ring->num_bufs = num_bufs;
+	ring->buf_size = buf_size;
+	unsigned i;
+	for (i = 0; i < num_bufs; i++) {
+		uring_recycle_buffer(ring, i);
+	}
+	return 0;
+}
+
+/*
+* Returns the provided buffer with id bid
+*/
+char * uring_buffer(struct uring * ring, unsigned short bid) {
+	return ring->bufs + (size_t) bid * ring->buf_size;
+}
+
+/*
+* Gives the provided buffer with id bid back to the kernel once its data has been used.
+*/
+void uring_recycle_buffer(struct uring * ring, unsigned short bid) {
+	unsigned short tail = ring->buf_ring->tail;
+	struct io_uring_buf * buf = &ring->buf_ring->bufs[tail & (ring->num_bufs - 1)];
+	buf->addr = (uint64_t) (uintptr_t) uring_buffer(ring, bid);
+	buf->len = ring->buf_size;
+	buf->bid = bid;
+	__atomic_store_n(&ring->buf_ring->tail, (unsigned short) (tail + 1), __ATOMIC_RELEASE);
+}
@@ -0,0 +1,49 @@
+#ifndef URING_H
+#define URING_H
+
+#include <stddef.h>
+#include <linux/io_uring.h>
+
+#define URING_BUFFER_GROUP 0 // buffer group of the provided receive buffers
+
+/*
+* An io_uring instance set up with raw system calls, with its submission and completion rings
+* mapped into memory. Used by one thread only.
+*/
+struct uring {
+	int fd;
+	unsigned * sq_head;
+	unsigned * sq_tail;
+	unsigned sq_mask;
+	unsigned * sq_array;
+	struct io_uring_sqe * sqes;
+	unsigned sq_entries;
+	unsigned sq_pending; // entries prepared since the last submit
+	unsigned * cq_head;
+	unsigned * cq_tail;
+	unsigned cq_mask;
+	struct io_uring_cqe * cqes;
+	void * sq_ring;
+	size_t sq_ring_size;
+	void * cq_ring;
+	size_t cq_ring_size;
+	size_t sqes_size;
+	struct io_uring_buf_ring * buf_ring; // provided receive buffers, NULL if there are none
+	size_t buf_ring_size;
+	char * bufs;
+	unsigned num_bufs;
+	unsigned buf_size;
+};
+
+int uring_init(struct uring * ring, unsigned entries);
+void uring_free(struct uring * ring);
+struct io_uring_sqe * uring_get_sqe(struct uring * ring);
+int uring_submit_and_wait(struct uring * ring, int timeout_ms);
+unsigned uring_cq_ready(struct uring * ring);
+struct io_uring_cqe * uring_cqe_at(struct uring * ring, unsigned i);
+void uring_cq_advance(struct uring * ring, unsigned n);
+int uring_provide_buffers(struct uring * ring, unsigned num_bufs, unsigned buf_size);
+char * uring_buffer(struct uring * ring, unsigned short bid);
+void uring_recycle_buffer(struct uring * ring, unsigned short bid);
+
+#endif
@@ -0,0 +1,153 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "worker.h"
+#include "log.h"
+
+static struct worker_deque * deques; // one per worker thread
+static int num_deques;
+static int num_queued; // work in all deques
+static int num_sleeping; // workers waiting on idle_cond
+static pthread_mutex_t idle_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t idle_cond = PTHREAD_COND_INITIALIZER;
+
+static void * run_worker(void * arg);
+static struct work * take(struct worker_deque * deque, bool front);
+static struct work * steal(int id);
+
+/*
+* Starts num_workers worker threads, each with its own deque. Returns 0 on success, -1 on failure.
+*/
+int create_worker_pool(int num_workers) {
+	deques = (struct worker_deque *) calloc(num_workers, sizeof(struct worker_deque));
+	if (NULL == deques) {
+		log_error("Failed to allocate worker deques\n");
+		return -1;
+	}
+	num_deques = num_workers;
+	int i;
+	for (i = 0; i < num_workers; i++) {
+		pthread_mutex_init(&deques[i].lock, NULL);
+		deques[i].head.prev = &deques[i].head;
+		deques[i].head.next = &deques[i].head;
+		deques[i].count = 0;
+	}
+	for (i = 0; i < num_workers; i++) {
+		pthread_t tid;
+		int err = pthread_create(&tid, NULL, &run_worker, (void *) (intptr_t) i);
+		if (0 != err) {
+			log_error("Error creating worker thread with error number %d\n", err);
+			return -1;
+		}
+		pthread_detach(tid);
+	}
+	return 0;
+}
+
+/*
+* Prepares work to call run on a worker thread, and on_done (which may be NULL) on its reactor
+* once run has returned.
+*/
+void work_init(struct work * work, void (*run)(struct work *), void (*on_done)(struct reactor *, struct reactor_post *)) {
+	work->prev = NULL;
+	work->next = NULL;
+	work->run = run;
+	work->reactor = NULL;
+	post_init(&work->done, on_done);
+}
+
+/*
+* Queues work on the deque of the worker paired with reactor, waking a sleeping worker if there
+* is one. Any worker may end up running it.
+*/
+void work_submit(struct reactor * reactor, struct work * work) {
+	struct worker_deque * deque = &deques[reactor->id % num_deques];
+	work->reactor = reactor;
+	pthread_mutex_lock(&deque->lock);
+	work->prev = deque->head.prev;
+	work->next = &deque->head;
+	deque->head.prev->next = work;
+	deque->head.prev = work;
+	__atomic_store_n(&deque->count, deque->count + 1, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&deque->lock);
+
+	// pairs with the check of num_queued by a worker going to sleep
+	__atomic_add_fetch(&num_queued, 1, __ATOMIC_SEQ_CST);
+	if (0 != __atomic_load_n(&num_sleeping, __ATOMIC_SEQ_CST)) {
+		pthread_mutex_lock(&idle_lock);
+		pthread_cond_signal(&idle_cond);
+		pthread_mutex_unlock(&idle_lock);
+	}
+}
+
+/*
+* Body of a worker thread. Runs the work in its own deque, or steals from the others when that
+* is empty, and sleeps when there is no work anywhere.
+*/
+static void * run_worker(void * arg) {
+	int id = (int) (intptr_t) arg;
+	while (true) {
+		struct work * work = take(&deques[id], true);
+		if (NULL == work) {
+			work = steal(id);
+		}
+		if (NULL == work) {
+			pthread_mutex_lock(&idle_lock);
+			__atomic_add_fetch(&num_sleeping, 1, __ATOMIC_SEQ_CST);
+			while (0 == __atomic_load_n(&num_queued, __ATOMIC_SEQ_CST)) {
+				pthread_cond_wait(&idle_cond, &idle_lock);
+			}
+			__atomic_sub_fetch(&num_sleeping, 1, __ATOMIC_SEQ_CST);
+			pthread_mutex_unlock(&idle_lock);
+			continue;
+		}
+
+		// work without on_done may be freed by run
+		struct reactor * reactor = work->reactor;
+		bool notify = NULL != work->done.on_post;
+		work->run(work);
+		if (notify) {
+			reactor_post(reactor, &work->done);
+		}
+	}
+	return NULL;
+}
+
+/*
+* Takes the work at the front (oldest) or back (newest) of deque, or returns NULL if it is empty.
+*/
+static struct work * take(struct worker_deque * deque, bool front) {
+	if (0 == __atomic_load_n(&deque->count, __ATOMIC_RELAXED)) {
+		return NULL;
+	}
+	pthread_mutex_lock(&deque->lock);
+	if (0 == deque->count) {
+		pthread_mutex_unlock(&deque->lock);
+		return NULL;
+	}
+	struct work * work = front ? deque->head.next : deque->head.prev;
+	work->prev->next = work->next;
+	work->next->prev = work->prev;
+	__atomic_store_n(&deque->count, deque->count - 1, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&deque->lock);
+	__atomic_sub_fetch(&num_queued, 1, __ATOMIC_SEQ_CST);
+	return work;
+}
+
+/*
+* Takes the newest work of another worker's deque, going round from the one after id. The
+* oldest work is left to its owner, which gets to it next.
+*/
+static struct work * steal(int id) {
+	int i;
+	for (i = 1; i < num_deques; i++) {
+		struct work * work = take(&deques[(id + i) % num_deques], false);
+		if (NULL != work) {
+			return work;
+		}
+	}
+	return NULL;
+}
@@ -0,0 +1,36 @@
+#ifndef WORKER_H
+#define WORKER_H
+
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "reactor.h"
+
+/*
+* A CPU or disk bound piece of work taken off a reactor, embedded in the object it belongs to.
+* run is called on a worker thread. If done has an on_post function, done is then posted to
+* reactor, and the object must stay put until it is; otherwise run owns the object and may free it.
+*/
+struct work {
+	struct work * prev; // in the deque of a worker
+	struct work * next;
+	void (*run)(struct work * work);
+	struct reactor * reactor; // reactor the work was submitted from
+	struct reactor_post done;
+};
+
+/*
+* Work queued for one worker thread. The worker takes work from the front, in the order it was
+* submitted; idle workers steal from the back of the others.
+*/
+struct worker_deque {
+	pthread_mutex_t lock;
+	struct work head; // sentinel
+	int count;
+};
+
+int create_worker_pool(int num_workers);
+void work_init(struct work * work, void (*run)(struct work *), void (*on_done)(struct reactor *, struct reactor_post *));
+void work_submit(struct reactor * reactor, struct work * work);
+
+#endif
@@ -0,0 +1,375 @@
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "writer.h"
+#include "partial.h"
+#include "log.h"
+
+/*
+* Batches waiting for one writer thread.
+*/
+struct writer_queue {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct cache_write_batch * head;
+	struct cache_write_batch * tail;
+	bool busy; // a batch taken off the queue is being carried out
+	pthread_cond_t idle_cond; // signalled when the queue is empty and not busy
+};
+
+static struct writer_queue writer_queues[WRITER_THREADS];
+static unsigned int next_thread;
+
+static struct cache_write * new_file(const char * uri);
+static void free_file(struct cache_write * file);
+static struct cache_write_batch * new_batch(struct cache_write * file, enum cache_write_op op);
+static void submit_change(const char * uri, enum cache_write_op op, const struct cache_meta * meta);
+static void submit(struct cache_write_batch * batch);
+static void * run_writer(void * arg);
+static void write_batch(struct cache_write_batch * batch);
+static void end_file(struct cache_write * file, bool store);
+
+/*
+* Starts the writer threads. Returns 0 on success, -1 on failure.
+*/
+int create_cache_writer() {
+	int i;
+	for (i = 0; i < WRITER_THREADS; i++) {
+		pthread_mutex_init(&writer_queues[i].lock, NULL);
+		pthread_cond_init(&writer_queues[i].cond, NULL);
+		pthread_cond_init(&writer_queues[i].idle_cond, NULL);
+		writer_queues[i].head = NULL;
+		writer_queues[i].tail = NULL;
+		writer_queues[i].busy = false;
+	}
+	for (i = 0; i < WRITER_THREADS; i++) {
+		pthread_t tid;
+		int err = pthread_create(&tid, NULL, &run_writer, (void *) &writer_queues[i]);
+		if (0 != err) {
+			log_error("Error creating cache writer thread with error number %d\n", err);
+			return -1;
+		}
+		pthread_detach(tid);
+	}
+	return 0;
+}
+
+/*
+* Opens temp_filename to cache the response to uri. fill, if not NULL, is the fill of uri led by
+* the caller, whose reference is handed over: its followers are told about each batch written,
+* and it is ended once the file is stored or removed. Returns NULL (leaving fill to the caller)
+* if the file cannot be opened.
+*/
+struct cache_write * cache_write_begin(const char * uri, const char * temp_filename, struct cache_fill * fill) {
+	struct cache_write * file = new_file(uri);
+	if (NULL == file) {
+		return NULL;
+	}
+	// the temp_file of a fill was already created by fill_begin, which its followers read
+	int flags = (NULL == fill) ? O_CREAT | O_EXCL : 0;
+	file->fd = open(temp_filename, O_WRONLY | O_APPEND | O_CLOEXEC | flags, S_IRWXU);
+	if (-1 == file->fd) {
+		log_error("Unable to open temp cache_file %s: %s\n", temp_filename, strerror(errno));
+		free_file(file);
+		return NULL;
+	}
+	snprintf(file->temp_filename, TEMP_FILENAME_SIZE, "%s", temp_filename);
+	file->fill = fill;
+	return file;
+}
+
+/*
+* Sets up writing a byte range of the response to uri, starting at byte first of its body, into
+* fd, the file of its partial object partial_id (see partial.c). fd is handed over. The range is
+* added to the object once finished. Returns NULL (leaving fd to the caller) on failure.
+*/
+struct cache_write * cache_write_begin_range(const char * uri, int fd, uint64_t partial_id, long long first) {
+	struct cache_write * file = new_file(uri);
+	if (NULL == file) {
+		return NULL;
+	}
+	file->fd = fd;
+	file->range_first = first;
+	file->partial_id = partial_id;
+	return file;
+}
+
+/*
+* Appends the len bytes of data to the file, submitting a batch to the writer thread each time
+* one fills up, or right away while followers of its fill wait for the data. Returns -1 if the
+* data cannot be queued (out of memory, or the disk has fallen too far behind); the caller
+* should then abort the file.
+*/
+int cache_write_append(struct cache_write * file, const char * data, int len) {
+	while (len > 0) {
+		if (NULL == file->batch) {
+			if (__atomic_load_n(&file->queued_bytes, __ATOMIC_RELAXED) > WRITER_MAX_QUEUED_BYTES) {
+				log_debug("Cache writer is too far behind for %s.\n", file->uri);
+				return -1;
+			}
+			file->batch = new_batch(file, CACHE_WRITE_DATA);
+			if (NULL == file->batch) {
+				return -1;
+			}
+		}
+		int n = WRITER_BATCH_SIZE - file->batch->len;
+		if (n > len) {
+			n = len;
+		}
+		memcpy(file->batch->data + file->batch->len, data, n);
+		file->batch->len += n;
+		data += n;
+		len -= n;
+		if (WRITER_BATCH_SIZE == file->batch->len) {
+			submit(file->batch);
+			file->batch = NULL;
+		}
+	}
+	// followers stream the response as it arrives, not a batch at a time
+	if (NULL != file->batch && NULL != file->fill && fill_has_waiters(file->fill)) {
+		submit(file->batch);
+		file->batch = NULL;
+	}
+	return 0;
+}
+
+/*
+* Hands the file to its writer thread to write the rest of the response and store it in the
+* cache with meta. The caller must not use file afterwards.
+*/
+void cache_write_finish(struct cache_write * file, const struct cache_meta * meta) {
+	if (NULL != file->batch) {
+		submit(file->batch);
+		file->batch = NULL;
+	}
+	file->meta = *meta;
+	file->last->op = CACHE_WRITE_FINISH;
+	submit(file->last);
+}
+
+/*
+* Hands the file to its writer thread to be removed once the batches already submitted are done.
+* The caller must not use file afterwards.
+*/
+void cache_write_abort(struct cache_write * file) {
+	free(file->batch);
+	file->batch = NULL;
+	file->last->op = CACHE_WRITE_ABORT;
+	submit(file->last);
+}
+
+/*
+* Has a writer thread rewrite the .meta file of the cache_file of uri, once host has revalidated
+* it and the index holds meta
+*/
+void cache_write_update_meta(const char * uri, const struct cache_meta * meta) {
+	submit_change(uri, CACHE_WRITE_UPDATE_META, meta);
+}
+
+/*
+* Has a writer thread delete the cache_file of uri
+*/
+void cache_write_delete(const char * uri) {
+	submit_change(uri, CACHE_WRITE_DELETE, NULL);
+}
+
+/*
+* Waits until every batch submitted so far has been carried out, so finished responses are
+* stored in the cache.
+*/
+void cache_writer_flush() {
+	int i;
+	for (i = 0; i < WRITER_THREADS; i++) {
+		struct writer_queue * queue = &writer_queues[i];
+		pthread_mutex_lock(&queue->lock);
+		while (NULL != queue->head || queue->busy) {
+			pthread_cond_wait(&queue->idle_cond, &queue->lock);
+		}
+		pthread_mutex_unlock(&queue->lock);
+	}
+}
+
+/*
+* Allocates a file for uri along with its last batch, and picks its writer thread
+*/
+static struct cache_write * new_file(const char * uri) {
+	struct cache_write * file = (struct cache_write *) calloc(1, sizeof(struct cache_write));
+	if (NULL == file) {
+		return NULL;
+	}
+	file->uri = strdup(uri);
+	file->last = (struct cache_write_batch *) malloc(sizeof(struct cache_write_batch));
+	if (NULL == file->uri || NULL == file->last) {
+		free_file(file);
+		return NULL;
+	}
+	file->fd = -1;
+	file->last->file = file;
+	file->last->len = 0;
+	file->range_first = -1;
+	file->thread = __atomic_fetch_add(&next_thread, 1, __ATOMIC_RELAXED) % WRITER_THREADS;
+	return file;
+}
+
+static void free_file(struct cache_write * file) {
+	free(file->uri);
+	free(file->last);
+	free(file);
+}
+
+static struct cache_write_batch * new_batch(struct cache_write * file, enum cache_write_op op) {
+	struct cache_write_batch * batch = (struct cache_write_batch *) malloc(sizeof(struct cache_write_batch) + WRITER_BATCH_SIZE);
+	if (NULL == batch) {
+		return NULL;
+	}
+	batch->file = file;
+	batch->op = op;
+	batch->len = 0;
+	return batch;
+}
+
+/*
+* Queues op on the cache_file of uri for a writer thread, as the last batch of a file without a
+* temp file. A change that cannot be allocated is dropped, as a failed write would be.
+*/
+static void submit_change(const char * uri, enum cache_write_op op, const struct cache_meta * meta) {
+	struct cache_write * file = new_file(uri);
+	if (NULL == file) {
+		log_error("Unable to queue change to cache_file of %s.\n", uri);
+		return;
+	}
+	if (NULL != meta) {
+		file->meta = *meta;
+	}
+	file->last->op = op;
+	submit(file->last);
+}
+
+/*
+* Queues batch for the writer thread of its file
+*/
+static void submit(struct cache_write_batch * batch) {
+	struct writer_queue * queue = &writer_queues[batch->file->thread];
+	__atomic_add_fetch(&batch->file->queued_bytes, batch->len, __ATOMIC_RELAXED);
+	batch->next = NULL;
+	pthread_mutex_lock(&queue->lock);
+	if (NULL == queue->tail) {
+		queue->head = batch;
+	} else {
+		queue->tail->next = batch;
+	}
+	queue->tail = batch;
+	pthread_cond_signal(&queue->cond);
+	pthread_mutex_unlock(&queue->lock);
+}
+
+/*
+* Body of a writer thread. Takes batches off its queue in order and carries them out.
+*/
+static void * run_writer(void * arg) {
+	struct writer_queue * queue = (struct writer_queue *) arg;
+	while (true) {
+		pthread_mutex_lock(&queue->lock);
+		queue->busy = false;
+		while (NULL == queue->head) {
+			pthread_cond_broadcast(&queue->idle_cond);
+			pthread_cond_wait(&queue->cond, &queue->lock);
+		}
+		struct cache_write_batch * batch = queue->head;
+		queue->head = batch->next;
+		if (NULL == queue->head) {
+			queue->tail = NULL;
+		}
+		queue->busy = true;
+		pthread_mutex_unlock(&queue->lock);
+
+		// the last batch of a file is freed with it
+		bool last = CACHE_WRITE_DATA != batch->op;
+		write_batch(batch);
+		if (!last) {
+			free(batch);
+		}
+	}
+	return NULL;
+}
+
+/*
+* Appends the data of batch to its file and tells the followers of the fill, then stores or
+* removes the file if it is the last batch.
+*/
+static void write_batch(struct cache_write_batch * batch) {
+	struct cache_write * file = batch->file;
+	if (CACHE_WRITE_UPDATE_META == batch->op || CACHE_WRITE_DELETE == batch->op) {
+		if (CACHE_WRITE_UPDATE_META == batch->op) {
+			write_cache_meta_for_request(file->uri, &file->meta);
+		} else {
+			delete_cache_file_for_request(file->uri);
+		}
+		free_file(file);
+		return;
+	}
+	int written = 0;
+	while (!file->failed && written < batch->len) {
+		ssize_t num_bytes_written;
+		if (-1 == file->range_first) {
+			num_bytes_written = write(file->fd, batch->data + written, batch->len - written);
+		} else {
+			num_bytes_written = pwrite(file->fd, batch->data + written, batch->len - written, file->range_first + file->bytes_written + written);
+		}
+		if (-1 == num_bytes_written) {
+			if (EINTR == errno) {
+				continue;
+			}
+			log_error("Error writing temp cache_file %s: %s\n", file->temp_filename, strerror(errno));
+			file->failed = true;
+			break;
+		}
+		written += num_bytes_written;
+	}
+	__atomic_sub_fetch(&file->queued_bytes, batch->len, __ATOMIC_RELAXED);
+	if (!file->failed && batch->len > 0) {
+		file->bytes_written += batch->len;
+		if (NULL != file->fill) {
+			fill_progress(file->fill, file->bytes_written);
+		}
+	}
+
+	if (CACHE_WRITE_FINISH == batch->op) {
+		end_file(file, !file->failed);
+	} else if (CACHE_WRITE_ABORT == batch->op) {
+		end_file(file, false);
+	}
+}
+
+/*
+* Closes the file and stores it in the cache (or adds it to its partial object), or removes it
+* if !store, then ends its fill and frees it along with its last batch.
+*/
+static void end_file(struct cache_write * file, bool store) {
+	close(file->fd);
+	if (-1 != file->range_first) {
+		if (store) {
+			partial_end(file->uri, file->partial_id, file->range_first, file->bytes_written);
+		}
+		free_file(file);
+		return;
+	}
+	if (store && -1 == store_cache_file(file->uri, file->temp_filename, file->bytes_written, &file->meta)) {
+		store = false;
+	}
+	if (!store) {
+		remove(file->temp_filename);
+	}
+	if (NULL != file->fill) {
+		fill_end(file->fill, store);
+		fill_release(file->fill);
+	}
+	free_file(file);
+}
@@ -0,0 +1,71 @@
+#ifndef WRITER_H
+#define WRITER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <pthread.h>
+
+#include "cache.h"
+#include "fill.h"
+
+#define WRITER_THREADS 2 // threads writing cache_files, each file is written by one of them
+#define WRITER_BATCH_SIZE (64 * 1024) // response bytes collected before they are written, unless a fill has followers
+#define WRITER_MAX_QUEUED_BYTES (16 * 1024 * 1024) // bytes of a file waiting to be written before caching it is given up
+
+enum cache_write_op {
+	CACHE_WRITE_DATA, // append data
+	CACHE_WRITE_FINISH, // store the file in the cache
+	CACHE_WRITE_ABORT, // remove the file
+	CACHE_WRITE_UPDATE_META, // rewrite the .meta file of the cache_file of uri, which has no temp file
+	CACHE_WRITE_DELETE // delete the cache_file of uri, which has no temp file
+};
+
+struct cache_write;
+
+/*
+* Work for the writer thread of a file. Batches of a file are carried out in the order they
+* were submitted.
+*/
+struct cache_write_batch {
+	struct cache_write_batch * next;
+	struct cache_write * file;
+	enum cache_write_op op;
+	int len;
+	char data[]; // WRITER_BATCH_SIZE bytes for CACHE_WRITE_DATA
+};
+
+/*
+* A temp cache_file being written for one response, or a change to the cache_file of uri. The
+* connection fetching the response collects it into batches, and the writer thread of the file
+* appends them through a descriptor kept open throughout and stores the file at the end, so the
+* connection never waits on the disk. Owned by the connection until it is finished or aborted,
+* then by the writer thread.
+*/
+struct cache_write {
+	int fd;
+	int thread; // writer thread the batches go to
+	char * uri;
+	char temp_filename[TEMP_FILENAME_SIZE];
+	struct cache_fill * fill; // told about each batch written, NULL if there is no fill
+	long long range_first; // where in the body the data goes for a byte range written into a partial object, -1 for a whole response
+	uint64_t partial_id; // of that partial object
+	struct cache_meta meta; // stored with the file when finished
+	struct cache_write_batch * batch; // being collected by the connection, NULL if none
+	struct cache_write_batch * last; // finishes or aborts the file, allocated up front so ending cannot fail
+	int queued_bytes; // submitted and not yet written
+	off_t bytes_written; // writer thread only
+	bool failed; // writer thread only
+};
+
+int create_cache_writer();
+struct cache_write * cache_write_begin(const char * uri, const char * temp_filename, struct cache_fill * fill);
+struct cache_write * cache_write_begin_range(const char * uri, int fd, uint64_t partial_id, long long first);
+int cache_write_append(struct cache_write * file, const char * data, int len);
+void cache_write_finish(struct cache_write * file, const struct cache_meta * meta);
+void cache_write_abort(struct cache_write * file);
+void cache_write_update_meta(const char * uri, const struct cache_meta * meta);
+void cache_write_delete(const char * uri);
+void cache_writer_flush();
+
+#endif